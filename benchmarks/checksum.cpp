@@ -0,0 +1,161 @@
+/**
+ * What the CRC-32C of every record costs: the checksum alone, and a
+ * Database::write of a record of the same size, with the blocking backend
+ * and without flushes, so the checksum is the biggest share of it it can be.
+ * Built with -DEASYKEY_BENCHMARKS=ON, e.g.:
+ *     build/checksum_benchmark 16 100 1024 4096 65536
+ * Writes its segments to a new /tmp/easykey-checksum-* directory, and removes
+ * it after
+ */
+#include "crc32c.hpp"
+#include "database.hpp"
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace easykey;
+using namespace std;
+
+/**
+ * How many bytes every size is run with, so the small ones are not just
+ * the timer
+ */
+constexpr static uint64_t BYTES_PER_SIZE = 256 * 1024 * 1024;
+
+/**
+ * The keys are overwritten, so the index stays small
+ */
+constexpr static uint32_t KEYS = 1000;
+
+double nanoseconds_since(const chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start)
+        .count();
+}
+
+void remove_directory(const string& directory)
+{
+    const auto listing = opendir(directory.c_str());
+    while (listing != nullptr)
+    {
+        const auto entry = readdir(listing);
+        if (entry == nullptr)
+        {
+            closedir(listing);
+            break;
+        }
+        const string name = entry->d_name;
+        if (name != "." && name != "..")
+        {
+            unlink((directory + "/" + name).c_str());
+        }
+    }
+    rmdir(directory.c_str());
+}
+
+/**
+ * The nanoseconds of a checksum of size bytes
+ */
+double checksum(const uint64_t size, const uint64_t count)
+{
+    const vector<uint8_t> value(size, 'c');
+    uint32_t result = 0;
+    const auto start = chrono::steady_clock::now();
+    for (uint64_t done = 0; done < count; done++)
+    {
+        result = crc32c(value.data(), value.size(), result);
+    }
+    const auto elapsed = nanoseconds_since(start);
+
+    // So the loop is not optimized away
+    if (result == 1)
+    {
+        cout << "";
+    }
+    return elapsed / count;
+}
+
+/**
+ * The nanoseconds of a write of a value of size bytes
+ */
+double write(const uint64_t size, const uint64_t count)
+{
+    char path[] = "/tmp/easykey-checksum-XXXXXX";
+    if (mkdtemp(path) == nullptr)
+    {
+        perror("mkdtemp: ");
+        exit(1);
+    }
+    DatabaseOptions options;
+    options.data_directories = {path};
+    options.io = IOBackend::BLOCKING;
+    options.durability = Durability::NONE;
+    double elapsed;
+    {
+        Database database(options);
+        const vector<uint8_t> value(size, 'w');
+        vector<string> keys;
+        for (uint32_t key = 0; key < KEYS; key++)
+        {
+            keys.push_back("key" + to_string(key));
+        }
+        uint64_t written = 0;
+        const auto start = chrono::steady_clock::now();
+        for (uint64_t done = 0; done < count; done++)
+        {
+            database.write(keys[done % KEYS],
+                           value,
+                           chrono::milliseconds(0),
+                           [&written](const bool success) {
+                               written += success;
+                           });
+        }
+        elapsed = nanoseconds_since(start);
+        if (written != count)
+        {
+            cerr << "Only " << written << " of " << count
+                 << " writes succeeded!" << endl;
+            exit(1);
+        }
+    }
+    remove_directory(path);
+    return elapsed / count;
+}
+
+int main(int argc, char* argv[])
+{
+    vector<uint64_t> sizes;
+    for (int argument = 1; argument < argc; argument++)
+    {
+        sizes.push_back(stoull(argv[argument]));
+    }
+    if (sizes.empty())
+    {
+        sizes = {16, 100, 1024, 4096, 65536};
+    }
+
+    for (const auto size : sizes)
+    {
+        const auto count =
+            max<uint64_t>(10000, min<uint64_t>(1000000, BYTES_PER_SIZE / size));
+        const auto checksum_time = checksum(size, count);
+        const auto write_time = write(size, count);
+        printf("%6lu bytes: crc32c %8.1f ns(%5.2f GB/s), write %8.1f ns, "
+               "the checksum is %4.1f%% of the write\n",
+               (unsigned long)size,
+               checksum_time,
+               size / checksum_time,
+               write_time,
+               checksum_time * 100 / write_time);
+    }
+    return 0;
+}
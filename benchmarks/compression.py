@@ -0,0 +1,79 @@
+"""
+What the compression costs and saves: KEYS JSON values of about VALUE_SIZE
+bytes are written, then one client reads them for SECONDS seconds, one
+request at a time. Reports the reads per second and the bytes of the
+segments. Starts the server itself with and without
+--compression-threshold; its files are /tmp/easykey-*, so it refuses to
+run when they exist, and removes them after every run
+"""
+import argparse
+import glob
+import json
+import os
+import random
+import tempfile
+import time
+
+from easykey import Client, start_server, stop_server
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--server', default='build/easykeydb')
+parser.add_argument('--keys', type=int, default=100)
+parser.add_argument('--value-size', type=int, default=14000)
+parser.add_argument('--threshold', type=int, default=1024,
+                    help='the --compression-threshold of the compressed run')
+parser.add_argument('--seconds', type=float, default=5)
+arguments = parser.parse_args()
+
+files = '/tmp/easykey-*'
+if glob.glob(files):
+    raise SystemExit('%s exist, move them away first' % files)
+log_name = tempfile.mkstemp(prefix='compression-', suffix='.log')[1]
+
+
+def document(key):
+    """A JSON array of user records, the field names repeat like in an API"""
+    generator = random.Random(key)
+    users = []
+    while len(json.dumps(users)) < arguments.value_size:
+        users.append({
+            'id': generator.randrange(10 ** 9),
+            'name': 'user%d' % generator.randrange(10000),
+            'email': 'user%d@example.com' % generator.randrange(10000),
+            'active': generator.random() < 0.5,
+            'score': round(generator.random() * 100, 2),
+            'tags': generator.sample(['admin', 'beta', 'staff', 'guest',
+                                      'trial', 'paid'], 2),
+        })
+    return json.dumps(users)
+
+
+def run(name, options):
+    server, _ = start_server([arguments.server] + options, log_name)
+    try:
+        client = Client()
+        for key in range(arguments.keys):
+            response = client.request('doc%d' % key, document(key))
+            assert response[0] == b'\x01', response
+        disk = sum(os.path.getsize(file_name)
+                   for file_name in glob.glob('/tmp/easykey-*.db'))
+
+        reads = 0
+        deadline = time.time() + arguments.seconds
+        while time.time() < deadline:
+            response = client.request('doc%d' % (reads % arguments.keys))
+            assert response[0] == b'\x01', response
+            reads += 1
+    finally:
+        stop_server(server)
+        for file_name in glob.glob(files):
+            os.unlink(file_name)
+    print('%-10s %8.1f reads/s %8d KB on disk'
+          % (name, reads / arguments.seconds, disk / 1024))
+
+
+try:
+    run('plain', [])
+    run('compressed', ['--compression-threshold=%d' % arguments.threshold])
+finally:
+    os.unlink(log_name)
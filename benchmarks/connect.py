@@ -0,0 +1,89 @@
+"""
+A connect storm: CLIENTS non-blocking clients connect at once, each one
+sends a read as soon as it is connected, and the script waits up to TIMEOUT
+seconds for every response. The connections that sit in the backlog, not
+accepted, are not answered.
+Starts the server itself, in an empty data directory. Thousands of clients
+need as many file descriptors, see ulimit -n
+"""
+import argparse
+import errno
+import os
+import resource
+import selectors
+import shutil
+import socket
+import tempfile
+import time
+
+from easykey import Client, frame, start_server, stop_server
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--server', default='build/easykeydb')
+parser.add_argument('--clients', default='1000,4000')
+parser.add_argument('--shards', type=int, default=1)
+parser.add_argument('--timeout', type=float, default=20)
+arguments = parser.parse_args()
+
+# The clients and the server, that inherits the limit, need a descriptor
+# per connection
+_, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+resource.setrlimit(resource.RLIMIT_NOFILE, (hard, hard))
+
+REQUEST = frame(['storm'])
+# [status][1 message][4-byte size]['value']
+RESPONSE_SIZE = 2 + 4 + len('value')
+
+
+def storm(count):
+    """How many clients were answered, and in how many seconds"""
+    selector = selectors.DefaultSelector()
+    received = {}
+    started = time.time()
+    for _ in range(count):
+        connection = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        connection.setblocking(False)
+        error = connection.connect_ex(('127.0.0.1', 9000))
+        assert error in (0, errno.EINPROGRESS), os.strerror(error)
+        selector.register(connection, selectors.EVENT_WRITE)
+        received[connection] = b''
+
+    answered = 0
+    deadline = started + arguments.timeout
+    while answered < count and time.time() < deadline:
+        for key, mask in selector.select(deadline - time.time()):
+            connection = key.fileobj
+            if mask & selectors.EVENT_WRITE:
+                connection.sendall(REQUEST)
+                selector.modify(connection, selectors.EVENT_READ)
+                continue
+            chunk = connection.recv(RESPONSE_SIZE)
+            received[connection] += chunk
+            if not chunk or len(received[connection]) == RESPONSE_SIZE:
+                assert received[connection][0] == 1, received[connection]
+                selector.unregister(connection)
+                answered += 1
+    elapsed = time.time() - started
+    for connection in received:
+        connection.close()
+    selector.close()
+    return answered, elapsed
+
+
+directory = tempfile.mkdtemp(prefix='easykey-connect-')
+server, _ = start_server([arguments.server,
+                          '--data-directories=' + directory,
+                          '--partitions=%d' % max(arguments.shards, 1),
+                          '--shards=%d' % arguments.shards],
+                         os.path.join(directory, 'server.log'))
+try:
+    assert Client().request('storm', 'value')[0] == b'\x01'
+    for count in [int(clients) for clients in arguments.clients.split(',')]:
+        answered, elapsed = storm(count)
+        print('%d clients: %d answered in %.2f s' %
+              (count, answered, elapsed))
+        # The closed connections of this storm leave the server first
+        time.sleep(1)
+finally:
+    stop_server(server)
+    shutil.rmtree(directory)
@@ -0,0 +1,59 @@
+"""
+What a bulk load leaves in the page cache: VALUES values of VALUE_SIZE bytes
+are written, then fincore(util-linux) counts the resident bytes of the
+segments. Runs the server with and without --drop-behind, each time in an
+empty data directory
+"""
+import argparse
+import glob
+import os
+import shutil
+import subprocess
+import tempfile
+import time
+
+from easykey import Client, start_server, stop_server
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--server', default='build/easykeydb')
+parser.add_argument('--values', type=int, default=256)
+parser.add_argument('--value-size', type=int, default=4 * 1024 * 1024)
+parser.add_argument('--io', default='blocking')
+arguments = parser.parse_args()
+
+
+def resident_bytes(segments):
+    output = subprocess.check_output(
+        ['fincore', '--bytes', '--noheadings', '--output', 'RES'] + segments)
+    return sum(int(line) for line in output.split())
+
+
+def run(name, options):
+    directory = tempfile.mkdtemp(prefix='easykey-drop-')
+    command = [arguments.server, '--data-directories=' + directory,
+               '--io=' + arguments.io] + options
+    server, _ = start_server(command, os.path.join(directory, 'server.log'))
+    try:
+        client = Client()
+        value = b'v' * arguments.value_size
+        started = time.time()
+        for key in range(arguments.values):
+            response = client.request('key%d' % key, value)
+            assert response[0] == b'\x01', response
+        elapsed = time.time() - started
+
+        # The maintenance drops what was written back since the last one
+        time.sleep(2)
+        segments = glob.glob(os.path.join(directory, '*.db'))
+        resident = resident_bytes(segments)
+        total = sum(os.path.getsize(segment) for segment in segments)
+    finally:
+        stop_server(server)
+        shutil.rmtree(directory)
+    print('%-12s %8.1f MiB/s %8.1f of %.1f MiB resident'
+          % (name, arguments.values * arguments.value_size / elapsed / 2 ** 20,
+             resident / 2 ** 20, total / 2 ** 20))
+
+
+run('default', [])
+run('drop behind', ['--drop-behind=yes'])
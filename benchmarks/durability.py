@@ -0,0 +1,86 @@
+"""
+The write throughput and latency of every durability mode. CLIENTS clients
+write VALUE_SIZE-byte values for SECONDS seconds each, one request at a
+time. Starts the server itself; its files are /tmp/easykey-*, so it refuses
+to run when they exist, and removes them after every mode
+"""
+import argparse
+import glob
+import os
+import tempfile
+import threading
+import time
+
+from easykey import Client, start_server, stop_server
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--server', default='build/easykeydb')
+parser.add_argument('--modes', default='none,interval,group,always')
+parser.add_argument('--interval', type=int, default=10,
+                    help='the --sync-interval of the interval mode')
+parser.add_argument('--group-window', type=int, default=0,
+                    help='the --sync-interval of the group mode')
+parser.add_argument('--clients', type=int, default=16)
+parser.add_argument('--seconds', type=float, default=5)
+parser.add_argument('--value-size', type=int, default=100)
+arguments = parser.parse_args()
+
+files = '/tmp/easykey-*'
+if glob.glob(files):
+    raise SystemExit('%s exist, move them away first' % files)
+log_name = tempfile.mkstemp(prefix='durability-', suffix='.log')[1]
+
+
+def write(client, number, deadline, latencies):
+    value = 'v' * arguments.value_size
+    request = 0
+    while time.time() < deadline:
+        started = time.time()
+        response = client.request('key%d_%d' % (number, request % 1000),
+                                  value)
+        latencies.append(time.time() - started)
+        assert response[0] == b'\x01', response
+        request += 1
+
+
+def run(mode):
+    command = [arguments.server, '--durability=' + mode]
+    if mode == 'interval':
+        command.append('--sync-interval=%d' % arguments.interval)
+    elif mode == 'group':
+        command.append('--sync-interval=%d' % arguments.group_window)
+    server, _ = start_server(command, log_name)
+    try:
+        # One at a time, every client is answered before the next connects
+        clients = []
+        for number in range(arguments.clients):
+            clients.append(Client())
+            clients[-1].request('warmup%d' % number, 'v')
+
+        latencies = [[] for _ in clients]
+        deadline = time.time() + arguments.seconds
+        threads = [threading.Thread(target=write,
+                                    args=(client, number, deadline,
+                                          latencies[number]))
+                   for number, client in enumerate(clients)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+    finally:
+        stop_server(server)
+        for name in glob.glob(files):
+            os.unlink(name)
+
+    merged = sorted(latency for client in latencies for latency in client)
+    print('%-8s %8d writes/s  p50 %7.2f ms  p99 %7.2f ms' %
+          (mode, len(merged) / arguments.seconds,
+           merged[len(merged) // 2] * 1000,
+           merged[len(merged) * 99 // 100] * 1000))
+
+
+try:
+    for mode in arguments.modes.split(','):
+        run(mode)
+finally:
+    os.unlink(log_name)
@@ -0,0 +1,74 @@
+"""
+A minimal Know Nothing client for the benchmarks, see KnowNothing.md
+"""
+import signal
+import socket
+import struct
+import subprocess
+import time
+
+
+def frame(messages):
+    """[protocol][message count]([4-byte size][message])..."""
+    output = bytes([1, len(messages)])
+    for message in messages:
+        if isinstance(message, str):
+            message = message.encode()
+        output += struct.pack('<I', len(message)) + message
+    return output
+
+
+def receive_exactly(connection, size):
+    output = b''
+    while len(output) < size:
+        chunk = connection.recv(size - len(output))
+        if not chunk:
+            raise EOFError('closed after %d of %d bytes' % (len(output), size))
+        output += chunk
+    return output
+
+
+def read_response(connection):
+    """The messages of the next response, the first one is the status"""
+    header = receive_exactly(connection, 2)
+    messages = []
+    for _ in range(header[1]):
+        (size,) = struct.unpack('<I', receive_exactly(connection, 4))
+        messages.append(receive_exactly(connection, size))
+    return messages
+
+
+class Client:
+    def __init__(self, host='127.0.0.1', port=9000):
+        self.connection = socket.create_connection((host, port))
+
+    def request(self, *messages):
+        self.connection.sendall(frame(messages))
+        return read_response(self.connection)
+
+    def pipeline(self, requests):
+        """Sends every request at once, and reads their responses in order"""
+        self.connection.sendall(b''.join(frame(messages)
+                                         for messages in requests))
+        return [read_response(self.connection) for _ in requests]
+
+
+def start_server(command, log_name):
+    """Starts the server, returns it and how long it took to listen"""
+    log = open(log_name, 'w')
+    started = time.time()
+    server = subprocess.Popen(command, stdout=log, stderr=subprocess.STDOUT)
+    while True:
+        with open(log_name) as output:
+            if 'Server running' in output.read():
+                return server, time.time() - started
+        if server.poll() is not None:
+            raise RuntimeError('the server exited, see %s' % log_name)
+        time.sleep(0.01)
+
+
+def stop_server(server):
+    """Stops the server like Ctrl+C, the hint files are written then"""
+    if server.poll() is None:
+        server.send_signal(signal.SIGINT)
+        server.wait()
@@ -0,0 +1,91 @@
+"""
+The ingest of big values: CLIENTS clients write VALUES values of VALUE_SIZE
+bytes, one request at a time. Every --run is a name and a server command,
+to compare builds or options, e.g.:
+    ingest.py --run copy=old/easykeydb \
+              --run pwritev="build/easykeydb --splice-threshold=0" \
+              --run splice=build/easykeydb
+Prints the ingest rate, and the CPU time the server spent per MiB, from
+/proc. The last value of every client is read back, so a run that stored
+something else fails. Starts the servers itself; their files are
+/tmp/easykey-*, so it refuses to run when they exist, and removes them
+after every run
+"""
+import argparse
+import glob
+import os
+import tempfile
+import threading
+import time
+
+from easykey import Client, start_server, stop_server
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--run', action='append', required=True,
+                    help='name=server command')
+parser.add_argument('--clients', type=int, default=4)
+parser.add_argument('--values', type=int, default=1000)
+parser.add_argument('--value-size', type=int, default=1024 * 1024)
+arguments = parser.parse_args()
+
+files = '/tmp/easykey-*'
+if glob.glob(files):
+    raise SystemExit('%s exist, move them away first' % files)
+log_name = tempfile.mkstemp(prefix='ingest-', suffix='.log')[1]
+value = bytes(range(256)) * (arguments.value_size // 256) + \
+    b'v' * (arguments.value_size % 256)
+
+
+def cpu_seconds(server):
+    """The user and system time of the server so far"""
+    with open('/proc/%d/stat' % server.pid) as stat:
+        fields = stat.read().rsplit(')', 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf('SC_CLK_TCK')
+
+
+def write(client, number, count):
+    for request in range(count):
+        response = client.request('big%d_%d' % (number, request % 100), value)
+        assert response[0] == b'\x01', response
+
+
+def run(name, command):
+    server, _ = start_server(command.split(), log_name)
+    try:
+        # One at a time, every client is answered before the next connects
+        clients = []
+        for number in range(arguments.clients):
+            clients.append(Client())
+            clients[-1].request('warmup%d' % number, 'v')
+
+        count = arguments.values // arguments.clients
+        started = time.time()
+        cpu_before = cpu_seconds(server)
+        threads = [threading.Thread(target=write, args=(client, number, count))
+                   for number, client in enumerate(clients)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        elapsed = time.time() - started
+        cpu = cpu_seconds(server) - cpu_before
+
+        for number, client in enumerate(clients):
+            response = client.request('big%d_%d' % (number, (count - 1) % 100))
+            assert response == [b'\x01', value], 'big%d was not stored' % number
+    finally:
+        stop_server(server)
+        for file_name in glob.glob(files):
+            os.unlink(file_name)
+
+    mebibytes = count * len(clients) * arguments.value_size / (1024 * 1024)
+    print('%-10s %8.1f MiB/s  server CPU %6.2f ms/MiB' %
+          (name, mebibytes / elapsed, cpu * 1000 / mebibytes))
+
+
+try:
+    for spec in arguments.run:
+        name, command = spec.split('=', 1)
+        run(name, command)
+finally:
+    os.unlink(log_name)
@@ -0,0 +1,104 @@
+"""
+How much memory the server takes per key: KEYS keys of 10 to 15 bytes with
+small values are written, and the growth of the server resident set is
+divided by them. Then LOOKUPS reads of random keys that were written, and of
+keys that were not, measure the lookup latency, 64 reads pipelined at a time.
+Every --run is a name and a server command, to compare builds or the disk
+index, e.g.:
+    memory.py --run memory="build/easykeydb --segment-size=1048576"
+              --run disk="build/easykeydb --segment-size=1048576
+                          --disk-index=yes"
+Starts the servers itself; their files are /tmp/easykey-*, so it refuses
+to run when they exist, and removes them after every run
+"""
+import argparse
+import glob
+import os
+import random
+import tempfile
+import time
+
+from easykey import Client, start_server, stop_server
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--run', action='append', required=True,
+                    help='name=server command')
+parser.add_argument('--keys', type=int, default=1000000)
+parser.add_argument('--lookups', type=int, default=200000)
+arguments = parser.parse_args()
+
+files = '/tmp/easykey-*'
+if glob.glob(files):
+    raise SystemExit('%s exist, move them away first' % files)
+log_name = tempfile.mkstemp(prefix='memory-', suffix='.log')[1]
+
+
+def resident_bytes(server):
+    with open('/proc/%d/status' % server.pid) as status:
+        for line in status:
+            if line.startswith('VmRSS:'):
+                return int(line.split()[1]) * 1024
+
+
+def key_name(key):
+    # 10 to 15 bytes
+    return 'key%07d%s' % (key, 'k' * (key % 6))
+
+
+def settled(server):
+    """Waits until the key tables are written and the memory stops changing"""
+    tables = -1
+    resident = -1
+    while True:
+        time.sleep(2)
+        now = (len(glob.glob('/tmp/easykey-*.keys')), resident_bytes(server))
+        if now == (tables, resident):
+            return resident
+        tables, resident = now
+
+
+def lookups(client, keys, status):
+    """The microseconds per read of the keys, 64 pipelined at a time"""
+    started = time.time()
+    for first in range(0, len(keys), 64):
+        for response in client.pipeline([[key]
+                                         for key in keys[first:first + 64]]):
+            assert response[0] == status, response
+    return (time.time() - started) * 1000000 / len(keys)
+
+
+def run(name, command):
+    server, _ = start_server(command.split(), log_name)
+    try:
+        client = Client()
+        client.request('warmup', 'v')
+        before = resident_bytes(server)
+        for first in range(0, arguments.keys, 1000):
+            last = min(first + 1000, arguments.keys)
+            for response in client.pipeline([[key_name(key), 'v']
+                                             for key in range(first, last)]):
+                assert response[0] == b'\x01', response
+        after = settled(server)
+
+        # The misses have the same lengths, but were never written
+        random.seed(1)
+        hits = [key_name(random.randrange(arguments.keys))
+                for _ in range(arguments.lookups)]
+        misses = ['m' + key_name(random.randrange(arguments.keys))[1:]
+                  for _ in range(arguments.lookups)]
+        hit = lookups(client, hits, b'\x01')
+        miss = lookups(client, misses, b'\x02')
+    finally:
+        stop_server(server)
+        for file_name in glob.glob(files):
+            os.unlink(file_name)
+    print('%-10s %6.1f bytes/key, hit %5.1f us, miss %5.1f us' %
+          (name, (after - before) / arguments.keys, hit, miss))
+
+
+try:
+    for spec in arguments.run:
+        name, command = spec.split('=', 1)
+        run(name, command)
+finally:
+    os.unlink(log_name)
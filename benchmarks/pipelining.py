@@ -0,0 +1,48 @@
+"""
+Reads and GROUP durability writes of one client, at several pipelining
+depths(requests sent before reading their responses).
+Starts the server itself, with --durability=group, in an empty data
+directory
+"""
+import argparse
+import os
+import shutil
+import tempfile
+import time
+
+from easykey import Client, start_server, stop_server
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--server', default='build/easykeydb')
+parser.add_argument('--requests', type=int, default=20000)
+parser.add_argument('--depths', default='1,10,64,512')
+arguments = parser.parse_args()
+depths = [int(depth) for depth in arguments.depths.split(',')]
+
+directory = tempfile.mkdtemp(prefix='easykey-pipelining-')
+server, _ = start_server([arguments.server,
+                          '--data-directories=' + directory,
+                          '--durability=group'],
+                         os.path.join(directory, 'server.log'))
+try:
+    client = Client()
+    client.request('pipelined', 'x' * 100)
+    for kind in ('get', 'write'):
+        for depth in depths:
+            started = time.time()
+            done = 0
+            while done < arguments.requests:
+                if kind == 'get':
+                    requests = [['pipelined']] * depth
+                else:
+                    requests = [['key%d' % ((done + index) % 1000), 'v' * 100]
+                                for index in range(depth)]
+                for response in client.pipeline(requests):
+                    assert response[0] == b'\x01', response
+                done += depth
+            elapsed = time.time() - started
+            print('%s depth %d: %d requests/s' %
+                  (kind, depth, done / elapsed))
+finally:
+    stop_server(server)
+    shutil.rmtree(directory)
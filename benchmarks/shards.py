@@ -0,0 +1,79 @@
+"""
+How the throughput scales with the shards: the server runs with every
+--shards count of SHARDS, and CLIENTS client processes write and read
+random keys for SECONDS seconds, one request at a time. The clients
+need cores of their own, or they are the bottleneck instead of the server.
+Starts the server itself, every time in an empty data directory
+"""
+import argparse
+import multiprocessing
+import os
+import random
+import shutil
+import tempfile
+import time
+
+from easykey import Client, start_server, stop_server
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--server', default='build/easykeydb')
+parser.add_argument('--shards', default='1,2,4')
+parser.add_argument('--partitions', type=int, default=8)
+parser.add_argument('--clients', type=int, default=8)
+parser.add_argument('--seconds', type=float, default=5)
+parser.add_argument('--keys', type=int, default=10000)
+parser.add_argument('--value-size', type=int, default=100)
+arguments = parser.parse_args()
+
+
+def load(number, deadline, done):
+    """Half writes and half reads, of the keys the first pass wrote"""
+    client = Client()
+    generator = random.Random(number)
+    value = 'v' * arguments.value_size
+    requests = 0
+    while time.time() < deadline:
+        key = 'key%d' % generator.randrange(arguments.keys)
+        if generator.random() < 0.5:
+            response = client.request(key, value)
+        else:
+            response = client.request(key)
+        assert response[0] == b'\x01', response
+        requests += 1
+    done.put(requests)
+
+
+def run(shards):
+    directory = tempfile.mkdtemp(prefix='easykey-shards-')
+    command = [arguments.server,
+               '--data-directories=' + directory,
+               '--partitions=%d' % arguments.partitions,
+               '--shards=%d' % shards]
+    server, _ = start_server(command, os.path.join(directory, 'server.log'))
+    try:
+        client = Client()
+        value = 'v' * arguments.value_size
+        for key in range(arguments.keys):
+            response = client.request('key%d' % key, value)
+            assert response[0] == b'\x01', response
+
+        done = multiprocessing.Queue()
+        deadline = time.time() + arguments.seconds
+        clients = [multiprocessing.Process(target=load,
+                                           args=(number, deadline, done))
+                   for number in range(arguments.clients)]
+        for process in clients:
+            process.start()
+        requests = sum(done.get() for _ in clients)
+        for process in clients:
+            process.join()
+    finally:
+        stop_server(server)
+        shutil.rmtree(directory)
+    print('shards=%-3d %8.1fk requests/s' %
+          (shards, requests / arguments.seconds / 1000))
+
+
+print('%d CPUs' % os.cpu_count())
+for shards in arguments.shards.split(','):
+    run(int(shards))
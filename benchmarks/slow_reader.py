@@ -0,0 +1,66 @@
+"""
+The read latency of a client while another one requests a big value and
+does not read it. The response waits in the output of the slow client, so
+the other one is still answered.
+Starts the server itself, in an empty data directory
+"""
+import argparse
+import os
+import shutil
+import socket
+import tempfile
+import threading
+import time
+
+from easykey import Client, frame, read_response, start_server, stop_server
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--server', default='build/easykeydb')
+parser.add_argument('--value-size', type=int, default=32 * 1024 * 1024)
+parser.add_argument('--reads', type=int, default=2000)
+parser.add_argument('--timeout', type=float, default=20)
+arguments = parser.parse_args()
+
+directory = tempfile.mkdtemp(prefix='easykey-slow-')
+server, _ = start_server([arguments.server,
+                          '--data-directories=' + directory],
+                         os.path.join(directory, 'server.log'))
+try:
+    client = Client()
+    value = b'v' * arguments.value_size
+    assert client.request('big', value)[0] == b'\x01'
+    assert client.request('small', 'value')[0] == b'\x01'
+
+    slow = socket.create_connection(('127.0.0.1', 9000))
+    slow.sendall(frame(['big']))
+    time.sleep(0.1)
+
+    latencies = []
+
+    def read():
+        for _ in range(arguments.reads):
+            started = time.time()
+            try:
+                assert client.request('small')[1] == b'value'
+            except OSError:
+                # The server was stopped, after the timeout
+                return
+            latencies.append(time.time() - started)
+
+    thread = threading.Thread(target=read, daemon=True)
+    thread.start()
+    thread.join(arguments.timeout)
+    if thread.is_alive():
+        print('%d of %d reads answered in %.0f s' %
+              (len(latencies), arguments.reads, arguments.timeout))
+    else:
+        response = read_response(slow)
+        assert response[0] == b'\x01' and response[1] == value
+        latencies.sort()
+        print('%d reads: median %.2f ms, max %.2f ms, the big value arrived'
+              ' whole' % (len(latencies), latencies[len(latencies) // 2] *
+                          1000, latencies[-1] * 1000))
+finally:
+    server.kill()
+    server.wait()
+    shutil.rmtree(directory)
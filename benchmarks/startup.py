@@ -0,0 +1,59 @@
+"""
+How long the server takes to start with KEYS keys, loading the index from
+the hint files, and with a full scan of the segments(the hint files are
+removed). Starts the server itself, in an empty data directory
+"""
+import argparse
+import glob
+import os
+import re
+import shutil
+import tempfile
+
+from easykey import Client, start_server, stop_server
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--server', default='build/easykeydb')
+parser.add_argument('--keys', type=int, default=10000000)
+parser.add_argument('--value-size', type=int, default=100)
+parser.add_argument('--partitions', type=int, default=5)
+arguments = parser.parse_args()
+
+directory = tempfile.mkdtemp(prefix='easykey-startup-')
+log_name = os.path.join(directory, 'server.log')
+command = [arguments.server,
+           '--data-directories=' + directory,
+           '--partitions=%d' % arguments.partitions]
+
+
+def recovery_milliseconds():
+    with open(log_name) as log:
+        return sum(int(milliseconds) for milliseconds in
+                   re.findall(r'Recovered \d+ keys .* in (\d+) ms', log.read()))
+
+
+server = None
+try:
+    server, _ = start_server(command, log_name)
+    client = Client()
+    value = 'v' * arguments.value_size
+    for key in range(arguments.keys):
+        response = client.request('key%d' % key, value)
+        assert response[0] == b'\x01', response
+    stop_server(server)
+
+    server, elapsed = start_server(command, log_name)
+    stop_server(server)
+    print('hint files: %.2f s to listen, %d ms recovering' %
+          (elapsed, recovery_milliseconds()))
+
+    for hint in glob.glob(os.path.join(directory, '*.hint')):
+        os.unlink(hint)
+    server, elapsed = start_server(command, log_name)
+    stop_server(server)
+    print('full scan: %.2f s to listen, %d ms recovering' %
+          (elapsed, recovery_milliseconds()))
+finally:
+    if server is not None:
+        stop_server(server)
+    shutil.rmtree(directory)
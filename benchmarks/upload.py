@@ -0,0 +1,63 @@
+"""
+The read latency of a client while another one sends a big value slowly,
+in CHUNKS pieces with PAUSE seconds between them. The value is spliced, and
+resumed when more of it arrives, so the reads are not held behind it.
+Starts the server itself, in an empty data directory
+"""
+import argparse
+import os
+import shutil
+import socket
+import struct
+import tempfile
+import threading
+import time
+
+from easykey import Client, read_response, start_server, stop_server
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--server', default='build/easykeydb')
+parser.add_argument('--value-size', type=int, default=4 * 1024 * 1024)
+parser.add_argument('--chunks', type=int, default=8)
+parser.add_argument('--pause', type=float, default=0.2)
+arguments = parser.parse_args()
+
+directory = tempfile.mkdtemp(prefix='easykey-upload-')
+server, _ = start_server([arguments.server,
+                          '--data-directories=' + directory],
+                         os.path.join(directory, 'server.log'))
+try:
+    reader = Client()
+    assert reader.request('small', 'value')[0] == b'\x01'
+    latencies = []
+    uploading = True
+
+    def read():
+        while uploading:
+            started = time.time()
+            assert reader.request('small')[1] == b'value'
+            latencies.append(time.time() - started)
+            time.sleep(0.01)
+
+    thread = threading.Thread(target=read)
+    thread.start()
+    size = arguments.value_size
+    uploader = socket.create_connection(('127.0.0.1', 9000))
+    uploader.sendall(bytes([1, 2]) + struct.pack('<I', 3) + b'big' +
+                     struct.pack('<I', size))
+    chunk = size // arguments.chunks
+    started = time.time()
+    for index in range(arguments.chunks):
+        end = size if index == arguments.chunks - 1 else (index + 1) * chunk
+        uploader.sendall(b'x' * (end - index * chunk))
+        time.sleep(arguments.pause)
+    assert read_response(uploader)[0] == b'\x01'
+    uploading = False
+    thread.join()
+finally:
+    stop_server(server)
+    shutil.rmtree(directory)
+latencies.sort()
+print('upload of %d bytes in %.2f s, reads: median %.2f ms, max %.2f ms' %
+      (size, time.time() - started, latencies[len(latencies) // 2] * 1000,
+       latencies[-1] * 1000))
@@ -4,13 +4,20 @@
 #include <cstdint>
 #include <exception>
 #include <memory>
-#include <queue>
 #include <stdexcept>
+#include <string>
 #include <vector>
 #include <functional>
 
 namespace easykey
 {
+/**
+ * Reads into the output up to size bytes, returns how many were read, zero
+ * if there is no more data for now
+ */
+using ByteSource =
+    std::function<std::uint64_t(std::uint8_t* output, std::uint64_t size)>;
+
 /**
  * For now, there is no need to make it thread safe, because we will have one
  * single thread
@@ -18,8 +25,7 @@ namespace easykey
 class ByteBuffer
 {
   public:
-    ByteBuffer(
-        const std::function<std::vector<std::uint8_t>(void)> source_trigger);
+    ByteBuffer(const ByteSource source_trigger);
 
     std::uint32_t get_integer4();
     std::uint8_t get_integer1();
@@ -27,33 +33,93 @@ class ByteBuffer
     bool has_content() const;
     std::uint32_t size() const;
 
+    /**
+     * The bytes read and not consumed yet, size() of them, so they can be
+     * written somewhere else without copying them first
+     */
+    const std::uint8_t* data() const;
+
+    /**
+     * Discards the first size bytes, see data
+     */
+    void consume(const std::uint32_t size);
+
+    /**
+     * Starts a frame at the current position. The bytes before it are
+     * dropped, the frame ones are kept until the next mark, so it can be
+     * checked again from its start, see arrived
+     */
+    void mark();
+
+    /**
+     * Reads what the source has, returns false if the frame still misses
+     * some bytes, so it is not worth reading it again yet
+     */
+    bool fill();
+
+    /**
+     * True if the size bytes from the current position are in the buffer,
+     * reading what the source has when they are not. Otherwise the frame
+     * misses them, see fill. Nothing is consumed, so a frame can be checked
+     * whole before it is parsed, see Handler::frame_arrived
+     */
+    bool arrived(const std::uint64_t size);
+
+    /**
+     * The most bytes a frame can take, from its mark. Reading, or checking
+     * with arrived, past them throws FrameTooBigException, so a size the
+     * client declared can not make the buffer take more memory
+     */
+    void set_frame_limit(const std::uint64_t limit);
+
   private:
     /**
-     * Someone reads from an end(pop) and other one writes to the other
-     * end(push)
+     * The bytes from position until length were not consumed yet.
+     * The source writes right after them, so every byte is copied only once.
+     * The bytes after length are not initialized, they are written by the
+     * source before being read
+     */
+    std::unique_ptr<std::uint8_t[]> buffer;
+    std::uint64_t length;
+    std::uint64_t capacity;
+    std::uint64_t position;
+
+    /**
+     * Where the frame starts, and how many bytes from there the last read
+     * that failed needed, zero if none failed
      */
-    std::queue<std::uint8_t> buffer;
+    std::uint64_t marked;
+    std::uint64_t awaited;
+    std::uint64_t frame_limit;
 
     /**
      * If buffer is empty, or, the client requested more bytes than the
      * available this function is executed
      */
-    const std::function<std::vector<std::uint8_t>(void)> source_trigger;
+    const ByteSource source_trigger;
 
     /**
-     * Trigger source_trigger function and append data to the internal buffer
+     * The getters only read what arrived already, see arrived
      */
     void ensure_has_requested(const std::uint32_t bytes_needed);
+
+    /**
+     * Reads from the source until the buffer has end bytes, or the source
+     * has no more. Returns false if it still does not have them
+     */
+    bool read_until(const std::uint64_t end);
+
+    /**
+     * Makes room for size bytes, at least doubling the capacity, so the
+     * buffer only grows with what actually arrived
+     */
+    void reserve(const std::uint64_t size);
 };
 
-class EmptyBufferException : public std::runtime_error
+class FrameTooBigException : public std::runtime_error
 {
-  private:
-    const char* message;
-
   public:
-    EmptyBufferException(const std::string message);
-    virtual const char* what() const noexcept override;
+    FrameTooBigException(const std::string message);
 };
 
-};  // namespace easykey
\ No newline at end of file
+};  // namespace easykey
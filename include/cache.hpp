@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace easykey
+{
+/**
+ * A value kept in the cache, with its key so it can be found when evicted
+ */
+struct CacheEntry
+{
+    std::string key;
+    std::vector<std::uint8_t> value;
+    bool is_protected;
+};
+
+/**
+ * Keeps the most read values in memory, up to a byte budget.
+ * The eviction is a segmented LRU: a value enters the probation segment, and
+ * only moves to the protected segment when it is read again. So, reading a
+ * lot of keys once only evicts the probation segment, and never the values
+ * that are read all the time.
+ * http://www.cs.ucr.edu/~zhuang/papers/SLRU.pdf
+ */
+class Cache
+{
+  public:
+    Cache(const std::uint64_t budget);
+
+    /**
+     * Returns the value of the key, or null if it is not cached
+     */
+    const std::vector<std::uint8_t>* get(const std::string& key);
+
+    /**
+     * Caches the value of the key, evicting the least recently read values
+     * until it fits the budget.
+     * Returns the cached value, or null if it is bigger than the budget
+     */
+    const std::vector<std::uint8_t>* put(const std::string& key,
+                                         std::vector<std::uint8_t> value);
+
+    /**
+     * Forgets the value of the key, if it is cached
+     */
+    void invalidate(const std::string& key);
+
+    /**
+     * Writes the cache counters
+     */
+    void report(std::ostream& output) const;
+
+  private:
+    const std::uint64_t budget;
+
+    /**
+     * The most recently read values first
+     */
+    std::list<CacheEntry> probation;
+    std::list<CacheEntry> protected_values;
+    std::unordered_map<std::string, std::list<CacheEntry>::iterator> entries;
+
+    std::uint64_t size;
+    std::uint64_t protected_size;
+
+    std::uint64_t hits;
+    std::uint64_t misses;
+    std::uint64_t evictions;
+
+    /**
+     * Removes the least recently read values until needed more bytes fit the
+     * budget
+     */
+    void evict(const std::uint64_t needed);
+
+    /**
+     * Removes the entry from its segment and from the lookup table
+     */
+    void remove(const std::list<CacheEntry>::iterator entry);
+};
+
+};  // namespace easykey
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdint>
+
+namespace easykey
+{
+/**
+ * The CRC-32C(Castagnoli) checksum, the one of iSCSI, ext4 and btrfs.
+ * It finds every burst of errors up to 32 bits, and the x86 processors with
+ * SSE4.2 compute it with one instruction for every 8 bytes
+ * https://www.rfc-editor.org/rfc/rfc3720#appendix-B.4
+ */
+
+/**
+ * Continues the checksum of the previous bytes, that starts at zero, with the
+ * next size bytes of input
+ */
+std::uint32_t crc32c(const std::uint8_t* input,
+                     std::uint64_t size,
+                     const std::uint32_t previous = 0);
+
+};  // namespace easykey
@@ -0,0 +1,1115 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cache.hpp"
+#include "index.hpp"
+#include "key_table.hpp"
+#include "ring.hpp"
+#include "timing_wheel.hpp"
+
+namespace easykey
+{
+/**
+ * When the written records are flushed to the disk
+ */
+enum class Durability : std::uint8_t
+{
+    /**
+     * Never, the kernel decides when to write the page cache to the disk
+     */
+    NONE,
+
+    /**
+     * Every sync interval, in the background. A write acknowledged in the
+     * last interval can be lost
+     */
+    INTERVAL,
+
+    /**
+     * The writes of the same server iteration, or of the same sync interval,
+     * are flushed together, and only then they are acknowledged
+     */
+    GROUP,
+
+    /**
+     * Every write is flushed before it is acknowledged
+     */
+    ALWAYS,
+};
+
+/**
+ * How the records are written to the partition files
+ */
+enum class IOBackend : std::uint8_t
+{
+    /**
+     * The write system calls run in the server thread, a slow disk stalls
+     * every client
+     */
+    BLOCKING,
+
+    /**
+     * The appends and the flushes are submitted to an io_uring, and the
+     * clients are answered when they complete
+     */
+    URING,
+};
+
+/**
+ * Called when a write or a flush completes, with true if it succeeded
+ */
+using IOCallback = std::function<void(bool)>;
+
+/**
+ * Called when the files of a snapshot were linked and flushed, with the
+ * manifest lines of every data directory and how many bytes were linked
+ */
+using SnapshotCallback =
+    std::function<void(bool done,
+                       const std::vector<std::string>& manifests,
+                       std::uint64_t bytes)>;
+
+struct DatabaseOptions
+{
+    /**
+     * In how many partitions the keys are spread.
+     * Must be the same every time the server starts with the same data
+     */
+    std::uint16_t partitions = 5;
+
+    /**
+     * When the active segment of a partition reaches this size, it becomes
+     * immutable and a new active segment is created
+     */
+    std::uint64_t segment_size = 64 * 1024 * 1024;
+
+    /**
+     * How many bytes per second the compaction and the hint files writing can
+     * read from the segments
+     */
+    std::uint64_t compaction_rate = 16 * 1024 * 1024;
+
+    /**
+     * The percentage of dead bytes that makes an immutable segment eligible
+     * to be compacted
+     */
+    std::uint8_t compaction_threshold = 50;
+
+    Durability durability = Durability::NONE;
+
+    /**
+     * How often the INTERVAL durability flushes, and how long the GROUP
+     * durability waits for more writes before flushing.
+     * Zero makes the GROUP durability flush at the end of every iteration
+     */
+    std::chrono::milliseconds sync_interval = std::chrono::milliseconds(0);
+
+    IOBackend io = IOBackend::BLOCKING;
+
+    /**
+     * Values up to this size are sent from the segment mapping, together with
+     * the response header, with one system call. The bigger ones use sendfile.
+     * Zero disables the mappings
+     */
+    std::uint64_t small_value_size = 1024;
+
+    /**
+     * How many bytes the cache of the most read small values can take.
+     * Zero disables the cache
+     */
+    std::uint64_t cache_size = 0;
+
+    /**
+     * Also keeps the keys in order, so they can be scanned
+     */
+    bool ordered_index = false;
+
+    /**
+     * Values bigger than this are stored compressed, if that makes them
+     * smaller. Zero disables the compression
+     */
+    std::uint64_t compression_threshold = 0;
+
+    /**
+     * Values of at least this size, written without a TTL, are moved from
+     * the socket to the segment with splice, so they never reach the user
+     * space. Not used for the values that would be compressed.
+     * Zero disables it
+     */
+    std::uint64_t splice_threshold = 64 * 1024;
+
+    /**
+     * The most bytes a request can take in memory, a bigger one is answered
+     * with an error and its connection is closed. The spliced values do not
+     * count, they never reach the memory
+     */
+    std::uint64_t max_request_size = 64 * 1024 * 1024;
+
+    /**
+     * The keys of the immutable segments are kept in key tables, next to the
+     * segments, instead of in memory. Only the keys of the active segment,
+     * and of the segments without a key table yet, are in memory
+     */
+    bool disk_index = false;
+
+    /**
+     * Where the segments are stored, the partitions are spread between them:
+     * the partition p is in the directory p % count, so every disk given its
+     * own directory takes a share of the appends.
+     * Must be given in the same order every time the server starts
+     */
+    std::vector<std::string> data_directories = {"/tmp"};
+
+    /**
+     * How many shards the server has, and which one this database is. It
+     * only has the partitions p where p % shards == shard, and the
+     * partitions must be at least as many as the shards
+     */
+    std::uint16_t shards = 1;
+    std::uint16_t shard = 0;
+
+    /**
+     * The new connections go to the shard of the core that got them, instead
+     * of the hash of the connection, so the same core takes the interrupt,
+     * the accept and the requests of a connection
+     */
+    bool steer_by_cpu = false;
+
+    /**
+     * How many connections can wait to be accepted by every shard, the
+     * kernel caps it at net.core.somaxconn
+     */
+    std::uint16_t backlog = 4096;
+
+    /**
+     * The new segments take all their disk space at once, so the appends do
+     * not allocate the file system blocks a few bytes at a time
+     */
+    bool preallocate = true;
+
+    /**
+     * The appended bytes are written back as they come, and dropped from the
+     * page cache once they are on the disk. For bulk loads, that would
+     * otherwise push every other file out of the page cache
+     */
+    bool drop_behind = false;
+
+    /**
+     * Logs every connection, message and write. They are written to stdout
+     * and flushed one by one, inside the accept loop and the batch of
+     * pipelined requests, so they are only for debugging
+     */
+    bool verbose = false;
+};
+
+struct File
+{
+    /**
+     * The file descriptor
+     */
+    const std::int32_t fd;
+
+    /**
+     * The file name
+     */
+    const std::string filename;
+
+    /**
+     * The file that keeps the key, offset and size of every record of this
+     * file, so the index can be rebuilt without reading the values
+     */
+    const std::string hint_filename;
+
+    /**
+     * The key table of the segment, with the disk index
+     */
+    const std::string table_filename;
+
+    /**
+     * The segment id, segments of a partition are ordered by it
+     */
+    const std::uint32_t id;
+
+    /**
+     * Unique for every file opened, the index points to the files by it
+     */
+    const std::uint32_t number;
+
+    /**
+     * How many bytes were appended to this file
+     */
+    off_t size;
+
+    /**
+     * How many bytes belong to records that were overwritten or deleted
+     */
+    std::uint64_t dead_bytes;
+
+    /**
+     * The segment is immutable, but its hint file was not written yet
+     */
+    bool hint_pending;
+
+    /**
+     * The keys of the segment, when it is immutable and has a key table.
+     * Then, the index does not have them
+     */
+    std::unique_ptr<KeyTable> table;
+
+    /**
+     * Some record was appended and not flushed to the disk yet
+     */
+    bool dirty;
+
+    /**
+     * Appends submitted to the io_uring that did not complete yet.
+     * The segment is not read while there are any, since they can still be
+     * holes in the file
+     */
+    std::uint32_t in_flight;
+
+    /**
+     * The io_uring appends that were not acknowledged yet, by the offset of
+     * their record. They complete in any order, but one is only acknowledged
+     * once the ones before it completed: until then their space can be a
+     * hole, and the recovery truncates the segment at it
+     */
+    std::map<off_t, std::uint64_t> appending;
+
+    /**
+     * The file mapped read only, or null if it is not mapped.
+     * It is mapped beyond its size, so the records appended later are also
+     * mapped
+     */
+    const std::uint8_t* mapping;
+    std::uint64_t mapping_size;
+
+    /**
+     * With the drop behind, up to where the file is being written back, and
+     * up to where it was dropped from the page cache
+     */
+    off_t written_back;
+    off_t dropped;
+
+    File(const std::int32_t fd,
+         const std::string filename,
+         const std::string hint_filename,
+         const std::string table_filename,
+         const std::uint32_t id,
+         const std::uint32_t number);
+    ~File();
+
+    /**
+     * Maps the first size bytes of the file
+     */
+    void map(const std::uint64_t size);
+
+    /**
+     * Where the bytes at offset are mapped, or null if they are not
+     */
+    const std::uint8_t* at(const off_t offset, const std::uint64_t size) const;
+
+    /**
+     * https://en.cppreference.com/w/cpp/language/rule_of_three
+     *
+     */
+    File(const File&) = delete;
+    File(File&&) = delete;
+    File operator=(const File&) = delete;
+    File operator=(File&&) = delete;
+};
+
+struct FileStorage
+{
+    /**
+     * The value stored size
+     */
+    std::uint64_t size;
+
+    /**
+     * Where the value starts
+     */
+    off_t offset;
+
+    /**
+     * In which file is it located
+     */
+    File* file;
+
+    /**
+     * The value is stored as [4-byte value size][LZ4 block], see lz4.hpp
+     */
+    bool compressed = false;
+
+    /**
+     * When the record expires, zero if it never does
+     */
+    std::uint64_t expiry = 0;
+};
+
+/**
+ * A value that is written as it arrives, straight to the space of its
+ * record, see Database::begin_upload
+ */
+struct Upload
+{
+    std::uint64_t id;
+    std::string key;
+
+    /**
+     * Where the value size starts, the value goes right after it
+     */
+    FileStorage storage;
+
+    /**
+     * Where the record starts
+     */
+    off_t offset;
+};
+
+struct Partition
+{
+    /**
+     * The segments ordered from the oldest to the newest.
+     * The last one is the active segment, where the writes are appended.
+     * They are shared, so a segment that was replaced by the compaction is
+     * only closed when no one else is using it
+     */
+    std::vector<std::shared_ptr<File>> segments;
+
+    std::uint32_t next_segment_id;
+
+    /**
+     * The files are named by the partition number, with the shards it is not
+     * its position in the partitions of the database
+     */
+    std::uint16_t number;
+
+    /**
+     * Counters, to check how evenly the keys are spread
+     */
+    std::uint64_t writes;
+    std::uint64_t reads;
+    std::uint64_t written_bytes;
+};
+
+/**
+ * A segment being rewritten with only its live records.
+ * The compaction runs a few records at every tick of the server, so it never
+ * blocks the clients for long
+ */
+struct Compaction
+{
+    Partition* partition;
+    std::shared_ptr<File> source;
+    std::shared_ptr<File> destination;
+
+    /**
+     * Where the destination is written until it replaces the source
+     */
+    std::string temporary_filename;
+
+    /**
+     * The offset of the next source record to be checked
+     */
+    off_t position;
+
+    /**
+     * The entries of the key table of the destination, when the source has
+     * a key table
+     */
+    std::vector<TableEntry> entries;
+
+    /**
+     * The source offset of every record already copied, so they can be
+     * pointed back to the source if the compaction is aborted
+     */
+    std::vector<off_t> moved;
+
+    /**
+     * Up to where the writeback of the destination was started
+     */
+    off_t written_back;
+};
+
+/**
+ * The hint file or the key table of an immutable segment, being written from
+ * its records.
+ * Like the compaction, it reads a few records at every tick of the server,
+ * under the compaction allowance, then writes the file the same way
+ */
+struct IndexWriting
+{
+    std::shared_ptr<File> segment;
+
+    /**
+     * A key table, with the disk index, or a hint file
+     */
+    bool table;
+
+    /**
+     * Where the file is written until it is complete, -1 once it was renamed
+     */
+    std::string temporary_filename;
+    std::int32_t fd;
+
+    /**
+     * The offset of the next segment record to be read
+     */
+    off_t position;
+
+    /**
+     * The bytes to write to the file, the first buffered ones already were
+     */
+    std::vector<std::uint8_t> buffer;
+    std::uint64_t buffered;
+
+    /**
+     * How many bytes were written to the file, their writeback was started
+     */
+    off_t written;
+
+    /**
+     * The last entry of every key of the segment, for a key table. Once it
+     * is in place, the first released keys left the index
+     */
+    std::vector<TableEntry> entries;
+    std::uint64_t released;
+};
+
+/**
+ * A snapshot whose segments were sealed, but not all linked yet: the appends
+ * and the uploads into some of them are still in flight
+ */
+struct PendingSnapshot
+{
+    std::string name;
+
+    /**
+     * The sealed segments not linked yet, with the number of their data
+     * directory
+     */
+    std::vector<std::pair<std::size_t, std::shared_ptr<File>>> segments;
+
+    /**
+     * The manifest lines of the files already linked, of every data directory
+     */
+    std::vector<std::string> manifests;
+    std::uint64_t bytes;
+    bool linked;
+    SnapshotCallback done;
+};
+
+/**
+ * An append or a flush submitted to the io_uring
+ */
+struct Operation
+{
+    /**
+     * The record being appended, the flushes have no record
+     */
+    std::string key;
+    std::vector<std::uint8_t> value;
+    bool tombstone;
+    std::uint64_t expiry;
+    std::uint8_t headers[20];
+    FileStorage storage;
+
+    /**
+     * What is still left to be written, and where.
+     * Only the parts the record has are used, see record_parts
+     */
+    struct iovec parts[4];
+    std::uint32_t first_part;
+    std::uint32_t parts_count;
+    off_t offset;
+
+    /**
+     * How many submitted operations did not complete yet
+     */
+    std::uint32_t remaining;
+    bool success;
+    IOCallback done;
+};
+
+/**
+ * Every record is stored in the partition files as:
+ * [4-byte key size][key][4-byte checksum][4-byte value size][value]
+ * The checksum is the CRC-32C of the other bytes of the record, so the
+ * recovery stops at a torn or corrupted record.
+ * The FileStorage of a key points to the value size, so a read can send the
+ * value size and the value as they are stored.
+ * A deleted key is stored as a tombstone, with the last bit of the key size
+ * set and no value: [4-byte key size | 0x80000000][key][4-byte checksum]
+ * A key with a TTL has the bit before it set, and its expiry(milliseconds
+ * since the epoch) after the key:
+ * [4-byte key size | 0x40000000][key][8-byte expiry][4-byte checksum]
+ * [4-byte value size][value]
+ * A compressed value has the bit 0x20000000 of the key size set
+ */
+class Database
+{
+  public:
+    Database(const DatabaseOptions options);
+    ~Database();
+    /**
+     * Appends the record to the partition of the key, and calls done when
+     * it was written (and flushed, with the ALWAYS durability).
+     * With the blocking backend, done is called before it returns.
+     * The key is only readable after it was written, and until its ttl
+     * passes, if it is not zero
+     */
+    void write(const std::string& key,
+               std::vector<std::uint8_t> data,
+               const std::chrono::milliseconds ttl,
+               const IOCallback done);
+
+    /**
+     * Like write, without a ttl, for a value of size bytes that is not in
+     * memory: begin_upload takes the space of its record in the active
+     * segment, and the caller writes the value there, right after the value
+     * size(upload.storage.offset + 4), as it arrives. Meanwhile, the record
+     * is marked as unfinished, so a crash leaves a record that the recovery
+     * skips. Returns false if it could not be marked
+     */
+    bool begin_upload(const std::string& key,
+                      const std::uint64_t size,
+                      Upload& upload);
+
+    /**
+     * The whole value of the upload was received, or it will never be. Its
+     * headers are written with its checksum, and it is indexed, unless the
+     * key was written again meanwhile. The value is never compressed, and
+     * done is called with false if it was not received
+     */
+    void finish_upload(const Upload& upload,
+                       const bool received,
+                       const IOCallback done);
+
+    /**
+     * Appends a tombstone of the key to its partition, and calls done when
+     * it was written, like write. The key is removed when it was written.
+     * Returns false, without calling done, if the key does not exist
+     */
+    bool remove(const std::string& key, const IOCallback done);
+
+    /**
+     * The shard whose database has the partition of the key
+     */
+    std::uint16_t shard_of(const std::string& key) const;
+
+    /**
+     * Returns where the value of the key is stored, with a null file if the
+     * key does not exist
+     */
+    FileStorage read(const std::string& key);
+
+    /**
+     * Returns the stored value size and the value of the key, if it is small
+     * enough to be cached. Otherwise, or if the key does not exist, returns
+     * null and the key must be read with read
+     */
+    const std::vector<std::uint8_t>* cached(const std::string& key);
+
+    /**
+     * Finds up to limit keys, in order, from the from key (inclusive) until
+     * the to key (exclusive, or until the last key if it is empty), and where
+     * their values are stored.
+     * The cursor is the key where the next scan starts, empty when there are
+     * no more keys.
+     * Returns false if the index is not ordered
+     */
+    bool scan(const std::string& from,
+              const std::string& to,
+              const std::uint32_t limit,
+              std::vector<std::pair<std::string, FileStorage>>& found,
+              std::string& cursor);
+
+    /**
+     * Appends the value size and the value of the key to output, decompressed
+     * if they are stored compressed.
+     * Returns false if they could not be read, or do not match the checksum
+     * of their record
+     */
+    bool load(const std::string& key,
+              const FileStorage& storage,
+              std::vector<std::uint8_t>& output) const;
+
+    /**
+     * Appends the value size and the value of the key to output, as they are
+     * stored, if they match the checksum of their record
+     */
+    bool load_stored(const std::string& key,
+                     const FileStorage& storage,
+                     std::vector<std::uint8_t>& output) const;
+
+    /**
+     * Checks the stored value size and value of the key, read from somewhere
+     * else, against the checksum of their record
+     */
+    bool verify(const std::string& key,
+                const FileStorage& storage,
+                const std::uint32_t checksum,
+                const std::uint8_t* stored) const;
+
+    /**
+     * Flushes every segment with records that were not flushed yet, and calls
+     * done when they were flushed.
+     * With the blocking backend, done is called before it returns
+     */
+    void sync(const IOCallback done);
+
+    /**
+     * A snapshot is taken in three steps, so every shard can link its own
+     * segments: create_snapshot creates the snapshot directory next to the
+     * segments, in every data directory, and returns false if the snapshot
+     * already exists or its directories could not be created
+     */
+    bool create_snapshot(const std::string& name);
+
+    /**
+     * Seals the active segments, so the writes after it go to new ones.
+     * Once the appends and the uploads into the sealed segments completed,
+     * hard links every one of them, with its hint file, to the snapshot
+     * directory, and copies its key table. Only the names are written, no
+     * segment is copied.
+     * done is called when they were flushed, with the manifest lines of the
+     * files of every data directory
+     */
+    void snapshot(const std::string& name, const SnapshotCallback done);
+
+    /**
+     * Writes the manifests of the snapshot, with the layout and the lines of
+     * every shard, so the snapshot is complete
+     */
+    bool finish_snapshot(const std::string& name,
+                         const std::vector<std::string>& manifests,
+                         const std::uint64_t bytes,
+                         const std::chrono::steady_clock::time_point start);
+
+    /**
+     * Readable when some io_uring operation completed, or -1 with the
+     * blocking backend
+     */
+    std::int32_t completion_descriptor() const;
+
+    /**
+     * Submits the io_uring operations queued since the last call
+     */
+    void submit();
+
+    /**
+     * Handles the io_uring operations that completed
+     */
+    void complete();
+
+    /**
+     * Waits until every io_uring operation completes
+     */
+    void wait();
+
+    /**
+     * True while an append of the key is in flight: the reads do not see it
+     * until it completes
+     */
+    bool writing(const std::string& key) const;
+
+    /**
+     * The operations started so far, writing_before tells if some of them
+     * are still in flight
+     */
+    std::uint64_t started_operations() const;
+    bool writing_before(const std::uint64_t operation) const;
+
+    /**
+     * Writes the counters of every partition
+     */
+    void report(std::ostream& output) const;
+
+    /**
+     * Removes the expired keys, writes the pending hint files and compacts
+     * the segments, a little bit at every call.
+     * Returns true if there is still work to do
+     */
+    bool maintenance();
+
+    /**
+     * How long until some key can expire
+     */
+    std::chrono::milliseconds next_expiry() const;
+
+  private:
+    const DatabaseOptions options;
+    std::vector<Partition> partitions;
+    Index stored;
+
+    /**
+     * Every file opened, by number. Null after it was replaced or removed
+     */
+    std::vector<File*> files;
+
+    std::unique_ptr<Compaction> compaction;
+    std::unique_ptr<IndexWriting> index_writing;
+
+    /**
+     * The timers of the keys with a TTL, in the memory index, see
+     * IndexEntry::timer
+     */
+    TimingWheel expirations;
+
+    /**
+     * How many bytes the compaction can still read, refilled with the
+     * compaction rate
+     */
+    std::uint64_t compaction_allowance;
+    std::chrono::steady_clock::time_point last_maintenance;
+    std::chrono::steady_clock::time_point last_sync;
+
+    /**
+     * Only created when the cache size is not zero
+     */
+    std::unique_ptr<Cache> cache;
+
+    /**
+     * Only created with the io_uring backend
+     */
+    std::unique_ptr<Ring> ring;
+
+    /**
+     * The submitted operations, by id. The io_uring user data is the id
+     * shifted left, with the last bit set for the flushes
+     */
+    std::unordered_map<std::uint64_t, Operation> operations;
+    std::uint64_t next_operation;
+
+    /**
+     * The id of the last operation submitted for every key with appends in
+     * flight. They can complete out of order, only the last one changes the
+     * index
+     */
+    std::unordered_map<std::string, std::uint64_t> latest_operations;
+
+    /**
+     * The last upload of every key whose value is still arriving, a write of
+     * the key meanwhile makes it older, see finish_upload
+     */
+    std::unordered_map<std::string, std::uint64_t> receiving;
+    std::uint64_t next_upload;
+
+    /**
+     * The snapshots waiting for their sealed segments, in order
+     */
+    std::vector<PendingSnapshot> pending_snapshots;
+
+    /**
+     * Opens the segment file, creating it if it does not exist
+     */
+    std::shared_ptr<File> open_segment(const std::uint16_t partition,
+                                       const std::uint32_t id);
+
+    /**
+     * The data directory of the partition number
+     */
+    const std::string& directory_of(const std::uint16_t partition) const;
+
+    /**
+     * Takes the disk space of a whole segment for the active segment, and
+     * gives back what the sealed segment did not use
+     */
+    void preallocate(File* file) const;
+    void release_preallocation(File* file) const;
+
+    /**
+     * Writes back the bytes appended to the file, and drops from the page
+     * cache the ones written back before. Returns true if some bytes are
+     * still not dropped
+     */
+    bool drop_behind(File* file, const bool sealed) const;
+
+    /**
+     * Creates the file with the next number
+     */
+    std::shared_ptr<File> create_file(const std::int32_t fd,
+                                      const std::string filename,
+                                      const std::string hint_filename,
+                                      const std::string table_filename,
+                                      const std::uint32_t id);
+
+    /**
+     * Unpacks the index entry
+     */
+    FileStorage storage_of(const IndexEntry& entry) const;
+
+    /**
+     * The partition where the key is stored
+     */
+    std::uint16_t partition_of(const std::string& key) const;
+
+    /**
+     * Makes the active segment immutable and appends a new one
+     */
+    File* roll(Partition& partition);
+
+    /**
+     * Links the pending snapshots whose sealed segments have nothing in
+     * flight anymore, and flushes them
+     */
+    void link_snapshots();
+
+    /**
+     * Points the key to its new storage, the previous record becomes dead.
+     * A key with an expiry(not zero) is removed when it expires
+     */
+    void index(const std::string& key,
+               const FileStorage storage,
+               const std::uint64_t expiry);
+
+    /**
+     * Removes the key from the index, its record becomes dead.
+     * With the disk index, the key stays in the index as deleted, since the
+     * key tables can still have it, until the file of the record that
+     * removed it has a key table too
+     */
+    void unindex(const std::string& key, const FileStorage record);
+
+    /**
+     * Removes the key if it expired, returns true if it did
+     */
+    bool expired(const std::string& key);
+
+    /**
+     * Finds the latest record of the key, in the index or in the key tables
+     * of its partition, from the newest to the oldest.
+     * Returns false if the key does not exist or was deleted
+     */
+    bool latest(const std::string& key, FileStorage& storage);
+
+    /**
+     * Finds the latest record of the key in the key tables of its partition
+     */
+    bool table_latest(const std::string& key, FileStorage& storage) const;
+
+    /**
+     * Like latest, but the expired keys do not exist either
+     */
+    bool live(const std::string& key, FileStorage& storage);
+
+    /**
+     * Indexes the record read from a segment or a hint file, or removes the
+     * key if it is a tombstone or it already expired
+     */
+    void replay(const std::string& key,
+                const FileStorage storage,
+                const bool tombstone,
+                const std::uint64_t expiry);
+
+    /**
+     * Appends the record, or the tombstone, to the partition of the key, see
+     * write
+     */
+    void append_record(const std::string& key,
+                       std::vector<std::uint8_t> data,
+                       const bool tombstone,
+                       const std::uint64_t expiry,
+                       const IOCallback done);
+
+    /**
+     * The record was written with the blocking backend, takes its space and
+     * indexes it, or removes its key if it is a tombstone
+     */
+    void appended(Partition& partition,
+                  const std::string& key,
+                  const FileStorage storage,
+                  const bool tombstone,
+                  const std::uint64_t expiry,
+                  const std::uint64_t total_size,
+                  const IOCallback done);
+
+    /**
+     * Takes the space of the record and creates its io_uring operation, the
+     * caller fills the parts to be written and submits it.
+     * Returns the id of the operation
+     */
+    std::uint64_t start_operation(Partition& partition,
+                                  const std::string& key,
+                                  const FileStorage storage,
+                                  const bool tombstone,
+                                  const std::uint64_t expiry,
+                                  const std::uint64_t total_size,
+                                  const IOCallback done);
+
+    /**
+     * Takes the space of a record at the end of the file, that is written
+     * later(in_flight). Returns where it starts
+     */
+    off_t take_space(Partition& partition,
+                     File* file,
+                     const std::uint64_t total_size);
+
+    /**
+     * Creates the io_uring operation of a record whose space was taken, at
+     * offset. Only the latest one of the key can index it when it completes
+     */
+    std::uint64_t create_operation(const std::string& key,
+                                   const FileStorage storage,
+                                   const bool tombstone,
+                                   const std::uint64_t expiry,
+                                   const off_t offset,
+                                   const bool latest,
+                                   const IOCallback done);
+
+    /**
+     * Points the index entry to the storage
+     */
+    void point(IndexEntry& entry, const FileStorage storage) const;
+
+    /**
+     * Writes the record, with the flags of its key size, with the write
+     * system calls.
+     * Returns false if it could not be written
+     */
+    bool append(File* file,
+                const std::string& key,
+                const std::vector<std::uint8_t>& data,
+                const std::uint32_t flags,
+                const std::uint64_t expiry,
+                const off_t offset);
+
+    /**
+     * Flushes every dirty segment with the fdatasync system call.
+     * Returns false if some segment could not be flushed
+     */
+    bool sync();
+
+    /**
+     * Queues what is left of the append, followed by a flush with the ALWAYS
+     * durability
+     */
+    void submit_append(const std::uint64_t id, Operation& operation);
+
+    /**
+     * Handles one io_uring completion
+     */
+    void completed(const std::uint64_t user_data, const std::int32_t result);
+
+    /**
+     * Acknowledges the completed appends of the file, in order, up to the
+     * first one that did not complete yet
+     */
+    void acknowledge_appends(File* file);
+
+    /**
+     * Rebuilds the index entries of the file.
+     * Uses the hint file when it is valid, and scans only the records that
+     * were appended after it was written.
+     * Otherwise, scans every record of the file
+     */
+    void recover(File* file);
+
+    /**
+     * Loads the index entries of the hint file.
+     * Returns how many bytes of the file the hint file covers, or -1 if the
+     * hint file does not exist or can not be trusted
+     */
+    off_t load_hint_file(File* file);
+
+    /**
+     * Reads the records of the file, starting at offset, and adds them to the
+     * index, or removes the keys of the tombstones.
+     * A torn record at the end of the file is truncated.
+     * Returns how many records were read
+     */
+    std::uint64_t scan(File* file, off_t offset);
+
+    /**
+     * Writes the hint file of the segment, reading its records
+     */
+    void write_hint_file(const File* file) const;
+
+    /**
+     * Starts writing the key table or the hint file of the segment, see
+     * write_index
+     */
+    void start_index_file(const std::shared_ptr<File>& segment,
+                          const bool table);
+
+    /**
+     * Reads the records of the segment for its file, until budget bytes
+     * were read, and writes what it has of the file. The key table is only
+     * encoded once every record was read, and written under the budget too.
+     * Once the whole file was written, the next call finishes it, after its
+     * writeback had a tick to go on. Then, the keys of a key table leave the
+     * index, see release.
+     * Returns how many bytes were read, and written for a key table
+     */
+    std::uint64_t write_index(const std::uint64_t budget);
+
+    /**
+     * Flushes the file and puts it in place of the old one
+     */
+    void finish_index_file();
+
+    /**
+     * Loads the key table of the segment, if it covers the whole segment
+     */
+    bool load_table(File* file);
+
+    /**
+     * Removes from the index the next keys of the new key table that still
+     * point to its segment
+     */
+    void release(IndexWriting& writing);
+
+    /**
+     * Picks the immutable segment with most dead bytes, if any is above the
+     * threshold
+     */
+    void start_compaction();
+
+    /**
+     * Copies the live records of the segment being compacted, and the
+     * tombstones that can still hide a record of an older segment, until
+     * budget bytes were read.
+     * Returns how many bytes were read
+     */
+    std::uint64_t compact(const std::uint64_t budget);
+
+    /**
+     * Replaces the compacted segment with its rewritten version, once every
+     * record was copied and their writeback had a tick to go on
+     */
+    void finish_compaction();
+
+    /**
+     * Points the records already copied back to the source, and discards
+     * the rewritten version
+     */
+    void abort_compaction();
+};
+
+/**
+ * Appends number_size bytes of number to output, least significant first
+ */
+void serialize(std::vector<std::uint8_t>& output,
+               std::uint64_t number,
+               std::uint8_t number_size);
+
+/**
+ * Restores a number_size bytes number, least significant first
+ */
+std::uint64_t deserialize(const std::uint8_t* input,
+                          std::uint8_t number_size);
+
+};  // namespace easykey
@@ -3,16 +3,23 @@
 #include <sys/types.h>
 #include "byte_buffer.hpp"
 
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
 #include <memory>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
+#include "database.hpp"
+#include "shards.hpp"
 #include "socket.hpp"
 
-#define NUMBER_OF_FILES 5
-
 namespace knownothing
 {
 /**
@@ -33,65 +40,237 @@ enum class ResponseStatus : std::uint8_t
     SERVER_ERROR = 0x03,
 };
 
-struct File
+/**
+ * A request whose first message is one of these bytes is a command, and not
+ * a read or a write. They are never valid keys
+ */
+enum class Command : std::uint8_t
 {
     /**
-     * The file descriptor
+     * [flags][start key][end key or prefix][4-byte limit]
+     * Answers with the cursor and the keys(and their values) in order, see
+     * Handler::scan
      */
-    const std::int32_t fd;
+    SCAN = 0x01,
 
     /**
-     * The file name
+     * [key]
+     * Removes the key, see Handler::remove
      */
-    const std::string filename;
+    DELETE = 0x02,
 
-    File(const std::int32_t fd, const std::string filename);
-    ~File();
+    /**
+     * [key]
+     * Answers with the encoding and the value as it is stored, so a client
+     * can decompress it, see Handler::read_stored
+     */
+    READ_STORED = 0x03,
 
     /**
-     * https://en.cppreference.com/w/cpp/language/rule_of_three
-     *
+     * [name]
+     * Hard links the segments to a snapshot directory, see Handler::snapshot
      */
-    File(const File&) = delete;
-    File(File&&) = delete;
-    File operator=(const File&) = delete;
-    File operator=(File&&) = delete;
+    SNAPSHOT = 0x04,
 };
 
-struct FileStorage
+/**
+ * How a value is stored
+ */
+enum ValueEncoding : std::uint8_t
 {
+    PLAIN = 0x00,
+
     /**
-     * The value stored size
+     * [4-byte value size][LZ4 block]
      */
-    const std::uint64_t size;
+    LZ4 = 0x01,
+};
 
+/**
+ * The flags of the SCAN command
+ */
+enum ScanFlags : std::uint8_t
+{
     /**
-     * Where the value starts
+     * Sends the value after every key
      */
-    const off_t offset;
+    SCAN_VALUES = 0x01,
 
     /**
-     * In which file is it located
+     * The end key is a prefix that every key must start with
      */
-    const File* file;
+    SCAN_PREFIX = 0x02,
 };
 
-class Database
+/**
+ * A response that can only be sent later: after the write completes, or after
+ * it is flushed, or after another shard answers.
+ * It takes its place in the output of the socket right away, so the requests
+ * after it are parsed meanwhile and their responses still go after it, see
+ * ClientSocket::reserve.
+ * The socket is cleared when the client disconnects before that
+ */
+struct PendingAcknowledgement
 {
-  public:
-    Database();
-    void write(const std::string key, const std::vector<std::uint8_t> data);
-    const FileStorage* read(const std::string key) const;
+    PendingAcknowledgement(
+        ClientSocket* socket,
+        std::vector<std::uint8_t> response = {},
+        std::function<void(std::vector<std::uint8_t>)> reply = nullptr);
 
-  private:
-    std::vector<std::unique_ptr<File>> opened_files;
-    std::unordered_map<std::string, FileStorage> stored;
+    ClientSocket* socket;
+    std::uint64_t slot;
+    std::vector<std::uint8_t> response;
+
+    /**
+     * For a request forwarded by another shard, sends the response back to
+     * it, instead of to a socket
+     */
+    std::function<void(std::vector<std::uint8_t>)> reply;
+};
+
+using Acknowledgement = std::list<PendingAcknowledgement>::iterator;
+
+/**
+ * A spliced value that did not arrive whole yet: remaining bytes of it are
+ * still written at offset, when the client sends them, see
+ * Handler::continue_upload
+ */
+struct SplicedValue
+{
+    Upload upload;
+    off_t offset;
+    std::uint64_t remaining;
+    Acknowledgement acknowledgement;
+};
+
+/**
+ * The keys a shard found for a scan, see Handler::scan
+ */
+struct ScanPart
+{
+    /**
+     * False if the index of the shard is not ordered
+     */
+    bool ordered;
+    std::vector<std::string> keys;
+
+    /**
+     * The value size and the value of every key, with SCAN_VALUES
+     */
+    std::vector<std::vector<std::uint8_t>> values;
+    std::string cursor;
+
+    /**
+     * The key whose value could not be read, if any
+     */
+    std::string unreadable;
+};
+
+/**
+ * What the shards answered so far for a scan or a snapshot, only the shard
+ * of the client touches it
+ */
+struct ScanGather
+{
+    std::uint16_t remaining;
+    std::vector<ScanPart> parts;
+};
+
+/**
+ * A scan that is sent a page at a time, in the reserved response of its
+ * client: every page is found from the cursor of the previous one, see
+ * Handler::scan_page
+ */
+struct ScanStream
+{
+    Acknowledgement acknowledgement;
+    std::string from;
+    std::string to;
+
+    /**
+     * How many keys can still be sent
+     */
+    std::uint64_t remaining;
+    bool with_values;
+};
+
+struct SnapshotGather
+{
+    std::uint16_t remaining;
+    bool done;
+    std::vector<std::string> manifests;
+    std::uint64_t bytes;
+    std::chrono::steady_clock::time_point start;
 };
 
 class Handler
 {
   private:
     Database database;
+
+    /**
+     * The requests for the keys of the other shards are forwarded to them,
+     * see run_on
+     */
+    Shards& shards;
+    const std::uint16_t shard;
+    const Durability durability;
+    const std::chrono::milliseconds sync_interval;
+    const std::uint64_t small_value_size;
+
+    /**
+     * The values of at least this size are spliced from the socket, unless
+     * they are bigger than the compression threshold, see parse_request
+     */
+    const std::uint64_t splice_threshold;
+    const std::uint64_t compression_threshold;
+    const std::uint64_t max_request_size;
+    const bool verbose;
+
+    /**
+     * Every write response that was not sent yet
+     */
+    std::list<PendingAcknowledgement> unacknowledged;
+
+    /**
+     * The GROUP durability responses, waiting for the next flush
+     */
+    std::vector<Acknowledgement> pending_acknowledgements;
+    std::chrono::steady_clock::time_point oldest_pending_acknowledgement;
+
+    /**
+     * The clients whose responses were filled in this iteration, they are
+     * flushed at its end, so the responses of a client go together
+     */
+    std::unordered_set<ClientSocket*> answered;
+
+    /**
+     * The scans whose next page waits until their client read the previous
+     * ones, see tick
+     */
+    std::vector<std::shared_ptr<ScanStream>> paused_scans;
+
+    /**
+     * The requests of every key that wait for the ones before them(true for
+     * the writes), and the scans that wait for the operations started
+     * before them, see in_order
+     */
+    std::unordered_map<std::string,
+                       std::deque<std::pair<bool, std::function<void()>>>>
+        waiting;
+    std::deque<std::pair<std::uint64_t, std::function<void()>>> waiting_scans;
+
+    /**
+     * The values each client is still sending, nothing else of the client is
+     * parsed until they arrived
+     */
+    std::unordered_map<const ClientSocket*, SplicedValue> uploads;
+
+    /**
+     * Set by request_report, the report is printed in the next tick
+     */
+    std::atomic<bool> report_requested;
+
     const std::uint8_t success_header[7] = {
         0x01,  // know nothing protocol
         0x02,  // number of messages
@@ -103,7 +282,244 @@ class Handler
     };
 
   public:
-    void parse_request(ClientSocket& socket);
+    Handler(const DatabaseOptions options, Shards& shards);
+
+    /**
+     * The appends in flight complete before the acknowledgements are gone,
+     * without answering: the clients are gone already
+     */
+    ~Handler();
+
+    /**
+     * Answers the next request of the client. Returns false if there is no
+     * whole request in the socket yet
+     */
+    bool parse_request(ClientSocket& socket);
+
+    /**
+     * Runs the background work of the database, and flushes the pending
+     * acknowledgements when they are due.
+     * Returns how long it can wait to run again
+     */
+    std::chrono::milliseconds tick();
+
+    /**
+     * Forgets the pending acknowledgements of the client
+     */
+    void disconnected(const ClientSocket& socket);
+
+    /**
+     * Readable when some database write completed, or -1 if the writes
+     * always complete right away
+     */
+    std::int32_t completion_descriptor() const;
+
+    /**
+     * Answers the writes that completed
+     */
+    void complete();
+
+    /**
+     * Prints the database counters
+     */
+    void report() const;
+
+    /**
+     * Asks the thread of the handler to print the report, in its next tick.
+     * It can be called from a signal handler
+     */
+    void request_report();
+
+  private:
+    /**
+     * Runs the task in the shard, right away if it is this one
+     */
+    void run_on(const std::uint16_t to, ShardTask task);
+
+    /**
+     * The acknowledgement a request of the shard origin is answered with:
+     * the request acknowledgement itself when origin is this shard, or a new
+     * one that sends the response back to it
+     */
+    Acknowledgement answering(const std::uint16_t origin,
+                              const Acknowledgement acknowledgement);
+
+    /**
+     * Runs the task of a request in the order of the requests of the key,
+     * right away when nothing waits: a read waits for the appends of the key
+     * in flight, so it sees the writes before it, and a write waits for the
+     * reads before it, so they do not see it. With an empty key, like a scan,
+     * it waits for every operation started before, and every write after it
+     * waits for it
+     */
+    void in_order(const std::string& key,
+                  const bool write,
+                  std::function<void()> task);
+
+    /**
+     * True if a request of the key can not run right away, see in_order
+     */
+    bool waits(const std::string& key, const bool write) const;
+
+    /**
+     * Runs the tasks that do not wait for anything anymore, see in_order
+     */
+    void release_waiting();
+
+    /**
+     * Flushes the database and sends the pending acknowledgements.
+     * If the flush failed, they become server errors
+     */
+    void flush_acknowledgements();
+
+    /**
+     * The write or the delete of the key completed, it is acknowledged now or
+     * after the next flush
+     */
+    void written(const Acknowledgement acknowledgement,
+                 const std::string& key,
+                 const bool success);
+
+    /**
+     * Writes what arrived of the value the client is sending. Returns true
+     * once it is over, because it arrived whole or it failed, and then the
+     * client is disconnected
+     */
+    bool continue_upload(ClientSocket& socket);
+
+    /**
+     * Sends the response, if the client is still connected
+     */
+    void acknowledge(const Acknowledgement acknowledgement);
+
+    /**
+     * Writes the value, answering when it was written, like parse_request
+     */
+    void write(const Acknowledgement acknowledgement,
+               const std::string& key,
+               std::vector<std::uint8_t> value,
+               const std::chrono::milliseconds ttl);
+
+    /**
+     * The response of a read of the key, with its value copied, for the
+     * reads forwarded by another shard
+     */
+    std::vector<std::uint8_t> read_response(const std::string& key);
+
+    /**
+     * The response of a stored read of the key, like read_response
+     */
+    std::vector<std::uint8_t> stored_response(const std::string& key);
+
+    /**
+     * True once every message of the frame at the mark arrived, but the
+     * value that is spliced, see splices. Otherwise the buffer knows how
+     * many bytes are missing, see ByteBuffer::fill
+     */
+    bool frame_arrived(ByteBuffer& buffer) const;
+
+    /**
+     * True if the value of the write goes from the socket to its segment,
+     * instead of being read to the memory first, see ClientSocket::receive
+     */
+    bool splices(const std::string& key,
+                 const std::uint8_t messages,
+                 const std::uint32_t size) const;
+
+    /**
+     * Answers the request that starts with the protocol, once it arrived
+     * whole, see frame_arrived
+     */
+    void parse_frame(ClientSocket& socket,
+                     const knownothing::Protocol protocol);
+
+    /**
+     * Runs the command, messages is how many messages follow the command
+     */
+    void run_command(ClientSocket& socket,
+                     const Command command,
+                     const std::uint8_t messages);
+
+    /**
+     * Sends the keys from the start key until the end key(exclusive, or the
+     * last key if empty) or, with the SCAN_PREFIX flag, the keys that start
+     * with the end key.
+     * The response messages are the status, the cursor(the start key of the
+     * next scan, empty when there are no more keys) and every key, followed by
+     * its value with the SCAN_VALUES flag.
+     * The keys are sent in pages, each one a response, until there are no more
+     * or the limit(0 for every key) was reached
+     */
+    void scan(ClientSocket& socket, const std::uint8_t messages);
+
+    /**
+     * Removes the key, answering when its tombstone was written, like a
+     * write. A key that does not exist is a client error
+     */
+    void remove(ClientSocket& socket, const std::uint8_t messages);
+
+    /**
+     * Writes the tombstone of the key, answering like remove
+     */
+    void remove_key(const Acknowledgement acknowledgement,
+                    const std::string& key);
+
+    /**
+     * The keys of this shard for a scan, see scan
+     */
+    ScanPart scan_part(const std::string& from,
+                       const std::string& to,
+                       const std::uint32_t limit,
+                       const bool with_values);
+
+    /**
+     * Finds the next page of the scan, up to limit keys of every shard
+     */
+    void scan_page(const std::shared_ptr<ScanStream> stream);
+
+    /**
+     * A shard found the keys of the page, it is sent when every shard did,
+     * and the next page is found until there are no more keys or the limit
+     * was reached
+     */
+    void scan_found(const std::shared_ptr<ScanStream> stream,
+                    ScanGather& gathered,
+                    const ScanPart& part,
+                    const std::uint32_t limit);
+
+    /**
+     * Sends the status, the encoding of the value and the value as it is
+     * stored, without decompressing it
+     */
+    void read_stored(ClientSocket& socket, const std::uint8_t messages);
+
+    /**
+     * Takes a snapshot of the segments, named by the message, answering when
+     * its manifest was written. A name that was already used is a client
+     * error
+     */
+    void snapshot(ClientSocket& socket, const std::uint8_t messages);
+
+    /**
+     * A shard linked its segments to the snapshot, the manifests are written
+     * when every shard did
+     */
+    void snapshot_linked(const Acknowledgement acknowledgement,
+                         SnapshotGather& gathered,
+                         const std::string& name,
+                         const bool done,
+                         const std::vector<std::string>& manifests,
+                         const std::uint64_t bytes);
+
+    /**
+     * Sends the header followed by the stored value size and value of the
+     * key, from the segment mapping when the value is small, or with sendfile
+     */
+    void send_stored(ClientSocket& socket,
+                     const std::string& key,
+                     const std::uint8_t* header,
+                     const std::uint32_t header_size,
+                     const FileStorage& value);
 };
 
 };  // namespace easykey
\ No newline at end of file
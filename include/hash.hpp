@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace easykey
+{
+/**
+ * The XXH64 hash function
+ * It is fast and spreads well keys that differ only in a few bytes, like
+ * keys with the same prefix and the same size
+ * https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+ */
+std::uint64_t hash(const std::uint8_t* input,
+                   std::uint64_t size,
+                   const std::uint64_t seed = 0);
+
+std::uint64_t hash(const std::string& key);
+
+};  // namespace easykey
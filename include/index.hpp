@@ -0,0 +1,233 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace easykey
+{
+/**
+ * Where the value of a key is stored, and when it expires, packed in 32 bytes
+ */
+struct IndexEntry
+{
+    /**
+     * The upper bits are a piece of the key hash, so most of the probes do
+     * not need to compare the key. The lower bits are where the key is in
+     * the arena
+     */
+    std::uint64_t key;
+
+    /**
+     * Where the value size starts. The last bit is set if the value is
+     * compressed
+     */
+    std::uint64_t offset;
+
+    /**
+     * The number of the file, see Database::files
+     */
+    std::uint32_t file;
+
+    /**
+     * The value size, without the 4 bytes of the value size itself
+     */
+    std::uint32_t size;
+
+    /**
+     * The number of the timer of the key expiry, zero if it never expires,
+     * see TimingWheel
+     */
+    std::uint32_t timer;
+};
+
+/**
+ * Called for every key of a scan, in order, until it returns false
+ */
+using ScanCallback =
+    std::function<bool(const std::string& key, const IndexEntry& entry)>;
+
+/**
+ * A node of the ordered index, see index.cpp
+ */
+struct TreeNode;
+
+/**
+ * The key index, an open addressing table with linear probing.
+ * Instead of one allocation per key, the entries live in one array and the
+ * keys are packed in an arena, one after the other, with their size
+ * https://en.wikipedia.org/wiki/Linear_probing
+ */
+class Index
+{
+  public:
+    /**
+     * When ordered, the keys are also kept in a B+tree, so they can be
+     * scanned in order
+     */
+    Index(const bool ordered);
+    ~Index();
+
+    /**
+     * Returns the entry of the key, or null if it does not exist.
+     * It is valid until the next insert
+     */
+    IndexEntry* find(const std::string& key);
+
+    /**
+     * Returns the entry of the key, adding an empty one if it does not
+     * exist. It is valid until the next insert
+     */
+    IndexEntry& insert(const std::string& key, bool& inserted);
+
+    /**
+     * Returns the entry with the timer, of a key with the hash, and copies
+     * its key. Null if no key has it
+     */
+    IndexEntry* find_timer(const std::uint64_t key_hash,
+                           const std::uint32_t timer,
+                           std::string& key);
+
+    /**
+     * Removes the key, returns false if it does not exist.
+     * Its bytes stay in the arena until most of it is erased keys
+     */
+    bool erase(const std::string& key);
+
+    /**
+     * Calls visit for every key, in no order, until it returns false.
+     * The index must not change until it returns
+     */
+    void for_each(const ScanCallback& visit);
+
+    /**
+     * Calls visit for every key from the from key (inclusive) until the to
+     * key (exclusive, or until the last key if it is empty), in order.
+     * Returns false if the index is not ordered
+     */
+    bool scan(const std::string& from,
+              const std::string& to,
+              const ScanCallback& visit);
+
+    /**
+     * How many keys are indexed
+     */
+    std::uint64_t size() const;
+
+    /**
+     * How many bytes the table and the arena take
+     */
+    std::uint64_t memory() const;
+
+  private:
+    std::vector<IndexEntry> entries;
+    std::uint64_t count;
+
+    /**
+     * The keys, stored as [varint size][key].
+     * The arena grows in chunks, so it never copies the keys it has
+     */
+    std::vector<std::unique_ptr<std::uint8_t[]>> chunks;
+    std::uint64_t chunks_size;
+    std::uint64_t chunk_position;
+
+    /**
+     * How many bytes of the arena belong to erased keys
+     */
+    std::uint64_t erased_bytes;
+
+    /**
+     * The B+tree of the arena locations of the keys, ordered by key.
+     * Null if the index is not ordered
+     */
+    std::unique_ptr<TreeNode> root;
+    std::uint64_t tree_nodes;
+
+    /**
+     * Returns the slot of the key, or of the empty entry where it would be
+     */
+    std::uint64_t probe(const std::string& key, const std::uint64_t hash) const;
+
+    /**
+     * Doubles the table
+     */
+    void grow();
+
+    /**
+     * Copies the keys to a new arena, without the erased ones
+     */
+    void repack();
+
+    /**
+     * Points the keys of the subtree of the node to where repack moved
+     * them. A separator can still be an erased key, it is copied once
+     */
+    void relocate(TreeNode* node,
+                  const std::vector<std::unique_ptr<std::uint8_t[]>>& previous,
+                  std::unordered_map<std::uint64_t, std::uint64_t>& moved);
+
+    /**
+     * Appends the key to the arena, returns where it is
+     */
+    std::uint64_t store(const std::uint8_t* key, const std::uint64_t size);
+
+    /**
+     * Where the key at the arena location starts, and its size
+     */
+    const std::uint8_t* key_at(const std::uint64_t location,
+                               std::uint64_t& size) const;
+
+    /**
+     * Compares the key at the arena location with the key, like memcmp
+     */
+    std::int32_t compare(const std::uint64_t location,
+                         const std::uint8_t* key,
+                         const std::uint64_t size) const;
+
+    /**
+     * The position of the first key of the node that is bigger than the
+     * key, or bigger or equal if inclusive
+     */
+    std::uint64_t search(const TreeNode* node,
+                         const std::uint8_t* key,
+                         const std::uint64_t size,
+                         const bool inclusive) const;
+
+    /**
+     * Adds the location to the subtree of the node.
+     * If the node was split, returns the new right node, and the key that
+     * separates them
+     */
+    std::unique_ptr<TreeNode> tree_insert(TreeNode* node,
+                                          const std::uint64_t location,
+                                          const std::uint8_t* key,
+                                          const std::uint64_t size,
+                                          std::uint64_t& separator);
+
+    /**
+     * Removes the key from its leaf. A node left with too few keys takes
+     * some from a sibling, or is merged with it, so the erased keys do not
+     * leave empty leaves behind, and the tree gets one level lower when the
+     * root has a single child
+     */
+    void tree_erase(const std::uint8_t* key, const std::uint64_t size);
+
+    /**
+     * Removes the key from the subtree of the node, returns true if the
+     * node has too few keys now, see rebalance
+     */
+    bool tree_erase(TreeNode* node,
+                    const std::uint8_t* key,
+                    const std::uint64_t size);
+
+    /**
+     * Fills the child at the position of the node, that has too few keys,
+     * with the keys of a sibling, or merges them
+     */
+    void rebalance(TreeNode* node, const std::uint64_t position);
+};
+
+};  // namespace easykey
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <sys/epoll.h>
 #include <cstdint>
 #include <vector>
 #include <chrono>
@@ -17,12 +18,19 @@ struct EventType
     const static EventType READ;
     const static EventType WRITE;
     const static EventType CLOSE_CONNECTION;
+    const static EventType HANG_UP;
 
 };
 
+/**
+ * A file descriptor, with the events to watch, or every event that happened
+ * to it at once(a client can be readable, writable and closed in the same
+ * wait)
+ */
 struct Event
 {
   Event(const std::int32_t file_descriptor);
+  Event(const struct epoll_event& returned);
   const std::int32_t file_descriptor;
   public:
 
@@ -57,7 +65,18 @@ class IONotifier
     ~IONotifier();
     bool add_event(const Event event);
     bool delete_event(const Event event);
-    const std::vector<Event> wait_for_events(std::chrono::duration<std::uint64_t, std::nano> timeout);
+
+    /**
+     * Waits for the events, returns how many happened, see event.
+     * Nothing is allocated, unless the file descriptors outgrew the events
+     * array
+     */
+    std::uint32_t wait_for_events(std::chrono::duration<std::uint64_t, std::nano> timeout);
+
+    /**
+     * The event index, from 0 to what the last wait returned
+     */
+    Event event(const std::uint32_t index) const;
   private:
     std::uint32_t file_descriptor;
 
@@ -65,6 +84,13 @@ class IONotifier
      * How many file descriptors are registered
     */
     std::uint32_t tracked_file_descriptors_count;
+
+    /**
+     * Where epoll writes the events, reused by every wait. It grows with the
+     * registered file descriptors, so every ready one fits a single wait, and
+     * shrinks when most of them are gone
+     */
+    std::vector<struct epoll_event> events_buffer;
 };
 
 };
\ No newline at end of file
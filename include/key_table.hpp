@@ -0,0 +1,167 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace easykey
+{
+/**
+ * The last record of a key in a segment
+ */
+struct TableEntry
+{
+    std::string key;
+
+    /**
+     * Where the value size starts, with the last bit set if the value is
+     * compressed, like IndexEntry. For a tombstone, where its record starts
+     */
+    std::uint64_t offset;
+
+    /**
+     * The stored size, with the 4 bytes of the value size, zero for a
+     * tombstone
+     */
+    std::uint32_t size;
+
+    /**
+     * When the key expires, zero if it never does
+     */
+    std::uint64_t expiry;
+};
+
+/**
+ * The last record of every key of an immutable segment, sorted by key, in a
+ * file next to the segment.
+ * The entries are packed in pages of 4 KiB, and only the first key of every
+ * page and a Bloom filter of the keys stay in memory. So a key that is not
+ * in the table almost never costs a read, and a key that is costs one page.
+ * The filter is blocked: all the bits of a key are in the same 64 bytes, one
+ * cache line
+ * https://en.wikipedia.org/wiki/Bloom_filter
+ * https://algo2.iti.kit.edu/documents/cacheefficientbloomfilters-jea.pdf
+ */
+class KeyTable
+{
+  public:
+    /**
+     * Writes the entries to the table file, sorted and with only the last
+     * entry of every key, so the entries can be given in the segment order.
+     * covered is the size of the segment they were read from.
+     * Returns false if the file could not be written
+     */
+    static bool write(const std::string& filename,
+                      std::vector<TableEntry>& entries,
+                      const std::uint64_t covered,
+                      const std::uint64_t dead_bytes);
+
+    /**
+     * The bytes of the table file of the entries, see write. The entries
+     * are left sorted, with only the last one of every key
+     */
+    static std::vector<std::uint8_t> encode(
+        std::vector<TableEntry>& entries,
+        const std::uint64_t covered,
+        const std::uint64_t dead_bytes);
+
+    /**
+     * Opens the table file, or returns null if it does not exist or is not
+     * valid
+     */
+    static std::unique_ptr<KeyTable> open(const std::string& filename);
+
+    /**
+     * The hash the filters use, it is the same for every table, so a lookup
+     * computes it only once
+     */
+    static std::uint64_t filter_hash(const std::string& key);
+
+    ~KeyTable();
+
+    /**
+     * Finds the entry of the key, filter_hash is the hash of the key.
+     * Returns false if the key is not in the table
+     */
+    bool find(const std::string& key,
+              const std::uint64_t filter_hash,
+              TableEntry& entry) const;
+
+    /**
+     * Keeps the dead bytes of the segment in the file, so they are known
+     * after a restart without reading the newer segments
+     */
+    void save_dead_bytes(const std::uint64_t dead_bytes);
+
+    /**
+     * The size of the segment when the table was written
+     */
+    std::uint64_t covered() const;
+
+    /**
+     * The dead bytes last saved
+     */
+    std::uint64_t dead_bytes() const;
+
+    /**
+     * How many keys the table has
+     */
+    std::uint64_t size() const;
+
+    /**
+     * How many bytes the filter and the first keys of the pages take
+     */
+    std::uint64_t memory() const;
+
+    /**
+     * https://en.cppreference.com/w/cpp/language/rule_of_three
+     *
+     */
+    KeyTable(const KeyTable&) = delete;
+    KeyTable(KeyTable&&) = delete;
+    KeyTable operator=(const KeyTable&) = delete;
+    KeyTable operator=(KeyTable&&) = delete;
+
+  private:
+    /**
+     * Where a page is in the file, and where its first key is in first_keys
+     */
+    struct Page
+    {
+        std::uint64_t offset;
+        std::uint32_t size;
+        std::uint32_t key_position;
+    };
+
+    const std::int32_t fd;
+    std::uint64_t covered_size;
+    std::uint64_t saved_dead_bytes;
+    std::uint64_t count;
+
+    /**
+     * The filter, 8 words for every block
+     */
+    std::vector<std::uint64_t> filter;
+    std::vector<Page> pages;
+
+    /**
+     * The first key of every page, one after the other
+     */
+    std::string first_keys;
+
+    KeyTable(const std::int32_t fd);
+
+    /**
+     * Returns false if the key is surely not in the table
+     */
+    bool may_contain(const std::uint64_t filter_hash) const;
+
+    /**
+     * Compares the first key of the page with the key, like memcmp
+     */
+    std::int32_t compare(const std::uint64_t page,
+                         const std::string& key) const;
+};
+
+};  // namespace easykey
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace easykey
+{
+/**
+ * The LZ4 block format, without the frame around it.
+ * Only repeated sequences of at least 4 bytes, up to 64 KiB back, are
+ * compressed, so it is fast enough to compress every write and decompress
+ * every read
+ * https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+ */
+
+/**
+ * Appends the compressed input to output
+ */
+void lz4_compress(const std::uint8_t* input,
+                  const std::uint64_t size,
+                  std::vector<std::uint8_t>& output);
+
+/**
+ * Appends the decompressed input, that must have exactly size bytes, to
+ * output.
+ * Returns false, without appending anything, if the input is not valid
+ */
+bool lz4_decompress(const std::uint8_t* input,
+                    const std::uint64_t input_size,
+                    const std::uint64_t size,
+                    std::vector<std::uint8_t>& output);
+
+};  // namespace easykey
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace easykey
+{
+/**
+ * Called for every completed operation, with the user data it was submitted
+ * with and its result (the bytes written, or a negative errno)
+ */
+using CompletionCallback = std::function<void(std::uint64_t, std::int32_t)>;
+
+/**
+ * A minimal io_uring, set up with the system calls, so liburing is not needed.
+ * The operations are queued and only reach the kernel in the next submit, so
+ * the operations of a whole server iteration cost one system call.
+ * The completions are signaled in an eventfd, that can be watched with epoll.
+ * https://kernel.dk/io_uring.pdf
+ */
+class Ring
+{
+  public:
+    /**
+     * Throws if the kernel does not support io_uring, or it was built
+     * without it
+     */
+    Ring(const std::uint32_t entries);
+    ~Ring();
+
+    /**
+     * https://en.cppreference.com/w/cpp/language/rule_of_three
+     *
+     */
+    Ring(const Ring&) = delete;
+    Ring(Ring&&) = delete;
+    Ring operator=(const Ring&) = delete;
+    Ring operator=(Ring&&) = delete;
+
+    /**
+     * Readable when some operation completed
+     */
+    std::int32_t notification_descriptor() const;
+
+    /**
+     * Queues a pwritev.
+     * A linked write is followed by an operation that only starts after it
+     * succeeds, so there is always room for both in the same submit
+     */
+    void writev(const std::int32_t fd,
+                const struct iovec* parts,
+                const std::uint32_t count,
+                const off_t offset,
+                const std::uint64_t user_data,
+                const bool linked);
+
+    /**
+     * Queues a fdatasync
+     */
+    void fdatasync(const std::int32_t fd, const std::uint64_t user_data);
+
+    /**
+     * Sends the queued operations to the kernel.
+     * Returns false if they could not be sent, they are sent again in the
+     * next call
+     */
+    bool submit();
+
+    /**
+     * Calls completed for every operation that already completed, also the
+     * ones that did not fit in the completion ring.
+     * When wait is true, waits until at least one completes.
+     * Returns how many completed
+     */
+    std::uint32_t complete(const CompletionCallback& completed,
+                           const bool wait);
+
+  private:
+    std::int32_t file_descriptor;
+    std::int32_t event_descriptor;
+
+    /**
+     * The rings shared with the kernel
+     */
+    void* submission_ring;
+    std::size_t submission_ring_size;
+    void* completion_ring;
+    std::size_t completion_ring_size;
+    struct io_uring_sqe* submission_entries;
+    std::size_t submission_entries_size;
+
+    std::uint32_t* submission_head;
+    std::uint32_t* submission_tail;
+    std::uint32_t submission_mask;
+    std::uint32_t submission_capacity;
+    std::uint32_t* submission_array;
+
+    /**
+     * Tells when completions did not fit in the completion ring, and wait
+     * in the kernel, see complete
+     */
+    std::uint32_t* submission_flags;
+    std::uint32_t* completion_head;
+    std::uint32_t* completion_tail;
+    std::uint32_t completion_mask;
+    struct io_uring_cqe* completion_entries;
+
+    /**
+     * Operations in the submission ring that the kernel did not take yet
+     */
+    std::uint32_t queued;
+
+    /**
+     * Returns an empty entry, submitting the queued ones if there is less
+     * than needed free entries
+     */
+    struct io_uring_sqe* next_entry(const std::uint32_t needed);
+
+    /**
+     * Makes the entry returned by next_entry visible to the kernel
+     */
+    void queue();
+};
+
+};  // namespace easykey
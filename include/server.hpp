@@ -4,11 +4,13 @@
 #include "byte_buffer.hpp"
 #include "io_notifier.hpp"
 
+#include <atomic>
 #include <cstdint>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <cstdlib>
 #include <unordered_map>
+#include <unordered_set>
 #include <memory>
 #include <vector>
 #include <chrono>
@@ -18,13 +20,26 @@
 namespace easykey
 {
 /**
+ * The receive message callback answers the next request of the client, and
+ * returns false when there is no whole request left.
  * This was inspired from:
  * https://github.com/an-tao/trantor/blob/35592d542f8eeb1345844cfa8a202ed96707d379/trantor/net/callbacks.h#L34
  */
-using ReceiveMessageCallback = std::function<void(ClientSocket&)>;
+using ReceiveMessageCallback = std::function<bool(ClientSocket&)>;
 using ClientConnectedCallback = std::function<void(const ClientSocket&)>;
 using ClientDisconnectedCallback = std::function<void(const ClientSocket&)>;
 
+/**
+ * Background work that runs in the server thread after every iteration.
+ * Returns how long it can wait to run again
+ */
+using TickCallback = std::function<std::chrono::milliseconds(void)>;
+
+/**
+ * Some watched file descriptor is ready to be read
+ */
+using ReadyCallback = std::function<void(void)>;
+
 class Server
 {
   public:
@@ -38,9 +53,36 @@ class Server
            const std::uint16_t pending_connections,
            const ReceiveMessageCallback receive_message_callback);
 
+    /**
+     * Binds the socket and starts listening, start does it if it was not
+     * done yet. The servers of the same port join its SO_REUSEPORT group in
+     * the order they listen
+     */
+    void listen();
+
     void start();
     void stop();
 
+    /**
+     * A new connection that arrives in the cpu c goes to the server that was
+     * the listener_of_cpu[c]-th to listen to the port, so it is served by
+     * the thread of the same core. The cpus without one(UINT16_MAX) are left
+     * to the hash of the connection. Must be called before listen
+     */
+    void steer_by_cpu(const std::vector<std::uint16_t>& listener_of_cpu);
+
+    /**
+     * The callback runs after the events of every iteration, and the server
+     * does not wait for new events longer than the callback asked
+     */
+    void set_tick_callback(const TickCallback tick_callback);
+
+    /**
+     * Calls the callback in the server thread, every time the file
+     * descriptor becomes readable
+     */
+    void watch(const std::int32_t file_descriptor, const ReadyCallback callback);
+
   private:
     const std::uint16_t port;
     const std::uint16_t pending_connections;
@@ -49,8 +91,22 @@ class Server
     const ClientConnectedCallback client_connected_callback;
     const ClientDisconnectedCallback client_disconnected_callback;
 
-    // A SIGTERM/SIGINT signal set this to false
-    bool running;
+    TickCallback tick_callback;
+
+    /**
+     * The watched file descriptors, that are not clients
+     */
+    std::unordered_map<std::int32_t, ReadyCallback> watched;
+
+    // A SIGTERM/SIGINT signal set this to false, from any thread
+    std::atomic<bool> running;
+
+    bool listening;
+
+    /**
+     * The program attached to the SO_REUSEPORT group when listening, if any
+     */
+    std::vector<struct sock_filter> steering;
 
     /**
      A new connection arrived
@@ -78,6 +134,42 @@ class Server
      */
     void handle_request(ClientSocket* client);
 
+    /**
+     * The client socket can take more of the responses
+     */
+    void handle_writable(ClientSocket* client);
+
+    /**
+     * Sends the responses that wait in the output of the client, and reads
+     * its requests again once most of them were sent
+     */
+    void flush_responses(ClientSocket* client);
+
+    /**
+     * The client sent more requests than its output can take for now
+     */
+    bool too_much_output(const ClientSocket* client) const;
+
+    /**
+     * Disconnects a closing client once its responses were sent and it
+     * closed its side, see ClientSocket::drain
+     */
+    void finish_closing(ClientSocket* client);
+
+    /**
+     * The paused and closing clients that wait for responses that are not
+     * ready yet. They are checked after every iteration, since the
+     * responses are filled without an event of their socket
+     */
+    std::unordered_set<std::int32_t> stalled;
+
+    /**
+     * Sends what is ready of the stalled clients, reads the requests of the
+     * ones that can be read again, and disconnects the closing ones that are
+     * done. Returns true if some requests were read
+     */
+    bool check_stalled_connections();
+
     /**
      Keep track of the current client connections
     */
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "spsc_queue.hpp"
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace easykey
+{
+class Handler;
+
+/**
+ * Work that runs in the thread of a shard, with the handler of the shard
+ */
+using ShardTask = std::function<void(Handler&)>;
+
+/**
+ * Every shard is a thread with its own server loop, its own handler and its
+ * own database, with the partitions p where p % shards is the shard.
+ * So the shards never share anything but these queues: a shard that reads a
+ * request for a key of another shard sends it the request, and gets the
+ * response back, through a queue for every pair of shards.
+ * The queues are lock-free, and a shard is woken up by its eventfd, written
+ * at most once per server iteration by every shard that sent it tasks
+ */
+class Shards
+{
+  public:
+    Shards(const std::uint16_t count);
+    ~Shards();
+
+    std::uint16_t size() const;
+
+    /**
+     * Queues the task to run in the shard to, from the thread of the shard
+     * from. The shard is woken up in the next flush
+     */
+    void send(const std::uint16_t from,
+              const std::uint16_t to,
+              ShardTask task);
+
+    /**
+     * Wakes up the shards that were sent tasks, from the thread of the shard
+     * from. Returns true if some task did not fit its queue yet, so the flush
+     * must run again soon
+     */
+    bool flush(const std::uint16_t from);
+
+    /**
+     * Runs the tasks sent to the shard, from its thread
+     */
+    void receive(const std::uint16_t to, Handler& handler);
+
+    /**
+     * Readable when the shard was sent tasks, or woken up
+     */
+    std::int32_t descriptor(const std::uint16_t shard) const;
+
+    /**
+     * Wakes up the shard, also from a signal handler
+     */
+    void wake(const std::uint16_t shard) const;
+
+    /**
+     * https://en.cppreference.com/w/cpp/language/rule_of_three
+     *
+     */
+    Shards(const Shards&) = delete;
+    Shards(Shards&&) = delete;
+    Shards operator=(const Shards&) = delete;
+    Shards operator=(Shards&&) = delete;
+
+  private:
+    const std::uint16_t count;
+
+    /**
+     * The queue from the shard from to the shard to is at from * count + to,
+     * a shard runs its own tasks right away, so it has no queue to itself.
+     * The tasks that did not fit a queue wait in its overflow, and the
+     * shards that must be woken up are marked in woken, both only used by
+     * the shard from
+     */
+    std::vector<std::unique_ptr<SPSCQueue<ShardTask>>> queues;
+    std::vector<std::deque<ShardTask>> overflows;
+    std::vector<std::uint8_t> woken;
+
+    /**
+     * The eventfd of every shard
+     */
+    std::vector<std::int32_t> descriptors;
+};
+
+};  // namespace easykey
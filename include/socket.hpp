@@ -5,11 +5,14 @@
 #include <cstdint>  // For fixed-width integer types like std::int32_t, std::uint16_t, etc.
 #include <cstdlib>       // For functions like perror
 #include <cstring>       // For functions like memcpy
+#include <linux/filter.h>  // For struct sock_fprog
 #include <netinet/in.h>  // For the sockaddr_in structure
 #include <sys/socket.h>  // For socket-related functions and constants
 #include <sys/time.h>    // For struct timeval
 #include <sys/types.h>
+#include <sys/uio.h>     // For struct iovec
 #include <unistd.h>  // For close function
+#include <deque>
 #include <functional>
 #include <memory>
 #include <vector>  // For std::vector
@@ -131,13 +134,21 @@ class Socket
          * in the linger option
          */
         static const Option<struct linger> LINGER;
+
+        /**
+         * A classic BPF program that chooses which socket of the
+         * SO_REUSEPORT group gets a new connection: it returns the index of
+         * the socket, in the order they joined the group. An index out of
+         * the group falls back to the hash of the connection
+         */
+        static const Option<struct sock_fprog> ATTACH_REUSE_PORT_PROGRAM;
     };
 
     template <typename VALUE_TYPE>
     struct OptionValue
     {
         OptionValue(const VALUE_TYPE value_type, const Option<VALUE_TYPE>& type)
-            : value_type(value_type), type(type)
+            : type(type), value_type(value_type)
         {
         }
 
@@ -200,6 +211,11 @@ class ServerSocket : public Socket
     static ServerSocket from(const std::uint16_t port);
     void assign_address() const;
     void set_available(std::uint16_t backlog_queue) const;
+
+    /**
+     * Accepts the next connection of the backlog, null if there is none
+     * left, or it could not be accepted
+     */
     ClientSocket* accept_connection() const;
 
   private:
@@ -212,16 +228,40 @@ class ClientSocket : public Socket
 
   public:
     ClientSocket(const std::int32_t file_descriptor,
-                 const std::string host_ip,
-                 const std::uint16_t port);
+                 const struct sockaddr_in address);
+    ~ClientSocket();
 
     const easykey::timestamp start;
-    const std::string host_ip;
-    const std::uint16_t port;
+
+    /**
+     * The address of the client, it is only written as text when it is
+     * needed, not for every accepted connection
+     */
+    const struct sockaddr_in address;
+    std::string host_ip() const;
+    std::uint16_t port() const;
 
     easykey::timestamp last_seen;
     std::uint32_t iterations;
 
+    /**
+     * The server does not read the requests of a client that does not read
+     * its responses, see Server::handle_request
+     */
+    bool reading_paused;
+
+    /**
+     * No more requests are read from the client, and it is disconnected once
+     * its responses were sent: what it sent can not be trusted, see drain
+     */
+    bool closing;
+
+    /**
+     * The client shut down its writing side, once what it sent was read it
+     * is closing, see Server::handle_request
+     */
+    bool peer_closed;
+
   public:
     /**
      * This buffer is where the data is stored after every socket read
@@ -231,11 +271,13 @@ class ClientSocket : public Socket
     /**
      * Writes the content to the socket buffer
      * If more_coming is true, we tell the kernel to add to the socket buffer,
-     * instead of writing immediately
+     * instead of writing immediately.
+     * What the socket buffer does not take waits in the output, every write
+     * goes after it, see flush
      */
     void write(const std::uint8_t* buffer,
                const std::uint32_t size,
-               bool more_coming) const;
+               bool more_coming);
 
     /**
      * Writes the content of the file descriptor, starting from offset and with
@@ -243,7 +285,141 @@ class ClientSocket : public Socket
      */
     void write(const std::int32_t file_descriptor,
                off_t offset,
-               const std::int64_t size) const;
+               const std::int64_t size);
+
+    /**
+     * Writes every part, in order, with just one system call
+     */
+    void write(const struct iovec* parts, const std::uint32_t count);
+
+    /**
+     * Writes what the socket buffer takes of the output, when the socket
+     * becomes writable. Returns false if the socket failed, the output is
+     * dropped and the connection closed then, see fail
+     */
+    bool flush();
+
+    /**
+     * How many bytes of the responses wait in the output
+     */
+    std::uint64_t pending_output() const;
+
+    /**
+     * Takes the place of a response that is not ready yet, at the end of the
+     * output: nothing after it is sent before it is filled, so the responses
+     * keep the order of the requests. Returns the slot to fill
+     */
+    std::uint64_t reserve();
+
+    /**
+     * The response of the slot is ready, the next flush sends it once the
+     * responses before it were. A slot of an output that was dropped is
+     * ignored
+     */
+    void fill(const std::uint64_t slot, std::vector<std::uint8_t> response);
+
+    /**
+     * Adds a part of the response of the slot, that stays reserved: the
+     * parts are sent as they come, and the responses after it still wait
+     * until it is filled
+     */
+    void fill_part(const std::uint64_t slot, std::vector<std::uint8_t> part);
+
+    /**
+     * How many reserved responses were not filled yet
+     */
+    std::uint64_t pending_responses() const;
+
+    /**
+     * Between them, the responses only go to the output, so the responses
+     * of every request the client sent at once(pipelined) are sent together
+     * at the end, with the fewest system calls
+     */
+    void begin_batch();
+    void end_batch();
+
+    /**
+     * Shuts down the writing side, once the responses were sent, and reads
+     * and drops what the client still sends: closing a socket with unread
+     * bytes resets the connection, and the client would lose the responses.
+     * Returns true when the client closed its side too
+     */
+    bool drain();
+
+    /**
+     * Writes the next size bytes the client sent to the file descriptor, at
+     * offset. The ones already in the read buffer are written from there,
+     * the others are moved with splice, without reaching the user space.
+     * Stops at the bytes that did not arrive yet, offset and size are moved
+     * past the ones written, so it goes on from the next readable event.
+     * Returns false if they could not be read or written
+     */
+    bool receive(const std::int32_t file_descriptor,
+                 off_t& offset,
+                 std::uint64_t& size);
+
+  private:
+    /**
+     * Some bytes(file_descriptor < 0, sent from offset), or a range of a
+     * file. The file is owned, a copy of the descriptor(dup), so the range
+     * can still be sent after the compaction closed and deleted the segment.
+     * In a batch it is not copied yet, the compaction only runs between the
+     * server iterations.
+     * A reserved one is a response that is not ready yet, see reserve
+     */
+    struct Output
+    {
+        std::vector<std::uint8_t> bytes;
+        std::int32_t file_descriptor;
+        off_t offset;
+        std::uint64_t size;
+        bool owned;
+        bool reserved;
+    };
+
+    /**
+     * The responses the socket buffer did not take yet, in order. The slot
+     * of the first one is first_slot, and the next ones follow it
+     */
+    std::deque<Output> output;
+    std::uint64_t output_size;
+    std::uint64_t first_slot;
+    std::uint64_t reserved_responses;
+    bool batching;
+    bool shut_down;
+
+    /**
+     * A response could not be sent whole, the client would wait for the
+     * rest of it and read the next responses from the wrong place, so
+     * nothing else is sent, see fail
+     */
+    bool failed;
+
+    void queue(const std::uint8_t* buffer, const std::uint64_t size);
+    void queue(const std::int32_t file_descriptor,
+               const off_t offset,
+               const std::uint64_t size);
+
+    /**
+     * Removes the first size bytes that were sent from the output
+     */
+    void sent(std::uint64_t size);
+
+    /**
+     * Adds the bytes after the unsent ones of the reserved response
+     */
+    void add(Output& reserved, std::vector<std::uint8_t> bytes);
+
+    /**
+     * Closes the copies of the file descriptors of the output, and drops it
+     */
+    void drop_output();
+
+    /**
+     * Drops the output and closes the connection: it is shut down, so the
+     * client reads the end of the stream and the server gets a hang up
+     */
+    void fail(const char* reason);
 };
 
 template <>
@@ -272,4 +448,8 @@ Socket::Option<std::int32_t> const Socket::Option<std::int32_t>::TCP_NO_DELAY;
 template <>
 Socket::Option<struct linger> const Socket::Option<struct linger>::LINGER;
 
+template <>
+Socket::Option<struct sock_fprog> const
+    Socket::Option<struct sock_fprog>::ATTACH_REUSE_PORT_PROGRAM;
+
 };  // namespace easykey
\ No newline at end of file
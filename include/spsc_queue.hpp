@@ -0,0 +1,137 @@
+#pragma once
+
+#include <stdlib.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+
+namespace easykey
+{
+/**
+ * A bounded queue between exactly one producer thread and one consumer
+ * thread, without locks: the producer only writes the tail and the consumer
+ * only writes the head, so each of them is an atomic that the other thread
+ * only reads.
+ * They are in different cache lines, and each side keeps a copy of the other
+ * side index, that it reads again only when the queue looks full(or empty),
+ * so the cache line of the other side is rarely pulled
+ * https://rigtorp.se/ringbuffer/
+ */
+template <typename TYPE>
+class SPSCQueue
+{
+  public:
+    /**
+     * The capacity is rounded up to a power of two
+     */
+    SPSCQueue(const std::uint32_t capacity)
+        : mask(round_up(capacity) - 1),
+          slots(new TYPE[mask + 1]),
+          head(0),
+          cached_tail(0),
+          tail(0),
+          cached_head(0)
+    {
+    }
+
+    /**
+     * Moves the item to the queue, only from the producer thread.
+     * Returns false, leaving the item as it is, if the queue is full
+     */
+    bool push(TYPE& item)
+    {
+        const auto position = tail.load(std::memory_order_relaxed);
+        if (position - cached_head > mask)
+        {
+            cached_head = head.load(std::memory_order_acquire);
+            if (position - cached_head > mask)
+            {
+                return false;
+            }
+        }
+        slots[position & mask] = std::move(item);
+        tail.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Moves the oldest item out of the queue, only from the consumer thread.
+     * Returns false if the queue is empty
+     */
+    bool pop(TYPE& item)
+    {
+        const auto position = head.load(std::memory_order_relaxed);
+        if (position == cached_tail)
+        {
+            cached_tail = tail.load(std::memory_order_acquire);
+            if (position == cached_tail)
+            {
+                return false;
+            }
+        }
+        item = std::move(slots[position & mask]);
+
+        // The slot keeps nothing alive until it is written again
+        slots[position & mask] = TYPE();
+        head.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Before C++17, new ignores an alignment bigger than the one of
+     * max_align_t, so the two sides would not surely be in their own cache
+     * lines. The queue is allocated aligned to them
+     */
+    static void* operator new(const std::size_t size)
+    {
+        void* memory = nullptr;
+        if (posix_memalign(&memory, alignof(SPSCQueue), size) != 0)
+        {
+            throw std::bad_alloc();
+        }
+        return memory;
+    }
+
+    static void operator delete(void* memory)
+    {
+        free(memory);
+    }
+
+    /**
+     * https://en.cppreference.com/w/cpp/language/rule_of_three
+     *
+     */
+    SPSCQueue(const SPSCQueue&) = delete;
+    SPSCQueue(SPSCQueue&&) = delete;
+    SPSCQueue operator=(const SPSCQueue&) = delete;
+    SPSCQueue operator=(SPSCQueue&&) = delete;
+
+  private:
+    static std::uint32_t round_up(const std::uint32_t capacity)
+    {
+        std::uint32_t rounded = 1;
+        while (rounded < capacity)
+        {
+            rounded <<= 1;
+        }
+        return rounded;
+    }
+
+    const std::uint64_t mask;
+    const std::unique_ptr<TYPE[]> slots;
+
+    /**
+     * The indexes only grow, the slot is the index & mask.
+     * The consumer side, then the producer side, each in its own cache line
+     */
+    alignas(64) std::atomic<std::uint64_t> head;
+    std::uint64_t cached_tail;
+    alignas(64) std::atomic<std::uint64_t> tail;
+    std::uint64_t cached_head;
+};
+
+};  // namespace easykey
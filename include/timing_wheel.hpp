@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace easykey
+{
+/**
+ * A key that expires at expiry, in milliseconds since the epoch. The key is
+ * not copied, its hash finds its index entry, and the entry has the number
+ * of the timer, see Index::find_timer
+ */
+struct Timer
+{
+    std::uint64_t hash;
+    std::uint64_t expiry;
+
+    /**
+     * The timers before and after it in its list, zero if there is none
+     */
+    std::uint32_t previous;
+    std::uint32_t next;
+
+    /**
+     * The list the timer is in, see TimingWheel::lists
+     */
+    std::uint32_t list;
+};
+
+/**
+ * Finds the timers that expired without looking at the ones that did not.
+ * Every level has 256 slots, a slot of the first level is 10 ms, and a slot
+ * of the next levels is as long as the whole previous level.
+ * A timer is kept in the level where its expiry first differs from the
+ * current time, and moves down (cascades) when the current time reaches its
+ * slot, so it is moved at most once per level.
+ * The timers of a slot are a doubly linked list, so a timer is cancelled
+ * without looking for it
+ * http://www.cs.columbia.edu/~nahum/w6998/papers/sosp87-timing-wheels.pdf
+ */
+class TimingWheel
+{
+  public:
+    TimingWheel(const std::uint64_t now);
+
+    /**
+     * Adds the timer of the key hash, it expires at the first slot after its
+     * expiry. Returns its number, never zero
+     */
+    std::uint32_t schedule(const std::uint64_t hash,
+                           const std::uint64_t expiry);
+
+    /**
+     * Removes the timer, an expired one too, and its number can be given to
+     * the next timer
+     */
+    void cancel(const std::uint32_t number);
+
+    /**
+     * The timer with the number, until it is cancelled
+     */
+    const Timer& timer(const std::uint32_t number) const;
+
+    /**
+     * Moves the wheel until now, and moves up to limit expired timers to
+     * expired. They are kept until they are cancelled.
+     * Returns true if there are still expired timers left
+     */
+    bool advance(const std::uint64_t now,
+                 const std::uint32_t limit,
+                 std::vector<std::uint32_t>& expired);
+
+    /**
+     * How many milliseconds from now until some timer can expire, or
+     * UINT64_MAX if there are no timers
+     */
+    std::uint64_t next_expiry(const std::uint64_t now) const;
+
+    /**
+     * How many timers did not expire yet
+     */
+    std::uint64_t size() const;
+
+  private:
+    /**
+     * Every timer, by number. The number zero is not used, and the numbers
+     * of the cancelled ones are in unused
+     */
+    std::vector<Timer> timers;
+    std::vector<std::uint32_t> unused;
+
+    /**
+     * The first timer of every list, zero if it is empty: the slots of every
+     * level, one level after the other, then the timers beyond the last
+     * level, placed again every time it turns, and the timers that expired
+     * and were not returned yet
+     */
+    std::vector<std::uint32_t> lists;
+
+    /**
+     * The current time, in slots of the first level
+     */
+    std::uint64_t current;
+
+    /**
+     * How many timers are in the lists, and how many of them expired
+     */
+    std::uint64_t count;
+    std::uint64_t due;
+
+    /**
+     * Puts the timer in the slot of its expiry
+     */
+    void place(const std::uint32_t number);
+
+    /**
+     * Adds the timer to the front of the list
+     */
+    void link(const std::uint32_t number, const std::uint32_t list);
+
+    /**
+     * Takes the timer out of its list
+     */
+    void unlink(const std::uint32_t number);
+
+    /**
+     * Places again the timers of the slot, in the lower levels
+     */
+    void cascade(const std::uint8_t level, const std::uint64_t slot);
+
+    /**
+     * The first slot after the current one where a timer expires or
+     * cascades, or where the overflow is placed again, but never after
+     * target. The slots before it have nothing to move, so the wheel jumps
+     * over them
+     */
+    std::uint64_t next_slot(const std::uint64_t target) const;
+};
+
+};  // namespace easykey
@@ -4,16 +4,24 @@
 #include "socket.hpp"
 
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <iostream>
 #include <iterator>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <unordered_map>
 #include <string>
+#include <thread>
 #include <vector>
 #include <csignal>
 
@@ -29,33 +37,113 @@ void signal_handler(int32_t signal);
 
 void gracefully_termination();
 
-Server* server_ptr = nullptr;
-Handler handler;
+/**
+ * Reads the --name=value arguments to the options.
+ * Returns false if some argument is unknown or invalid
+ */
+bool parse_arguments(int argc, char** argv, DatabaseOptions& options);
+
+/**
+ * Runs the server loop of the shard, with its own handler and database
+ */
+void run_shard(DatabaseOptions options, const uint16_t shard);
+
+/**
+ * Keeps the thread of the shard on one core, so its caches only have the
+ * data of the shard
+ */
+void pin_to_core(const uint16_t shard);
+
+/**
+ * The cores the server can run on, the shards take them in order
+ */
+vector<int32_t> allowed_cores();
 
-void on_connection(const ClientSocket& client)
+Shards* shards_ptr = nullptr;
+vector<int32_t> cores;
+
+/**
+ * The shards listen in order, so the index of a shard in the SO_REUSEPORT
+ * group is the shard, that is what the steering program returns
+ */
+mutex listening_mutex;
+condition_variable listening_turn;
+uint16_t listening = 0;
+
+/**
+ * The server and the handler of every shard, while it runs. The signal
+ * handler reads them from any thread
+ */
+unique_ptr<atomic<Server*>[]> servers;
+unique_ptr<atomic<Handler*>[]> handlers;
+
+void on_connection(const ClientSocket& client, const bool verbose)
 {
-    cout << "The client: " << client.host_ip << ":" << client.port
-         << " has just connected!" << endl;
+    if (verbose)
+    {
+        cout << "The client: " << client.host_ip() << ":" << client.port()
+             << " has just connected!" << endl;
+    }
 }
 
-void on_disconnected(const ClientSocket& client)
+void on_disconnected(Handler& handler,
+                     const ClientSocket& client,
+                     const bool verbose)
 {
-    cout << "The client: " << client.host_ip << ":" << client.port
-         << " has just disconnected!" << endl;
+    if (verbose)
+    {
+        cout << "The client: " << client.host_ip() << ":" << client.port()
+             << " has just disconnected!" << endl;
+    }
+    handler.disconnected(client);
 }
 
-void on_message(ClientSocket& client)
+bool on_message(Handler& handler, ClientSocket& client, const bool verbose)
 {
-    cout << "The client: " << client.host_ip << ":" << client.port
-         << " sent a message!" << endl;
-    handler.parse_request(client);
+    const auto parsed = handler.parse_request(client);
+    if (parsed && verbose)
+    {
+        cout << "The client: " << client.host_ip() << ":" << client.port()
+             << " sent a message!" << endl;
+    }
+    return parsed;
 }
 
-int main()
+int main(int argc, char** argv)
 {
-    auto server = Server(9000, 10, on_message, on_connection, on_disconnected);
+    DatabaseOptions options;
+    if (!parse_arguments(argc, argv, options))
+    {
+        cerr << "Usage: " << argv[0]
+             << " [--partitions=<count>]"
+                " [--segment-size=<bytes>]"
+                " [--compaction-rate=<bytes per second>]"
+                " [--compaction-threshold=<percentage>]"
+                " [--durability=<none|interval|group|always>]"
+                " [--sync-interval=<milliseconds>]"
+                " [--io=<blocking|uring>]"
+                " [--small-value-size=<bytes>]"
+                " [--cache-size=<bytes>]"
+                " [--ordered-index=<yes|no>]"
+                " [--compression-threshold=<bytes>]"
+                " [--disk-index=<yes|no>]"
+                " [--splice-threshold=<bytes>]"
+                " [--data-directories=<directory,...>]"
+                " [--preallocate=<yes|no>]"
+                " [--drop-behind=<yes|no>]"
+                " [--shards=<count>]"
+                " [--steering=<hash|cpu>]"
+                " [--backlog=<connections>]"
+                " [--max-request-size=<bytes>]"
+                " [--verbose=<yes|no>]"
+             << endl;
+        return 1;
+    }
 
-    server_ptr = &server;
+    Shards shards(options.shards);
+    shards_ptr = &shards;
+    servers.reset(new atomic<Server*>[options.shards]());
+    handlers.reset(new atomic<Handler*>[options.shards]());
 
     // https://en.cppreference.com/w/cpp/utility/program/signal
     /**
@@ -64,13 +152,368 @@ int main()
     signal(SIGTERM, signal_handler);
     signal(SIGINT, signal_handler);
 
-    server.start();
+    // kill -USR1 prints the counters of every partition
+    signal(SIGUSR1, signal_handler);
+
+    // A client that left before its responses were sent is only an error
+    signal(SIGPIPE, SIG_IGN);
+
+    // Before any thread is pinned
+    cores = allowed_cores();
+
+    // The first shard runs in the main thread
+    vector<thread> threads;
+    for (uint16_t shard = 1; shard < options.shards; shard++)
+    {
+        threads.emplace_back(run_shard, options, shard);
+    }
+    run_shard(options, 0);
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
 
     cout << "Finished!" << endl;
 
     return 0;
 }
 
+void run_shard(DatabaseOptions options, const uint16_t shard)
+{
+    if (options.shards > 1 && !cores.empty())
+    {
+        pin_to_core(shard);
+    }
+
+    // The cache and the compaction budget are for the whole server
+    options.shard = shard;
+    options.cache_size /= options.shards;
+    options.compaction_rate =
+        max<uint64_t>(1, options.compaction_rate / options.shards);
+
+    Handler handler(options, *shards_ptr);
+
+    /**
+     * Every shard listens to the port, with SO_REUSEPORT, and the kernel
+     * spreads the connections between them
+     */
+    Server server(
+        9000,
+        options.backlog,
+        [&handler, &options](ClientSocket& client) {
+            return on_message(handler, client, options.verbose);
+        },
+        [&options](const ClientSocket& client) {
+            on_connection(client, options.verbose);
+        },
+        [&handler, &options](const ClientSocket& client) {
+            on_disconnected(handler, client, options.verbose);
+        });
+
+    // The compaction, the hint files and the flushes run in the server thread
+    server.set_tick_callback([&handler]() { return handler.tick(); });
+
+    // With io_uring, the writes are answered when they complete
+    const auto completions = handler.completion_descriptor();
+    if (completions >= 0)
+    {
+        server.watch(completions, [&handler]() { handler.complete(); });
+    }
+
+    // The requests forwarded by the other shards, and their answers
+    server.watch(shards_ptr->descriptor(shard), [&handler, shard]() {
+        shards_ptr->receive(shard, handler);
+    });
+
+    /**
+     * A connection that arrives in a core with a shard goes to that shard,
+     * the cores without one(when there are more cores than shards) are left
+     * to the hash
+     */
+    if (options.steer_by_cpu && !cores.empty())
+    {
+        vector<uint16_t> listener_of_cpu(
+            *max_element(cores.begin(), cores.end()) + 1, UINT16_MAX);
+        for (size_t core = 0;
+             core < min<size_t>(cores.size(), options.shards);
+             core++)
+        {
+            listener_of_cpu[cores[core]] = core;
+        }
+        server.steer_by_cpu(listener_of_cpu);
+    }
+    {
+        unique_lock<mutex> lock(listening_mutex);
+        listening_turn.wait(lock, [shard]() { return listening == shard; });
+        server.listen();
+        listening++;
+    }
+    listening_turn.notify_all();
+
+    handlers[shard] = &handler;
+    servers[shard] = &server;
+    server.start();
+    servers[shard] = nullptr;
+    handlers[shard] = nullptr;
+}
+
+vector<int32_t> allowed_cores()
+{
+    vector<int32_t> cores;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+    {
+        perror("sched_getaffinity: ");
+        return cores;
+    }
+    for (int32_t core = 0; core < CPU_SETSIZE; core++)
+    {
+        if (CPU_ISSET(core, &allowed))
+        {
+            cores.push_back(core);
+        }
+    }
+    return cores;
+}
+
+void pin_to_core(const uint16_t shard)
+{
+    cpu_set_t chosen;
+    CPU_ZERO(&chosen);
+    CPU_SET(cores[shard % cores.size()], &chosen);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(chosen), &chosen) != 0)
+    {
+        cerr << "Could not pin the shard: " << to_string(shard)
+             << " to the core: " << to_string(cores[shard % cores.size()])
+             << endl;
+    }
+}
+
+bool parse_arguments(int argc, char** argv, DatabaseOptions& options)
+{
+    for (int32_t index = 1; index < argc; index++)
+    {
+        const string argument = argv[index];
+        const auto separator = argument.find('=');
+        if (separator == string::npos)
+        {
+            return false;
+        }
+        const auto name = argument.substr(0, separator);
+        const auto value = argument.substr(separator + 1);
+        try
+        {
+            if (name == "--partitions")
+            {
+                const auto partitions = stoul(value);
+                if (partitions == 0 || partitions > UINT16_MAX)
+                {
+                    return false;
+                }
+                options.partitions = partitions;
+            }
+            else if (name == "--segment-size")
+            {
+                options.segment_size = stoull(value);
+            }
+            else if (name == "--compaction-rate")
+            {
+                options.compaction_rate = stoull(value);
+            }
+            else if (name == "--compaction-threshold")
+            {
+                const auto threshold = stoul(value);
+                if (threshold > 100)
+                {
+                    return false;
+                }
+                options.compaction_threshold = threshold;
+            }
+            else if (name == "--durability")
+            {
+                if (value == "none")
+                {
+                    options.durability = Durability::NONE;
+                }
+                else if (value == "interval")
+                {
+                    options.durability = Durability::INTERVAL;
+                }
+                else if (value == "group")
+                {
+                    options.durability = Durability::GROUP;
+                }
+                else if (value == "always")
+                {
+                    options.durability = Durability::ALWAYS;
+                }
+                else
+                {
+                    return false;
+                }
+            }
+            else if (name == "--sync-interval")
+            {
+                options.sync_interval = chrono::milliseconds(stoull(value));
+            }
+            else if (name == "--small-value-size")
+            {
+                options.small_value_size = stoull(value);
+            }
+            else if (name == "--cache-size")
+            {
+                options.cache_size = stoull(value);
+            }
+            else if (name == "--ordered-index")
+            {
+                if (value != "yes" && value != "no")
+                {
+                    return false;
+                }
+                options.ordered_index = value == "yes";
+            }
+            else if (name == "--compression-threshold")
+            {
+                options.compression_threshold = stoull(value);
+            }
+            else if (name == "--splice-threshold")
+            {
+                options.splice_threshold = stoull(value);
+            }
+            else if (name == "--disk-index")
+            {
+                if (value != "yes" && value != "no")
+                {
+                    return false;
+                }
+                options.disk_index = value == "yes";
+            }
+            else if (name == "--data-directories")
+            {
+                // One directory for every disk, separated by commas
+                options.data_directories.clear();
+                size_t start = 0;
+                while (start <= value.size())
+                {
+                    auto end = value.find(',', start);
+                    if (end == string::npos)
+                    {
+                        end = value.size();
+                    }
+                    if (end == start)
+                    {
+                        return false;
+                    }
+                    options.data_directories.push_back(
+                        value.substr(start, end - start));
+                    start = end + 1;
+                }
+            }
+            else if (name == "--preallocate")
+            {
+                if (value != "yes" && value != "no")
+                {
+                    return false;
+                }
+                options.preallocate = value == "yes";
+            }
+            else if (name == "--drop-behind")
+            {
+                if (value != "yes" && value != "no")
+                {
+                    return false;
+                }
+                options.drop_behind = value == "yes";
+            }
+            else if (name == "--verbose")
+            {
+                if (value != "yes" && value != "no")
+                {
+                    return false;
+                }
+                options.verbose = value == "yes";
+            }
+            else if (name == "--shards")
+            {
+                const auto shards = stoul(value);
+                if (shards == 0 || shards > UINT16_MAX)
+                {
+                    return false;
+                }
+                options.shards = shards;
+            }
+            else if (name == "--backlog")
+            {
+                const auto backlog = stoul(value);
+                if (backlog == 0 || backlog > UINT16_MAX)
+                {
+                    return false;
+                }
+                options.backlog = backlog;
+            }
+            else if (name == "--max-request-size")
+            {
+                options.max_request_size = stoull(value);
+                if (options.max_request_size == 0)
+                {
+                    return false;
+                }
+            }
+            else if (name == "--steering")
+            {
+                if (value != "hash" && value != "cpu")
+                {
+                    return false;
+                }
+                options.steer_by_cpu = value == "cpu";
+            }
+            else if (name == "--io")
+            {
+                if (value == "blocking")
+                {
+                    options.io = IOBackend::BLOCKING;
+                }
+#ifdef EASYKEY_URING
+                else if (value == "uring")
+                {
+                    options.io = IOBackend::URING;
+                }
+#endif
+                else
+                {
+                    return false;
+                }
+            }
+            else
+            {
+                return false;
+            }
+        }
+        catch (const logic_error& error)
+        {
+            return false;
+        }
+    }
+    // The INTERVAL durability needs some interval to flush
+    if (options.durability == Durability::INTERVAL &&
+        options.sync_interval.count() == 0)
+    {
+        options.sync_interval = chrono::milliseconds(1000);
+    }
+    // The key tables are not ordered across the segments, so the scan needs
+    // every key in memory
+    if (options.disk_index && options.ordered_index)
+    {
+        return false;
+    }
+    // Every shard has at least one partition
+    if (options.shards > options.partitions)
+    {
+        return false;
+    }
+    return options.segment_size > 0 && options.compaction_rate > 0;
+}
+
 void signal_handler(int32_t signal)
 {
     switch (signal)
@@ -79,6 +522,16 @@ void signal_handler(int32_t signal)
         case SIGTERM:
             gracefully_termination();
             break;
+        case SIGUSR1:
+            for (uint16_t shard = 0; shard < shards_ptr->size(); shard++)
+            {
+                const auto handler = handlers[shard].load();
+                if (handler != nullptr)
+                {
+                    handler->request_report();
+                }
+            }
+            break;
         default:
             throw "Signal: " + to_string(signal) +
                 " catched is not being handled!";
@@ -87,5 +540,14 @@ void signal_handler(int32_t signal)
 
 void gracefully_termination()
 {
-    server_ptr->stop();
+    // A shard waiting for events is woken up to see it
+    for (uint16_t shard = 0; shard < shards_ptr->size(); shard++)
+    {
+        const auto server = servers[shard].load();
+        if (server != nullptr)
+        {
+            server->stop();
+        }
+        shards_ptr->wake(shard);
+    }
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include "byte_buffer.hpp"
 #include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <functional>
 #include <iostream>
 #include <stdexcept>
@@ -8,22 +9,42 @@
 using namespace std;
 using namespace easykey;
 
-ByteBuffer::ByteBuffer(const function<vector<uint8_t>(void)> source_trigger)
-    : source_trigger(source_trigger)
+/**
+ * How much the source is asked for at least, so the small requests of a
+ * client are read with just one system call
+ */
+constexpr static uint64_t READ_SIZE = 64 * 1024;
+
+ByteBuffer::ByteBuffer(const ByteSource source_trigger)
+    : length(0),
+      capacity(0),
+      position(0),
+      marked(0),
+      awaited(0),
+      frame_limit(UINT64_MAX),
+      source_trigger(source_trigger)
 {
 }
 
 uint32_t ByteBuffer::size() const
 {
-    return buffer.size();
+    return length - position;
+}
+
+const uint8_t* ByteBuffer::data() const
+{
+    return buffer.get() + position;
+}
+
+void ByteBuffer::consume(const uint32_t size)
+{
+    position += min((uint64_t)size, length - position);
 }
 
 uint8_t ByteBuffer::get_integer1()
 {
     ensure_has_requested(1);
-    auto value = buffer.front();
-    buffer.pop();
-    return value;
+    return buffer[position++];
 }
 
 uint32_t ByteBuffer::get_integer4()
@@ -32,9 +53,7 @@ uint32_t ByteBuffer::get_integer4()
     uint32_t value = 0;
     for (uint8_t index = 0; index < 4; index++)
     {
-        auto temp = buffer.front();
-        buffer.pop();
-        value |= temp << (8 * index);
+        value |= buffer[position++] << (8 * index);
     }
     return value;
 }
@@ -42,77 +61,139 @@ uint32_t ByteBuffer::get_integer4()
 vector<uint8_t> ByteBuffer::get_next(const uint32_t size)
 {
     ensure_has_requested(size);
-    vector<uint8_t> output;
-    output.reserve(min((uint64_t)size, buffer.size()));
-    for (uint32_t index = 0; index < size && !buffer.empty(); index++)
+    vector<uint8_t> output(buffer.get() + position,
+                           buffer.get() + position + size);
+    position += size;
+    return output;
+}
+
+void ByteBuffer::mark()
+{
+    marked = position;
+    awaited = 0;
+}
+
+bool ByteBuffer::fill()
+{
+    if (awaited == 0)
     {
-        auto temp = buffer.front();
-        buffer.pop();
-        output.push_back(temp);
+        return true;
     }
-    return output;
+    if (!read_until(marked + awaited))
+    {
+        return false;
+    }
+    awaited = 0;
+    return true;
+}
+
+bool ByteBuffer::arrived(const uint64_t size)
+{
+    // A frame over the limit is refused even if it already arrived whole
+    if (position + size - marked > frame_limit)
+    {
+        throw FrameTooBigException("The frame would take " +
+                                   to_string(position + size - marked) +
+                                   " bytes, the limit is " +
+                                   to_string(frame_limit));
+    }
+    if (length - position >= size)
+    {
+        // No need to request more data to the source trigger
+        return true;
+    }
+    if (!read_until(position + size))
+    {
+        // After triggering the source, still, there are no bytes available to
+        // satisfy the requested amount
+        awaited = position + size - marked;
+        return false;
+    }
+    return true;
+}
+
+void ByteBuffer::set_frame_limit(const uint64_t limit)
+{
+    frame_limit = limit;
 }
 
 bool ByteBuffer::has_content() const
 {
-    return !buffer.empty();
+    return position < length;
 }
 
 void ByteBuffer::ensure_has_requested(const uint32_t size)
 {
-    if (buffer.size() >= size)
+    if (!arrived(size))
     {
-        // No need to request more data to the source trigger
-        return;
+        throw out_of_range("Requested amount exceed the available in the "
+                           "buffer ...! Buffer size: " +
+                           to_string(length - position) +
+                           " requested: " + to_string(size));
+    }
+}
+
+bool ByteBuffer::read_until(uint64_t end)
+{
+    // The bytes before the frame are dropped, usually there are none after it
+    if (marked > 0)
+    {
+        memmove(buffer.get(), buffer.get() + marked, length - marked);
     }
+    length -= marked;
+    position -= marked;
+    end -= marked;
+    marked = 0;
 
-    while (true)
+    // A big value does not keep its memory after it was consumed
+    if (length == 0 && capacity > 16 * READ_SIZE)
+    {
+        buffer.reset();
+        capacity = 0;
+    }
+    while (length < end)
     {
         /**
-         * Request more data
+         * Request more data, straight after the bytes already read. The
+         * buffer only grows by what already arrived, never by the size the
+         * client declared, which may never come
          */
-        const auto result = source_trigger();
-        /**
-         * There is no more data to be read
-         *
-         */
-        if (result.empty())
+        if (capacity - length < READ_SIZE)
         {
-            break;
-        }
-
-        for (const auto& value : result)
-        {
-            buffer.push(value);
+            reserve(length + READ_SIZE);
         }
+        const auto result =
+            source_trigger(buffer.get() + length, capacity - length);
+        length += result;
 
         /**
-         * Now, we satisfied the request amount
+         * There is no more data to be read, until the next event
+         *
          */
-        if (buffer.size() >= size)
+        if (result == 0)
         {
             break;
         }
     }
-    // After triggering the source, still, there are no bytes available to
-    // satisfy the requested amount
-    if (buffer.size() < size)
-    {
-        const auto msg =
-            "Requested amount exceed the available in the buffer ...! Buffer "
-            "size: " +
-            to_string(buffer.size()) + " requested: " + to_string(size);
-        cerr << msg << endl;
-        throw EmptyBufferException(msg);
-    }
+    return length >= end;
 }
 
-EmptyBufferException::EmptyBufferException(const string message)
-    : std::runtime_error(message.c_str()), message(message.c_str())
+void ByteBuffer::reserve(const uint64_t size)
 {
+    if (size <= capacity)
+    {
+        return;
+    }
+    capacity = max(size, 2 * capacity);
+    unique_ptr<uint8_t[]> larger(new uint8_t[capacity]);
+    if (length > 0)
+    {
+        memcpy(larger.get(), buffer.get(), length);
+    }
+    buffer = move(larger);
 }
 
-const char* EmptyBufferException::what() const noexcept
+FrameTooBigException::FrameTooBigException(const string message)
+    : std::runtime_error(message)
 {
-    return message;
 }
\ No newline at end of file
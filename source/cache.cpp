@@ -0,0 +1,134 @@
+#include "cache.hpp"
+
+#include <cstdint>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+using namespace easykey;
+using namespace std;
+
+/**
+ * The bytes that every entry costs besides its key and its value: the list
+ * node, the lookup table node and their pointers
+ */
+constexpr static uint64_t ENTRY_OVERHEAD = 128;
+
+/**
+ * The percentage of the budget that the protected segment can take
+ */
+constexpr static uint64_t PROTECTED_PERCENTAGE = 80;
+
+uint64_t entry_size(const CacheEntry& entry);
+
+Cache::Cache(const uint64_t budget)
+    : budget(budget),
+      size(0),
+      protected_size(0),
+      hits(0),
+      misses(0),
+      evictions(0)
+{
+}
+
+const vector<uint8_t>* Cache::get(const string& key)
+{
+    const auto found = entries.find(key);
+    if (found == entries.end())
+    {
+        misses++;
+        return nullptr;
+    }
+    hits++;
+
+    auto entry = found->second;
+    if (entry->is_protected)
+    {
+        protected_values.splice(
+            protected_values.begin(), protected_values, entry);
+        return &entry->value;
+    }
+
+    // Read twice, so it is protected from now on
+    entry->is_protected = true;
+    protected_size += entry_size(*entry);
+    protected_values.splice(protected_values.begin(), probation, entry);
+
+    // The least read protected values go back to the probation
+    while (protected_size * 100 > budget * PROTECTED_PERCENTAGE)
+    {
+        const auto demoted = prev(protected_values.end());
+        demoted->is_protected = false;
+        protected_size -= entry_size(*demoted);
+        probation.splice(probation.begin(), protected_values, demoted);
+    }
+    return &entry->value;
+}
+
+const vector<uint8_t>* Cache::put(const string& key, vector<uint8_t> value)
+{
+    invalidate(key);
+    CacheEntry entry{key, move(value), false};
+    const auto bytes = entry_size(entry);
+    if (bytes > budget)
+    {
+        return nullptr;
+    }
+    evict(bytes);
+
+    // The new value is the most recently read of the probation segment
+    probation.push_front(move(entry));
+    entries[key] = probation.begin();
+    size += bytes;
+    return &probation.front().value;
+}
+
+void Cache::invalidate(const string& key)
+{
+    const auto found = entries.find(key);
+    if (found != entries.end())
+    {
+        remove(found->second);
+    }
+}
+
+void Cache::report(ostream& output) const
+{
+    output << "Cached values | Bytes | Protected bytes | Hits | Misses | "
+              "Evictions"
+           << endl;
+    output << to_string(entries.size()) << " | " << to_string(size)
+           << " | " << to_string(protected_size) << " | " << to_string(hits)
+           << " | " << to_string(misses) << " | " << to_string(evictions)
+           << endl;
+}
+
+void Cache::evict(const uint64_t needed)
+{
+    while (size + needed > budget)
+    {
+        auto& segment = probation.empty() ? protected_values : probation;
+        remove(prev(segment.end()));
+        evictions++;
+    }
+}
+
+void Cache::remove(const list<CacheEntry>::iterator entry)
+{
+    const auto entry_bytes = entry_size(*entry);
+    size -= entry_bytes;
+    entries.erase(entry->key);
+    if (entry->is_protected)
+    {
+        protected_size -= entry_bytes;
+        protected_values.erase(entry);
+        return;
+    }
+    probation.erase(entry);
+}
+
+uint64_t entry_size(const CacheEntry& entry)
+{
+    return entry.key.size() + entry.value.size() + ENTRY_OVERHEAD;
+}
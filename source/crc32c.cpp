@@ -0,0 +1,130 @@
+#include "crc32c.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+using namespace std;
+using namespace easykey;
+
+/**
+ * The Castagnoli polynomial, with the bits reversed
+ */
+constexpr static uint32_t POLYNOMIAL = 0x82F63B78;
+
+/**
+ * The software checksum handles 8 bytes at a time (slicing-by-8): the table
+ * n has the checksum of a byte followed by n zero bytes
+ * https://create.stephan-brumme.com/crc32/#slicing-by-8-overview
+ */
+struct Tables
+{
+    uint32_t table[8][256];
+
+    Tables()
+    {
+        for (uint32_t byte = 0; byte < 256; byte++)
+        {
+            uint32_t crc = byte;
+            for (uint8_t bit = 0; bit < 8; bit++)
+            {
+                crc = (crc >> 1) ^ (crc & 1 ? POLYNOMIAL : 0);
+            }
+            table[0][byte] = crc;
+        }
+        for (uint32_t byte = 0; byte < 256; byte++)
+        {
+            for (uint8_t slice = 1; slice < 8; slice++)
+            {
+                const auto previous = table[slice - 1][byte];
+                table[slice][byte] =
+                    (previous >> 8) ^ table[0][previous & 0xff];
+            }
+        }
+    }
+};
+
+static const Tables tables;
+
+static uint32_t software_crc32c(const uint8_t* input,
+                                uint64_t size,
+                                uint32_t crc)
+{
+    const auto& table = tables.table;
+    while (size >= 8)
+    {
+        // The input is little endian, like the records
+        uint64_t word;
+        memcpy(&word, input, sizeof(word));
+        word ^= crc;
+        crc = table[7][word & 0xff] ^ table[6][(word >> 8) & 0xff] ^
+              table[5][(word >> 16) & 0xff] ^ table[4][(word >> 24) & 0xff] ^
+              table[3][(word >> 32) & 0xff] ^ table[2][(word >> 40) & 0xff] ^
+              table[1][(word >> 48) & 0xff] ^ table[0][word >> 56];
+        input += 8;
+        size -= 8;
+    }
+    while (size > 0)
+    {
+        crc = (crc >> 8) ^ table[0][(crc ^ *input) & 0xff];
+        input++;
+        size--;
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * Only this function is compiled with SSE4.2, the rest of the server still
+ * runs where it is not available
+ */
+__attribute__((target("sse4.2"))) static uint32_t hardware_crc32c(
+    const uint8_t* input,
+    uint64_t size,
+    uint32_t crc)
+{
+    uint64_t crc64 = crc;
+    while (size >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, input, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        input += 8;
+        size -= 8;
+    }
+    crc = crc64;
+    while (size > 0)
+    {
+        crc = _mm_crc32_u8(crc, *input);
+        input++;
+        size--;
+    }
+    return crc;
+}
+
+static bool hardware_supported()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+
+static const bool HARDWARE_CRC32C = hardware_supported();
+#endif
+
+uint32_t easykey::crc32c(const uint8_t* input,
+                         uint64_t size,
+                         const uint32_t previous)
+{
+    // The checksum starts and ends inverted, so leading zeros count
+    const uint32_t crc = ~previous;
+#if defined(__x86_64__)
+    if (HARDWARE_CRC32C)
+    {
+        return ~hardware_crc32c(input, size, crc);
+    }
+#endif
+    return ~software_crc32c(input, size, crc);
+}
@@ -0,0 +1,3243 @@
+#include "database.hpp"
+#include "cache.hpp"
+#include "crc32c.hpp"
+#include "hash.hpp"
+#include "lz4.hpp"
+#include "ring.hpp"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace easykey;
+using namespace std;
+
+/**
+ * The file must be opened with Read & Write
+ * Must be created if does not exist
+ * Must keep its content if exists, the index is rebuilt from it
+ */
+constexpr static int32_t OPEN_FILE_FLAGS = O_RDWR | O_CREAT;
+
+/**
+ * The mode(permissions) of the file are:
+ * Owner of the file has READ and Write permissions
+ * Everyone else does not have any permissions
+ */
+constexpr static int32_t OPEN_FILE_MODE = S_IRUSR | S_IWUSR;
+
+/**
+ * A segment file is named: easykey-<partition>-<segment id>.db, in the data
+ * directory of its partition
+ */
+static const string FILE_PREFIX = "easykey-";
+
+/**
+ * Keeps how the keys were spread between the partitions, and how the records
+ * were written.
+ * A key must always go to the same partition, otherwise the recovery could
+ * not tell which of its records is the newest
+ */
+static const string LAYOUT_FILENAME = "easykey-layout";
+static const string LAYOUT_HASH = "xxh64";
+static const string LAYOUT_RECORDS = "crc32c";
+
+/**
+ * A snapshot is a directory next to the segments, easykey-snapshot-<name>,
+ * with hard links to them. Every data directory has its own, a hard link
+ * can not cross file systems
+ */
+static const string SNAPSHOT_PREFIX = "easykey-snapshot-";
+static const string MANIFEST_FILENAME = "manifest";
+
+/**
+ * With the drop behind, how many appended bytes are written back together
+ */
+constexpr static uint64_t DROP_BEHIND_SIZE = 8 * 1024 * 1024;
+static const off_t MEMORY_PAGE_SIZE = sysconf(_SC_PAGESIZE);
+
+/**
+ * The first bytes of every hint file
+ */
+constexpr static uint8_t HINT_FILE_MAGIC[4] = {'E', 'K', 'H', '1'};
+
+/**
+ * Set in the key size of the tombstones, the records of the deleted keys
+ */
+constexpr static uint32_t TOMBSTONE_FLAG = 0x80000000;
+
+/**
+ * Set in the key size of the records with an expiry
+ */
+constexpr static uint32_t EXPIRY_FLAG = 0x40000000;
+
+/**
+ * Set in the key size of the records with a compressed value
+ */
+constexpr static uint32_t COMPRESSED_FLAG = 0x20000000;
+constexpr static uint32_t RECORD_FLAGS =
+    TOMBSTONE_FLAG | EXPIRY_FLAG | COMPRESSED_FLAG;
+
+/**
+ * A tombstone is never compressed, so both flags mark the record of a value
+ * that is still being received. It has a value size, and is skipped until its
+ * real headers replace them, see Database::begin_upload
+ */
+constexpr static uint32_t UNFINISHED_FLAGS = TOMBSTONE_FLAG | COMPRESSED_FLAG;
+
+/**
+ * Set in the offset of the index entries of the compressed values
+ */
+constexpr static uint64_t COMPRESSED_VALUE = 1ull << 63;
+
+/**
+ * The size of the index entries of the deleted keys, with the disk index
+ */
+constexpr static uint32_t DELETED_SIZE = UINT32_MAX;
+
+/**
+ * Every record has a CRC-32C of its other bytes, right before the value size
+ */
+constexpr static uint64_t CHECKSUM_SIZE = 4;
+
+/**
+ * How many expired keys are removed at most at every maintenance, so a lot of
+ * keys expiring together do not stall the clients
+ */
+constexpr static uint32_t EXPIRATION_BATCH = 1024;
+
+/**
+ * How many keys of a new key table leave the index at every maintenance
+ */
+constexpr static uint32_t RELEASE_BATCH = 16384;
+
+/**
+ * How many bytes are read/written at once while recovering, compacting or
+ * writing the hint files
+ */
+constexpr static uint32_t RECOVERY_BUFFER_SIZE = 1024 * 1024;
+
+/**
+ * How many operations can be queued in the io_uring before they are submitted
+ */
+constexpr static uint32_t RING_ENTRIES = 256;
+
+/**
+ * The last bit of the io_uring user data, set for the flushes
+ */
+constexpr static uint64_t FLUSH_OPERATION = 1;
+
+bool write_all(const int32_t fd, const uint8_t* buffer, uint64_t size);
+bool write_all(const int32_t fd,
+               struct iovec* parts,
+               uint32_t count,
+               off_t offset);
+void skip_written(struct iovec*& parts, uint32_t& count, uint64_t written);
+bool copy_range(const int32_t from,
+                off_t from_offset,
+                const int32_t to,
+                off_t to_offset,
+                uint64_t size);
+uint64_t record_size(const uint64_t key_size,
+                     const uint64_t stored_size,
+                     const uint64_t expiry);
+uint32_t record_parts(const string& key,
+                      const vector<uint8_t>& value,
+                      const uint32_t flags,
+                      const uint64_t expiry,
+                      uint8_t* headers,
+                      struct iovec* parts);
+uint32_t header_parts(const string& key,
+                      const uint64_t value_size,
+                      const uint32_t flags,
+                      const uint64_t expiry,
+                      const uint32_t checksum,
+                      uint8_t* headers,
+                      struct iovec* parts);
+uint32_t headers_checksum(const string& key,
+                          const uint32_t key_size,
+                          const uint64_t expiry);
+uint32_t value_size_checksum(const uint64_t value_size,
+                             const uint32_t previous);
+uint64_t current_time();
+void check_layout(const string& directory, const uint16_t partitions);
+bool link_file(const string& filename,
+               const string& directory,
+               const bool optional,
+               string& manifest);
+bool copy_file(const string& filename,
+               const string& directory,
+               const bool optional,
+               string& manifest);
+bool write_manifest(const string& directory, const string& manifest);
+
+/**
+ * Reads a file sequentially, starting at some offset.
+ * Keeps a read ahead buffer, so the small record headers do not cost one
+ * system call each, and values can be skipped without being read
+ */
+class SequentialReader
+{
+  public:
+    SequentialReader(const int32_t fd, const off_t offset) : fd(fd)
+    {
+        buffer.resize(RECOVERY_BUFFER_SIZE);
+        buffer_offset = offset;
+        buffer_position = 0;
+        buffer_size = 0;
+    }
+
+    /**
+     * Copies the next size bytes to output.
+     * Returns false if the file ends before that
+     */
+    bool read(uint8_t* output, uint64_t size)
+    {
+        while (size > 0)
+        {
+            if (buffer_position == buffer_size && !fill())
+            {
+                return false;
+            }
+            const auto available =
+                min(size, (uint64_t)(buffer_size - buffer_position));
+            memcpy(output, buffer.data() + buffer_position, available);
+            buffer_position += available;
+            output += available;
+            size -= available;
+        }
+        return true;
+    }
+
+    /**
+     * Moves forward size bytes, without reading them if they are not
+     * buffered yet
+     */
+    void skip(const uint64_t size)
+    {
+        if (buffer_size - buffer_position >= size)
+        {
+            buffer_position += size;
+            return;
+        }
+        buffer_offset = position() + size;
+        buffer_position = 0;
+        buffer_size = 0;
+    }
+
+    /**
+     * Continues the checksum with the next size bytes, without copying them.
+     * Returns false if the file ends before that
+     */
+    bool checksum(uint64_t size, uint32_t& checksum)
+    {
+        while (size > 0)
+        {
+            if (buffer_position == buffer_size && !fill())
+            {
+                return false;
+            }
+            const auto available =
+                min(size, (uint64_t)(buffer_size - buffer_position));
+            checksum =
+                crc32c(buffer.data() + buffer_position, available, checksum);
+            buffer_position += available;
+            size -= available;
+        }
+        return true;
+    }
+
+    /**
+     * The file offset of the next byte to be read
+     */
+    off_t position() const
+    {
+        return buffer_offset + buffer_position;
+    }
+
+  private:
+    const int32_t fd;
+    vector<uint8_t> buffer;
+
+    /**
+     * The file offset of the first buffered byte
+     */
+    off_t buffer_offset;
+    uint64_t buffer_position;
+    uint64_t buffer_size;
+
+    bool fill()
+    {
+        buffer_offset += buffer_size;
+        buffer_position = 0;
+        buffer_size = 0;
+        const auto bytes_read =
+            ::pread(fd, buffer.data(), buffer.size(), buffer_offset);
+        if (bytes_read <= 0)
+        {
+            return false;
+        }
+        buffer_size = bytes_read;
+        return true;
+    }
+};
+
+/**
+ * A record as it is read from a segment, without its value
+ */
+struct Record
+{
+    std::string key;
+
+    /**
+     * Where the record starts
+     */
+    off_t offset;
+
+    /**
+     * Where the value size starts, or where the next record starts for a
+     * tombstone
+     */
+    off_t value_offset;
+    uint32_t value_size;
+    bool tombstone;
+    bool compressed;
+
+    /**
+     * Its value never arrived whole, it is not a value of the key
+     */
+    bool unfinished;
+
+    /**
+     * When the key expires, zero if it never does
+     */
+    uint64_t expiry;
+
+    /**
+     * Where the next record starts
+     */
+    off_t end() const
+    {
+        return tombstone ? value_offset : value_offset + 4 + value_size;
+    }
+};
+
+/**
+ * Reads the next record, that must end before the end offset.
+ * With verify, the value is read too, and the record must match its checksum
+ */
+bool read_record(SequentialReader& reader,
+                 const off_t end,
+                 const bool verify,
+                 Record& record)
+{
+    record.offset = reader.position();
+    uint8_t integer4[4];
+    if (!reader.read(integer4, 4))
+    {
+        return false;
+    }
+    const uint32_t key_size = deserialize(integer4, 4);
+    record.unfinished = (key_size & UNFINISHED_FLAGS) == UNFINISHED_FLAGS;
+    record.tombstone = (key_size & TOMBSTONE_FLAG) && !record.unfinished;
+    record.compressed = (key_size & COMPRESSED_FLAG) && !record.unfinished;
+    const bool expiring = key_size & EXPIRY_FLAG;
+    record.key.resize(key_size & ~RECORD_FLAGS);
+    const uint64_t headers_size =
+        4 + CHECKSUM_SIZE + (record.tombstone ? 0 : (expiring ? 12 : 4));
+    if (record.offset + headers_size + record.key.size() > (uint64_t)end ||
+        !reader.read(reinterpret_cast<uint8_t*>(&record.key[0]),
+                     record.key.size()))
+    {
+        return false;
+    }
+    record.expiry = 0;
+    uint8_t integer8[8];
+    if (expiring && !record.tombstone)
+    {
+        if (!reader.read(integer8, 8))
+        {
+            return false;
+        }
+        record.expiry = deserialize(integer8, 8);
+    }
+    if (!reader.read(integer4, 4))
+    {
+        return false;
+    }
+    const uint32_t stored_checksum = deserialize(integer4, 4);
+    auto checksum = verify
+                        ? headers_checksum(record.key, key_size, record.expiry)
+                        : 0;
+    if (record.tombstone)
+    {
+        record.value_size = 0;
+        record.value_offset = reader.position();
+        return !verify || checksum == stored_checksum;
+    }
+    if (!reader.read(integer4, 4))
+    {
+        return false;
+    }
+    record.value_size = deserialize(integer4, 4);
+    record.value_offset = reader.position() - 4;
+    if (record.end() > end)
+    {
+        return false;
+    }
+    if (!verify)
+    {
+        reader.skip(record.value_size);
+        return true;
+    }
+    checksum = crc32c(integer4, 4, checksum);
+
+    // Only the headers of an unfinished record were checksummed
+    if (record.unfinished)
+    {
+        reader.skip(record.value_size);
+        return checksum == stored_checksum;
+    }
+    return reader.checksum(record.value_size, checksum) &&
+           checksum == stored_checksum;
+}
+
+/**
+ * Appends the hint file entry of the record to buffer
+ */
+void serialize_hint(vector<uint8_t>& buffer, const Record& record)
+{
+    const uint32_t flags = (record.tombstone ? TOMBSTONE_FLAG : 0) |
+                           (record.expiry != 0 ? EXPIRY_FLAG : 0) |
+                           (record.compressed ? COMPRESSED_FLAG : 0);
+    serialize(buffer, record.key.size() | flags, 4);
+    buffer.insert(buffer.end(), record.key.begin(), record.key.end());
+    serialize(buffer,
+              record.tombstone ? record.offset : record.value_offset,
+              8);
+    serialize(buffer, record.tombstone ? 0 : record.value_size + 4, 4);
+    if (record.expiry != 0)
+    {
+        serialize(buffer, record.expiry, 8);
+    }
+}
+
+File::File(const int32_t fd,
+           const string filename,
+           const string hint_filename,
+           const string table_filename,
+           const uint32_t id,
+           const uint32_t number)
+    : fd(fd),
+      filename(filename),
+      hint_filename(hint_filename),
+      table_filename(table_filename),
+      id(id),
+      number(number),
+      size(0),
+      dead_bytes(0),
+      hint_pending(false),
+      dirty(false),
+      in_flight(0),
+      mapping(nullptr),
+      mapping_size(0),
+      written_back(0),
+      dropped(0)
+{
+    cout << "Opened file: " << filename
+         << " with file descriptor: " << to_string(fd) << endl;
+}
+
+File::~File()
+{
+    if (mapping != nullptr)
+    {
+        munmap(const_cast<uint8_t*>(mapping), mapping_size);
+    }
+    cout << "Calling close to descriptor: " << to_string(fd) << endl;
+    if (close(fd) < 0)
+    {
+        cerr << "Could not close the file properly ..." << endl;
+    }
+}
+
+void File::map(const uint64_t size)
+{
+    void* address = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED)
+    {
+        perror("mmap: ");
+        return;
+    }
+
+    // The reads are spread over the file, reading ahead would be wasted
+    madvise(address, size, MADV_RANDOM);
+    mapping = static_cast<const uint8_t*>(address);
+    mapping_size = size;
+}
+
+const uint8_t* File::at(const off_t offset, const uint64_t size) const
+{
+    if (mapping == nullptr || offset + size > mapping_size)
+    {
+        return nullptr;
+    }
+    return mapping + offset;
+}
+
+Database::Database(const DatabaseOptions options)
+    : options(options),
+      stored(options.ordered_index),
+      expirations(current_time()),
+      compaction_allowance(0),
+      next_operation(0),
+      next_upload(0)
+{
+    /**
+     * The blocking backend is the fallback, when the kernel does not support
+     * io_uring
+     */
+    if (options.io == IOBackend::URING)
+    {
+        try
+        {
+            ring.reset(new Ring(RING_ENTRIES));
+        }
+        catch (const char* msg)
+        {
+            cerr << msg << " Using the blocking backend ..." << endl;
+        }
+    }
+
+    if (options.cache_size > 0)
+    {
+        cache.reset(new Cache(options.cache_size));
+    }
+
+    const uint16_t files = options.partitions;
+    const auto& data_directories = options.data_directories;
+    for (const auto& data_directory : data_directories)
+    {
+        check_layout(data_directory, files);
+    }
+
+    // The partitions of this shard, its partition index is number / shards
+    const auto shards = options.shards;
+    partitions.resize((files - options.shard + shards - 1) / shards);
+
+    /**
+     * Finds the segments of every partition.
+     * Leftovers of an interrupted compaction are removed, the segment they
+     * were replacing is still intact
+     */
+    vector<vector<uint32_t>> segment_ids(partitions.size());
+    for (size_t number = 0; number < data_directories.size(); number++)
+    {
+        const auto& data_directory = data_directories[number];
+        DIR* directory = opendir(data_directory.c_str());
+        if (directory == nullptr)
+        {
+            throw "Could not open the data directory: " + data_directory;
+        }
+        while (const auto entry = readdir(directory))
+        {
+            const string name = entry->d_name;
+            uint32_t partition;
+            uint32_t id;
+            int32_t consumed = 0;
+            if (name.compare(0, FILE_PREFIX.size(), FILE_PREFIX) != 0 ||
+                sscanf(name.c_str() + FILE_PREFIX.size(),
+                       "%u-%u.db%n",
+                       &partition,
+                       &id,
+                       &consumed) != 2 ||
+                partition >= files)
+            {
+                continue;
+            }
+
+            // Its segments would be missed, and their keys lost
+            if (partition % data_directories.size() != number)
+            {
+                closedir(directory);
+                const auto msg =
+                    "The segment: " + data_directory + "/" + name +
+                    " is not in the data directory of its partition! Start "
+                    "the server with the same data directories, in the same "
+                    "order";
+                cerr << msg << endl;
+                throw msg;
+            }
+            if (partition % shards != options.shard)
+            {
+                continue;
+            }
+            const auto suffix = name.substr(FILE_PREFIX.size() + consumed);
+            if (suffix.empty())
+            {
+                segment_ids[partition / shards].push_back(id);
+            }
+            else if (suffix == ".compact")
+            {
+                cout << "Removing interrupted compaction: " << name << endl;
+                unlink((data_directory + "/" + name).c_str());
+            }
+        }
+        closedir(directory);
+    }
+
+    for (uint16_t index = 0; index < partitions.size(); index++)
+    {
+        auto& partition = partitions[index];
+        partition.number = index * shards + options.shard;
+        partition.writes = 0;
+        partition.reads = 0;
+        partition.written_bytes = 0;
+        auto& ids = segment_ids[index];
+        sort(ids.begin(), ids.end());
+        if (ids.empty())
+        {
+            ids.push_back(0);
+        }
+        for (const auto& id : ids)
+        {
+            partition.segments.push_back(open_segment(partition.number, id));
+            const auto segment = partition.segments.back().get();
+            recover(segment);
+            segment->written_back = segment->size;
+            segment->dropped = segment->size;
+        }
+        partition.next_segment_id = ids.back() + 1;
+        preallocate(partition.segments.back().get());
+
+        // The active segment hint file is written when the server stops
+        partition.segments.back()->hint_pending = false;
+    }
+    last_maintenance = chrono::steady_clock::now();
+    last_sync = last_maintenance;
+}
+
+Database::~Database()
+{
+    wait();
+    if (compaction)
+    {
+        cout << "Interrupting the compaction of: "
+             << compaction->source->filename << endl;
+        unlink(compaction->temporary_filename.c_str());
+    }
+
+    // Its segment is still pending, its hint file is written whole below
+    if (index_writing && index_writing->fd >= 0)
+    {
+        close(index_writing->fd);
+        unlink(index_writing->temporary_filename.c_str());
+    }
+    index_writing.reset();
+    for (const auto& partition : partitions)
+    {
+        for (const auto& segment : partition.segments)
+        {
+            if (segment->table)
+            {
+                segment->table->save_dead_bytes(segment->dead_bytes);
+            }
+            else if (segment->hint_pending ||
+                     segment == partition.segments.back())
+            {
+                write_hint_file(segment.get());
+            }
+        }
+    }
+}
+
+shared_ptr<File> Database::open_segment(const uint16_t partition,
+                                        const uint32_t id)
+{
+    const auto location = directory_of(partition) + "/" + FILE_PREFIX +
+                          to_string(partition) + "-" + to_string(id);
+    const auto filename = location + ".db";
+    int32_t fd = open(filename.c_str(), OPEN_FILE_FLAGS, OPEN_FILE_MODE);
+    if (fd == -1)
+    {
+        throw "Could not open file: " + filename;
+    }
+    auto file =
+        create_file(fd, filename, location + ".hint", location + ".keys", id);
+
+    /**
+     * The active segment grows up to the segment size, a segment bigger
+     * than that (with a huge record) is not appended anymore
+     */
+    struct stat file_stat;
+    if (options.small_value_size > 0 && fstat(fd, &file_stat) == 0)
+    {
+        file->map(max(options.segment_size, (uint64_t)file_stat.st_size));
+    }
+    return file;
+}
+
+shared_ptr<File> Database::create_file(const int32_t fd,
+                                       const string filename,
+                                       const string hint_filename,
+                                       const string table_filename,
+                                       const uint32_t id)
+{
+    auto file = make_shared<File>(
+        fd, filename, hint_filename, table_filename, id, files.size());
+    files.push_back(file.get());
+    return file;
+}
+
+FileStorage Database::storage_of(const IndexEntry& entry) const
+{
+    return FileStorage{
+        entry.size + 4ull,
+        (off_t)(entry.offset & ~COMPRESSED_VALUE),
+        files[entry.file],
+        (entry.offset & COMPRESSED_VALUE) != 0,
+        entry.timer == 0 ? 0 : expirations.timer(entry.timer).expiry};
+}
+
+void Database::point(IndexEntry& entry, const FileStorage storage) const
+{
+    entry.offset = storage.offset | (storage.compressed ? COMPRESSED_VALUE : 0);
+    entry.file = storage.file->number;
+    entry.size = storage.size - 4;
+}
+
+const string& Database::directory_of(const uint16_t partition) const
+{
+    const auto& directories = options.data_directories;
+    return directories[partition % directories.size()];
+}
+
+void Database::preallocate(File* file) const
+{
+    /**
+     * The space is allocated beyond the end of the file, so its size is
+     * still where the records end, and the recovery does not read the
+     * preallocated blocks as records
+     */
+    if (!options.preallocate || file->size >= (off_t)options.segment_size ||
+        fallocate(file->fd, FALLOC_FL_KEEP_SIZE, 0, options.segment_size) ==
+            0)
+    {
+        return;
+    }
+
+    // Some file systems, like tmpfs without huge pages, can not preallocate
+    if (errno != EOPNOTSUPP)
+    {
+        perror("fallocate: ");
+        cerr << "Could not preallocate the file: " << file->filename << endl;
+    }
+}
+
+void Database::release_preallocation(File* file) const
+{
+    /**
+     * Truncating a file frees its blocks beyond the size, even to the same
+     * size. The appends in flight are below its size, that is already taken
+     */
+    if (options.preallocate && file->size < (off_t)options.segment_size &&
+        ftruncate(file->fd, file->size) < 0)
+    {
+        perror("ftruncate: ");
+        cerr << "Could not release the preallocation of the file: "
+             << file->filename << endl;
+    }
+}
+
+bool Database::drop_behind(File* file, const bool sealed) const
+{
+    /**
+     * The bytes written back the previous time are waited for, they most
+     * likely are on the disk already, and only the clean pages can be
+     * dropped. https://lwn.net/Articles/718734/
+     */
+    if (file->dropped < file->written_back)
+    {
+        const auto size = file->written_back - file->dropped;
+
+        // The pages touched through the mapping are only dropped once unmapped
+        if (file->mapping != nullptr)
+        {
+            const auto start =
+                file->dropped / MEMORY_PAGE_SIZE * MEMORY_PAGE_SIZE;
+            const auto end =
+                min((uint64_t)file->written_back, file->mapping_size);
+            if (end > (uint64_t)start)
+            {
+                madvise(const_cast<uint8_t*>(file->mapping) + start,
+                        end - start,
+                        MADV_DONTNEED);
+            }
+        }
+        if (sync_file_range(file->fd,
+                            file->dropped,
+                            size,
+                            SYNC_FILE_RANGE_WAIT_BEFORE |
+                                SYNC_FILE_RANGE_WRITE |
+                                SYNC_FILE_RANGE_WAIT_AFTER) < 0)
+        {
+            perror("sync_file_range: ");
+        }
+        posix_fadvise(file->fd, file->dropped, size, POSIX_FADV_DONTNEED);
+        file->dropped = file->written_back;
+    }
+
+    // The writeback starts now and goes on while the server does other work
+    const auto appended = file->size - file->written_back;
+    if (appended >= (off_t)DROP_BEHIND_SIZE || (sealed && appended > 0))
+    {
+        if (sync_file_range(file->fd,
+                            file->written_back,
+                            appended,
+                            SYNC_FILE_RANGE_WRITE) < 0)
+        {
+            perror("sync_file_range: ");
+        }
+        file->written_back = file->size;
+    }
+    return file->dropped < file->written_back;
+}
+
+File* Database::roll(Partition& partition)
+{
+    partition.segments.back()->hint_pending = true;
+    release_preallocation(partition.segments.back().get());
+    partition.segments.push_back(
+        open_segment(partition.number, partition.next_segment_id++));
+    preallocate(partition.segments.back().get());
+    cout << "Partition: " << to_string(partition.number)
+         << " rolled to the segment: " << partition.segments.back()->filename
+         << endl;
+    return partition.segments.back().get();
+}
+
+void Database::index(const string& key,
+                     const FileStorage storage,
+                     const uint64_t expiry)
+{
+    if (cache)
+    {
+        cache->invalidate(key);
+    }
+    bool inserted;
+    auto& entry = stored.insert(key, inserted);
+    if (!inserted && entry.size != DELETED_SIZE)
+    {
+        const auto previous = storage_of(entry);
+        previous.file->dead_bytes +=
+            record_size(key.size(), previous.size, previous.expiry);
+    }
+    point(entry, storage);
+
+    // The timer of the previous expiry is replaced
+    if (entry.timer != 0 &&
+        (expiry == 0 || expirations.timer(entry.timer).expiry != expiry))
+    {
+        expirations.cancel(entry.timer);
+        entry.timer = 0;
+    }
+    if (expiry != 0 && entry.timer == 0)
+    {
+        entry.timer = expirations.schedule(easykey::hash(key), expiry);
+    }
+
+    // The previous record can be in a key table, that is not in memory
+    FileStorage previous;
+    if (inserted && table_latest(key, previous))
+    {
+        previous.file->dead_bytes +=
+            record_size(key.size(), previous.size, previous.expiry);
+    }
+}
+
+void Database::unindex(const string& key, const FileStorage record)
+{
+    if (cache)
+    {
+        cache->invalidate(key);
+    }
+    FileStorage previous;
+    if (latest(key, previous))
+    {
+        previous.file->dead_bytes +=
+            record_size(key.size(), previous.size, previous.expiry);
+    }
+    const auto found = stored.find(key);
+    if (found != nullptr && found->timer != 0)
+    {
+        expirations.cancel(found->timer);
+        found->timer = 0;
+    }
+    if (!options.disk_index)
+    {
+        stored.erase(key);
+        return;
+    }
+    bool inserted;
+    auto& entry = stored.insert(key, inserted);
+    point(entry, record);
+    entry.size = DELETED_SIZE;
+}
+
+bool Database::expired(const string& key)
+{
+    if (expirations.size() == 0)
+    {
+        return false;
+    }
+    const auto entry = stored.find(key);
+    if (entry == nullptr || entry->timer == 0 ||
+        expirations.timer(entry->timer).expiry > current_time())
+    {
+        return false;
+    }
+    unindex(key, storage_of(*entry));
+    return true;
+}
+
+bool Database::latest(const string& key, FileStorage& storage)
+{
+    const auto entry = stored.find(key);
+    if (entry == nullptr)
+    {
+        return table_latest(key, storage);
+    }
+    if (entry->size == DELETED_SIZE)
+    {
+        return false;
+    }
+    storage = storage_of(*entry);
+    return true;
+}
+
+bool Database::table_latest(const string& key, FileStorage& storage) const
+{
+    if (!options.disk_index)
+    {
+        return false;
+    }
+    const auto& segments = partitions[partition_of(key)].segments;
+
+    // Hashed only once, and only if some segment has a table
+    bool hashed = false;
+    uint64_t filter_hash = 0;
+    TableEntry entry;
+    for (auto segment = segments.rbegin(); segment != segments.rend();
+         segment++)
+    {
+        const auto& table = (*segment)->table;
+        if (!table)
+        {
+            continue;
+        }
+        if (!hashed)
+        {
+            filter_hash = KeyTable::filter_hash(key);
+            hashed = true;
+        }
+        if (!table->find(key, filter_hash, entry))
+        {
+            continue;
+        }
+
+        // A tombstone has no size
+        if (entry.size == 0)
+        {
+            return false;
+        }
+        storage = FileStorage{entry.size,
+                              (off_t)(entry.offset & ~COMPRESSED_VALUE),
+                              segment->get(),
+                              (entry.offset & COMPRESSED_VALUE) != 0,
+                              entry.expiry};
+        return true;
+    }
+    return false;
+}
+
+bool Database::live(const string& key, FileStorage& storage)
+{
+    if (!latest(key, storage))
+    {
+        return false;
+    }
+    if (storage.expiry == 0 || storage.expiry > current_time())
+    {
+        return true;
+    }
+
+    // The expired keys in memory are removed right away, the ones in the key
+    // tables only when their segment is compacted
+    if (stored.find(key) != nullptr)
+    {
+        unindex(key, storage);
+    }
+    return false;
+}
+
+void Database::replay(const string& key,
+                      const FileStorage storage,
+                      const bool tombstone,
+                      const uint64_t expiry)
+{
+    if (tombstone)
+    {
+        unindex(key, storage);
+        return;
+    }
+
+    // Works like a tombstone, the record itself is dead too
+    if (expiry != 0 && expiry <= current_time())
+    {
+        unindex(key, storage);
+        storage.file->dead_bytes +=
+            record_size(key.size(), storage.size, expiry);
+        return;
+    }
+    index(key, storage, expiry);
+}
+
+void Database::recover(File* file)
+{
+    const auto start = chrono::steady_clock::now();
+
+    struct stat file_stat;
+    if (fstat(file->fd, &file_stat) < 0)
+    {
+        throw "Could not stat file: " + file->filename;
+    }
+    file->size = file_stat.st_size;
+
+    if (options.disk_index && load_table(file))
+    {
+        cout << "Recovered " << to_string(file->table->size())
+             << " keys of the file: " << file->filename << " in "
+             << to_string(chrono::duration_cast<chrono::milliseconds>(
+                              chrono::steady_clock::now() - start)
+                              .count())
+             << " ms (key table)" << endl;
+        return;
+    }
+
+    const auto keys_before = stored.size();
+    auto offset = load_hint_file(file);
+    const bool from_hint = offset >= 0;
+    if (!from_hint)
+    {
+        offset = 0;
+    }
+    const auto scanned = scan(file, offset);
+
+    // The hint file must be rewritten if it does not cover the whole segment
+    file->hint_pending = scanned > 0 || !from_hint;
+
+    const auto elapsed = chrono::duration_cast<chrono::milliseconds>(
+                             chrono::steady_clock::now() - start)
+                             .count();
+    cout << "Recovered " << to_string((int64_t)(stored.size() - keys_before))
+         << " keys of the file: " << file->filename << " in "
+         << to_string(elapsed) << " ms ("
+         << (from_hint ? "hint file" : "full scan") << ", "
+         << to_string(scanned) << " records scanned)" << endl;
+}
+
+off_t Database::load_hint_file(File* file)
+{
+    const int32_t fd = open(file->hint_filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    vector<uint8_t> content;
+    struct stat hint_stat;
+    if (fstat(fd, &hint_stat) == 0)
+    {
+        content.resize(hint_stat.st_size);
+        SequentialReader reader(fd, 0);
+        if (!reader.read(content.data(), content.size()))
+        {
+            content.clear();
+        }
+    }
+    close(fd);
+
+    // [4-byte magic][8-byte covered size] and then, for every record:
+    // [4-byte key size][key][8-byte offset][4-byte size]([8-byte expiry])
+    // The key size has the same flags of the record, a tombstone has size 0
+    const uint64_t header_size = sizeof(HINT_FILE_MAGIC) + 8;
+    if (content.size() < header_size ||
+        memcmp(content.data(), HINT_FILE_MAGIC, sizeof(HINT_FILE_MAGIC)) != 0)
+    {
+        return -1;
+    }
+    const off_t covered = deserialize(content.data() + 4, 8);
+    if (covered > file->size)
+    {
+        cerr << "The hint file: " << file->hint_filename
+             << " covers more than the file has! Ignoring it ..." << endl;
+        return -1;
+    }
+
+    vector<Record> entries;
+    uint64_t position = header_size;
+    while (position < content.size())
+    {
+        if (content.size() - position < 4)
+        {
+            return -1;
+        }
+        Record entry;
+        const auto key_header = deserialize(content.data() + position, 4);
+        const auto key_size = key_header & ~RECORD_FLAGS;
+        entry.tombstone = key_header & TOMBSTONE_FLAG;
+        entry.compressed = key_header & COMPRESSED_FLAG;
+        const uint64_t expiry_size = key_header & EXPIRY_FLAG ? 8 : 0;
+        position += 4;
+        if (content.size() - position < key_size + 12 + expiry_size)
+        {
+            return -1;
+        }
+        entry.key.assign(content.begin() + position,
+                         content.begin() + position + key_size);
+        position += key_size;
+        entry.value_offset = deserialize(content.data() + position, 8);
+        const auto size = deserialize(content.data() + position + 8, 4);
+        entry.expiry =
+            expiry_size > 0 ? deserialize(content.data() + position + 12, 8)
+                            : 0;
+        position += 12 + expiry_size;
+        if (entry.value_offset + (off_t)size > covered ||
+            (!entry.tombstone && size < 4))
+        {
+            return -1;
+        }
+        entry.value_size = entry.tombstone ? 0 : size - 4;
+        entries.push_back(move(entry));
+    }
+
+    for (const auto& entry : entries)
+    {
+        replay(entry.key,
+               FileStorage{entry.value_size + 4u,
+                           entry.value_offset,
+                           file,
+                           entry.compressed},
+               entry.tombstone,
+               entry.expiry);
+    }
+    return covered;
+}
+
+uint64_t Database::scan(File* file, off_t offset)
+{
+    SequentialReader reader(file->fd, offset);
+    uint64_t records = 0;
+    Record record;
+    while (offset < file->size &&
+           read_record(reader, file->size, true, record))
+    {
+        if (record.unfinished)
+        {
+            file->dead_bytes += record.end() - record.offset;
+            offset = record.end();
+            continue;
+        }
+        replay(record.key,
+               FileStorage{record.value_size + 4u,
+                           record.value_offset,
+                           file,
+                           record.compressed},
+               record.tombstone,
+               record.expiry);
+        offset = record.end();
+        records++;
+    }
+
+    if (offset < file->size)
+    {
+        cerr << "The file: " << file->filename
+             << " has a torn or corrupted record at " << to_string(offset)
+             << "! Truncating it ..." << endl;
+        if (ftruncate(file->fd, offset) < 0)
+        {
+            perror("ftruncate: ");
+        }
+        file->size = offset;
+    }
+    return records;
+}
+
+void Database::write_hint_file(const File* file) const
+{
+    const auto temporary = file->hint_filename + ".tmp";
+    const int32_t fd =
+        open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, OPEN_FILE_MODE);
+    if (fd < 0)
+    {
+        cerr << "Could not create the hint file: " << temporary << endl;
+        return;
+    }
+
+    vector<uint8_t> buffer;
+    buffer.reserve(RECOVERY_BUFFER_SIZE);
+    buffer.insert(buffer.end(),
+                  HINT_FILE_MAGIC,
+                  HINT_FILE_MAGIC + sizeof(HINT_FILE_MAGIC));
+    serialize(buffer, file->size, 8);
+
+    /**
+     * Every record goes to the hint file, in the order they were appended.
+     * The recovery keeps the last one of every key
+     */
+    bool written = true;
+    SequentialReader reader(file->fd, 0);
+    Record record;
+    while (written && reader.position() < file->size &&
+           read_record(reader, file->size, false, record))
+    {
+        if (record.unfinished)
+        {
+            continue;
+        }
+        serialize_hint(buffer, record);
+        if (buffer.size() >= RECOVERY_BUFFER_SIZE)
+        {
+            written = write_all(fd, buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+    written = written && write_all(fd, buffer.data(), buffer.size()) &&
+              fsync(fd) == 0;
+    close(fd);
+
+    // Rename is atomic, a crash never leaves a half written hint file
+    if (!written || rename(temporary.c_str(), file->hint_filename.c_str()) < 0)
+    {
+        cerr << "Could not write the hint file: " << file->hint_filename
+             << endl;
+        unlink(temporary.c_str());
+    }
+}
+
+void Database::start_index_file(const shared_ptr<File>& segment,
+                                const bool table)
+{
+    const auto temporary =
+        (table ? segment->table_filename : segment->hint_filename) + ".tmp";
+    const int32_t fd =
+        open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, OPEN_FILE_MODE);
+    if (fd < 0)
+    {
+        cerr << "Could not create the file: " << temporary << endl;
+        segment->hint_pending = false;
+        return;
+    }
+    index_writing.reset(
+        new IndexWriting{segment, table, temporary, fd, 0, {}, 0, 0, {}, 0});
+
+    // The key table is encoded once every record was read
+    if (!table)
+    {
+        index_writing->buffer.assign(
+            HINT_FILE_MAGIC, HINT_FILE_MAGIC + sizeof(HINT_FILE_MAGIC));
+        serialize(index_writing->buffer, segment->size, 8);
+    }
+}
+
+uint64_t Database::write_index(const uint64_t budget)
+{
+    auto& writing = *index_writing;
+    const auto segment = writing.segment.get();
+
+    // The key table is in place, its keys leave the index a batch at a time
+    if (writing.fd < 0)
+    {
+        release(writing);
+        return 0;
+    }
+
+    uint64_t used = 0;
+    if (writing.position < segment->size)
+    {
+        /**
+         * Every record goes to the hint file, in the order they were
+         * appended, the recovery keeps the last one of every key. The key
+         * table keeps only the last one
+         */
+        SequentialReader reader(segment->fd, writing.position);
+        Record record;
+        while (used < budget && writing.position < segment->size)
+        {
+            // The rest of the segment is scanned by the recovery
+            if (!read_record(reader, segment->size, false, record))
+            {
+                writing.position = segment->size;
+                break;
+            }
+            if (!record.unfinished && writing.table)
+            {
+                writing.entries.push_back(TableEntry{
+                    record.key,
+                    record.tombstone
+                        ? (uint64_t)record.offset
+                        : record.value_offset |
+                              (record.compressed ? COMPRESSED_VALUE : 0),
+                    record.tombstone ? 0 : record.value_size + 4,
+                    record.expiry});
+            }
+            else if (!record.unfinished)
+            {
+                serialize_hint(writing.buffer, record);
+            }
+            used += record.end() - record.offset;
+            writing.position = record.end();
+        }
+    }
+    else if (writing.table && writing.written == 0 && writing.buffer.empty())
+    {
+        writing.buffer = KeyTable::encode(
+            writing.entries, segment->size, segment->dead_bytes);
+    }
+    else if (writing.buffer.empty())
+    {
+        // The writeback of the last bytes was started in the previous tick
+        finish_index_file();
+        return 0;
+    }
+
+    // The hint entries are a small part of what was read, the table is
+    // written under the budget
+    const uint64_t pending = writing.buffer.size() - writing.buffered;
+    const uint64_t size =
+        writing.table ? min(pending, budget - min(used, budget)) : pending;
+    if (size > 0 && ::pwrite(writing.fd,
+                              writing.buffer.data() + writing.buffered,
+                              size,
+                              writing.written) != (ssize_t)size)
+    {
+        cerr << "Could not write the file: " << writing.temporary_filename
+             << endl;
+        close(writing.fd);
+        unlink(writing.temporary_filename.c_str());
+        segment->hint_pending = false;
+        index_writing.reset();
+        return used;
+    }
+
+    // The writeback starts now, the fsync that finishes the file waits less
+    if (size > 0 &&
+        sync_file_range(
+            writing.fd, writing.written, size, SYNC_FILE_RANGE_WRITE) < 0)
+    {
+        perror("sync_file_range: ");
+    }
+    writing.written += size;
+    writing.buffered += size;
+    if (writing.buffered == writing.buffer.size())
+    {
+        writing.buffer.clear();
+        writing.buffered = 0;
+    }
+    return min(used + (writing.table ? size : 0), budget);
+}
+
+void Database::finish_index_file()
+{
+    auto& writing = *index_writing;
+    const auto segment = writing.segment;
+    const auto filename =
+        writing.table ? segment->table_filename : segment->hint_filename;
+    const bool written = fsync(writing.fd) == 0;
+    close(writing.fd);
+    writing.fd = -1;
+
+    // Rename is atomic, a crash never leaves a half written file
+    if (!written || rename(writing.temporary_filename.c_str(),
+                           filename.c_str()) < 0)
+    {
+        cerr << "Could not write the file: " << filename << endl;
+        unlink(writing.temporary_filename.c_str());
+        writing.entries.clear();
+    }
+    segment->hint_pending = false;
+
+    // It was read from the segment, that is dropped again
+    if (options.drop_behind)
+    {
+        segment->dropped = 0;
+    }
+    if (!writing.table || !(segment->table = KeyTable::open(filename)))
+    {
+        index_writing.reset();
+        return;
+    }
+    cout << "Wrote the key table: " << filename << " with "
+         << to_string(segment->table->size()) << " keys" << endl;
+}
+
+bool Database::load_table(File* file)
+{
+    auto table = KeyTable::open(file->table_filename);
+    if (!table)
+    {
+        return false;
+    }
+    if (table->covered() != (uint64_t)file->size)
+    {
+        cerr << "The key table: " << file->table_filename
+             << " does not cover the whole segment! Ignoring it ..." << endl;
+        return false;
+    }
+    file->dead_bytes = table->dead_bytes();
+    file->table = move(table);
+    file->hint_pending = false;
+    return true;
+}
+
+void Database::release(IndexWriting& writing)
+{
+    /**
+     * Only the keys of the table can point to its segment, the others are
+     * not visited. The index keeps the keys that were written since
+     */
+    const auto number = writing.segment->number;
+    const auto end =
+        min(writing.entries.size(), writing.released + RELEASE_BATCH);
+    for (; writing.released < end; writing.released++)
+    {
+        const auto& key = writing.entries[writing.released].key;
+        const auto entry = stored.find(key);
+        if (entry == nullptr || entry->file != number)
+        {
+            continue;
+        }
+
+        // The cache does not check the expiries of the key tables
+        if (entry->timer != 0)
+        {
+            expirations.cancel(entry->timer);
+            if (cache)
+            {
+                cache->invalidate(key);
+            }
+        }
+        stored.erase(key);
+    }
+    if (writing.released == writing.entries.size())
+    {
+        index_writing.reset();
+    }
+}
+
+void Database::write(const string& key,
+                     vector<uint8_t> data,
+                     const chrono::milliseconds ttl,
+                     const IOCallback done)
+{
+    const uint64_t expiry = ttl.count() > 0 ? current_time() + ttl.count() : 0;
+    append_record(key, move(data), false, expiry, done);
+}
+
+bool Database::remove(const string& key, const IOCallback done)
+{
+    // The last append in flight decides if the key exists when it completes
+    const auto pending = latest_operations.find(key);
+    FileStorage storage;
+    const bool exists = pending == latest_operations.end()
+                            ? live(key, storage)
+                            : !operations[pending->second].tombstone;
+    if (!exists)
+    {
+        return false;
+    }
+    append_record(key, {}, true, 0, done);
+    return true;
+}
+
+void Database::append_record(const string& key,
+                             vector<uint8_t> data,
+                             const bool tombstone,
+                             const uint64_t expiry,
+                             const IOCallback done)
+{
+    auto& partition = partitions[partition_of(key)];
+    auto file = partition.segments.back().get();
+
+    // The value being received is older than this one
+    receiving.erase(key);
+
+    /**
+     * The compressed value keeps its original size, so the reads know how
+     * much it takes decompressed. It is only kept if it is smaller
+     */
+    bool compressed = false;
+    if (!tombstone && options.compression_threshold > 0 &&
+        data.size() > options.compression_threshold)
+    {
+        vector<uint8_t> packed;
+        serialize(packed, data.size(), 4);
+        lz4_compress(data.data(), data.size(), packed);
+        if (packed.size() < data.size())
+        {
+            data = move(packed);
+            compressed = true;
+        }
+    }
+    const uint32_t flags = (tombstone ? TOMBSTONE_FLAG : 0) |
+                           (compressed ? COMPRESSED_FLAG : 0);
+
+    // A record is never split between segments
+    const uint64_t total_size =
+        tombstone ? sizeof(uint32_t) + key.size() + CHECKSUM_SIZE
+                  : record_size(key.size(), data.size() + 4, expiry);
+    if (file->size > 0 && file->size + total_size > options.segment_size)
+    {
+        file = roll(partition);
+    }
+
+    // The records are always appended, so the tail is the segment size
+    const auto current_file_size = file->size;
+
+    // Constructs the storage, it starts at the value size, after the expiry
+    // and the checksum
+    FileStorage storage{data.size() + sizeof(uint32_t),
+                        current_file_size + 4 + (off_t)key.size() +
+                            (expiry != 0 ? 8 : 0) + (off_t)CHECKSUM_SIZE,
+        file,
+        compressed};
+
+    if (!ring)
+    {
+        if (!append(file, key, data, flags, expiry, current_file_size))
+        {
+            done(false);
+            return;
+        }
+        appended(partition, key, storage, tombstone, expiry, total_size, done);
+        return;
+    }
+
+    const auto id = start_operation(
+        partition, key, storage, tombstone, expiry, total_size, done);
+    auto& operation = operations[id];
+    operation.value = move(data);
+    operation.parts_count = record_parts(operation.key,
+                                         operation.value,
+                                         flags,
+                                         expiry,
+                                         operation.headers,
+                                         operation.parts);
+    submit_append(id, operation);
+}
+
+bool Database::begin_upload(const string& key,
+                            const uint64_t size,
+                            Upload& upload)
+{
+    auto& partition = partitions[partition_of(key)];
+    auto file = partition.segments.back().get();
+    const uint64_t total_size = record_size(key.size(), size + 4, 0);
+    if (file->size > 0 && file->size + total_size > options.segment_size)
+    {
+        file = roll(partition);
+    }
+    upload.key = key;
+    upload.offset = file->size;
+    upload.storage = FileStorage{size + sizeof(uint32_t),
+                                 upload.offset + 4 + (off_t)key.size() +
+                                     (off_t)CHECKSUM_SIZE,
+                                 file};
+
+    /**
+     * The headers are written first, so the records appended after it, while
+     * the value arrives, can be found: the recovery skips this one by its
+     * value size
+     */
+    uint8_t headers[20];
+    struct iovec parts[3];
+    const auto checksum = value_size_checksum(
+        size, headers_checksum(key, key.size() | UNFINISHED_FLAGS, 0));
+    const auto count = header_parts(
+        key, size, UNFINISHED_FLAGS, 0, checksum, headers, parts);
+    if (!write_all(file->fd, parts, count, upload.offset))
+    {
+        return false;
+    }
+    take_space(partition, file, total_size);
+    upload.id = next_upload++;
+    receiving[key] = upload.id;
+    return true;
+}
+
+void Database::finish_upload(const Upload& upload,
+                             const bool received,
+                             const IOCallback done)
+{
+    const auto& key = upload.key;
+    const auto file = upload.storage.file;
+    const auto size = upload.storage.size - 4;
+    const auto receiver = receiving.find(key);
+    const bool latest =
+        receiver != receiving.end() && receiver->second == upload.id;
+    bool whole = received;
+    if (latest)
+    {
+        receiving.erase(receiver);
+    }
+
+    // The checksum is computed from the page cache, through the mapping
+    // when the segment is mapped
+    auto checksum = value_size_checksum(
+        size, headers_checksum(key, key.size(), 0));
+    const auto mapped = file->at(upload.storage.offset + 4, size);
+    if (whole && mapped != nullptr)
+    {
+        checksum = crc32c(mapped, size, checksum);
+    }
+    else if (whole)
+    {
+        SequentialReader reader(file->fd, upload.storage.offset + 4);
+        if (!reader.checksum(size, checksum))
+        {
+            cerr << "The value of the key: " << key
+                 << " could not be read back!" << endl;
+            whole = false;
+        }
+    }
+
+    // The record stays unfinished, the compaction drops it
+    if (!whole)
+    {
+        file->in_flight--;
+        file->dead_bytes += record_size(key.size(), upload.storage.size, 0);
+        done(false);
+        return;
+    }
+
+    if (!ring)
+    {
+        uint8_t headers[20];
+        struct iovec parts[3];
+        const auto count =
+            header_parts(key, size, 0, 0, checksum, headers, parts);
+        file->in_flight--;
+        if (!write_all(file->fd, parts, count, upload.offset))
+        {
+            file->dead_bytes +=
+                record_size(key.size(), upload.storage.size, 0);
+            done(false);
+            return;
+        }
+        if (options.verbose)
+        {
+            cout << "Write content of the key: " << key
+                 << " at file: " << file->filename << endl;
+        }
+        file->dirty = true;
+        if (latest)
+        {
+            index(key, upload.storage, 0);
+        }
+        else
+        {
+            file->dead_bytes +=
+                record_size(key.size(), upload.storage.size, 0);
+        }
+        done(options.durability != Durability::ALWAYS || sync());
+        return;
+    }
+
+    // Only the headers are left to be written
+    const auto id = create_operation(
+        key, upload.storage, false, 0, upload.offset, latest, done);
+    auto& operation = operations[id];
+    operation.parts_count = header_parts(operation.key,
+                                         size,
+                                         0,
+                                         0,
+                                         checksum,
+                                         operation.headers,
+                                         operation.parts);
+    submit_append(id, operation);
+}
+
+void Database::appended(Partition& partition,
+                        const string& key,
+                        const FileStorage storage,
+                        const bool tombstone,
+                        const uint64_t expiry,
+                        const uint64_t total_size,
+                        const IOCallback done)
+{
+    const auto file = storage.file;
+    file->size += total_size;
+    file->dirty = true;
+    partition.writes++;
+    partition.written_bytes += total_size;
+
+    // Add to our database, replacing the previous value if any
+    if (tombstone)
+    {
+        unindex(key, storage);
+    }
+    else
+    {
+        index(key, storage, expiry);
+    }
+    done(options.durability != Durability::ALWAYS || sync());
+}
+
+uint64_t Database::start_operation(Partition& partition,
+                                   const string& key,
+                                   const FileStorage storage,
+                                   const bool tombstone,
+                                   const uint64_t expiry,
+                                   const uint64_t total_size,
+                                   const IOCallback done)
+{
+    /**
+     * The space is taken right away, so the next appends do not wait for
+     * this one. The key is indexed when it completes
+     */
+    const auto offset = take_space(partition, storage.file, total_size);
+    return create_operation(
+        key, storage, tombstone, expiry, offset, true, done);
+}
+
+off_t Database::take_space(Partition& partition,
+                           File* file,
+                           const uint64_t total_size)
+{
+    const auto offset = file->size;
+    file->size += total_size;
+    file->in_flight++;
+    partition.writes++;
+    partition.written_bytes += total_size;
+    return offset;
+}
+
+uint64_t Database::create_operation(const string& key,
+                                    const FileStorage storage,
+                                    const bool tombstone,
+                                    const uint64_t expiry,
+                                    const off_t offset,
+                                    const bool latest,
+                                    const IOCallback done)
+{
+    const auto id = next_operation++;
+    if (latest)
+    {
+        latest_operations[key] = id;
+    }
+    auto& operation = operations[id];
+    if (storage.file != nullptr)
+    {
+        storage.file->appending[offset] = id;
+    }
+    operation.key = key;
+    operation.value.clear();
+    operation.tombstone = tombstone;
+    operation.expiry = expiry;
+    operation.storage = storage;
+    operation.first_part = 0;
+    operation.offset = offset;
+    operation.remaining = 0;
+    operation.success = true;
+    operation.done = done;
+    return id;
+}
+
+bool Database::append(File* file,
+                      const string& key,
+                      const vector<uint8_t>& data,
+                      const uint32_t flags,
+                      const uint64_t expiry,
+                      const off_t offset)
+{
+    /**
+     * The headers, the key and the value are written with just one system
+     * call, straight from where they are, without copying them to a buffer
+     * https://man7.org/linux/man-pages/man2/pwritev.2.html
+     */
+    uint8_t headers[20];
+    struct iovec parts[4];
+    const auto count = record_parts(key, data, flags, expiry, headers, parts);
+    if (!write_all(file->fd, parts, count, offset))
+    {
+        return false;
+    }
+
+    if (options.verbose)
+    {
+        cout << (flags & TOMBSTONE_FLAG ? "Delete the key: "
+                                        : "Write content of the key: ")
+             << key << " at file: " << file->filename << endl;
+    }
+    return true;
+}
+
+void Database::submit_append(const uint64_t id, Operation& operation)
+{
+    /**
+     * With the ALWAYS durability, the flush is linked to the write, so it
+     * only starts after the write completes
+     */
+    const bool flush = options.durability == Durability::ALWAYS;
+    ring->writev(operation.storage.file->fd,
+                 operation.parts + operation.first_part,
+                 operation.parts_count - operation.first_part,
+                 operation.offset,
+                 id << 1,
+                 flush);
+    operation.remaining++;
+    if (flush)
+    {
+        ring->fdatasync(operation.storage.file->fd, id << 1 | FLUSH_OPERATION);
+        operation.remaining++;
+    }
+}
+
+void Database::completed(const uint64_t user_data, const int32_t result)
+{
+    const auto found = operations.find(user_data >> 1);
+    if (found == operations.end())
+    {
+        cerr << "Unknown io_uring completion: " << to_string(user_data)
+             << endl;
+        return;
+    }
+    auto& operation = found->second;
+    operation.remaining--;
+
+    if (user_data & FLUSH_OPERATION)
+    {
+        // A linked flush is canceled if its write failed or was short
+        if (result < 0 && result != -ECANCELED)
+        {
+            errno = -result;
+            perror("fdatasync: ");
+            operation.success = false;
+        }
+    }
+    else if (result < 0)
+    {
+        errno = -result;
+        perror("pwritev: ");
+        operation.success = false;
+    }
+    else
+    {
+        // A short write, submits what is left
+        auto parts = operation.parts + operation.first_part;
+        auto count = operation.parts_count - operation.first_part;
+        skip_written(parts, count, result);
+        operation.first_part = operation.parts_count - count;
+        operation.offset += result;
+        if (count > 0)
+        {
+            submit_append(found->first, operation);
+        }
+    }
+
+    if (operation.remaining > 0)
+    {
+        return;
+    }
+
+    const auto file = operation.storage.file;
+    if (file != nullptr)
+    {
+        file->in_flight--;
+        if (!operation.success)
+        {
+            cerr << "Could not write the key: " << operation.key
+                 << " at file: " << file->filename << endl;
+        }
+        else
+        {
+            file->dirty = options.durability != Durability::ALWAYS;
+            if (options.verbose)
+            {
+                cout << (operation.tombstone ? "Delete the key: "
+                                             : "Write content of the key: ")
+                     << operation.key << " at file: " << file->filename
+                     << endl;
+            }
+        }
+
+        /**
+         * The appends of the same key can complete out of order, the one
+         * submitted last is always the newest
+         */
+        const auto latest = latest_operations.find(operation.key);
+        const bool newest = latest != latest_operations.end() &&
+                            latest->second == found->first;
+        if (newest)
+        {
+            latest_operations.erase(latest);
+        }
+        if (operation.success && newest && operation.tombstone)
+        {
+            unindex(operation.key, operation.storage);
+        }
+        else if (operation.success && newest)
+        {
+            index(operation.key, operation.storage, operation.expiry);
+        }
+        else if (operation.success && !operation.tombstone)
+        {
+            file->dead_bytes += record_size(
+                operation.key.size(), operation.storage.size, operation.expiry);
+        }
+        acknowledge_appends(file);
+        return;
+    }
+
+    const auto done = move(operation.done);
+    const auto success = operation.success;
+    operations.erase(found);
+    done(success);
+}
+
+void Database::acknowledge_appends(File* file)
+{
+    /**
+     * A record is readable once it completed, but it is not acknowledged
+     * while one before it can still be a hole: the recovery would drop it
+     * with the rest of the segment. With the ALWAYS durability, the flush of
+     * every append before it completed too, so it is on the disk
+     */
+    while (!file->appending.empty())
+    {
+        const auto first = file->appending.begin();
+        const auto found = operations.find(first->second);
+        if (found != operations.end() && found->second.remaining > 0)
+        {
+            return;
+        }
+        file->appending.erase(first);
+        if (found == operations.end())
+        {
+            continue;
+        }
+        const auto done = move(found->second.done);
+        const auto success = found->second.success;
+        operations.erase(found);
+        done(success);
+    }
+}
+
+bool Database::sync()
+{
+    bool success = true;
+    for (const auto& partition : partitions)
+    {
+        for (const auto& segment : partition.segments)
+        {
+            if (!segment->dirty)
+            {
+                continue;
+            }
+            /**
+             * Only the data and the size are flushed, the other metadata
+             * (like the modification time) is not needed to read it back
+             */
+            if (fdatasync(segment->fd) < 0)
+            {
+                perror("fdatasync: ");
+                success = false;
+                continue;
+            }
+            segment->dirty = false;
+        }
+    }
+    last_sync = chrono::steady_clock::now();
+    return success;
+}
+
+void Database::sync(const IOCallback done)
+{
+    if (!ring)
+    {
+        done(sync());
+        return;
+    }
+
+    const auto id = next_operation++;
+    auto& operation = operations[id];
+    operation.storage.file = nullptr;
+    operation.remaining = 0;
+    operation.success = true;
+    operation.done = done;
+    for (const auto& partition : partitions)
+    {
+        for (const auto& segment : partition.segments)
+        {
+            if (!segment->dirty)
+            {
+                continue;
+            }
+            ring->fdatasync(segment->fd, id << 1 | FLUSH_OPERATION);
+            operation.remaining++;
+            segment->dirty = false;
+        }
+    }
+    last_sync = chrono::steady_clock::now();
+    if (operation.remaining == 0)
+    {
+        operations.erase(id);
+        done(true);
+        return;
+    }
+
+    /**
+     * Submitted right away, the kernel holds the files from then on. The
+     * compaction of this tick could close a segment before the next submit
+     */
+    ring->submit();
+}
+
+bool Database::create_snapshot(const string& name)
+{
+    const auto& data_directories = options.data_directories;
+    vector<string> directories;
+    for (const auto& data_directory : data_directories)
+    {
+        const auto directory = data_directory + "/" + SNAPSHOT_PREFIX + name;
+        if (mkdir(directory.c_str(), S_IRWXU) < 0)
+        {
+            perror("mkdir: ");
+            for (const auto& created : directories)
+            {
+                rmdir(created.c_str());
+            }
+            return false;
+        }
+        directories.push_back(directory);
+    }
+    return true;
+}
+
+void Database::snapshot(const string& name, const SnapshotCallback done)
+{
+    PendingSnapshot pending{name, {}, {}, 0, true, done};
+    pending.manifests.resize(options.data_directories.size());
+    for (auto& partition : partitions)
+    {
+        /**
+         * The active segment is sealed, so the writes after the snapshot go
+         * to a new one and every linked segment is immutable: the compaction
+         * renames a new file over it, and the snapshot keeps the old one
+         */
+        if (partition.segments.back()->size > 0)
+        {
+            roll(partition);
+        }
+        const auto number = partition.number % options.data_directories.size();
+        for (const auto& segment : partition.segments)
+        {
+            if (segment->size > 0)
+            {
+                pending.segments.emplace_back(number, segment);
+            }
+        }
+    }
+    pending_snapshots.push_back(move(pending));
+    link_snapshots();
+}
+
+void Database::link_snapshots()
+{
+    /**
+     * A sealed segment is linked once the appends and the uploads into it
+     * completed: they are still written through the same file, an upload
+     * would make its record live in the snapshot. It can not be compacted
+     * meanwhile, and this runs before the next compaction starts
+     */
+    for (auto pending = pending_snapshots.begin();
+         pending != pending_snapshots.end();)
+    {
+        auto& segments = pending->segments;
+        for (auto waiting = segments.begin(); waiting != segments.end();)
+        {
+            const auto& segment = waiting->second;
+            if (segment->in_flight > 0)
+            {
+                waiting++;
+                continue;
+            }
+            const auto directory = options.data_directories[waiting->first] +
+                                   "/" + SNAPSHOT_PREFIX + pending->name;
+            auto& manifest = pending->manifests[waiting->first];
+            pending->linked =
+                pending->linked &&
+                link_file(segment->filename, directory, false, manifest) &&
+                link_file(segment->hint_filename, directory, true, manifest) &&
+                copy_file(segment->table_filename, directory, true, manifest);
+            pending->bytes += segment->size;
+            waiting = segments.erase(waiting);
+        }
+        if (!segments.empty())
+        {
+            pending++;
+            continue;
+        }
+
+        const auto done = pending->done;
+        const auto manifests = move(pending->manifests);
+        const auto bytes = pending->bytes;
+        const bool linked = pending->linked;
+        pending = pending_snapshots.erase(pending);
+        if (!linked)
+        {
+            done(false, manifests, bytes);
+            continue;
+        }
+        sync([manifests, bytes, done](const bool flushed) {
+            done(flushed, manifests, bytes);
+        });
+    }
+}
+
+bool Database::finish_snapshot(const string& name,
+                               const vector<string>& manifests,
+                               const uint64_t bytes,
+                               const chrono::steady_clock::time_point start)
+{
+    // The manifests are written last, a snapshot without them is incomplete
+    const auto& data_directories = options.data_directories;
+    for (size_t number = 0; number < data_directories.size(); number++)
+    {
+        const auto& data_directory = data_directories[number];
+        const auto directory = data_directory + "/" + SNAPSHOT_PREFIX + name;
+        string manifest = LAYOUT_HASH + " " + to_string(options.partitions) +
+                          " " + LAYOUT_RECORDS + "\n";
+        if (!link_file(data_directory + "/" + LAYOUT_FILENAME,
+                       directory,
+                       false,
+                       manifest) ||
+            !write_manifest(directory, manifest + manifests[number]))
+        {
+            return false;
+        }
+    }
+    cout << "Snapshot: " << name << " of " << to_string(bytes) << " bytes in "
+         << to_string(chrono::duration_cast<chrono::microseconds>(
+                          chrono::steady_clock::now() - start)
+                          .count())
+         << " us" << endl;
+    return true;
+}
+
+int32_t Database::completion_descriptor() const
+{
+    return ring ? ring->notification_descriptor() : -1;
+}
+
+void Database::submit()
+{
+    if (ring)
+    {
+        ring->submit();
+    }
+}
+
+void Database::complete()
+{
+    if (!ring)
+    {
+        return;
+    }
+    ring->complete(
+        [this](const uint64_t user_data, const int32_t result) {
+            completed(user_data, result);
+        },
+        false);
+    link_snapshots();
+
+    // The short writes, and the flushes of the snapshots, are submitted
+    ring->submit();
+}
+
+void Database::wait()
+{
+    while (ring && !operations.empty())
+    {
+        ring->submit();
+        ring->complete(
+            [this](const uint64_t user_data, const int32_t result) {
+                completed(user_data, result);
+            },
+            true);
+        link_snapshots();
+    }
+}
+
+bool Database::writing(const string& key) const
+{
+    return latest_operations.count(key) > 0;
+}
+
+uint64_t Database::started_operations() const
+{
+    return next_operation;
+}
+
+bool Database::writing_before(const uint64_t operation) const
+{
+    for (const auto& pending : operations)
+    {
+        if (pending.first < operation)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+FileStorage Database::read(const string& key)
+{
+    partitions[partition_of(key)].reads++;
+    FileStorage storage;
+    if (!live(key, storage))
+    {
+        return FileStorage{0, 0, nullptr};
+    }
+    return storage;
+}
+
+const vector<uint8_t>* Database::cached(const string& key)
+{
+    if (!cache || expired(key))
+    {
+        return nullptr;
+    }
+    auto value = cache->get(key);
+    if (value == nullptr)
+    {
+        /**
+         * Only the expiries of the keys in memory are checked before the
+         * cache, so the values of the key tables with an expiry are never
+         * cached
+         */
+        FileStorage storage;
+        if (!live(key, storage) ||
+            storage.size > options.small_value_size + 4 ||
+            (storage.expiry != 0 && stored.find(key) == nullptr))
+        {
+            return nullptr;
+        }
+
+        vector<uint8_t> content;
+        if (!load(key, storage, content))
+        {
+            return nullptr;
+        }
+        value = cache->put(key, move(content));
+        if (value == nullptr)
+        {
+            return nullptr;
+        }
+    }
+    partitions[partition_of(key)].reads++;
+    return value;
+}
+
+bool Database::scan(const string& from,
+                    const string& to,
+                    const uint32_t limit,
+                    vector<pair<string, FileStorage>>& found,
+                    string& cursor)
+{
+    cursor.clear();
+    const auto now = current_time();
+    return stored.scan(
+        from, to, [&](const string& key, const IndexEntry& entry) {
+            // The expired keys are removed by the maintenance, not while the
+            // tree is being walked
+            const auto storage = storage_of(entry);
+            if (storage.expiry != 0 && storage.expiry <= now)
+            {
+                return true;
+            }
+            if (found.size() == limit)
+            {
+                cursor = key;
+                return false;
+            }
+            found.push_back(make_pair(key, storage));
+            return true;
+        });
+}
+
+bool Database::load(const string& key,
+                    const FileStorage& storage,
+                    vector<uint8_t>& output) const
+{
+    if (storage.compressed)
+    {
+        // [4-byte stored size][4-byte value size][LZ4 block]
+        vector<uint8_t> stored_value;
+        if (!load_stored(key, storage, stored_value) ||
+            stored_value.size() < 8)
+        {
+            return false;
+        }
+        const auto size = deserialize(stored_value.data() + 4, 4);
+        serialize(output, size, 4);
+        if (!lz4_decompress(stored_value.data() + 8,
+                            stored_value.size() - 8,
+                            size,
+                            output))
+        {
+            cerr << "The value at: " << to_string(storage.offset)
+                 << " of the file: " << storage.file->filename
+                 << " could not be decompressed!" << endl;
+            output.resize(output.size() - 4);
+            return false;
+        }
+        return true;
+    }
+    return load_stored(key, storage, output);
+}
+
+bool Database::verify(const string& key,
+                      const FileStorage& storage,
+                      const uint32_t checksum,
+                      const uint8_t* stored) const
+{
+    // The headers are not read, they are known from the index
+    const uint32_t key_size = key.size() |
+                              (storage.expiry != 0 ? EXPIRY_FLAG : 0) |
+                              (storage.compressed ? COMPRESSED_FLAG : 0);
+    if (crc32c(stored,
+               storage.size,
+               headers_checksum(key, key_size, storage.expiry)) == checksum)
+    {
+        return true;
+    }
+    cerr << "The record of the key: " << key << " at the file: "
+         << storage.file->filename << " does not match its checksum!" << endl;
+    return false;
+}
+
+bool Database::load_stored(const string& key,
+                           const FileStorage& storage,
+                           vector<uint8_t>& output) const
+{
+    // The checksum is right before the value size
+    const auto start = output.size();
+    output.resize(start + storage.size);
+    uint8_t checksum[CHECKSUM_SIZE];
+    const auto mapped = storage.file->at(storage.offset - CHECKSUM_SIZE,
+                                         CHECKSUM_SIZE + storage.size);
+    if (mapped != nullptr)
+    {
+        copy(mapped, mapped + CHECKSUM_SIZE, checksum);
+        copy(mapped + CHECKSUM_SIZE,
+             mapped + CHECKSUM_SIZE + storage.size,
+             output.begin() + start);
+    }
+    else
+    {
+        const struct iovec parts[2] = {
+            {checksum, CHECKSUM_SIZE},
+            {output.data() + start, storage.size},
+        };
+        if (::preadv(storage.file->fd,
+                     parts,
+                     2,
+                     storage.offset - CHECKSUM_SIZE) !=
+            (ssize_t)(CHECKSUM_SIZE + storage.size))
+        {
+            perror("preadv: ");
+            output.resize(start);
+            return false;
+        }
+    }
+    if (!verify(key,
+                storage,
+                deserialize(checksum, CHECKSUM_SIZE),
+                output.data() + start))
+    {
+        output.resize(start);
+        return false;
+    }
+    return true;
+}
+
+uint16_t Database::partition_of(const string& key) const
+{
+    return easykey::hash(key) % options.partitions / options.shards;
+}
+
+uint16_t Database::shard_of(const string& key) const
+{
+    return easykey::hash(key) % options.partitions % options.shards;
+}
+
+void Database::report(ostream& output) const
+{
+    output << "Partition | Segments | Bytes | Dead bytes | Writes | "
+              "Written bytes | Reads"
+           << endl;
+    for (const auto& partition : partitions)
+    {
+        uint64_t bytes = 0;
+        uint64_t dead_bytes = 0;
+        for (const auto& segment : partition.segments)
+        {
+            bytes += segment->size;
+            dead_bytes += segment->dead_bytes;
+        }
+        output << to_string(partition.number) << " | "
+               << to_string(partition.segments.size()) << " | "
+               << to_string(bytes) << " | " << to_string(dead_bytes) << " | "
+               << to_string(partition.writes) << " | "
+               << to_string(partition.written_bytes) << " | "
+               << to_string(partition.reads) << endl;
+    }
+    output << "Indexed keys | Index bytes | Timers" << endl;
+    output << to_string(stored.size()) << " | " << to_string(stored.memory())
+           << " | " << to_string(expirations.size()) << endl;
+    if (options.disk_index)
+    {
+        uint64_t tables = 0;
+        uint64_t keys = 0;
+        uint64_t memory = 0;
+        for (const auto& partition : partitions)
+        {
+            for (const auto& segment : partition.segments)
+            {
+                if (segment->table)
+                {
+                    tables++;
+                    keys += segment->table->size();
+                    memory += segment->table->memory();
+                }
+            }
+        }
+        output << "Key tables | Table keys | Table memory bytes" << endl;
+        output << to_string(tables) << " | " << to_string(keys) << " | "
+               << to_string(memory) << endl;
+    }
+    if (cache)
+    {
+        cache->report(output);
+    }
+}
+
+bool Database::maintenance()
+{
+    const auto now = chrono::steady_clock::now();
+    const auto elapsed =
+        chrono::duration_cast<chrono::microseconds>(now - last_maintenance)
+            .count();
+    last_maintenance = now;
+
+    // Before a compaction can start on a segment that a snapshot still links
+    link_snapshots();
+
+    // Never accumulates more than one second of reads
+    compaction_allowance =
+        min(options.compaction_rate,
+            compaction_allowance + options.compaction_rate * elapsed / 1000000);
+
+    if (options.durability == Durability::INTERVAL &&
+        now - last_sync >= options.sync_interval)
+    {
+        sync([](bool) {});
+    }
+
+    vector<uint32_t> timers;
+    const bool expiring =
+        expirations.advance(current_time(), EXPIRATION_BATCH, timers);
+    string key;
+    for (const auto timer : timers)
+    {
+        // A rewrite replaces the timer, so its key still expires now
+        const auto entry =
+            stored.find_timer(expirations.timer(timer).hash, timer, key);
+        if (entry == nullptr)
+        {
+            expirations.cancel(timer);
+            continue;
+        }
+        unindex(key, storage_of(*entry));
+    }
+
+    // The segments with appends in flight can still have holes
+    bool dropping = false;
+    if (options.drop_behind)
+    {
+        for (const auto& partition : partitions)
+        {
+            for (const auto& segment : partition.segments)
+            {
+                if (segment->dropped < segment->size &&
+                    segment->in_flight == 0)
+                {
+                    dropping |= drop_behind(
+                        segment.get(), segment != partition.segments.back());
+                }
+            }
+        }
+    }
+
+    /**
+     * The hint files and the key tables are written from the segments, so
+     * they share the compaction budget.
+     * With the disk index, the immutable segments get a key table instead of
+     * a hint file. Not the one being compacted, its keys are moving, and its
+     * hint file is replaced by the one of the compacted segment
+     */
+    for (const auto& partition : partitions)
+    {
+        for (const auto& segment : partition.segments)
+        {
+            if (index_writing)
+            {
+                break;
+            }
+            const bool compacting = compaction && compaction->source == segment;
+            const bool table_pending = options.disk_index && !segment->table &&
+                                       segment != partition.segments.back() &&
+                                       !compacting;
+            if ((!segment->hint_pending && !table_pending) ||
+                segment->in_flight > 0 || compacting)
+            {
+                continue;
+            }
+            if (compaction_allowance == 0)
+            {
+                return true;
+            }
+            start_index_file(segment, table_pending);
+        }
+    }
+
+    // The file is written over several ticks, before any compaction
+    if (index_writing)
+    {
+        compaction_allowance -= write_index(compaction_allowance);
+        if (index_writing || compaction_allowance == 0)
+        {
+            return true;
+        }
+    }
+
+    if (!compaction)
+    {
+        start_compaction();
+    }
+    if (!compaction)
+    {
+        return expiring || dropping;
+    }
+    compaction_allowance -= compact(compaction_allowance);
+    return true;
+}
+
+chrono::milliseconds Database::next_expiry() const
+{
+    const auto next = expirations.next_expiry(current_time());
+    return next >= (uint64_t)chrono::milliseconds::max().count()
+               ? chrono::milliseconds::max()
+               : chrono::milliseconds(next);
+}
+
+void Database::start_compaction()
+{
+    Partition* chosen_partition = nullptr;
+    shared_ptr<File> chosen;
+    for (auto& partition : partitions)
+    {
+        // The active segment is never compacted
+        for (uint64_t index = 0; index + 1 < partition.segments.size(); index++)
+        {
+            const auto& segment = partition.segments[index];
+            if (segment->dead_bytes * 100 <
+                    (uint64_t)segment->size * options.compaction_threshold ||
+                segment->size == 0 || segment->in_flight > 0 ||
+                (index_writing && index_writing->segment == segment))
+            {
+                continue;
+            }
+            if (!chosen || segment->dead_bytes * chosen->size >
+                               chosen->dead_bytes * segment->size)
+            {
+                chosen_partition = &partition;
+                chosen = segment;
+            }
+        }
+    }
+    if (!chosen)
+    {
+        return;
+    }
+
+    const auto temporary = chosen->filename + ".compact";
+    const int32_t fd =
+        open(temporary.c_str(), OPEN_FILE_FLAGS | O_TRUNC, OPEN_FILE_MODE);
+    if (fd < 0)
+    {
+        cerr << "Could not create the compaction file: " << temporary << endl;
+        return;
+    }
+    cout << "Compacting the segment: " << chosen->filename << " with "
+         << to_string(chosen->dead_bytes) << " dead bytes of "
+         << to_string(chosen->size) << endl;
+
+    auto destination = create_file(fd,
+                                   chosen->filename,
+                                   chosen->hint_filename,
+                                   chosen->table_filename,
+                                   chosen->id);
+
+    // The live records never take more than the whole segment
+    if (options.small_value_size > 0)
+    {
+        destination->map(chosen->size);
+    }
+    compaction.reset(new Compaction{
+        chosen_partition, chosen, destination, temporary, 0, {}, {}, 0});
+}
+
+uint64_t Database::compact(const uint64_t budget)
+{
+    const auto source = compaction->source.get();
+    const auto destination = compaction->destination.get();
+
+    // The writeback of the last records was started in the previous tick
+    if (compaction->position >= source->size)
+    {
+        finish_compaction();
+        return 0;
+    }
+
+    uint64_t bytes_read = 0;
+    SequentialReader reader(source->fd, compaction->position);
+    Record record;
+    const auto now = current_time();
+    const bool oldest =
+        compaction->partition->segments.front() == compaction->source;
+    while (bytes_read < budget && compaction->position < source->size)
+    {
+        if (!read_record(reader, source->size, false, record))
+        {
+            cerr << "The segment: " << source->filename
+                 << " has an invalid record at "
+                 << to_string(compaction->position) << "!" << endl;
+            abort_compaction();
+            return bytes_read;
+        }
+
+        /**
+         * Only the record that the index points to is still alive.
+         * The index does not know which older segments have a record of a
+         * deleted key, so its tombstone is kept while the key stays deleted,
+         * in every segment but the oldest one, that has nothing to hide. It
+         * can outlive the records it hides.
+         * An expired record is replaced by a tombstone by the same rule
+         */
+        FileStorage latest_record;
+        const bool exists = latest(record.key, latest_record);
+        const bool expired = record.expiry != 0 && record.expiry <= now;
+        const bool hides =
+            (record.tombstone || expired) && !exists && !oldest;
+        const bool live = record.tombstone
+                              ? hides
+                              : exists && latest_record.file == source &&
+                                    latest_record.offset == record.value_offset;
+
+        // A source with a key table is replaced by a destination with one
+        const bool tabled = (bool)source->table;
+        if (!live && hides)
+        {
+            uint8_t headers[20];
+            struct iovec parts[4];
+            const auto count =
+                record_parts(record.key, {}, TOMBSTONE_FLAG, 0, headers, parts);
+            if (!write_all(destination->fd, parts, count, destination->size))
+            {
+                cerr << "Could not write the tombstone of the key: "
+                     << record.key << " to: " << compaction->temporary_filename
+                     << endl;
+                abort_compaction();
+                return bytes_read;
+            }
+            if (tabled)
+            {
+                compaction->entries.push_back(
+                    TableEntry{record.key, (uint64_t)destination->size, 0, 0});
+            }
+            destination->size += 4 + record.key.size() + CHECKSUM_SIZE;
+        }
+        const auto size = record.end() - record.offset;
+        if (live && !copy_range(source->fd,
+                                record.offset,
+                                destination->fd,
+                                destination->size,
+                                size))
+        {
+            cerr << "Could not copy the record of the key: " << record.key
+                 << " to: " << compaction->temporary_filename << endl;
+            abort_compaction();
+            return bytes_read;
+        }
+        const auto value_offset =
+            destination->size + (record.value_offset - record.offset);
+        const auto entry = live ? stored.find(record.key) : nullptr;
+        if (entry != nullptr && !record.tombstone)
+        {
+            /**
+             * The destination is already a complete file for the records it
+             * has, so the reads can use it right away. The keys of a key
+             * table keep reading the source until it is replaced
+             */
+            point(*entry,
+                  FileStorage{record.value_size + 4u,
+                              value_offset,
+                              destination,
+                              record.compressed});
+            compaction->moved.push_back(record.offset);
+        }
+        if (live && tabled)
+        {
+            compaction->entries.push_back(TableEntry{
+                record.key,
+                record.tombstone
+                    ? (uint64_t)destination->size
+                    : value_offset | (record.compressed ? COMPRESSED_VALUE : 0),
+                record.tombstone ? 0 : record.value_size + 4,
+                record.expiry});
+        }
+        if (live)
+        {
+            destination->size += size;
+        }
+        bytes_read += record.end() - record.offset;
+        compaction->position = record.end();
+    }
+
+    // The writeback starts now, the fsync that finishes it waits less
+    const auto copied = destination->size - compaction->written_back;
+    if (copied > 0 && sync_file_range(destination->fd,
+                                      compaction->written_back,
+                                      copied,
+                                      SYNC_FILE_RANGE_WRITE) < 0)
+    {
+        perror("sync_file_range: ");
+    }
+    compaction->written_back = destination->size;
+    return min(bytes_read, budget);
+}
+
+void Database::finish_compaction()
+{
+    auto& segments = compaction->partition->segments;
+    const auto source = compaction->source;
+    const auto destination = compaction->destination;
+
+    // Its writeback was started as it was copied, see compact
+    if (fsync(destination->fd) < 0)
+    {
+        perror("fsync: ");
+    }
+
+    /**
+     * The keys of a source key table are read from it until it is replaced,
+     * so the ones overwritten or deleted after they were copied left their
+     * dead bytes in the source. They are dead in the destination
+     */
+    if (source->table)
+    {
+        FileStorage latest_record;
+        for (const auto& entry : compaction->entries)
+        {
+            if (entry.size > 0 &&
+                (!latest(entry.key, latest_record) ||
+                 (latest_record.file != source.get() &&
+                  latest_record.file != destination.get())))
+            {
+                destination->dead_bytes +=
+                    record_size(entry.key.size(), entry.size, entry.expiry);
+            }
+        }
+    }
+
+    /**
+     * The old hint file and key table describe the old offsets.
+     * Rename is atomic, so the segment name always has a complete file, the
+     * old or the new one. Readers that still have the old one keep using its
+     * file descriptor
+     */
+    unlink(source->hint_filename.c_str());
+    unlink(source->table_filename.c_str());
+    if (rename(compaction->temporary_filename.c_str(),
+               source->filename.c_str()) < 0)
+    {
+        perror("rename: ");
+    }
+
+    const auto position = find(segments.begin(), segments.end(), source);
+    files[source->number] = nullptr;
+    if (destination->size == 0)
+    {
+        cout << "The segment: " << source->filename
+             << " has no live records! Removing it ..." << endl;
+        unlink(source->filename.c_str());
+        segments.erase(position);
+        files[destination->number] = nullptr;
+    }
+    else
+    {
+        destination->hint_pending = true;
+        *position = destination;
+    }
+
+    // The keys of the source key table are not in memory, only in the new one
+    if (destination->size > 0 && source->table)
+    {
+        if (KeyTable::write(destination->table_filename,
+                            compaction->entries,
+                            destination->size,
+                            destination->dead_bytes))
+        {
+            destination->table = KeyTable::open(destination->table_filename);
+        }
+        if (!destination->table)
+        {
+            cerr << "Indexing the keys of the segment: " << source->filename
+                 << " in memory ..." << endl;
+            scan(destination.get(), 0);
+        }
+        destination->hint_pending = !destination->table;
+    }
+    cout << "Compacted the segment: " << source->filename << " from "
+         << to_string(source->size) << " to "
+         << to_string(destination->size) << " bytes" << endl;
+    compaction.reset();
+}
+
+void Database::abort_compaction()
+{
+    const auto source = compaction->source.get();
+    const auto destination = compaction->destination.get();
+
+    // The moved offsets are ascending, so the source is read only once
+    SequentialReader reader(source->fd, 0);
+    Record record;
+    for (const auto& offset : compaction->moved)
+    {
+        reader.skip(offset - reader.position());
+        if (!read_record(reader, source->size, false, record))
+        {
+            break;
+        }
+        const auto entry = stored.find(record.key);
+        if (entry != nullptr && entry->file == destination->number)
+        {
+            point(*entry,
+                  FileStorage{record.value_size + 4u,
+                              record.value_offset,
+                              source,
+                              record.compressed});
+        }
+    }
+    cerr << "The compaction of the segment: " << source->filename
+         << " was aborted!" << endl;
+    unlink(compaction->temporary_filename.c_str());
+    files[destination->number] = nullptr;
+    compaction.reset();
+}
+
+uint64_t record_size(const uint64_t key_size,
+                     const uint64_t stored_size,
+                     const uint64_t expiry)
+{
+    // The key size, the key, the expiry, the checksum, and the value size
+    // with the value
+    return sizeof(uint32_t) + key_size + (expiry != 0 ? 8 : 0) +
+           CHECKSUM_SIZE + stored_size;
+}
+
+uint32_t record_parts(const string& key,
+                      const vector<uint8_t>& value,
+                      const uint32_t flags,
+                      const uint64_t expiry,
+                      uint8_t* headers,
+                      struct iovec* parts)
+{
+    const uint32_t key_size =
+        key.size() | flags | (expiry != 0 ? EXPIRY_FLAG : 0);
+    auto checksum = headers_checksum(key, key_size, expiry);
+    if (flags & TOMBSTONE_FLAG)
+    {
+        return header_parts(key, 0, flags, expiry, checksum, headers, parts);
+    }
+    checksum = value_size_checksum(value.size(), checksum);
+    checksum = crc32c(value.data(), value.size(), checksum);
+    auto count = header_parts(
+        key, value.size(), flags, expiry, checksum, headers, parts);
+    parts[count++] = {const_cast<uint8_t*>(value.data()), value.size()};
+    return count;
+}
+
+uint32_t header_parts(const string& key,
+                      const uint64_t value_size,
+                      const uint32_t flags,
+                      const uint64_t expiry,
+                      const uint32_t checksum,
+                      uint8_t* headers,
+                      struct iovec* parts)
+{
+    /**
+     * serialize the key size, so the index can be rebuilt from the file.
+     * The headers are [key size][expiry][checksum][value size], so the ones
+     * after the key are written together
+     */
+    const uint32_t key_size =
+        key.size() | flags | (expiry != 0 ? EXPIRY_FLAG : 0);
+    for (uint8_t index = 0; index < 4; index++)
+    {
+        headers[index] = key_size >> (8 * index);
+        headers[12 + index] = checksum >> (8 * index);
+        headers[16 + index] = value_size >> (8 * index);
+    }
+    for (uint8_t index = 0; index < 8; index++)
+    {
+        headers[4 + index] = expiry >> (8 * index);
+    }
+    const bool tombstone = (flags & UNFINISHED_FLAGS) == TOMBSTONE_FLAG;
+    const auto expiry_headers = headers + (expiry != 0 ? 4 : 12);
+
+    uint32_t count = 0;
+    parts[count++] = {headers, 4};
+    parts[count++] = {const_cast<char*>(key.data()), key.size()};
+    parts[count++] = {expiry_headers,
+                      (uint64_t)(headers + (tombstone ? 16 : 20) -
+                                 expiry_headers)};
+    return count;
+}
+
+uint32_t value_size_checksum(const uint64_t value_size,
+                             const uint32_t previous)
+{
+    uint8_t size[4];
+    for (uint8_t index = 0; index < 4; index++)
+    {
+        size[index] = value_size >> (8 * index);
+    }
+    return crc32c(size, 4, previous);
+}
+
+uint32_t headers_checksum(const string& key,
+                          const uint32_t key_size,
+                          const uint64_t expiry)
+{
+    // The checksum of the bytes before it: the key size, the key and the
+    // expiry
+    uint8_t headers[8];
+    for (uint8_t index = 0; index < 4; index++)
+    {
+        headers[index] = key_size >> (8 * index);
+    }
+    auto checksum = crc32c(headers, 4);
+    checksum = crc32c(reinterpret_cast<const uint8_t*>(key.data()),
+                      key.size(),
+                      checksum);
+    if (expiry == 0)
+    {
+        return checksum;
+    }
+    for (uint8_t index = 0; index < 8; index++)
+    {
+        headers[index] = expiry >> (8 * index);
+    }
+    return crc32c(headers, 8, checksum);
+}
+
+uint64_t current_time()
+{
+    return chrono::duration_cast<chrono::milliseconds>(
+               chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+void check_layout(const string& directory, const uint16_t partitions)
+{
+    // The shards start together, and the first one writes the layout
+    static mutex layout_mutex;
+    lock_guard<mutex> lock(layout_mutex);
+
+    const auto filename = directory + "/" + LAYOUT_FILENAME;
+    const auto layout =
+        LAYOUT_HASH + " " + to_string(partitions) + " " + LAYOUT_RECORDS;
+
+    ifstream input(filename);
+    string stored_layout;
+    if (getline(input, stored_layout))
+    {
+        if (stored_layout != layout)
+        {
+            const auto msg = "The data directory was written with the layout: " +
+                             stored_layout + " but the server is using: " +
+                             layout +
+                             "! Start it with the same number of partitions, "
+                             "the records without checksums can not be read";
+            cerr << msg << endl;
+            throw msg;
+        }
+        return;
+    }
+
+    ofstream output(filename, ios::trunc);
+    output << layout << endl;
+    if (!output)
+    {
+        throw "Could not write the layout file: " + filename;
+    }
+}
+
+bool link_file(const string& filename,
+               const string& directory,
+               const bool optional,
+               string& manifest)
+{
+    /**
+     * A hard link is a second name of the same file, nothing is copied.
+     * The manifest has the name and the size of every file: a sealed segment
+     * is only linked once nothing is written to it anymore, see
+     * Database::link_snapshots
+     */
+    const auto name = filename.substr(filename.rfind('/') + 1);
+    if (link(filename.c_str(), (directory + "/" + name).c_str()) < 0)
+    {
+        if (optional && errno == ENOENT)
+        {
+            return true;
+        }
+        perror("link: ");
+        cerr << "Could not link the file: " << filename << " to the snapshot"
+             << endl;
+        return false;
+    }
+    struct stat file_stat;
+    if (stat(filename.c_str(), &file_stat) < 0)
+    {
+        return false;
+    }
+    manifest += name + " " + to_string(file_stat.st_size) + "\n";
+    return true;
+}
+
+bool copy_file(const string& filename,
+               const string& directory,
+               const bool optional,
+               string& manifest)
+{
+    // A key table is copied: the server writes the dead bytes of its segment
+    // back to it when it stops, see KeyTable::save_dead_bytes
+    const int32_t from = open(filename.c_str(), O_RDONLY);
+    if (from < 0)
+    {
+        if (optional && errno == ENOENT)
+        {
+            return true;
+        }
+        perror("open: ");
+        return false;
+    }
+    const auto name = filename.substr(filename.rfind('/') + 1);
+    const auto copy = directory + "/" + name;
+    struct stat file_stat;
+    const int32_t to =
+        fstat(from, &file_stat) == 0
+            ? open(copy.c_str(), O_WRONLY | O_CREAT | O_EXCL, OPEN_FILE_MODE)
+            : -1;
+    const bool copied =
+        to >= 0 && copy_range(from, 0, to, 0, file_stat.st_size) &&
+        fsync(to) == 0;
+    close(from);
+    if (to >= 0)
+    {
+        close(to);
+    }
+    if (!copied)
+    {
+        cerr << "Could not copy the file: " << filename << " to the snapshot"
+             << endl;
+        return false;
+    }
+    manifest += name + " " + to_string(file_stat.st_size) + "\n";
+    return true;
+}
+
+bool write_manifest(const string& directory, const string& manifest)
+{
+    const auto filename = directory + "/" + MANIFEST_FILENAME;
+    const auto temporary = filename + ".tmp";
+    const int32_t fd =
+        open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, OPEN_FILE_MODE);
+    if (fd < 0)
+    {
+        cerr << "Could not create the manifest: " << temporary << endl;
+        return false;
+    }
+    bool written =
+        write_all(fd,
+                  reinterpret_cast<const uint8_t*>(manifest.data()),
+                  manifest.size()) &&
+        fsync(fd) == 0;
+    close(fd);
+    written = written && rename(temporary.c_str(), filename.c_str()) == 0;
+
+    // The links and the manifest are entries of the directory
+    const int32_t directory_fd = open(directory.c_str(), O_RDONLY);
+    written = written && directory_fd >= 0 && fsync(directory_fd) == 0;
+    if (directory_fd >= 0)
+    {
+        close(directory_fd);
+    }
+    if (!written)
+    {
+        cerr << "Could not write the manifest: " << filename << endl;
+        unlink(temporary.c_str());
+    }
+    return written;
+}
+
+bool write_all(const int32_t fd, const uint8_t* buffer, uint64_t size)
+{
+    while (size > 0)
+    {
+        const auto written = ::write(fd, buffer, size);
+        if (written < 0)
+        {
+            perror("write: ");
+            return false;
+        }
+        buffer += written;
+        size -= written;
+    }
+    return true;
+}
+
+bool write_all(const int32_t fd,
+               struct iovec* parts,
+               uint32_t count,
+               off_t offset)
+{
+    while (count > 0)
+    {
+        const auto written = ::pwritev(fd, parts, count, offset);
+        if (written < 0)
+        {
+            perror("pwritev: ");
+            return false;
+        }
+        offset += written;
+        skip_written(parts, count, written);
+    }
+    return true;
+}
+
+void skip_written(struct iovec*& parts, uint32_t& count, uint64_t written)
+{
+    while (count > 0 && written >= parts->iov_len)
+    {
+        written -= parts->iov_len;
+        parts++;
+        count--;
+    }
+    if (count > 0)
+    {
+        parts->iov_base = static_cast<uint8_t*>(parts->iov_base) + written;
+        parts->iov_len -= written;
+    }
+}
+
+bool copy_range(const int32_t from,
+                off_t from_offset,
+                const int32_t to,
+                off_t to_offset,
+                uint64_t size)
+{
+    /**
+     * Copies inside the kernel, without the bytes going to user space
+     * https://man7.org/linux/man-pages/man2/copy_file_range.2.html
+     */
+    while (size > 0)
+    {
+        const auto copied =
+            copy_file_range(from, &from_offset, to, &to_offset, size, 0);
+        if (copied <= 0)
+        {
+            break;
+        }
+        size -= copied;
+    }
+
+    // Not supported between these files, falls back to read and write
+    vector<uint8_t> buffer;
+    while (size > 0)
+    {
+        buffer.resize(min(size, (uint64_t)RECOVERY_BUFFER_SIZE));
+        const auto bytes_read =
+            ::pread(from, buffer.data(), buffer.size(), from_offset);
+        if (bytes_read <= 0 ||
+            ::pwrite(to, buffer.data(), bytes_read, to_offset) != bytes_read)
+        {
+            return false;
+        }
+        from_offset += bytes_read;
+        to_offset += bytes_read;
+        size -= bytes_read;
+    }
+    return true;
+}
+
+void easykey::serialize(vector<uint8_t>& output,
+                        uint64_t number,
+                        uint8_t number_size)
+{
+    for (uint8_t index = 0; index < number_size; index++)
+    {
+        output.push_back(number >> (8 * index));
+    }
+}
+
+uint64_t easykey::deserialize(const uint8_t* input, uint8_t number_size)
+{
+    uint64_t value = 0;
+    for (uint8_t index = 0; index < number_size; index++)
+    {
+        value |= (uint64_t)input[index] << (8 * index);
+    }
+    return value;
+}
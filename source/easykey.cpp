@@ -5,10 +5,12 @@
 #include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <algorithm>
 #include <array>
+#include <chrono>
 #include <cstdint>
 #include <cstdio>
 #include <iostream>
@@ -28,199 +30,1194 @@ static const string regex_value = "[^a-zA-Z0-9_]+";
 static const regex invalid_key_regex(regex_value);
 
 /**
- * The file must be opened with Read & Write
- * Must be created if does not exist
- * Must be truncated if exists
+ * How often the compaction runs while it has work to do
  */
-constexpr static int32_t OPEN_FILE_FLAGS = O_RDWR | O_CREAT | O_TRUNC;
+constexpr static chrono::milliseconds MAINTENANCE_INTERVAL(100);
 
 /**
- * The mode(permissions) of the file are:
- * Owner of the file has READ and Write permissions
- * Everyone else does not have any permissions
+ * The response has at most 255 messages, the status and the cursor take two
  */
-constexpr static int32_t OPEN_FILE_MODE = S_IRUSR | S_IWUSR;
+constexpr static uint32_t MAX_SCAN_MESSAGES = 253;
+
+/**
+ * A page of a scan with values takes about this many bytes of them, shared
+ * by the shards, and the next page is only found once the client read all
+ * but a page, so a scan of every key does not keep its values in memory
+ */
+constexpr static uint64_t SCAN_PAGE_BYTES = 1024 * 1024;
 
 bool is_key_valid(const string& key);
-uint8_t hash(const string key, uint8_t mod);
+bool is_command(const string& message);
+string read_message(ByteBuffer& buffer);
+
+/**
+ * Reads the next count messages, and discards them
+ */
+void skip_messages(ByteBuffer& buffer, const uint8_t count);
+void append_message(vector<uint8_t>& response,
+                    const uint8_t* message,
+                    const uint32_t size);
+string prefix_end(string prefix);
+vector<uint8_t> scan_response(const vector<ScanPart>& parts,
+                              const uint32_t limit,
+                              const bool with_values,
+                              string& cursor,
+                              uint32_t& count);
+vector<uint8_t> stored_header(const bool compressed);
 vector<uint8_t> write_dynamic_content(ResponseStatus status,
                                       const string error_description);
 
-File::File(const int32_t fd, const string filename) : fd(fd), filename(filename)
+PendingAcknowledgement::PendingAcknowledgement(
+    ClientSocket* socket,
+    vector<uint8_t> response,
+    function<void(vector<uint8_t>)> reply)
+    : socket(socket),
+      slot(socket != nullptr ? socket->reserve() : 0),
+      response(move(response)),
+      reply(move(reply))
+{
+}
+
+Handler::Handler(const DatabaseOptions options, Shards& shards)
+    : database(options),
+      shards(shards),
+      shard(options.shard),
+      durability(options.durability),
+      sync_interval(options.sync_interval),
+      small_value_size(options.small_value_size),
+      splice_threshold(options.splice_threshold),
+      compression_threshold(options.compression_threshold),
+      max_request_size(options.max_request_size),
+      verbose(options.verbose),
+      report_requested(false)
 {
-    cout << "Opened file: " << filename
-         << " with file descriptor: " << to_string(fd) << endl;
 }
 
-File::~File()
+Handler::~Handler()
 {
-    cout << "Calling close to descriptor: " << to_string(fd) << endl;
-    if (close(fd) < 0)
+    for (auto& pending : unacknowledged)
+    {
+        pending.socket = nullptr;
+        pending.reply = nullptr;
+    }
+    answered.clear();
+    for (const auto& spliced : uploads)
     {
-        cerr << "Could not close the file properly ..." << endl;
+        database.finish_upload(spliced.second.upload, false, [](const bool) {});
     }
+    uploads.clear();
+    database.wait();
 }
 
-Database::Database()
+chrono::milliseconds Handler::tick()
 {
-    uint8_t files = NUMBER_OF_FILES;
-    opened_files.reserve(files);
-    for (uint8_t index = 0; index < files; index++)
+    release_waiting();
+    auto next = database.maintenance() ? MAINTENANCE_INTERVAL
+                                       : chrono::milliseconds::max();
+    if (durability == Durability::INTERVAL)
     {
-        const auto location = "/tmp/easykey-" + to_string(index) + ".db";
-        int32_t fd = open(location.c_str(), OPEN_FILE_FLAGS, OPEN_FILE_MODE);
-        if (fd == -1)
+        next = min(next, sync_interval);
+    }
+    next = min(next, database.next_expiry());
+    if (!pending_acknowledgements.empty())
+    {
+        const auto waiting =
+            chrono::duration_cast<chrono::milliseconds>(
+                chrono::steady_clock::now() - oldest_pending_acknowledgement);
+        if (waiting >= sync_interval)
+        {
+            flush_acknowledgements();
+        }
+        else
+        {
+            next = min(next, sync_interval - waiting);
+        }
+    }
+
+    for (const auto socket : answered)
+    {
+        socket->flush();
+    }
+    answered.clear();
+
+    // The client read the previous pages, or left
+    auto paused = move(paused_scans);
+    paused_scans.clear();
+    for (const auto& stream : paused)
+    {
+        const auto socket = stream->acknowledgement->socket;
+        if (socket == nullptr)
+        {
+            unacknowledged.erase(stream->acknowledgement);
+        }
+        else if (socket->pending_output() > SCAN_PAGE_BYTES)
+        {
+            paused_scans.push_back(stream);
+        }
+        else
         {
-            throw "Could not open file: " + location;
+            scan_page(stream);
         }
-        opened_files.push_back(unique_ptr<File>(new File(fd, location)));
     }
+
+    if (report_requested.exchange(false))
+    {
+        report();
+    }
+
+    // The writes and flushes of this iteration are submitted together
+    database.submit();
+
+    // The other shards are woken up once for all the tasks of the iteration
+    if (shards.flush(shard))
+    {
+        next = chrono::milliseconds(0);
+    }
+    return next;
 }
 
-void Database::write(const string key, const vector<uint8_t> data)
+void Handler::disconnected(const ClientSocket& socket)
 {
-    auto file = this->opened_files[::hash(key, NUMBER_OF_FILES)].get();
+    answered.erase(const_cast<ClientSocket*>(&socket));
+    for (auto& pending : unacknowledged)
+    {
+        if (pending.socket == &socket)
+        {
+            pending.socket = nullptr;
+        }
+    }
 
-    // The file offset is set to the size of the file plus offset bytes.
-    const auto current_file_size = lseek(file->fd, 0, SEEK_END);
+    // The value will never arrive whole
+    const auto upload = uploads.find(&socket);
+    if (upload != uploads.end())
+    {
+        const auto spliced = move(upload->second);
+        uploads.erase(upload);
+        database.finish_upload(spliced.upload, false, [](const bool) {});
+        unacknowledged.erase(spliced.acknowledgement);
+    }
+}
 
-    vector<uint8_t> stored_data;
-    stored_data.reserve(data.size() + sizeof(uint32_t));
+int32_t Handler::completion_descriptor() const
+{
+    return database.completion_descriptor();
+}
 
-    // serialize the 4 integer of the user data size
-    stored_data.push_back(data.size());
-    stored_data.push_back(data.size() >> 8);
-    stored_data.push_back(data.size() >> 16);
-    stored_data.push_back(data.size() >> 24);
+void Handler::complete()
+{
+    database.complete();
+}
 
-    copy(data.begin(), data.end(), back_inserter(stored_data));
+void Handler::flush_acknowledgements()
+{
+    if (pending_acknowledgements.empty())
+    {
+        return;
+    }
+    const auto flushing = move(pending_acknowledgements);
+    pending_acknowledgements.clear();
+    database.sync([this, flushing](const bool flushed) {
+        const auto error = write_dynamic_content(
+            ResponseStatus::SERVER_ERROR, "The write could not be flushed!");
+        for (const auto& acknowledgement : flushing)
+        {
+            if (!flushed)
+            {
+                acknowledgement->response = error;
+            }
+            acknowledge(acknowledgement);
+        }
+    });
+}
+
+void Handler::written(const Acknowledgement acknowledgement,
+                      const string& key,
+                      const bool success)
+{
+    if (!success)
+    {
+        acknowledgement->response = write_dynamic_content(
+            ResponseStatus::SERVER_ERROR,
+            "The key: " + key + " could not be written!");
+        acknowledge(acknowledgement);
+        return;
+    }
+    if (durability == Durability::GROUP)
+    {
+        // Acknowledged only after the next flush, see tick
+        if (pending_acknowledgements.empty())
+        {
+            oldest_pending_acknowledgement = chrono::steady_clock::now();
+        }
+        pending_acknowledgements.push_back(acknowledgement);
+        return;
+    }
+    acknowledge(acknowledgement);
+    if (verbose)
+    {
+        cout << "The key: " << key << " was successfully written!" << endl;
+    }
+}
+
+bool Handler::continue_upload(ClientSocket& socket)
+{
+    auto& spliced = uploads.at(&socket);
+    const bool received =
+        socket.receive(spliced.upload.storage.file->fd,
+                       spliced.offset,
+                       spliced.remaining);
+    if (received && spliced.remaining > 0)
+    {
+        return false;
+    }
+
+    /**
+     * The bytes of the value that were not read would be parsed as
+     * requests, so the client is answered and disconnected
+     */
+    if (!received)
+    {
+        socket.closing = true;
+    }
+    const auto finished = move(spliced);
+    uploads.erase(&socket);
+    const auto acknowledgement = finished.acknowledgement;
+    const auto key = finished.upload.key;
+    database.finish_upload(
+        finished.upload,
+        received,
+        [this, acknowledgement, key](const bool success) {
+            written(acknowledgement, key, success);
+        });
+    return true;
+}
+
+void Handler::acknowledge(const Acknowledgement acknowledgement)
+{
+    if (acknowledgement->socket != nullptr)
+    {
+        acknowledgement->socket->fill(acknowledgement->slot,
+                                      move(acknowledgement->response));
+        answered.insert(acknowledgement->socket);
+    }
+    else if (acknowledgement->reply)
+    {
+        acknowledgement->reply(move(acknowledgement->response));
+    }
+    unacknowledged.erase(acknowledgement);
+}
 
-    // Use write system call to append data at the end of the file
-    if (::write(file->fd, stored_data.data(), stored_data.size()) == -1)
+void Handler::report() const
+{
+    cout << "Shard: " << to_string(shard) << endl;
+    database.report(cout);
+}
+
+void Handler::request_report()
+{
+    report_requested = true;
+    shards.wake(shard);
+}
+
+void Handler::run_on(const uint16_t to, ShardTask task)
+{
+    if (to == shard)
     {
-        perror("write: ");
+        task(*this);
+        return;
     }
+    shards.send(shard, to, move(task));
+}
 
-    cout << "Write content of the key: " << key
-         << " at file: " << file->filename << endl;
+Acknowledgement Handler::answering(const uint16_t origin,
+                                   const Acknowledgement acknowledgement)
+{
+    if (origin == shard)
+    {
+        return acknowledgement;
+    }
+    return unacknowledged.emplace(
+        unacknowledged.end(),
+        nullptr,
+        vector<uint8_t>(),
+        [this, origin, acknowledgement](vector<uint8_t> response) {
+            run_on(origin, [acknowledgement, response](Handler& handler) {
+                acknowledgement->response = response;
+                handler.acknowledge(acknowledgement);
+            });
+        });
+}
 
-    // Constructs the storage
-    FileStorage storage{stored_data.size(), current_file_size, file};
+void Handler::in_order(const string& key,
+                       const bool write,
+                       function<void()> task)
+{
+    if (key.empty())
+    {
+        if (!database.writing_before(database.started_operations()))
+        {
+            task();
+            return;
+        }
+        waiting_scans.emplace_back(database.started_operations(), move(task));
+        return;
+    }
+    if (!waits(key, write))
+    {
+        task();
+        return;
+    }
+    waiting[key].emplace_back(write, move(task));
+}
 
-    // Add to our database
-    stored.insert(make_pair(key, storage));
+bool Handler::waits(const string& key, const bool write) const
+{
+    return waiting.count(key) > 0 ||
+           (write ? !waiting_scans.empty() : database.writing(key));
 }
 
-const FileStorage* Database::read(const string key) const
+void Handler::release_waiting()
 {
-    const auto value = stored.find(key);
-    if (value == stored.end())
+    // The later scans wait for more operations, they are in order
+    while (!waiting_scans.empty() &&
+           !database.writing_before(waiting_scans.front().first))
+    {
+        const auto task = move(waiting_scans.front().second);
+        waiting_scans.pop_front();
+        task();
+    }
+
+    /**
+     * The tasks of every key run in order, until one waits: a read for the
+     * appends in flight, that a write before it just started too
+     */
+    vector<string> keys;
+    for (const auto& next : waiting)
+    {
+        keys.push_back(next.first);
+    }
+    for (const auto& key : keys)
     {
-        return nullptr;
+        auto& tasks = waiting[key];
+        while (!tasks.empty() && !database.writing(key) &&
+               (!tasks.front().first || waiting_scans.empty()))
+        {
+            const auto task = move(tasks.front().second);
+            tasks.pop_front();
+            task();
+        }
+        if (tasks.empty())
+        {
+            waiting.erase(key);
+        }
     }
-    return &(value->second);
 }
 
-void Handler::parse_request(ClientSocket& socket)
+bool Handler::parse_request(ClientSocket& socket)
 {
+    // The rest of a value goes first, it is not a request
+    if (uploads.count(&socket) &&
+        (!continue_upload(socket) || socket.closing))
+    {
+        return false;
+    }
+
+    // The frame is still missing bytes, there is nothing to parse yet
+    if (!socket.read_buffer.fill())
+    {
+        return false;
+    }
+
+    /**
+     * The socket does not block, so the frame may not have arrived whole.
+     * It is only parsed once every message arrived, otherwise it is checked
+     * again from its start when the bytes it missed arrive
+     */
+    socket.read_buffer.set_frame_limit(max_request_size);
+    socket.read_buffer.mark();
     try
     {
+        if (!frame_arrived(socket.read_buffer))
+        {
+            return false;
+        }
         const auto protocol = static_cast<knownothing::Protocol>(
             socket.read_buffer.get_integer1());
-        if (protocol != knownothing::Protocol::V1)
+        parse_frame(socket, protocol);
+    }
+    catch (const FrameTooBigException& exception)
+    {
+        /**
+         * The rest of the frame is not read, so nothing after it can be
+         * parsed either
+         */
+        cerr << exception.what() << endl;
+        const auto response = write_dynamic_content(
+            ResponseStatus::CLIENT_ERROR,
+            "The request is bigger than " + to_string(max_request_size) +
+                " bytes!");
+        socket.write(response.data(), response.size(), false);
+        socket.closing = true;
+        return false;
+    }
+    return true;
+}
+
+bool Handler::frame_arrived(ByteBuffer& buffer) const
+{
+    // Nothing after an unknown protocol is read, see parse_frame
+    if (!buffer.arrived(1))
+    {
+        return false;
+    }
+    if (static_cast<knownothing::Protocol>(buffer.data()[0]) !=
+        knownothing::Protocol::V1)
+    {
+        return true;
+    }
+
+    // [protocol][message count]([4-byte size][message])...
+    if (!buffer.arrived(2))
+    {
+        return false;
+    }
+    const auto messages = buffer.data()[1];
+    uint64_t size = 2;
+    string first_message;
+    for (uint8_t message = 0; message < messages; message++)
+    {
+        if (!buffer.arrived(size + 4))
         {
-            cerr << "Invalid Know Nothing Protocol " << endl;
-            const auto response = write_dynamic_content(
-                ResponseStatus::CLIENT_ERROR,
-                "Only the first version of Know Nothing is supported!");
-            socket.write(response.data(), response.size(), false);
+            return false;
+        }
+        const uint32_t message_size = deserialize(buffer.data() + size, 4);
+        size += 4;
+        if (message == 1 && splices(first_message, messages, message_size))
+        {
+            return true;
+        }
+        if (!buffer.arrived(size + message_size))
+        {
+            return false;
+        }
+        if (message == 0)
+        {
+            first_message.assign(
+                reinterpret_cast<const char*>(buffer.data() + size),
+                message_size);
+        }
+        size += message_size;
+    }
+    return true;
+}
+
+bool Handler::splices(const string& key,
+                      const uint8_t messages,
+                      const uint32_t size) const
+{
+    /**
+     * The TTL comes after the value, and the record needs it before, so only
+     * the writes without one are spliced. Another shard can not read the
+     * socket, so its writes are read to the memory, and so are the ones that
+     * wait for the requests before them
+     */
+    return messages == 2 && splice_threshold > 0 && size >= splice_threshold &&
+           (compression_threshold == 0 || size <= compression_threshold) &&
+           is_key_valid(key) && database.shard_of(key) == shard &&
+           !waits(key, true);
+}
+
+void Handler::parse_frame(ClientSocket& socket,
+                          const knownothing::Protocol protocol)
+{
+    /**
+     * Without the protocol, the size of the frame is unknown, so nothing
+     * the client sends after it can be trusted
+     */
+    if (protocol != knownothing::Protocol::V1)
+    {
+        cerr << "Invalid Know Nothing Protocol " << endl;
+        const auto response = write_dynamic_content(
+            ResponseStatus::CLIENT_ERROR,
+            "Only the first version of Know Nothing is supported!");
+        socket.write(response.data(), response.size(), false);
+        socket.closing = true;
+        return;
+    }
+
+    const auto messages = socket.read_buffer.get_integer1();
+    const auto first_message =
+        messages > 0 ? read_message(socket.read_buffer) : "";
+    if (is_command(first_message))
+    {
+        run_command(socket,
+                    static_cast<Command>(first_message[0]),
+                    messages - 1);
+        return;
+    }
+    if (messages < 1 || messages > 3)
+    {
+        // The next request starts after the messages of this one
+        skip_messages(socket.read_buffer, messages > 0 ? messages - 1 : 0);
+        cerr << "Invalid Easy Key Message!"
+             << " One to Three messages are allowed. Provided is "
+             << messages << endl;
+        const auto response = write_dynamic_content(
+            ResponseStatus::CLIENT_ERROR,
+            "Invalid EasyKey Message! Allowed is 1 to 3 Messages!");
+        socket.write(response.data(), response.size(), false);
+        return;
+    }
+
+    if (!is_key_valid(first_message))
+    {
+        skip_messages(socket.read_buffer, messages - 1);
+        cerr << "The key: " << first_message << " is not valid ..." << endl;
+        const auto response = write_dynamic_content(
+            ResponseStatus::CLIENT_ERROR,
+            "The key: " + first_message +
+                " is not valid! Must be alphanumeric!");
+        socket.write(response.data(), response.size(), false);
+        return;
+    }
+
+    // The shard of the key answers, through this one
+    const auto owner = database.shard_of(first_message);
+
+    /**
+     * Its a read operation. Another shard answers it with a copy of the
+     * value, and so does this one when the key is still being written
+     */
+    if (messages == 1 && (owner != shard || waits(first_message, false)))
+    {
+        const auto acknowledgement =
+            unacknowledged.emplace(unacknowledged.end(), &socket);
+        run_on(owner,
+               [origin = shard, acknowledgement, first_message](
+                   Handler& handler) {
+                   const auto answer =
+                       handler.answering(origin, acknowledgement);
+                   handler.in_order(
+                       first_message,
+                       false,
+                       [&handler, answer, first_message]() {
+                           answer->response =
+                               handler.read_response(first_message);
+                           handler.acknowledge(answer);
+                       });
+               });
+        return;
+    }
+    if (messages == 1)
+    {
+        const auto cached = database.cached(first_message);
+        if (cached != nullptr)
+        {
+            const struct iovec parts[2] = {
+                {const_cast<uint8_t*>(success_header),
+                 sizeof(success_header)},
+                {const_cast<uint8_t*>(cached->data()), cached->size()},
+            };
+            socket.write(parts, 2);
             return;
         }
 
-        const auto messages = socket.read_buffer.get_integer1();
-        if (messages != 1 && messages != 2)
+        const auto value = database.read(first_message);
+        if (value.file == nullptr)
         {
-            // handle
-            cerr << "Invalid Easy Key Message!"
-                 << " One or Two messages are allowed. Provided is " << messages
+            // not found
+            cerr << "The key: " << first_message << " was not found!"
                  << endl;
-            const auto response = write_dynamic_content(
-                ResponseStatus::CLIENT_ERROR,
-                "Invalid EasyKey Message! Allowed is 1 or 2 Messages!");
+            const auto response =
+                write_dynamic_content(ResponseStatus::CLIENT_ERROR,
+                                      "The key " + first_message +
+                                          " was not found!");
             socket.write(response.data(), response.size(), false);
             return;
         }
+        // A compressed value can not be sent from the file as it is
+        if (value.compressed)
+        {
+            vector<uint8_t> content;
+            if (!database.load(first_message, value, content))
+            {
+                const auto response = write_dynamic_content(
+                    ResponseStatus::SERVER_ERROR,
+                    "The key: " + first_message + " could not be read!");
+                socket.write(response.data(), response.size(), false);
+                return;
+            }
+            const struct iovec parts[2] = {
+                {const_cast<uint8_t*>(success_header),
+                 sizeof(success_header)},
+                {content.data(), content.size()},
+            };
+            socket.write(parts, 2);
+            return;
+        }
+        send_stored(socket,
+                    first_message,
+                    success_header,
+                    sizeof(success_header),
+                    value);
+        return;
+    }
 
-        const auto first_message_size = socket.read_buffer.get_integer4();
-        string first_message;
-        first_message.reserve(first_message_size);
+    // Its a write operation
+    const auto second_message_size = socket.read_buffer.get_integer4();
+
+    /**
+     * A big value goes from the socket to the segment without being
+     * copied to the user space, see ClientSocket::receive
+     */
+    const bool spliced =
+        splices(first_message, messages, second_message_size);
+    vector<uint8_t> second_message;
+    if (!spliced)
+    {
+        second_message = socket.read_buffer.get_next(second_message_size);
+    }
+
+    // The third message is the TTL, in seconds
+    chrono::milliseconds ttl(0);
+    if (messages == 3)
+    {
+        const auto ttl_message = read_message(socket.read_buffer);
+        if (ttl_message.size() != 4)
+        {
+            const auto response = write_dynamic_content(
+                ResponseStatus::CLIENT_ERROR, "The TTL must have 4 bytes!");
+            socket.write(response.data(), response.size(), false);
+            return;
+        }
+        ttl = chrono::seconds(deserialize(
+            reinterpret_cast<const uint8_t*>(ttl_message.data()), 4));
+    }
 
-        // Return the next buffer messages
-        for (const auto& ch : socket.read_buffer.get_next(first_message_size))
+    // Answered when the write completes, see written
+    const auto acknowledgement =
+        unacknowledged.emplace(unacknowledged.end(), &socket);
+    if (spliced)
+    {
+        acknowledgement->response = write_dynamic_content(
+            ResponseStatus::OK,
+            "The key: " + first_message + " was successfully written!");
+        Upload upload;
+        if (!database.begin_upload(
+                first_message, second_message_size, upload))
         {
-            first_message += ch;
+            // The value can not be skipped, it would be parsed as requests
+            written(acknowledgement, first_message, false);
+            socket.closing = true;
+            return;
         }
+        const auto offset = upload.storage.offset + 4;
+        uploads.emplace(&socket,
+                        SplicedValue{move(upload),
+                                     offset,
+                                     second_message_size,
+                                     acknowledgement});
+        continue_upload(socket);
+        return;
+    }
+    run_on(owner,
+           [origin = shard,
+            acknowledgement,
+            first_message,
+            second_message = move(second_message),
+            ttl](Handler& handler) mutable {
+               handler.write(handler.answering(origin, acknowledgement),
+                             first_message,
+                             move(second_message),
+                             ttl);
+           });
+}
+
+void Handler::write(const Acknowledgement acknowledgement,
+                    const string& key,
+                    vector<uint8_t> value,
+                    const chrono::milliseconds ttl)
+{
+    acknowledgement->response = write_dynamic_content(
+        ResponseStatus::OK, "The key: " + key + " was successfully written!");
+    in_order(key,
+             true,
+             [this, acknowledgement, key, value = move(value), ttl]() mutable {
+                 database.write(
+                     key,
+                     move(value),
+                     ttl,
+                     [this, acknowledgement, key](const bool success) {
+                         written(acknowledgement, key, success);
+                     });
+             });
+}
 
-        if (!is_key_valid(first_message))
+vector<uint8_t> Handler::read_response(const string& key)
+{
+    vector<uint8_t> response(success_header,
+                             success_header + sizeof(success_header));
+    const auto cached = database.cached(key);
+    if (cached != nullptr)
+    {
+        response.insert(response.end(), cached->begin(), cached->end());
+        return response;
+    }
+    const auto value = database.read(key);
+    if (value.file == nullptr)
+    {
+        cerr << "The key: " << key << " was not found!" << endl;
+        return write_dynamic_content(ResponseStatus::CLIENT_ERROR,
+                                     "The key " + key + " was not found!");
+    }
+    if (!database.load(key, value, response))
+    {
+        return write_dynamic_content(
+            ResponseStatus::SERVER_ERROR,
+            "The key: " + key + " could not be read!");
+    }
+    return response;
+}
+
+vector<uint8_t> Handler::stored_response(const string& key)
+{
+    const auto value = database.read(key);
+    if (value.file == nullptr)
+    {
+        return write_dynamic_content(ResponseStatus::CLIENT_ERROR,
+                                     "The key " + key + " was not found!");
+    }
+    auto response = stored_header(value.compressed);
+    if (!database.load_stored(key, value, response))
+    {
+        return write_dynamic_content(
+            ResponseStatus::SERVER_ERROR,
+            "The key: " + key + " could not be read!");
+    }
+    return response;
+}
+
+void Handler::run_command(ClientSocket& socket,
+                          const Command command,
+                          const uint8_t messages)
+{
+    switch (command)
+    {
+        case Command::SCAN:
+            scan(socket, messages);
+            break;
+        case Command::DELETE:
+            remove(socket, messages);
+            break;
+        case Command::READ_STORED:
+            read_stored(socket, messages);
+            break;
+        case Command::SNAPSHOT:
+            snapshot(socket, messages);
+            break;
+        default:
         {
-            cerr << "The key: " << first_message << " is not valid ..." << endl;
+            skip_messages(socket.read_buffer, messages);
             const auto response = write_dynamic_content(
-                ResponseStatus::CLIENT_ERROR,
-                "The key: " + first_message +
-                    " is not valid! Must be alphanumeric!");
+                ResponseStatus::CLIENT_ERROR, "Unknown command!");
             socket.write(response.data(), response.size(), false);
-            return;
+            break;
         }
+    }
+}
+
+void Handler::scan(ClientSocket& socket, const uint8_t messages)
+{
+    if (messages != 4)
+    {
+        // The messages are skipped, so the next request is read from its start
+        skip_messages(socket.read_buffer, messages);
+        const auto response = write_dynamic_content(
+            ResponseStatus::CLIENT_ERROR,
+            "A scan has 4 messages after the command: the flags, the start "
+            "key, the end key or prefix and the limit!");
+        socket.write(response.data(), response.size(), false);
+        return;
+    }
+    const auto flags = read_message(socket.read_buffer);
+    const auto start = read_message(socket.read_buffer);
+    const auto end = read_message(socket.read_buffer);
+    const auto limit_message = read_message(socket.read_buffer);
+    if (flags.size() != 1 || limit_message.size() != 4)
+    {
+        const auto response = write_dynamic_content(
+            ResponseStatus::CLIENT_ERROR,
+            "The scan flags must have 1 byte and the limit 4 bytes!");
+        socket.write(response.data(), response.size(), false);
+        return;
+    }
+    const bool with_values = flags[0] & SCAN_VALUES;
+    auto from = start;
+    auto to = end;
+    if (flags[0] & SCAN_PREFIX)
+    {
+        from = max(start, end);
+        to = prefix_end(end);
+    }
+
+    const uint32_t limit = deserialize(
+        reinterpret_cast<const uint8_t*>(limit_message.data()), 4);
+    const auto stream = make_shared<ScanStream>();
+    stream->acknowledgement =
+        unacknowledged.emplace(unacknowledged.end(), &socket);
+    stream->from = from;
+    stream->to = to;
+    stream->remaining = limit == 0 ? UINT64_MAX : limit;
+    stream->with_values = with_values;
+    scan_page(stream);
+}
 
-        // Its a read operation
-        if (messages == 1)
+void Handler::scan_page(const shared_ptr<ScanStream> stream)
+{
+    // Every key takes one message, and its value another
+    const uint32_t limit = min<uint64_t>(
+        stream->remaining,
+        stream->with_values ? MAX_SCAN_MESSAGES / 2 : MAX_SCAN_MESSAGES);
+
+    /**
+     * Every shard finds up to limit keys, and this one merges them, see
+     * scan_response
+     */
+    const auto gathered = make_shared<ScanGather>();
+    gathered->remaining = shards.size();
+    for (uint16_t other = 0; other < shards.size(); other++)
+    {
+        run_on(other,
+               [origin = shard,
+                stream,
+                gathered,
+                from = stream->from,
+                to = stream->to,
+                limit,
+                with_values = stream->with_values](Handler& handler) {
+                   handler.in_order("", false, [&handler,
+                                             origin,
+                                             stream,
+                                             gathered,
+                                             from,
+                                             to,
+                                             limit,
+                                             with_values]() {
+                       const auto part =
+                           handler.scan_part(from, to, limit, with_values);
+                       handler.run_on(origin,
+                                      [stream, gathered, part, limit](
+                                          Handler& client_shard) {
+                                          client_shard.scan_found(
+                                              stream, *gathered, part, limit);
+                                      });
+                   });
+               });
+    }
+}
+
+void Handler::scan_found(const shared_ptr<ScanStream> stream,
+                         ScanGather& gathered,
+                         const ScanPart& part,
+                         const uint32_t limit)
+{
+    gathered.parts.push_back(part);
+    if (--gathered.remaining > 0)
+    {
+        return;
+    }
+    string cursor;
+    uint32_t count = 0;
+    auto response = scan_response(
+        gathered.parts, limit, stream->with_values, cursor, count);
+    stream->remaining -= count;
+    const auto acknowledgement = stream->acknowledgement;
+    const auto socket = acknowledgement->socket;
+    if (cursor.empty() || stream->remaining == 0 || socket == nullptr)
+    {
+        acknowledgement->response = move(response);
+        acknowledge(acknowledgement);
+        return;
+    }
+
+    // The page is sent right away, the next one goes after it
+    socket->fill_part(acknowledgement->slot, move(response));
+    answered.insert(socket);
+    stream->from = cursor;
+    if (socket->pending_output() > SCAN_PAGE_BYTES)
+    {
+        paused_scans.push_back(stream);
+        return;
+    }
+    scan_page(stream);
+}
+
+ScanPart Handler::scan_part(const string& from,
+                            const string& to,
+                            const uint32_t limit,
+                            const bool with_values)
+{
+    ScanPart part;
+    vector<pair<string, FileStorage>> found;
+    part.ordered = database.scan(from, to, limit, found, part.cursor);
+    uint64_t loaded = 0;
+    for (const auto& key : found)
+    {
+        // The page is full, the next one starts at this key
+        if (loaded >= SCAN_PAGE_BYTES / shards.size())
         {
-            const auto value = database.read(first_message);
-            if (value == nullptr)
+            part.cursor = key.first;
+            break;
+        }
+        part.keys.push_back(key.first);
+
+        // The value is stored as a message, with its size
+        if (with_values)
+        {
+            part.values.emplace_back();
+            if (!database.load(key.first, key.second, part.values.back()))
             {
-                // not found
-                cerr << "The key: " << first_message << " was not found!"
-                     << endl;
-                const auto response =
-                    write_dynamic_content(ResponseStatus::CLIENT_ERROR,
-                                          "The key " + first_message +
-                                              " was not found!");
-                socket.write(response.data(), response.size(), false);
-                return;
+                part.unreadable = key.first;
+                break;
             }
-            // send the first message
-            socket.write(success_header,
-                         sizeof(success_header) / sizeof(success_header[0]),
-                         true);
-            // send the second message
-            socket.write(value->file->fd, value->offset, value->size);
-            return;
+            loaded += part.values.back().size();
+        }
+    }
+    return part;
+}
+
+void Handler::remove(ClientSocket& socket, const uint8_t messages)
+{
+    if (messages != 1)
+    {
+        skip_messages(socket.read_buffer, messages);
+        const auto response = write_dynamic_content(
+            ResponseStatus::CLIENT_ERROR,
+            "A delete has 1 message after the command: the key!");
+        socket.write(response.data(), response.size(), false);
+        return;
+    }
+    const auto key = read_message(socket.read_buffer);
+    if (!is_key_valid(key))
+    {
+        const auto response = write_dynamic_content(
+            ResponseStatus::CLIENT_ERROR,
+            "The key: " + key + " is not valid! Must be alphanumeric!");
+        socket.write(response.data(), response.size(), false);
+        return;
+    }
+
+    // Answered when the tombstone is written, see written
+    const auto acknowledgement =
+        unacknowledged.emplace(unacknowledged.end(), &socket);
+    run_on(database.shard_of(key),
+           [origin = shard, acknowledgement, key](Handler& handler) {
+               handler.remove_key(handler.answering(origin, acknowledgement),
+                                  key);
+           });
+}
+
+void Handler::remove_key(const Acknowledgement acknowledgement,
+                         const string& key)
+{
+    acknowledgement->response = write_dynamic_content(
+        ResponseStatus::OK, "The key: " + key + " was deleted!");
+    in_order(key, true, [this, acknowledgement, key]() {
+        const bool exists = database.remove(
+            key, [this, acknowledgement, key](const bool done) {
+                written(acknowledgement, key, done);
+            });
+        if (!exists)
+        {
+            cerr << "The key: " << key << " was not found!" << endl;
+            acknowledgement->response = write_dynamic_content(
+                ResponseStatus::CLIENT_ERROR,
+                "The key " + key + " was not found!");
+            acknowledge(acknowledgement);
         }
+    });
+}
+
+void Handler::read_stored(ClientSocket& socket, const uint8_t messages)
+{
+    if (messages != 1)
+    {
+        skip_messages(socket.read_buffer, messages);
+        const auto response = write_dynamic_content(
+            ResponseStatus::CLIENT_ERROR,
+            "A stored read has 1 message after the command: the key!");
+        socket.write(response.data(), response.size(), false);
+        return;
+    }
+    const auto key = read_message(socket.read_buffer);
+    const auto owner = is_key_valid(key) ? database.shard_of(key) : shard;
+    if (owner != shard || waits(key, false))
+    {
+        const auto acknowledgement =
+            unacknowledged.emplace(unacknowledged.end(), &socket);
+        run_on(owner, [origin = shard, acknowledgement, key](Handler& handler) {
+            const auto answer = handler.answering(origin, acknowledgement);
+            handler.in_order(key, false, [&handler, answer, key]() {
+                answer->response = handler.stored_response(key);
+                handler.acknowledge(answer);
+            });
+        });
+        return;
+    }
+    const auto value =
+        is_key_valid(key) ? database.read(key) : FileStorage{0, 0, nullptr};
+    if (value.file == nullptr)
+    {
+        const auto response = write_dynamic_content(
+            ResponseStatus::CLIENT_ERROR, "The key " + key + " was not found!");
+        socket.write(response.data(), response.size(), false);
+        return;
+    }
 
-        // Its a write operation
-        const auto second_message_size = socket.read_buffer.get_integer4();
-        const auto second_message =
-            socket.read_buffer.get_next(second_message_size);
+    const auto header = stored_header(value.compressed);
+    send_stored(socket, key, header.data(), header.size(), value);
+}
 
-        database.write(first_message, second_message);
-        const auto response =
-            write_dynamic_content(ResponseStatus::OK,
-                                  "The key: " + first_message +
-                                      " was successfully written!");
+void Handler::snapshot(ClientSocket& socket, const uint8_t messages)
+{
+    if (messages != 1)
+    {
+        skip_messages(socket.read_buffer, messages);
+        const auto response = write_dynamic_content(
+            ResponseStatus::CLIENT_ERROR,
+            "A snapshot has 1 message after the command: the name!");
         socket.write(response.data(), response.size(), false);
-        cout << "The key: " << first_message << " was successfully written!"
-             << endl;
+        return;
     }
-    catch (const EmptyBufferException& exception)
+    const auto name = read_message(socket.read_buffer);
+    if (!is_key_valid(name))
     {
-        cerr << "Message does not follow KnowNothing Protocol specification!"
-             << endl;
         const auto response = write_dynamic_content(
             ResponseStatus::CLIENT_ERROR,
-            "Message does not follow KnowNothing Protocol Specification!");
+            "The snapshot: " + name + " is not valid! Must be alphanumeric!");
         socket.write(response.data(), response.size(), false);
         return;
     }
+
+    if (!database.create_snapshot(name))
+    {
+        const auto response = write_dynamic_content(
+            ResponseStatus::CLIENT_ERROR,
+            "The snapshot: " + name + " already exists or can not be created!");
+        socket.write(response.data(), response.size(), false);
+        return;
+    }
+
+    /**
+     * Every shard links its segments, and this one writes the manifests when
+     * all of them are done. Answered after the pending writes
+     */
+    const auto acknowledgement = unacknowledged.emplace(
+        unacknowledged.end(),
+        &socket,
+        write_dynamic_content(ResponseStatus::OK,
+                              "The snapshot: " + name + " was taken!"));
+    const auto gathered = make_shared<SnapshotGather>();
+    gathered->remaining = shards.size();
+    gathered->done = true;
+    gathered->bytes = 0;
+    gathered->start = chrono::steady_clock::now();
+    for (uint16_t other = 0; other < shards.size(); other++)
+    {
+        run_on(other,
+               [origin = shard, acknowledgement, gathered, name](
+                   Handler& handler) {
+                   handler.database.snapshot(
+                       name,
+                       [&handler, origin, acknowledgement, gathered, name](
+                           const bool done,
+                           const vector<string>& manifests,
+                           const uint64_t bytes) {
+                           handler.run_on(origin,
+                                          [acknowledgement,
+                                           gathered,
+                                           name,
+                                           done,
+                                           manifests,
+                                           bytes](Handler& client_shard) {
+                                              client_shard.snapshot_linked(
+                                                  acknowledgement,
+                                                  *gathered,
+                                                  name,
+                                                  done,
+                                                  manifests,
+                                                  bytes);
+                                          });
+                       });
+               });
+    }
+}
+
+void Handler::snapshot_linked(const Acknowledgement acknowledgement,
+                              SnapshotGather& gathered,
+                              const string& name,
+                              const bool done,
+                              const vector<string>& manifests,
+                              const uint64_t bytes)
+{
+    gathered.manifests.resize(manifests.size());
+    for (size_t number = 0; number < manifests.size(); number++)
+    {
+        gathered.manifests[number] += manifests[number];
+    }
+    gathered.done = gathered.done && done;
+    gathered.bytes += bytes;
+    if (--gathered.remaining > 0)
+    {
+        return;
+    }
+    if (!gathered.done ||
+        !database.finish_snapshot(
+            name, gathered.manifests, gathered.bytes, gathered.start))
+    {
+        acknowledgement->response = write_dynamic_content(
+            ResponseStatus::SERVER_ERROR,
+            "The snapshot: " + name + " could not be taken!");
+    }
+    acknowledge(acknowledgement);
+}
+
+void Handler::send_stored(ClientSocket& socket,
+                          const string& key,
+                          const uint8_t* header,
+                          const uint32_t header_size,
+                          const FileStorage& value)
+{
+    /**
+     * A small value costs less to copy from the mapping than a second system
+     * call, and is checked against its checksum, right before it, on the way
+     */
+    const auto mapped = value.size <= small_value_size + 4
+                            ? value.file->at(value.offset - 4, value.size + 4)
+                            : nullptr;
+    if (mapped != nullptr)
+    {
+        if (!database.verify(key, value, deserialize(mapped, 4), mapped + 4))
+        {
+            const auto response = write_dynamic_content(
+                ResponseStatus::SERVER_ERROR,
+                "The key: " + key + " could not be read!");
+            socket.write(response.data(), response.size(), false);
+            return;
+        }
+        const struct iovec parts[2] = {
+            {const_cast<uint8_t*>(header), header_size},
+            {const_cast<uint8_t*>(mapped + 4), value.size},
+        };
+        socket.write(parts, 2);
+        return;
+    }
+
+    // The bigger values never reach the user space, so they are not checked
+    // send the first message
+    socket.write(header, header_size, true);
+    // send the second message
+    socket.write(value.file->fd, value.offset, value.size);
 }
 
 bool is_key_valid(const string& key)
@@ -228,9 +1225,172 @@ bool is_key_valid(const string& key)
     return !key.empty() && !regex_search(key, invalid_key_regex);
 }
 
-uint8_t hash(const string key, uint8_t mod)
+bool is_command(const string& message)
+{
+    // A single byte that is not a valid key, the unknown ones are rejected
+    return message.size() == 1 && !is_key_valid(message);
+}
+
+string read_message(ByteBuffer& buffer)
 {
-    return key.size() % mod;
+    const auto size = buffer.get_integer4();
+    const auto content = buffer.get_next(size);
+    return string(content.begin(), content.end());
+}
+
+void skip_messages(ByteBuffer& buffer, const uint8_t count)
+{
+    for (uint8_t index = 0; index < count; index++)
+    {
+        buffer.get_next(buffer.get_integer4());
+    }
+}
+
+void append_message(vector<uint8_t>& response,
+                    const uint8_t* message,
+                    const uint32_t size)
+{
+    serialize(response, size, 4);
+    response.insert(response.end(), message, message + size);
+}
+
+string prefix_end(string prefix)
+{
+    // The smallest key bigger than every key with the prefix
+    while (!prefix.empty() && static_cast<uint8_t>(prefix.back()) == 0xff)
+    {
+        prefix.pop_back();
+    }
+    if (!prefix.empty())
+    {
+        prefix.back()++;
+    }
+    return prefix;
+}
+
+vector<uint8_t> scan_response(const vector<ScanPart>& parts,
+                              const uint32_t limit,
+                              const bool with_values,
+                              string& cursor,
+                              uint32_t& count)
+{
+    for (const auto& part : parts)
+    {
+        if (!part.ordered)
+        {
+            return write_dynamic_content(
+                ResponseStatus::CLIENT_ERROR,
+                "The keys are not ordered! Start the server with "
+                "--ordered-index=yes to scan them");
+        }
+        if (!part.unreadable.empty())
+        {
+            return write_dynamic_content(
+                ResponseStatus::SERVER_ERROR,
+                "The key: " + part.unreadable + " could not be read!");
+        }
+    }
+
+    /**
+     * Every shard has its own keys, in order, so the first limit keys of all
+     * of them are the answer, up to the smallest cursor: a shard whose page
+     * was full of values may have more keys before the last ones of the
+     * others. The next page starts at the first key that was left out, or at
+     * the smallest cursor of the shards that had no more
+     */
+    vector<pair<const string*, size_t>> found;
+    for (size_t index = 0; index < parts.size(); index++)
+    {
+        for (const auto& key : parts[index].keys)
+        {
+            found.emplace_back(&key, index);
+        }
+    }
+    sort(found.begin(),
+         found.end(),
+         [](const pair<const string*, size_t>& first,
+            const pair<const string*, size_t>& second) {
+             return *first.first < *second.first;
+         });
+    for (const auto& part : parts)
+    {
+        if (part.cursor.empty())
+        {
+            continue;
+        }
+        const auto end =
+            find_if(found.begin(),
+                    found.end(),
+                    [&part](const pair<const string*, size_t>& key) {
+                        return *key.first >= part.cursor;
+                    });
+        found.erase(end, found.end());
+    }
+    if (found.size() > limit)
+    {
+        found.resize(limit);
+    }
+    vector<size_t> taken(parts.size(), 0);
+    for (const auto& key : found)
+    {
+        taken[key.second]++;
+    }
+    count = found.size();
+    for (size_t index = 0; index < parts.size(); index++)
+    {
+        const auto& part = parts[index];
+        const auto& next = taken[index] < part.keys.size()
+                               ? part.keys[taken[index]]
+                               : part.cursor;
+        if (!next.empty() && (cursor.empty() || next < cursor))
+        {
+            cursor = next;
+        }
+    }
+
+    vector<uint8_t> response = {Protocol::V1,
+                                static_cast<uint8_t>(
+                                    2 + found.size() * (with_values ? 2 : 1)),
+                                1,
+                                0,
+                                0,
+                                0,
+                                static_cast<uint8_t>(ResponseStatus::OK)};
+    append_message(response,
+                   reinterpret_cast<const uint8_t*>(cursor.data()),
+                   cursor.size());
+    fill(taken.begin(), taken.end(), 0);
+    for (const auto& key : found)
+    {
+        append_message(response,
+                       reinterpret_cast<const uint8_t*>(key.first->data()),
+                       key.first->size());
+        if (with_values)
+        {
+            const auto& value = parts[key.second].values[taken[key.second]];
+            response.insert(response.end(), value.begin(), value.end());
+        }
+        taken[key.second]++;
+    }
+    return response;
+}
+
+vector<uint8_t> stored_header(const bool compressed)
+{
+    return {
+        Protocol::V1,
+        3,  // number of messages
+        1,
+        0,
+        0,
+        0,
+        static_cast<uint8_t>(ResponseStatus::OK),
+        1,
+        0,
+        0,
+        0,
+        compressed ? ValueEncoding::LZ4 : ValueEncoding::PLAIN,
+    };
 }
 
 vector<uint8_t> write_dynamic_content(ResponseStatus status,
@@ -266,3 +1426,4 @@ vector<uint8_t> write_dynamic_content(ResponseStatus status,
     }
     return response;
 }
+
@@ -0,0 +1,122 @@
+#include "hash.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+using namespace std;
+using namespace easykey;
+
+constexpr static uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+constexpr static uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr static uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+constexpr static uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+constexpr static uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static uint64_t rotate_left(const uint64_t value, const uint8_t bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+/**
+ * The input is read as little endian, like the KnowNothing integers.
+ * memcpy does not need the input to be aligned
+ */
+static uint64_t read8(const uint8_t* input)
+{
+    uint64_t value;
+    memcpy(&value, input, sizeof(value));
+    return value;
+}
+
+static uint32_t read4(const uint8_t* input)
+{
+    uint32_t value;
+    memcpy(&value, input, sizeof(value));
+    return value;
+}
+
+static uint64_t mix(uint64_t accumulator, const uint64_t input)
+{
+    accumulator += input * PRIME64_2;
+    accumulator = rotate_left(accumulator, 31);
+    return accumulator * PRIME64_1;
+}
+
+static uint64_t merge(uint64_t accumulator, const uint64_t value)
+{
+    accumulator ^= mix(0, value);
+    return accumulator * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t easykey::hash(const uint8_t* input,
+                       uint64_t size,
+                       const uint64_t seed)
+{
+    const uint64_t total_size = size;
+    uint64_t result;
+
+    if (size >= 32)
+    {
+        // Four independent lanes of 8 bytes
+        uint64_t lane1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t lane2 = seed + PRIME64_2;
+        uint64_t lane3 = seed;
+        uint64_t lane4 = seed - PRIME64_1;
+        while (size >= 32)
+        {
+            lane1 = mix(lane1, read8(input));
+            lane2 = mix(lane2, read8(input + 8));
+            lane3 = mix(lane3, read8(input + 16));
+            lane4 = mix(lane4, read8(input + 24));
+            input += 32;
+            size -= 32;
+        }
+        result = rotate_left(lane1, 1) + rotate_left(lane2, 7) +
+                 rotate_left(lane3, 12) + rotate_left(lane4, 18);
+        result = merge(result, lane1);
+        result = merge(result, lane2);
+        result = merge(result, lane3);
+        result = merge(result, lane4);
+    }
+    else
+    {
+        result = seed + PRIME64_5;
+    }
+    result += total_size;
+
+    while (size >= 8)
+    {
+        result ^= mix(0, read8(input));
+        result = rotate_left(result, 27) * PRIME64_1 + PRIME64_4;
+        input += 8;
+        size -= 8;
+    }
+    if (size >= 4)
+    {
+        result ^= read4(input) * PRIME64_1;
+        result = rotate_left(result, 23) * PRIME64_2 + PRIME64_3;
+        input += 4;
+        size -= 4;
+    }
+    while (size > 0)
+    {
+        result ^= (*input) * PRIME64_5;
+        result = rotate_left(result, 11) * PRIME64_1;
+        input++;
+        size--;
+    }
+
+    // Avalanche, so every input bit affects every output bit
+    result ^= result >> 33;
+    result *= PRIME64_2;
+    result ^= result >> 29;
+    result *= PRIME64_3;
+    result ^= result >> 32;
+    return result;
+}
+
+uint64_t easykey::hash(const string& key)
+{
+    return hash(reinterpret_cast<const uint8_t*>(key.data()), key.size());
+}
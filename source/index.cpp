@@ -0,0 +1,639 @@
+#include "index.hpp"
+#include "hash.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace easykey;
+using namespace std;
+
+/**
+ * How many entries the table starts with, always a power of two
+ */
+constexpr static uint64_t INITIAL_CAPACITY = 1024;
+
+/**
+ * The table doubles when it is 3/4 full, after that the probes get long
+ */
+constexpr static uint64_t MAX_LOAD_NUMERATOR = 3;
+constexpr static uint64_t MAX_LOAD_DENOMINATOR = 4;
+
+/**
+ * The entry key of an empty slot
+ */
+constexpr static uint64_t EMPTY = UINT64_MAX;
+
+/**
+ * The lower 40 bits of the entry key are the arena location, the upper 24
+ * bits are the upper bits of the key hash
+ */
+constexpr static uint8_t LOCATION_BITS = 40;
+constexpr static uint64_t LOCATION_MASK = (1ull << LOCATION_BITS) - 1;
+
+/**
+ * An arena location is the chunk and the position in the chunk.
+ * A key bigger than a chunk gets a chunk of its own
+ */
+constexpr static uint8_t CHUNK_BITS = 20;
+constexpr static uint64_t CHUNK_SIZE = 1ull << CHUNK_BITS;
+
+/**
+ * How many keys a B+tree node has before it is split, and how few before it
+ * is filled from a sibling or merged with it. A quarter, and not a half, so
+ * a node that was just split or merged is not changed again by the next
+ * operations
+ */
+constexpr static uint64_t TREE_NODE_KEYS = 64;
+constexpr static uint64_t TREE_NODE_MIN_KEYS = TREE_NODE_KEYS / 4;
+
+namespace easykey
+{
+/**
+ * The keys are arena locations.
+ * An internal node has one child more than keys, the keys of the child i are
+ * bigger or equal than the key i - 1, and smaller than the key i.
+ * The leaves are linked, so a scan walks them without going up
+ * https://en.wikipedia.org/wiki/B%2B_tree
+ */
+struct TreeNode
+{
+    bool leaf;
+    std::vector<std::uint64_t> keys;
+    std::vector<std::unique_ptr<TreeNode>> children;
+    TreeNode* next;
+};
+};  // namespace easykey
+
+const uint8_t* arena_key(const vector<unique_ptr<uint8_t[]>>& chunks,
+                         const uint64_t location,
+                         uint64_t& size);
+uint8_t varint_size(uint64_t size);
+
+Index::Index(const bool ordered)
+    : count(0),
+      chunks_size(0),
+      chunk_position(CHUNK_SIZE),
+      erased_bytes(0),
+      tree_nodes(0)
+{
+    entries.resize(INITIAL_CAPACITY, IndexEntry{EMPTY, 0, 0, 0, 0});
+    if (ordered)
+    {
+        root.reset(new TreeNode{true, {}, {}, nullptr});
+        tree_nodes = 1;
+    }
+}
+
+Index::~Index()
+{
+}
+
+IndexEntry* Index::find(const string& key)
+{
+    auto& entry = entries[probe(key, hash(key))];
+    return entry.key == EMPTY ? nullptr : &entry;
+}
+
+IndexEntry& Index::insert(const string& key, bool& inserted)
+{
+    const auto key_hash = hash(key);
+    auto slot = probe(key, key_hash);
+    inserted = entries[slot].key == EMPTY;
+    if (!inserted)
+    {
+        return entries[slot];
+    }
+
+    if ((count + 1) * MAX_LOAD_DENOMINATOR >
+        entries.size() * MAX_LOAD_NUMERATOR)
+    {
+        grow();
+        slot = probe(key, key_hash);
+    }
+    count++;
+    const auto location =
+        store(reinterpret_cast<const uint8_t*>(key.data()), key.size());
+    if (root)
+    {
+        uint64_t separator;
+        const auto key_data = reinterpret_cast<const uint8_t*>(key.data());
+        auto right =
+            tree_insert(root.get(), location, key_data, key.size(), separator);
+        if (right)
+        {
+            // The root was split, the tree grows one level
+            unique_ptr<TreeNode> new_root(new TreeNode{false, {}, {}, nullptr});
+            new_root->keys.push_back(separator);
+            new_root->children.push_back(move(root));
+            new_root->children.push_back(move(right));
+            root = move(new_root);
+            tree_nodes++;
+        }
+    }
+    auto& entry = entries[slot];
+    entry = IndexEntry{(key_hash & ~LOCATION_MASK) | location, 0, 0, 0, 0};
+    return entry;
+}
+
+IndexEntry* Index::find_timer(const uint64_t key_hash,
+                              const uint32_t timer,
+                              string& key)
+{
+    // The timers are unique, the probe only needs the tag of the hash
+    const auto mask = entries.size() - 1;
+    const auto tag = key_hash & ~LOCATION_MASK;
+    for (auto slot = key_hash & mask; entries[slot].key != EMPTY;
+         slot = (slot + 1) & mask)
+    {
+        auto& entry = entries[slot];
+        if ((entry.key & ~LOCATION_MASK) == tag && entry.timer == timer)
+        {
+            uint64_t size;
+            const auto key_data = key_at(entry.key & LOCATION_MASK, size);
+            key.assign(key_data, key_data + size);
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+bool Index::erase(const string& key)
+{
+    const auto mask = entries.size() - 1;
+    auto hole = probe(key, hash(key));
+    if (entries[hole].key == EMPTY)
+    {
+        return false;
+    }
+    count--;
+    if (root)
+    {
+        tree_erase(reinterpret_cast<const uint8_t*>(key.data()), key.size());
+    }
+    erased_bytes += varint_size(key.size()) + key.size();
+
+    /**
+     * A probe stops at the first empty slot, so the entries after the hole
+     * are moved back, unless the hole is before where they belong
+     * https://en.wikipedia.org/wiki/Linear_probing#Deletion
+     */
+    for (auto slot = (hole + 1) & mask; entries[slot].key != EMPTY;
+         slot = (slot + 1) & mask)
+    {
+        uint64_t size;
+        const auto stored = key_at(entries[slot].key & LOCATION_MASK, size);
+        const auto home = hash(stored, size) & mask;
+        if (((slot - home) & mask) >= ((slot - hole) & mask))
+        {
+            entries[hole] = entries[slot];
+            hole = slot;
+        }
+    }
+    entries[hole].key = EMPTY;
+
+    /**
+     * When most of the arena is erased keys, the keys left are copied to a
+     * new one
+     */
+    if (chunks_size > CHUNK_SIZE && erased_bytes * 2 > chunks_size)
+    {
+        repack();
+    }
+    return true;
+}
+
+void Index::for_each(const ScanCallback& visit)
+{
+    for (const auto& entry : entries)
+    {
+        if (entry.key == EMPTY)
+        {
+            continue;
+        }
+        uint64_t size;
+        const auto key_data = key_at(entry.key & LOCATION_MASK, size);
+        if (!visit(string(key_data, key_data + size), entry))
+        {
+            return;
+        }
+    }
+}
+
+bool Index::scan(const string& from, const string& to, const ScanCallback& visit)
+{
+    if (!root)
+    {
+        return false;
+    }
+    const auto from_data = reinterpret_cast<const uint8_t*>(from.data());
+    const auto to_data = reinterpret_cast<const uint8_t*>(to.data());
+
+    auto node = root.get();
+    while (!node->leaf)
+    {
+        node = node->children[search(node, from_data, from.size(), false)].get();
+    }
+    auto position = search(node, from_data, from.size(), true);
+    for (; node != nullptr; node = node->next, position = 0)
+    {
+        for (; position < node->keys.size(); position++)
+        {
+            const auto location = node->keys[position];
+            if (!to.empty() && compare(location, to_data, to.size()) >= 0)
+            {
+                return true;
+            }
+            uint64_t size;
+            const auto key_data = key_at(location, size);
+            const string key(key_data, key_data + size);
+            if (!visit(key, *find(key)))
+            {
+                return true;
+            }
+        }
+    }
+    return true;
+}
+
+uint64_t Index::size() const
+{
+    return count;
+}
+
+uint64_t Index::memory() const
+{
+    // The tree nodes are only estimated, from how full they are on average
+    const uint64_t tree = root ? tree_nodes * (sizeof(TreeNode) +
+                                               TREE_NODE_KEYS * 3 / 4 *
+                                                   sizeof(uint64_t))
+                               : 0;
+    return entries.size() * sizeof(IndexEntry) + chunks_size + tree;
+}
+
+uint64_t Index::probe(const string& key, const uint64_t key_hash) const
+{
+    const auto mask = entries.size() - 1;
+    const auto tag = key_hash & ~LOCATION_MASK;
+    for (auto slot = key_hash & mask;; slot = (slot + 1) & mask)
+    {
+        const auto& entry = entries[slot];
+        if (entry.key == EMPTY)
+        {
+            return slot;
+        }
+        if ((entry.key & ~LOCATION_MASK) != tag)
+        {
+            continue;
+        }
+        uint64_t size;
+        const auto stored = key_at(entry.key & LOCATION_MASK, size);
+        if (size == key.size() && memcmp(stored, key.data(), size) == 0)
+        {
+            return slot;
+        }
+    }
+}
+
+void Index::grow()
+{
+    vector<IndexEntry> previous(entries.size() * 2,
+                                IndexEntry{EMPTY, 0, 0, 0, 0});
+    previous.swap(entries);
+    const auto mask = entries.size() - 1;
+    for (const auto& entry : previous)
+    {
+        if (entry.key == EMPTY)
+        {
+            continue;
+        }
+
+        // The keys are unique, so they only need an empty slot
+        uint64_t size;
+        const auto key = key_at(entry.key & LOCATION_MASK, size);
+        auto slot = hash(key, size) & mask;
+        while (entries[slot].key != EMPTY)
+        {
+            slot = (slot + 1) & mask;
+        }
+        entries[slot] = entry;
+    }
+}
+
+void Index::repack()
+{
+    vector<unique_ptr<uint8_t[]>> previous;
+    previous.swap(chunks);
+    chunks_size = 0;
+    chunk_position = CHUNK_SIZE;
+    erased_bytes = 0;
+
+    // The B+tree has the same locations, they are moved after the entries
+    unordered_map<uint64_t, uint64_t> moved;
+    if (root)
+    {
+        moved.reserve(count);
+    }
+    for (auto& entry : entries)
+    {
+        if (entry.key == EMPTY)
+        {
+            continue;
+        }
+        uint64_t size;
+        const auto location = entry.key & LOCATION_MASK;
+        const auto key = arena_key(previous, location, size);
+        entry.key = (entry.key & ~LOCATION_MASK) | store(key, size);
+        if (root)
+        {
+            moved.emplace(location, entry.key & LOCATION_MASK);
+        }
+    }
+    if (root)
+    {
+        relocate(root.get(), previous, moved);
+    }
+}
+
+void Index::relocate(TreeNode* node,
+                     const vector<unique_ptr<uint8_t[]>>& previous,
+                     unordered_map<uint64_t, uint64_t>& moved)
+{
+    for (auto& location : node->keys)
+    {
+        const auto found = moved.find(location);
+        if (found != moved.end())
+        {
+            location = found->second;
+            continue;
+        }
+
+        // Only a separator of an internal node can be an erased key
+        uint64_t size;
+        const auto key = arena_key(previous, location, size);
+        const auto copied = store(key, size);
+        erased_bytes += varint_size(size) + size;
+        moved.emplace(location, copied);
+        location = copied;
+    }
+    for (auto& child : node->children)
+    {
+        relocate(child.get(), previous, moved);
+    }
+}
+
+uint64_t Index::store(const uint8_t* key, const uint64_t key_size)
+{
+    // The size is a varint, the keys are usually small
+    uint8_t header[10];
+    uint8_t header_size = 0;
+    uint64_t size = key_size;
+    do
+    {
+        header[header_size] = (size & 0x7f) | (size > 0x7f ? 0x80 : 0);
+        header_size++;
+        size >>= 7;
+    } while (size > 0);
+
+    const auto needed = header_size + key_size;
+    if (chunk_position + needed > CHUNK_SIZE)
+    {
+        const auto chunk_size = max(CHUNK_SIZE, (uint64_t)needed);
+        chunks.emplace_back(new uint8_t[chunk_size]);
+        chunks_size += chunk_size;
+        chunk_position = 0;
+    }
+    const auto location =
+        ((chunks.size() - 1) << CHUNK_BITS) | chunk_position;
+    auto output = chunks.back().get() + chunk_position;
+    memcpy(output, header, header_size);
+    memcpy(output + header_size, key, key_size);
+    chunk_position += needed;
+    return location;
+}
+
+int32_t Index::compare(const uint64_t location,
+                       const uint8_t* key,
+                       const uint64_t size) const
+{
+    uint64_t stored_size;
+    const auto stored = key_at(location, stored_size);
+    const auto result = memcmp(stored, key, min(stored_size, size));
+    if (result != 0 || stored_size == size)
+    {
+        return result;
+    }
+    return stored_size < size ? -1 : 1;
+}
+
+uint64_t Index::search(const TreeNode* node,
+                       const uint8_t* key,
+                       const uint64_t size,
+                       const bool inclusive) const
+{
+    uint64_t low = 0;
+    uint64_t high = node->keys.size();
+    while (low < high)
+    {
+        const auto middle = low + (high - low) / 2;
+        const auto result = compare(node->keys[middle], key, size);
+        if (result > 0 || (inclusive && result == 0))
+        {
+            high = middle;
+        }
+        else
+        {
+            low = middle + 1;
+        }
+    }
+    return low;
+}
+
+unique_ptr<TreeNode> Index::tree_insert(TreeNode* node,
+                                        const uint64_t location,
+                                        const uint8_t* key,
+                                        const uint64_t size,
+                                        uint64_t& separator)
+{
+    const auto position = search(node, key, size, false);
+    if (node->leaf)
+    {
+        node->keys.insert(node->keys.begin() + position, location);
+    }
+    else
+    {
+        uint64_t child_separator;
+        auto child = tree_insert(node->children[position].get(),
+                                 location,
+                                 key,
+                                 size,
+                                 child_separator);
+        if (child)
+        {
+            node->keys.insert(node->keys.begin() + position, child_separator);
+            node->children.insert(node->children.begin() + position + 1,
+                                  move(child));
+        }
+    }
+    if (node->keys.size() <= TREE_NODE_KEYS)
+    {
+        return nullptr;
+    }
+
+    // Splits the node in half
+    unique_ptr<TreeNode> right(new TreeNode{node->leaf, {}, {}, nullptr});
+    tree_nodes++;
+    const auto middle = node->keys.size() / 2;
+    if (node->leaf)
+    {
+        right->keys.assign(node->keys.begin() + middle, node->keys.end());
+        node->keys.resize(middle);
+        separator = right->keys.front();
+        right->next = node->next;
+        node->next = right.get();
+        return right;
+    }
+
+    // The middle key moves up, it only separates the two halves
+    separator = node->keys[middle];
+    right->keys.assign(node->keys.begin() + middle + 1, node->keys.end());
+    node->keys.resize(middle);
+    for (auto child = node->children.begin() + middle + 1;
+         child != node->children.end();
+         child++)
+    {
+        right->children.push_back(move(*child));
+    }
+    node->children.resize(middle + 1);
+    return right;
+}
+
+const uint8_t* Index::key_at(const uint64_t location, uint64_t& size) const
+{
+    return arena_key(chunks, location, size);
+}
+
+const uint8_t* arena_key(const vector<unique_ptr<uint8_t[]>>& chunks,
+                         const uint64_t location,
+                         uint64_t& size)
+{
+    auto input = chunks[location >> CHUNK_BITS].get() +
+                 (location & (CHUNK_SIZE - 1));
+    size = 0;
+    for (uint8_t shift = 0;; shift += 7)
+    {
+        const auto byte = *input++;
+        size |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return input;
+        }
+    }
+}
+
+void Index::tree_erase(const uint8_t* key, const uint64_t size)
+{
+    tree_erase(root.get(), key, size);
+
+    // The root lost its last separator, its only child is the root now
+    if (!root->leaf && root->keys.empty())
+    {
+        unique_ptr<TreeNode> child = move(root->children.front());
+        root = move(child);
+        tree_nodes--;
+    }
+}
+
+bool Index::tree_erase(TreeNode* node, const uint8_t* key, const uint64_t size)
+{
+    if (node->leaf)
+    {
+        const auto position = search(node, key, size, true);
+        if (position < node->keys.size() &&
+            compare(node->keys[position], key, size) == 0)
+        {
+            node->keys.erase(node->keys.begin() + position);
+        }
+        return node->keys.size() < TREE_NODE_MIN_KEYS;
+    }
+    const auto position = search(node, key, size, false);
+    if (tree_erase(node->children[position].get(), key, size))
+    {
+        rebalance(node, position);
+    }
+    return node->keys.size() < TREE_NODE_MIN_KEYS;
+}
+
+void Index::rebalance(TreeNode* node, const uint64_t position)
+{
+    // The child and its left sibling, or its right one for the first child
+    const auto separator = position > 0 ? position - 1 : position;
+    auto left = node->children[separator].get();
+    auto right = node->children[separator + 1].get();
+
+    /**
+     * The keys of both, in order. The separator of two internal nodes goes
+     * down between them, the one of two leaves is only a copy of the first
+     * key of the right one
+     */
+    vector<uint64_t> keys = move(left->keys);
+    if (!left->leaf)
+    {
+        keys.push_back(node->keys[separator]);
+    }
+    keys.insert(keys.end(), right->keys.begin(), right->keys.end());
+    vector<unique_ptr<TreeNode>> children = move(left->children);
+    for (auto& child : right->children)
+    {
+        children.push_back(move(child));
+    }
+    left->keys.clear();
+    left->children.clear();
+    right->keys.clear();
+    right->children.clear();
+
+    if (keys.size() <= TREE_NODE_KEYS)
+    {
+        // Merged in the left one, the right one is freed
+        left->keys = move(keys);
+        left->children = move(children);
+        left->next = right->next;
+        node->keys.erase(node->keys.begin() + separator);
+        node->children.erase(node->children.begin() + separator + 1);
+        tree_nodes--;
+        return;
+    }
+
+    // Split in half again, with a new separator
+    const auto middle = keys.size() / 2;
+    if (left->leaf)
+    {
+        left->keys.assign(keys.begin(), keys.begin() + middle);
+        right->keys.assign(keys.begin() + middle, keys.end());
+        node->keys[separator] = right->keys.front();
+        return;
+    }
+    left->keys.assign(keys.begin(), keys.begin() + middle);
+    node->keys[separator] = keys[middle];
+    right->keys.assign(keys.begin() + middle + 1, keys.end());
+    for (uint64_t child = 0; child < children.size(); child++)
+    {
+        auto& side = child <= middle ? left->children : right->children;
+        side.push_back(move(children[child]));
+    }
+}
+
+uint8_t varint_size(uint64_t size)
+{
+    uint8_t bytes = 1;
+    while (size > 0x7f)
+    {
+        size >>= 7;
+        bytes++;
+    }
+    return bytes;
+}
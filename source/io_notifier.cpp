@@ -3,6 +3,7 @@
 #include <bits/stdint-uintn.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <algorithm>
 #include <chrono>
 #include <cstdint>
 #include <cstring>
@@ -18,6 +19,11 @@ using namespace easykey;
  */
 constexpr static int32_t POLL_SYSTEM_FLAGS = 0;
 
+/**
+ * The events array never gets smaller than this
+ */
+constexpr static size_t MINIMUM_EVENTS = 32;
+
 namespace easykey
 {
 /**
@@ -37,6 +43,12 @@ const EventType EventType::WRITE(EPOLLOUT);
  */
 const EventType EventType::CLOSE_CONNECTION(EPOLLRDHUP);
 
+/**
+ * The socket has an error, or was closed both ways: nothing can be sent to
+ * the peer anymore. Always reported, it does not need to be added
+ */
+const EventType EventType::HANG_UP(EPOLLHUP | EPOLLERR);
+
 };  // namespace easykey
 
 Event::Event(int32_t file_descriptor) : file_descriptor(file_descriptor)
@@ -44,6 +56,11 @@ Event::Event(int32_t file_descriptor) : file_descriptor(file_descriptor)
     flags = 0;
 }
 
+Event::Event(const struct epoll_event &returned)
+    : file_descriptor(returned.data.fd), flags(returned.events)
+{
+}
+
 Event &Event::add(const EventType &type)
 {
     flags |= type.flag;
@@ -65,7 +82,7 @@ bool Event::is_for(const int32_t file_descriptor) const
     return this->file_descriptor == file_descriptor;
 }
 
-IONotifier::IONotifier()
+IONotifier::IONotifier() : tracked_file_descriptors_count(0)
 {
     file_descriptor = epoll_create1(POLL_SYSTEM_FLAGS);
     if (file_descriptor < 0)
@@ -108,7 +125,7 @@ bool IONotifier::add_event(const Event event)
     const bool success = epoll_ctl(file_descriptor,
                                    EPOLL_CTL_ADD,
                                    event.file_descriptor,
-                                   &epoll_e);
+                                   &epoll_e) == 0;
 
     if (success)
     {
@@ -122,7 +139,7 @@ bool IONotifier::delete_event(const Event event)
     const bool success = epoll_ctl(file_descriptor,
                                    EPOLL_CTL_DEL,
                                    event.file_descriptor,
-                                   nullptr);
+                                   nullptr) == 0;
     if (success)
     {
         tracked_file_descriptors_count--;
@@ -130,51 +147,31 @@ bool IONotifier::delete_event(const Event event)
     return success;
 }
 
-const vector<Event> IONotifier::wait_for_events(
-    chrono::duration<uint64_t, nano> timeout)
+uint32_t IONotifier::wait_for_events(chrono::duration<uint64_t, nano> timeout)
 {
-    // TODO: Should not be a static value size.
-    // Should grow/shrink, while new file descriptors are added/removed ...
-    struct epoll_event events_buffer[32];
+    const auto wanted =
+        max<size_t>(MINIMUM_EVENTS, tracked_file_descriptors_count);
+    if (events_buffer.size() < wanted || events_buffer.size() > 4 * wanted)
+    {
+        events_buffer.resize(wanted);
+        events_buffer.shrink_to_fit();
+    }
 
     const auto total_events = epoll_wait(
         file_descriptor,
-        events_buffer,
-        sizeof(events_buffer) / sizeof(events_buffer[0]),
+        events_buffer.data(),
+        events_buffer.size(),
         chrono::duration_cast<chrono::milliseconds>(timeout).count());
 
     if (total_events < 0)
     {
         cerr << "Epoll wait error!" << endl;
-        return {};
-    }
-    if (total_events == 0)
-    {
-        cout << "Epoll Timeout!" << endl;
-        return {};
+        return 0;
     }
+    return total_events;
+}
 
-    vector<Event> events;
-    events.reserve(total_events);
-    for (int32_t index = 0; index < total_events; index++)
-    {
-        const auto returned = events_buffer[index];
-
-        Event event(returned.data.fd);
-
-        if (returned.events & EPOLLRDHUP)
-        {
-            event.add(EventType::CLOSE_CONNECTION);
-        }
-        else if (returned.events & EPOLLIN)
-        {
-            event.add(EventType::READ);
-        }
-        else if (returned.events & EPOLLOUT)
-        {
-            event.add(EventType::WRITE);
-        }
-        events.push_back(event);
-    }
-    return events;
-}
\ No newline at end of file
+Event IONotifier::event(const uint32_t index) const
+{
+    return Event(events_buffer[index]);
+}
@@ -0,0 +1,463 @@
+#include "key_table.hpp"
+#include "crc32c.hpp"
+#include "database.hpp"
+#include "hash.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace easykey;
+using namespace std;
+
+/**
+ * The first bytes of every table file
+ */
+constexpr static uint8_t TABLE_FILE_MAGIC[4] = {'E', 'K', 'T', '1'};
+
+/**
+ * [4-byte magic][8-byte dead bytes][4-byte checksum]
+ * [8-byte covered size][8-byte keys][8-byte filter blocks][8-byte pages]
+ * [8-byte pages offset]
+ * Then the filter, and for every page:
+ * [8-byte offset][4-byte first key size][first key][4-byte page size]
+ * The checksum is the CRC-32C of everything after it until the pages, the
+ * dead bytes change after the table is written
+ */
+constexpr static uint64_t HEADER_SIZE = 56;
+constexpr static uint64_t CHECKED_OFFSET = 16;
+
+/**
+ * The pages are read whole, an entry is only in a bigger page if it does not
+ * fit a page alone
+ */
+constexpr static uint64_t PAGE_SIZE = 4096;
+
+/**
+ * About 1% of the keys that are not in the table pass the filter
+ */
+constexpr static uint64_t FILTER_BITS_PER_KEY = 10;
+constexpr static uint8_t FILTER_PROBES = 7;
+constexpr static uint64_t FILTER_BLOCK_BITS = 512;
+constexpr static uint64_t FILTER_BLOCK_WORDS = FILTER_BLOCK_BITS / 64;
+
+/**
+ * The probes are 9 bits each of the hash multiplied by this, so they depend
+ * on every bit of it
+ */
+constexpr static uint64_t FILTER_MIX = 0x9E3779B97F4A7C15;
+
+/**
+ * Not the seed of the partitions, the keys of a partition share the bits of
+ * that hash
+ */
+constexpr static uint64_t FILTER_SEED = 0x6B65797461626C65;
+
+/**
+ * Set in the key size of the entries with an expiry, like in the records
+ */
+constexpr static uint32_t EXPIRY_FLAG = 0x40000000;
+
+bool write_file(const string& filename, const vector<uint8_t>& bytes);
+uint64_t filter_block(const uint64_t filter_hash, const uint64_t blocks);
+
+bool KeyTable::write(const string& filename,
+                     vector<TableEntry>& entries,
+                     const uint64_t covered,
+                     const uint64_t dead_bytes)
+{
+    return write_file(filename, encode(entries, covered, dead_bytes));
+}
+
+vector<uint8_t> KeyTable::encode(vector<TableEntry>& entries,
+                                 const uint64_t covered,
+                                 const uint64_t dead_bytes)
+{
+    // The stable sort keeps the entries of a key in the segment order
+    stable_sort(entries.begin(),
+                entries.end(),
+                [](const TableEntry& left, const TableEntry& right) {
+                    return left.key < right.key;
+                });
+    uint64_t keys = 0;
+    for (uint64_t index = 0; index < entries.size(); index++)
+    {
+        if (index + 1 < entries.size() &&
+            entries[index].key == entries[index + 1].key)
+        {
+            continue;
+        }
+        // Moving an entry to itself would leave it empty
+        if (keys != index)
+        {
+            entries[keys] = move(entries[index]);
+        }
+        keys++;
+    }
+    entries.resize(keys);
+
+    const uint64_t blocks =
+        max((uint64_t)1,
+            (keys * FILTER_BITS_PER_KEY + FILTER_BLOCK_BITS - 1) /
+                FILTER_BLOCK_BITS);
+    vector<uint64_t> filter(blocks * FILTER_BLOCK_WORDS, 0);
+
+    // [4-byte key size][key][8-byte offset][4-byte size]([8-byte expiry])
+    vector<uint8_t> pages;
+    vector<uint8_t> directory;
+    uint64_t page_start = 0;
+    uint64_t page_count = 0;
+    for (const auto& entry : entries)
+    {
+        const auto filter_hash = KeyTable::filter_hash(entry.key);
+        const auto words = filter.data() + filter_block(filter_hash, blocks) *
+                                               FILTER_BLOCK_WORDS;
+        auto bits = filter_hash * FILTER_MIX;
+        for (uint8_t probe = 0; probe < FILTER_PROBES; probe++)
+        {
+            const auto bit = bits & (FILTER_BLOCK_BITS - 1);
+            words[bit / 64] |= 1ull << (bit % 64);
+            bits >>= 9;
+        }
+
+        const uint64_t entry_size =
+            4 + entry.key.size() + 12 + (entry.expiry != 0 ? 8 : 0);
+        const bool full = pages.size() - page_start + entry_size > PAGE_SIZE;
+        if (pages.size() == 0 || (full && pages.size() > page_start))
+        {
+            if (pages.size() > 0)
+            {
+                serialize(directory, pages.size() - page_start, 4);
+            }
+            page_start = pages.size();
+            page_count++;
+            serialize(directory, page_start, 8);
+            serialize(directory, entry.key.size(), 4);
+            directory.insert(
+                directory.end(), entry.key.begin(), entry.key.end());
+        }
+        serialize(pages,
+                  entry.key.size() | (entry.expiry != 0 ? EXPIRY_FLAG : 0),
+                  4);
+        pages.insert(pages.end(), entry.key.begin(), entry.key.end());
+        serialize(pages, entry.offset, 8);
+        serialize(pages, entry.size, 4);
+        if (entry.expiry != 0)
+        {
+            serialize(pages, entry.expiry, 8);
+        }
+    }
+    if (pages.size() > 0)
+    {
+        serialize(directory, pages.size() - page_start, 4);
+    }
+
+    vector<uint8_t> metadata;
+    metadata.reserve(HEADER_SIZE + filter.size() * 8 + directory.size() +
+                     pages.size());
+    metadata.insert(metadata.end(),
+                    TABLE_FILE_MAGIC,
+                    TABLE_FILE_MAGIC + sizeof(TABLE_FILE_MAGIC));
+    serialize(metadata, dead_bytes, 8);
+    serialize(metadata, 0, 4);
+    serialize(metadata, covered, 8);
+    serialize(metadata, keys, 8);
+    serialize(metadata, blocks, 8);
+    serialize(metadata, page_count, 8);
+    serialize(metadata,
+              HEADER_SIZE + filter.size() * 8 + directory.size(),
+              8);
+    for (const auto& word : filter)
+    {
+        serialize(metadata, word, 8);
+    }
+    metadata.insert(metadata.end(), directory.begin(), directory.end());
+    const auto checksum = crc32c(metadata.data() + CHECKED_OFFSET,
+                                 metadata.size() - CHECKED_OFFSET);
+    for (uint8_t index = 0; index < 4; index++)
+    {
+        metadata[12 + index] = checksum >> (8 * index);
+    }
+    metadata.insert(metadata.end(), pages.begin(), pages.end());
+    return metadata;
+}
+
+unique_ptr<KeyTable> KeyTable::open(const string& filename)
+{
+    // Read and write, the dead bytes are saved in place
+    const int32_t fd = ::open(filename.c_str(), O_RDWR);
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+    unique_ptr<KeyTable> table(new KeyTable(fd));
+
+    uint8_t header[HEADER_SIZE];
+    if (::pread(fd, header, HEADER_SIZE, 0) != (ssize_t)HEADER_SIZE ||
+        memcmp(header, TABLE_FILE_MAGIC, sizeof(TABLE_FILE_MAGIC)) != 0)
+    {
+        return nullptr;
+    }
+    table->saved_dead_bytes = deserialize(header + 4, 8);
+    const uint32_t checksum = deserialize(header + 12, 4);
+    table->covered_size = deserialize(header + 16, 8);
+    table->count = deserialize(header + 24, 8);
+    const auto blocks = deserialize(header + 32, 8);
+    const auto page_count = deserialize(header + 40, 8);
+    const auto pages_offset = deserialize(header + 48, 8);
+
+    struct stat table_stat;
+    if (fstat(fd, &table_stat) < 0 ||
+        pages_offset > (uint64_t)table_stat.st_size ||
+        pages_offset < HEADER_SIZE + blocks * FILTER_BLOCK_BITS / 8 ||
+        blocks == 0)
+    {
+        return nullptr;
+    }
+    vector<uint8_t> metadata(pages_offset);
+    if (::pread(fd, metadata.data(), pages_offset, 0) !=
+            (ssize_t)pages_offset ||
+        crc32c(metadata.data() + CHECKED_OFFSET,
+               metadata.size() - CHECKED_OFFSET) != checksum)
+    {
+        cerr << "The key table: " << filename << " is corrupted!" << endl;
+        return nullptr;
+    }
+
+    auto position = HEADER_SIZE;
+    table->filter.resize(blocks * FILTER_BLOCK_WORDS);
+    for (auto& word : table->filter)
+    {
+        word = deserialize(metadata.data() + position, 8);
+        position += 8;
+    }
+    const auto pages_size = table_stat.st_size - pages_offset;
+    table->pages.reserve(page_count);
+    for (uint64_t page = 0; page < page_count; page++)
+    {
+        if (metadata.size() - position < 12)
+        {
+            return nullptr;
+        }
+        const auto offset = deserialize(metadata.data() + position, 8);
+        const auto key_size = deserialize(metadata.data() + position + 8, 4);
+        position += 12;
+        if (metadata.size() - position < key_size + 4)
+        {
+            return nullptr;
+        }
+        table->pages.push_back(
+            Page{pages_offset + offset, 0, (uint32_t)table->first_keys.size()});
+        table->first_keys.append(
+            reinterpret_cast<const char*>(metadata.data() + position),
+            key_size);
+        position += key_size;
+        table->pages.back().size =
+            deserialize(metadata.data() + position, 4);
+        position += 4;
+        if (offset + table->pages.back().size > pages_size)
+        {
+            return nullptr;
+        }
+    }
+    return table;
+}
+
+uint64_t KeyTable::filter_hash(const string& key)
+{
+    return hash(reinterpret_cast<const uint8_t*>(key.data()),
+                key.size(),
+                FILTER_SEED);
+}
+
+KeyTable::KeyTable(const int32_t fd)
+    : fd(fd), covered_size(0), saved_dead_bytes(0), count(0)
+{
+}
+
+KeyTable::~KeyTable()
+{
+    close(fd);
+}
+
+bool KeyTable::find(const string& key,
+                    const uint64_t filter_hash,
+                    TableEntry& entry) const
+{
+    if (!may_contain(filter_hash))
+    {
+        return false;
+    }
+
+    // The last page whose first key is not bigger than the key
+    uint64_t low = 0;
+    uint64_t high = pages.size();
+    while (low < high)
+    {
+        const auto middle = low + (high - low) / 2;
+        if (compare(middle, key) <= 0)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    if (low == 0)
+    {
+        return false;
+    }
+    const auto& page = pages[low - 1];
+
+    uint8_t small_page[PAGE_SIZE];
+    vector<uint8_t> big_page;
+    auto content = small_page;
+    if (page.size > PAGE_SIZE)
+    {
+        big_page.resize(page.size);
+        content = big_page.data();
+    }
+    if (::pread(fd, content, page.size, page.offset) != (ssize_t)page.size)
+    {
+        perror("pread: ");
+        return false;
+    }
+
+    // The entries are sorted, the search stops at the first bigger key
+    uint64_t position = 0;
+    while (position + 4 <= page.size)
+    {
+        const auto key_header = deserialize(content + position, 4);
+        const uint64_t key_size = key_header & ~EXPIRY_FLAG;
+        const uint64_t expiry_size = key_header & EXPIRY_FLAG ? 8 : 0;
+        position += 4;
+        if (page.size - position < key_size + 12 + expiry_size)
+        {
+            return false;
+        }
+        const auto order = key.compare(
+            0,
+            key.size(),
+            reinterpret_cast<const char*>(content + position),
+            key_size);
+        if (order < 0)
+        {
+            return false;
+        }
+        position += key_size;
+        if (order == 0)
+        {
+            entry.key = key;
+            entry.offset = deserialize(content + position, 8);
+            entry.size = deserialize(content + position + 8, 4);
+            entry.expiry =
+                expiry_size > 0 ? deserialize(content + position + 12, 8) : 0;
+            return true;
+        }
+        position += 12 + expiry_size;
+    }
+    return false;
+}
+
+void KeyTable::save_dead_bytes(const uint64_t dead_bytes)
+{
+    if (dead_bytes == saved_dead_bytes)
+    {
+        return;
+    }
+    vector<uint8_t> bytes;
+    serialize(bytes, dead_bytes, 8);
+    if (::pwrite(fd, bytes.data(), bytes.size(), 4) == (ssize_t)bytes.size())
+    {
+        saved_dead_bytes = dead_bytes;
+    }
+}
+
+uint64_t KeyTable::covered() const
+{
+    return covered_size;
+}
+
+uint64_t KeyTable::dead_bytes() const
+{
+    return saved_dead_bytes;
+}
+
+uint64_t KeyTable::size() const
+{
+    return count;
+}
+
+uint64_t KeyTable::memory() const
+{
+    return filter.size() * sizeof(uint64_t) + pages.size() * sizeof(Page) +
+           first_keys.size();
+}
+
+bool KeyTable::may_contain(const uint64_t filter_hash) const
+{
+    const auto words =
+        filter.data() +
+        filter_block(filter_hash, filter.size() / FILTER_BLOCK_WORDS) *
+            FILTER_BLOCK_WORDS;
+    auto bits = filter_hash * FILTER_MIX;
+    for (uint8_t probe = 0; probe < FILTER_PROBES; probe++)
+    {
+        const auto bit = bits & (FILTER_BLOCK_BITS - 1);
+        if ((words[bit / 64] & (1ull << (bit % 64))) == 0)
+        {
+            return false;
+        }
+        bits >>= 9;
+    }
+    return true;
+}
+
+int32_t KeyTable::compare(const uint64_t page, const string& key) const
+{
+    const auto position = pages[page].key_position;
+    const auto end = page + 1 < pages.size() ? pages[page + 1].key_position
+                                             : first_keys.size();
+    return first_keys.compare(position, end - position, key);
+}
+
+bool write_file(const string& filename, const vector<uint8_t>& bytes)
+{
+    const auto temporary = filename + ".tmp";
+    const int32_t fd = open(
+        temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+    {
+        cerr << "Could not create the key table: " << temporary << endl;
+        return false;
+    }
+    const bool written =
+        ::pwrite(fd, bytes.data(), bytes.size(), 0) == (ssize_t)bytes.size() &&
+        fsync(fd) == 0;
+    close(fd);
+
+    // Rename is atomic, a crash never leaves a half written table
+    if (!written || rename(temporary.c_str(), filename.c_str()) < 0)
+    {
+        cerr << "Could not write the key table: " << filename << endl;
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+uint64_t filter_block(const uint64_t filter_hash, const uint64_t blocks)
+{
+    // The upper bits pick the block, without a division
+    return ((filter_hash >> 32) * blocks) >> 32;
+}
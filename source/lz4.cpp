@@ -0,0 +1,298 @@
+#include "lz4.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+using namespace easykey;
+using namespace std;
+
+/**
+ * The shortest match, its length is stored minus this
+ */
+constexpr static uint64_t MIN_MATCH = 4;
+
+/**
+ * The last bytes of a block are always literals, and the last match starts
+ * at least 12 bytes before the end
+ */
+constexpr static uint64_t LAST_LITERALS = 5;
+constexpr static uint64_t MATCH_LIMIT = 12;
+
+/**
+ * How far back a match can be, the offset has 2 bytes
+ */
+constexpr static uint64_t MAX_OFFSET = 65535;
+
+/**
+ * The last positions of the 4-byte sequences, by their hash
+ */
+constexpr static uint8_t HASH_BITS = 12;
+
+/**
+ * After this many misses in a row, the input is probably not compressible,
+ * and the search starts skipping more and more bytes
+ */
+constexpr static uint8_t SKIP_TRIGGER = 6;
+
+/**
+ * The lengths that do not fit the 4 bits of the token
+ */
+constexpr static uint64_t LENGTH_MASK = 15;
+
+uint32_t read_sequence(const uint8_t* input);
+uint64_t match_end(const uint8_t* input,
+                   uint64_t position,
+                   const uint64_t distance,
+                   const uint64_t limit);
+void write_length(vector<uint8_t>& output, uint64_t length);
+bool read_length(const uint8_t* input,
+                 const uint64_t input_size,
+                 uint64_t& position,
+                 uint64_t& length);
+void write_sequence(vector<uint8_t>& output,
+                    const uint8_t* literals,
+                    const uint64_t literals_size,
+                    const uint64_t offset,
+                    const uint64_t match_size);
+
+void easykey::lz4_compress(const uint8_t* input,
+                           const uint64_t size,
+                           vector<uint8_t>& output)
+{
+    output.reserve(output.size() + size + size / 255 + 16);
+    uint64_t anchor = 0;
+
+    // A block smaller than that has only literals
+    if (size > MATCH_LIMIT)
+    {
+        vector<uint32_t> positions(1 << HASH_BITS, 0);
+        const auto match_start_limit = size - MATCH_LIMIT;
+        const auto match_end_limit = size - LAST_LITERALS;
+        uint64_t position = 1;
+        uint64_t misses = 1 << SKIP_TRIGGER;
+        while (position < match_start_limit)
+        {
+            const auto sequence = read_sequence(input + position);
+            auto& last = positions[(sequence * 2654435761u) >> (32 - HASH_BITS)];
+            const uint64_t candidate = last;
+            last = position;
+            if (position - candidate > MAX_OFFSET ||
+                read_sequence(input + candidate) != sequence)
+            {
+                position += misses++ >> SKIP_TRIGGER;
+                continue;
+            }
+            misses = 1 << SKIP_TRIGGER;
+
+            // The match can also start before, among the pending literals
+            auto start = position;
+            auto reference = candidate;
+            while (start > anchor && reference > 0 &&
+                   input[start - 1] == input[reference - 1])
+            {
+                start--;
+                reference--;
+            }
+            const auto end = match_end(input,
+                                       position + MIN_MATCH,
+                                       position - candidate,
+                                       match_end_limit);
+
+            write_sequence(output,
+                           input + anchor,
+                           start - anchor,
+                           start - reference,
+                           end - start);
+            anchor = end;
+            position = end;
+        }
+    }
+
+    // The last sequence has only literals
+    const auto literals_size = size - anchor;
+    output.push_back(min(literals_size, LENGTH_MASK) << 4);
+    if (literals_size >= LENGTH_MASK)
+    {
+        write_length(output, literals_size - LENGTH_MASK);
+    }
+    output.insert(output.end(), input + anchor, input + size);
+}
+
+bool easykey::lz4_decompress(const uint8_t* input,
+                             const uint64_t input_size,
+                             const uint64_t size,
+                             vector<uint8_t>& output)
+{
+    const auto start = output.size();
+    output.resize(start + size);
+    auto decompressed = output.data() + start;
+    uint64_t written = 0;
+    uint64_t position = 0;
+    bool valid = true;
+    while (valid && position < input_size)
+    {
+        const auto token = input[position++];
+        uint64_t literals_size = token >> 4;
+        valid = (literals_size < LENGTH_MASK ||
+                 read_length(input, input_size, position, literals_size)) &&
+                literals_size <= input_size - position &&
+                literals_size <= size - written;
+        if (!valid)
+        {
+            break;
+        }
+
+        // The usual short literals are copied with a fixed size, when there
+        // is room for it
+        if (literals_size <= 16 && input_size - position >= 16 &&
+            size - written >= 16)
+        {
+            memcpy(decompressed + written, input + position, 16);
+        }
+        else
+        {
+            memcpy(decompressed + written, input + position, literals_size);
+        }
+        position += literals_size;
+        written += literals_size;
+
+        // The last sequence has no match
+        if (position == input_size)
+        {
+            break;
+        }
+
+        uint64_t offset = 0;
+        uint64_t match_size = token & LENGTH_MASK;
+        valid = input_size - position >= 2;
+        if (valid)
+        {
+            offset = input[position] | input[position + 1] << 8;
+            position += 2;
+        }
+        valid = valid && offset > 0 && offset <= written &&
+                (match_size < LENGTH_MASK ||
+                 read_length(input, input_size, position, match_size)) &&
+                match_size + MIN_MATCH <= size - written;
+        if (!valid)
+        {
+            break;
+        }
+        match_size += MIN_MATCH;
+
+        /**
+         * A match can overlap what it copies, a run of the same bytes.
+         * From 8 bytes back, every 8 bytes copied were already written, and
+         * the bytes written past the match are overwritten later
+         */
+        const auto from = decompressed + written - offset;
+        if (offset >= 8 && size - written >= match_size + 8)
+        {
+            for (uint64_t index = 0; index < match_size; index += 8)
+            {
+                memcpy(decompressed + written + index, from + index, 8);
+            }
+        }
+        else if (offset >= match_size)
+        {
+            memcpy(decompressed + written, from, match_size);
+        }
+        else
+        {
+            for (uint64_t index = 0; index < match_size; index++)
+            {
+                decompressed[written + index] = from[index];
+            }
+        }
+        written += match_size;
+    }
+
+    if (!valid || written != size)
+    {
+        output.resize(start);
+        return false;
+    }
+    return true;
+}
+
+uint32_t read_sequence(const uint8_t* input)
+{
+    uint32_t sequence;
+    memcpy(&sequence, input, sizeof(sequence));
+    return sequence;
+}
+
+uint64_t match_end(const uint8_t* input,
+                   uint64_t position,
+                   const uint64_t distance,
+                   const uint64_t limit)
+{
+    // 8 bytes at a time, the first different byte has the first different bit
+    for (; position + 8 <= limit; position += 8)
+    {
+        uint64_t current;
+        uint64_t previous;
+        memcpy(&current, input + position, 8);
+        memcpy(&previous, input + position - distance, 8);
+        if (current != previous)
+        {
+            return position + __builtin_ctzll(current ^ previous) / 8;
+        }
+    }
+    while (position < limit && input[position] == input[position - distance])
+    {
+        position++;
+    }
+    return position;
+}
+
+void write_length(vector<uint8_t>& output, uint64_t length)
+{
+    for (; length >= 255; length -= 255)
+    {
+        output.push_back(255);
+    }
+    output.push_back(length);
+}
+
+bool read_length(const uint8_t* input,
+                 const uint64_t input_size,
+                 uint64_t& position,
+                 uint64_t& length)
+{
+    uint8_t byte;
+    do
+    {
+        if (position >= input_size)
+        {
+            return false;
+        }
+        byte = input[position++];
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+void write_sequence(vector<uint8_t>& output,
+                    const uint8_t* literals,
+                    const uint64_t literals_size,
+                    const uint64_t offset,
+                    const uint64_t match_size)
+{
+    const auto match_length = match_size - MIN_MATCH;
+    output.push_back(min(literals_size, LENGTH_MASK) << 4 |
+                     min(match_length, LENGTH_MASK));
+    if (literals_size >= LENGTH_MASK)
+    {
+        write_length(output, literals_size - LENGTH_MASK);
+    }
+    output.insert(output.end(), literals, literals + literals_size);
+    output.push_back(offset);
+    output.push_back(offset >> 8);
+    if (match_length >= LENGTH_MASK)
+    {
+        write_length(output, match_length - LENGTH_MASK);
+    }
+}
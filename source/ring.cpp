@@ -0,0 +1,308 @@
+#include "ring.hpp"
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#ifdef EASYKEY_URING
+#include <linux/io_uring.h>
+#endif
+
+using namespace easykey;
+using namespace std;
+
+#ifdef EASYKEY_URING
+
+Ring::Ring(const uint32_t entries) : queued(0)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    file_descriptor = syscall(__NR_io_uring_setup, entries, &params);
+    if (file_descriptor < 0)
+    {
+        perror("io_uring_setup: ");
+        throw "Could not create the io_uring instance!";
+    }
+
+    /**
+     * The submission ring, the completion ring and the submission entries
+     * are mapped from the io_uring file descriptor.
+     * Newer kernels map both rings at once
+     */
+    submission_ring_size =
+        params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    completion_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    const bool single_mapping = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mapping)
+    {
+        submission_ring_size = completion_ring_size =
+            max(submission_ring_size, completion_ring_size);
+    }
+    submission_entries_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    submission_ring = mmap(nullptr,
+                           submission_ring_size,
+                           PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE,
+                           file_descriptor,
+                           IORING_OFF_SQ_RING);
+    completion_ring = single_mapping ? submission_ring
+                                     : mmap(nullptr,
+                                            completion_ring_size,
+                                            PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE,
+                                            file_descriptor,
+                                            IORING_OFF_CQ_RING);
+    void* entries_mapping = mmap(nullptr,
+                                 submission_entries_size,
+                                 PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_POPULATE,
+                                 file_descriptor,
+                                 IORING_OFF_SQES);
+    if (submission_ring == MAP_FAILED || completion_ring == MAP_FAILED ||
+        entries_mapping == MAP_FAILED)
+    {
+        perror("mmap: ");
+        close(file_descriptor);
+        throw "Could not map the io_uring rings!";
+    }
+    submission_entries = static_cast<struct io_uring_sqe*>(entries_mapping);
+
+    const auto submission = static_cast<uint8_t*>(submission_ring);
+    submission_head =
+        reinterpret_cast<uint32_t*>(submission + params.sq_off.head);
+    submission_tail =
+        reinterpret_cast<uint32_t*>(submission + params.sq_off.tail);
+    submission_mask =
+        *reinterpret_cast<uint32_t*>(submission + params.sq_off.ring_mask);
+    submission_capacity = params.sq_entries;
+    submission_array =
+        reinterpret_cast<uint32_t*>(submission + params.sq_off.array);
+    submission_flags =
+        reinterpret_cast<uint32_t*>(submission + params.sq_off.flags);
+
+    const auto completion = static_cast<uint8_t*>(completion_ring);
+    completion_head =
+        reinterpret_cast<uint32_t*>(completion + params.cq_off.head);
+    completion_tail =
+        reinterpret_cast<uint32_t*>(completion + params.cq_off.tail);
+    completion_mask =
+        *reinterpret_cast<uint32_t*>(completion + params.cq_off.ring_mask);
+    completion_entries =
+        reinterpret_cast<struct io_uring_cqe*>(completion + params.cq_off.cqes);
+
+    // The kernel writes to the eventfd every time an operation completes
+    event_descriptor = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_descriptor < 0 || syscall(__NR_io_uring_register,
+                                        file_descriptor,
+                                        IORING_REGISTER_EVENTFD,
+                                        &event_descriptor,
+                                        1) < 0)
+    {
+        perror("io_uring_register: ");
+        throw "Could not register the io_uring eventfd!";
+    }
+    cout << "Created io_uring instance with " << to_string(params.sq_entries)
+         << " entries" << endl;
+}
+
+Ring::~Ring()
+{
+    munmap(submission_entries, submission_entries_size);
+    if (completion_ring != submission_ring)
+    {
+        munmap(completion_ring, completion_ring_size);
+    }
+    munmap(submission_ring, submission_ring_size);
+    close(event_descriptor);
+    close(file_descriptor);
+}
+
+int32_t Ring::notification_descriptor() const
+{
+    return event_descriptor;
+}
+
+void Ring::writev(const int32_t fd,
+                  const struct iovec* parts,
+                  const uint32_t count,
+                  const off_t offset,
+                  const uint64_t user_data,
+                  const bool linked)
+{
+    auto entry = next_entry(linked ? 2 : 1);
+    entry->opcode = IORING_OP_WRITEV;
+    entry->fd = fd;
+    entry->addr = reinterpret_cast<uint64_t>(parts);
+    entry->len = count;
+    entry->off = offset;
+    entry->user_data = user_data;
+    if (linked)
+    {
+        entry->flags = IOSQE_IO_LINK;
+    }
+    queue();
+}
+
+void Ring::fdatasync(const int32_t fd, const uint64_t user_data)
+{
+    auto entry = next_entry(1);
+    entry->opcode = IORING_OP_FSYNC;
+    entry->fd = fd;
+    entry->fsync_flags = IORING_FSYNC_DATASYNC;
+    entry->user_data = user_data;
+    queue();
+}
+
+bool Ring::submit()
+{
+    while (queued > 0)
+    {
+        const auto submitted = syscall(
+            __NR_io_uring_enter, file_descriptor, queued, 0, 0, nullptr, 0);
+        if (submitted < 0)
+        {
+            perror("io_uring_enter: ");
+            return false;
+        }
+        queued -= submitted;
+    }
+    return true;
+}
+
+uint32_t Ring::complete(const CompletionCallback& completed, const bool wait)
+{
+    // Clears the notification before looking, so no completion is missed
+    uint64_t notifications;
+    if (read(event_descriptor, &notifications, sizeof(notifications)) < 0 &&
+        errno != EAGAIN)
+    {
+        perror("read: ");
+    }
+
+    auto head = *completion_head;
+    if (wait && head == __atomic_load_n(completion_tail, __ATOMIC_ACQUIRE) &&
+        syscall(__NR_io_uring_enter,
+                file_descriptor,
+                0,
+                1,
+                IORING_ENTER_GETEVENTS,
+                nullptr,
+                0) < 0)
+    {
+        perror("io_uring_enter: ");
+    }
+
+    uint32_t count = 0;
+    while (true)
+    {
+        while (head != __atomic_load_n(completion_tail, __ATOMIC_ACQUIRE))
+        {
+            const auto& entry = completion_entries[head & completion_mask];
+            const auto user_data = entry.user_data;
+            const auto result = entry.res;
+
+            // The entry is given back before the callback, that can queue
+            // more
+            head++;
+            __atomic_store_n(completion_head, head, __ATOMIC_RELEASE);
+            completed(user_data, result);
+            count++;
+        }
+
+        /**
+         * More operations can be in flight than the completion ring holds,
+         * the kernel keeps the completions that did not fit, and only moves
+         * them to the ring, now that it has room, when asked to
+         */
+        if (!(__atomic_load_n(submission_flags, __ATOMIC_ACQUIRE) &
+              IORING_SQ_CQ_OVERFLOW))
+        {
+            return count;
+        }
+        if (syscall(__NR_io_uring_enter,
+                    file_descriptor,
+                    0,
+                    0,
+                    IORING_ENTER_GETEVENTS,
+                    nullptr,
+                    0) < 0)
+        {
+            perror("io_uring_enter: ");
+            return count;
+        }
+        head = *completion_head;
+    }
+}
+
+struct io_uring_sqe* Ring::next_entry(const uint32_t needed)
+{
+    auto tail = *submission_tail;
+    if (tail - __atomic_load_n(submission_head, __ATOMIC_ACQUIRE) + needed >
+        submission_capacity)
+    {
+        submit();
+    }
+    const auto index = tail & submission_mask;
+    auto entry = &submission_entries[index];
+    memset(entry, 0, sizeof(*entry));
+    submission_array[index] = index;
+    return entry;
+}
+
+void Ring::queue()
+{
+    // The kernel only sees the entry after the tail moves
+    __atomic_store_n(submission_tail, *submission_tail + 1, __ATOMIC_RELEASE);
+    queued++;
+}
+
+#else
+
+Ring::Ring(const uint32_t entries)
+{
+    throw "The server was built without io_uring!";
+}
+
+Ring::~Ring()
+{
+}
+
+int32_t Ring::notification_descriptor() const
+{
+    return -1;
+}
+
+void Ring::writev(const int32_t fd,
+                  const struct iovec* parts,
+                  const uint32_t count,
+                  const off_t offset,
+                  const uint64_t user_data,
+                  const bool linked)
+{
+}
+
+void Ring::fdatasync(const int32_t fd, const uint64_t user_data)
+{
+}
+
+bool Ring::submit()
+{
+    return false;
+}
+
+uint32_t Ring::complete(const CompletionCallback& completed, const bool wait)
+{
+    return 0;
+}
+
+#endif
@@ -25,6 +25,26 @@
 using namespace std;
 using namespace easykey;
 
+/**
+ * How long the server waits for events when there is no background work
+ */
+constexpr static chrono::seconds IDLE_TIMEOUT(10);
+
+/**
+ * The requests of a client stop being read when this many bytes of its
+ * responses wait to be sent, and are read again when they are down to the
+ * low watermark
+ */
+constexpr static uint64_t OUTPUT_HIGH_WATERMARK = 4 * 1024 * 1024;
+constexpr static uint64_t OUTPUT_LOW_WATERMARK = 1024 * 1024;
+
+/**
+ * The same for the responses that are not ready yet, like the writes that
+ * wait for the next flush, see ClientSocket::reserve
+ */
+constexpr static uint64_t RESPONSES_HIGH_WATERMARK = 1024;
+constexpr static uint64_t RESPONSES_LOW_WATERMARK = 256;
+
 Server::Server(const uint16_t port,
                const uint16_t pending_connections,
                const ReceiveMessageCallback receive_message_callback,
@@ -35,7 +55,9 @@ Server::Server(const uint16_t port,
       socket(ServerSocket::from(port)),
       receive_message_callback(receive_message_callback),
       client_connected_callback(client_connected_callback),
-      client_disconnected_callback(client_disconnected_callback)
+      client_disconnected_callback(client_disconnected_callback),
+      tick_callback(nullptr),
+      listening(false)
 {
 }
 
@@ -47,17 +69,50 @@ Server::Server(const uint16_t port,
       socket(ServerSocket::from(port)),
       receive_message_callback(receive_message_callback),
       client_connected_callback(nullptr),
-      client_disconnected_callback(nullptr)
+      client_disconnected_callback(nullptr),
+      tick_callback(nullptr),
+      listening(false)
 {
 }
 
-void Server::start()
+void Server::set_tick_callback(const TickCallback tick_callback)
 {
-    /**
-     * Register the server socket as this event in epoll
-     */
-    io_notifier.add_event(Event(socket.file_descriptor).add(EventType::READ));
+    this->tick_callback = tick_callback;
+}
+
+void Server::watch(const int32_t file_descriptor, const ReadyCallback callback)
+{
+    io_notifier.add_event(Event(file_descriptor).add(EventType::READ));
+    watched[file_descriptor] = callback;
+}
+
+void Server::steer_by_cpu(const vector<uint16_t>& listener_of_cpu)
+{
+    // A = the cpu that got the connection
+    steering = {BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                         static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU))};
+
+    // if A == cpu return listener
+    for (uint32_t cpu = 0; cpu < listener_of_cpu.size(); cpu++)
+    {
+        if (listener_of_cpu[cpu] == UINT16_MAX)
+        {
+            continue;
+        }
+        steering.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpu, 0, 1));
+        steering.push_back(BPF_STMT(BPF_RET | BPF_K, listener_of_cpu[cpu]));
+    }
 
+    // An index out of the group, so the hash chooses
+    steering.push_back(BPF_STMT(BPF_RET | BPF_K, UINT32_MAX));
+}
+
+void Server::listen()
+{
+    if (listening)
+    {
+        return;
+    }
     socket.set_option(Socket::OptionValue<std::int32_t>{
         1, Socket::Option<int32_t>::REUSE_ADDRESS});
     socket.set_option(
@@ -66,6 +121,28 @@ void Server::start()
 
     socket.assign_address();
     socket.set_available(pending_connections);
+    listening = true;
+
+    // The program is for the whole group, every server sets the same one
+    if (!steering.empty())
+    {
+        struct sock_fprog program;
+        program.len = steering.size();
+        program.filter = steering.data();
+        socket.set_option(Socket::OptionValue<struct sock_fprog>{
+            program,
+            Socket::Option<struct sock_fprog>::ATTACH_REUSE_PORT_PROGRAM});
+    }
+}
+
+void Server::start()
+{
+    listen();
+
+    /**
+     * Register the server socket as this event in epoll
+     */
+    io_notifier.add_event(Event(socket.file_descriptor).add(EventType::READ));
 
     cout << "Server in mode to accept connections ..." << endl;
     cout << "Server running in port: " << to_string(port) << " and can queue "
@@ -73,15 +150,17 @@ void Server::start()
 
     running = true;
     uint16_t iterations = 0;
+    chrono::milliseconds timeout = IDLE_TIMEOUT;
     do
     {
-        const auto events =
-            io_notifier.wait_for_events(std::chrono::seconds(10));
-        if (events.empty())
+        const auto total_events = io_notifier.wait_for_events(timeout);
+        if (total_events == 0 && timeout == IDLE_TIMEOUT)
         {
+            // Only the whole idle timeout, the shorter ones are ticks
+            cout << "Epoll Timeout!" << endl;
             check_idle_connections();
         }
-        for (const auto &event : events)
+        for (uint32_t index = 0; index < total_events; index++)
         {
             if (!running)
             {
@@ -89,22 +168,73 @@ void Server::start()
                 // server requested to stop
                 break;
             }
+            const auto event = io_notifier.event(index);
             if (event.is_for(socket.file_descriptor))
             {
                 handle_new_connection();
+                continue;
             }
-            else if (event.has(EventType::CLOSE_CONNECTION))
+            const auto found = watched.find(event.file_descriptor);
+            if (found != watched.end())
+            {
+                found->second();
+                continue;
+            }
+            const auto client = current_connections.find(event.file_descriptor);
+            if (client == current_connections.end())
+            {
+                // closed by an earlier event of this same wait
+                continue;
+            }
+
+            // Nothing can reach the peer anymore
+            if (event.has(EventType::HANG_UP))
             {
                 handle_client_disconnected(event.file_descriptor);
+                continue;
             }
-            else if (event.has(EventType::READ))
+
+            /**
+             * The peer can send its last requests and shut down its side in
+             * the same wait, so they are read and answered before the
+             * connection goes away, see handle_request
+             */
+            if (event.has(EventType::CLOSE_CONNECTION))
             {
-                handle_request(
-                    current_connections.at(event.file_descriptor).get());
+                client->second->peer_closed = true;
+            }
+            if (event.has(EventType::READ) ||
+                event.has(EventType::CLOSE_CONNECTION))
+            {
+                handle_request(client->second.get());
+            }
+            else if (event.has(EventType::WRITE))
+            {
+                handle_writable(client->second.get());
+            }
+            if (client->second->closing)
+            {
+                finish_closing(client->second.get());
             }
         }
         iterations++;
 
+        /**
+         * The background work runs after every iteration, and tells how long
+         * the server can wait for the next events
+         */
+        timeout = IDLE_TIMEOUT;
+        if (tick_callback)
+        {
+            timeout = min(timeout, tick_callback());
+        }
+
+        // Its requests are parsed in the next iteration, without waiting
+        if (check_stalled_connections())
+        {
+            timeout = chrono::milliseconds(0);
+        }
+
         /**
          * Every 1000 iterations, we check for idle connections
          */
@@ -123,6 +253,10 @@ void Server::start()
      * file descriptor
      */
     io_notifier.delete_event(Event(socket.file_descriptor));
+    for (const auto &entry : watched)
+    {
+        io_notifier.delete_event(Event(entry.first));
+    }
 }
 
 void Server::stop()
@@ -135,34 +269,46 @@ void Server::stop()
 
 void Server::handle_new_connection()
 {
-    unique_ptr<ClientSocket> client(socket.accept_connection());
-
-    struct timeval read_timeout;
-    read_timeout.tv_sec = 0;
-    // 300 milliseconds of read block timeout if needed ...
-    // This is needed, because the client can sends tons of KiB at one request,
-    // and the kernel might not be able to return everything at just once read
-    // system call
-    read_timeout.tv_usec = 1000 * 300;
-
-    client->set_option(Socket::OptionValue<struct timeval>(
-        read_timeout, Socket::Option<struct timeval>::READ_TIMEOUT));
-
     /**
-     * Register the accepted socket to those epoll events
-     * READ | Edge Triggered | WRITE | PEER SHUTDOW
+     * The server socket is Edge Triggered, so the event only tells that some
+     * connections arrived: all of them are accepted, until the backlog is
+     * empty, or they would wait for the next connection to be accepted.
+     * The client socket does not block, a request that did not arrive whole
+     * is parsed again when the rest arrives
      */
-    io_notifier.add_event(Event(client->file_descriptor)
-                              .add(EventType::READ)
-                              .add(EventType::CLOSE_CONNECTION)
-                              .add(EventType::WRITE));
-
-    if (client_connected_callback)
+    while (true)
     {
-        client_connected_callback(*client);
+        unique_ptr<ClientSocket> client(socket.accept_connection());
+        if (client == nullptr)
+        {
+            return;
+        }
+
+        /**
+         * The responses of a batch are already sent together, see
+         * ClientSocket::end_batch. A slot filled after the batch would
+         * otherwise wait for the ACK of the previous send, that the client
+         * delays as it has nothing to send until it has every response
+         */
+        client->set_option(Socket::OptionValue<std::int32_t>{
+            1, Socket::Option<int32_t>::TCP_NO_DELAY});
+
+        /**
+         * Register the accepted socket to those epoll events
+         * READ | Edge Triggered | WRITE | PEER SHUTDOW
+         */
+        io_notifier.add_event(Event(client->file_descriptor)
+                                  .add(EventType::READ)
+                                  .add(EventType::CLOSE_CONNECTION)
+                                  .add(EventType::WRITE));
+
+        if (client_connected_callback)
+        {
+            client_connected_callback(*client);
+        }
+        current_connections.insert(
+            make_pair(client->file_descriptor, move(client)));
     }
-    current_connections.insert(
-        make_pair(client->file_descriptor, move(client)));
 }
 
 void Server::handle_request(ClientSocket *client)
@@ -187,8 +333,143 @@ void Server::handle_request(ClientSocket *client)
      */
     client->iterations++;
 
-    // Send the message to the client
-    receive_message_callback(*client);
+    // The event can also mean that the client read some responses
+    flush_responses(client);
+    if (client->reading_paused || client->closing)
+    {
+        return;
+    }
+
+    /**
+     * Every whole request the client sent is answered now, so a client can
+     * send many of them without waiting for the responses(pipelining), and
+     * their responses are sent together
+     */
+    while (!client->reading_paused)
+    {
+        client->begin_batch();
+        bool parsed = true;
+        while (parsed && !client->closing && !too_much_output(client))
+        {
+            parsed = receive_message_callback(*client);
+        }
+        client->end_batch();
+
+        /**
+         * A client that sends requests faster than it reads the responses
+         * would make its output grow without limit, so its next requests wait
+         * in the socket until it reads most of them.
+         * The responses that are not ready do not make the socket writable
+         * when they are, so the client is checked after every iteration
+         */
+        if (too_much_output(client))
+        {
+            client->reading_paused = true;
+            if (client->pending_responses() > 0)
+            {
+                stalled.insert(client->file_descriptor);
+            }
+        }
+        else if (!parsed || client->closing)
+        {
+            break;
+        }
+    }
+
+    /**
+     * Every request the client sent before shutting down its side was read,
+     * the connection closes once they are answered, see finish_closing
+     */
+    if (client->peer_closed && !client->reading_paused)
+    {
+        client->closing = true;
+    }
+}
+
+void Server::handle_writable(ClientSocket *client)
+{
+    const bool paused = client->reading_paused;
+    flush_responses(client);
+
+    // The requests that arrived while it was paused do not make a new event
+    if (paused && !client->reading_paused)
+    {
+        handle_request(client);
+    }
+}
+
+void Server::flush_responses(ClientSocket *client)
+{
+    if (client->pending_output() > 0)
+    {
+        client->flush();
+    }
+    if (client->reading_paused &&
+        client->pending_output() <= OUTPUT_LOW_WATERMARK &&
+        client->pending_responses() <= RESPONSES_LOW_WATERMARK)
+    {
+        client->reading_paused = false;
+    }
+}
+
+bool Server::too_much_output(const ClientSocket *client) const
+{
+    return client->pending_output() >= OUTPUT_HIGH_WATERMARK ||
+           client->pending_responses() >= RESPONSES_HIGH_WATERMARK;
+}
+
+void Server::finish_closing(ClientSocket *client)
+{
+    // The output waits for the socket to become writable
+    if (client->pending_responses() > 0)
+    {
+        stalled.insert(client->file_descriptor);
+        return;
+    }
+    if (client->pending_output() == 0 && client->drain())
+    {
+        handle_client_disconnected(client->file_descriptor);
+    }
+}
+
+bool Server::check_stalled_connections()
+{
+    // Copied, a client that is checked can be stalled again, or disconnected
+    const vector<int32_t> clients(stalled.begin(), stalled.end());
+    stalled.clear();
+    bool resumed = false;
+    for (const auto file_descriptor : clients)
+    {
+        const auto found = current_connections.find(file_descriptor);
+        if (found == current_connections.end())
+        {
+            continue;
+        }
+        const auto client = found->second.get();
+        if (client->closing)
+        {
+            finish_closing(client);
+            continue;
+        }
+        flush_responses(client);
+        if (client->reading_paused)
+        {
+            if (client->pending_responses() > 0)
+            {
+                stalled.insert(file_descriptor);
+            }
+            continue;
+        }
+
+        // The requests that arrived meanwhile do not make a new event
+        handle_request(client);
+        if (client->closing)
+        {
+            finish_closing(client);
+        }
+        resumed = true;
+    }
+    return resumed;
 }
 
 void Server::handle_client_disconnected(const std::int32_t file_descriptor)
@@ -201,6 +482,7 @@ void Server::handle_client_disconnected(const std::int32_t file_descriptor)
 
     io_notifier.delete_event(Event(file_descriptor));
     current_connections.erase(file_descriptor);
+    stalled.erase(file_descriptor);
 }
 
 void Server::check_idle_connections()
@@ -0,0 +1,138 @@
+#include "shards.hpp"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <utility>
+
+using namespace easykey;
+using namespace std;
+
+/**
+ * How many tasks fit every queue, the others wait in its overflow
+ */
+constexpr static uint32_t QUEUE_CAPACITY = 1024;
+
+Shards::Shards(const uint16_t count)
+    : count(count),
+      queues(count * count),
+      overflows(count * count),
+      woken(count * count, 0)
+{
+    for (uint16_t from = 0; from < count; from++)
+    {
+        for (uint16_t to = 0; to < count; to++)
+        {
+            if (from != to)
+            {
+                queues[from * count + to].reset(
+                    new SPSCQueue<ShardTask>(QUEUE_CAPACITY));
+            }
+        }
+    }
+    for (uint16_t shard = 0; shard < count; shard++)
+    {
+        const auto descriptor = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (descriptor < 0)
+        {
+            perror("eventfd: ");
+            throw "Could not create the eventfd of the shard: " +
+                to_string(shard);
+        }
+        descriptors.push_back(descriptor);
+    }
+}
+
+Shards::~Shards()
+{
+    for (const auto& descriptor : descriptors)
+    {
+        close(descriptor);
+    }
+}
+
+uint16_t Shards::size() const
+{
+    return count;
+}
+
+void Shards::send(const uint16_t from, const uint16_t to, ShardTask task)
+{
+    const auto pair = from * count + to;
+
+    // The tasks that did not fit go first, a shard runs them in order
+    auto& overflow = overflows[pair];
+    if (!overflow.empty() || !queues[pair]->push(task))
+    {
+        overflow.push_back(move(task));
+    }
+    woken[pair] = 1;
+}
+
+bool Shards::flush(const uint16_t from)
+{
+    bool overflowing = false;
+    for (uint16_t to = 0; to < count; to++)
+    {
+        const auto pair = from * count + to;
+        auto& overflow = overflows[pair];
+        while (!overflow.empty() && queues[pair]->push(overflow.front()))
+        {
+            overflow.pop_front();
+            woken[pair] = 1;
+        }
+        overflowing = overflowing || !overflow.empty();
+        if (woken[pair])
+        {
+            wake(to);
+            woken[pair] = 0;
+        }
+    }
+    return overflowing;
+}
+
+void Shards::receive(const uint16_t to, Handler& handler)
+{
+    /**
+     * Read before the queues, a task sent after that wakes the shard up
+     * again
+     */
+    uint64_t wakes;
+    if (read(descriptors[to], &wakes, sizeof(wakes)) < 0 && errno != EAGAIN)
+    {
+        perror("read eventfd: ");
+    }
+    ShardTask task;
+    for (uint16_t from = 0; from < count; from++)
+    {
+        if (from == to)
+        {
+            continue;
+        }
+        auto& queue = *queues[from * count + to];
+        while (queue.pop(task))
+        {
+            task(handler);
+        }
+    }
+}
+
+int32_t Shards::descriptor(const uint16_t shard) const
+{
+    return descriptors[shard];
+}
+
+void Shards::wake(const uint16_t shard) const
+{
+    const uint64_t wakes = 1;
+    if (write(descriptors[shard], &wakes, sizeof(wakes)) < 0 &&
+        errno != EAGAIN)
+    {
+        perror("write eventfd: ");
+    }
+}
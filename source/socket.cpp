@@ -1,11 +1,12 @@
 #include "socket.hpp"
 
-//#include <fcntl.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <cerrno>
 #include <cstdint>
 #include <cstdio>
+#include <algorithm>
 #include <functional>
 #include <iostream>
 #include <memory>
@@ -15,10 +16,36 @@
 #include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 using namespace std;
 using namespace easykey;
 
+/**
+ * How many bytes the pipe of splice holds, it is moved to the file whenever
+ * it is full
+ */
+constexpr static uint64_t SPLICE_PIPE_SIZE = 1024 * 1024;
+
+/**
+ * The pipe every value goes through, every shard thread has its own, shared
+ * by its clients.
+ * It is created the first time it is used, returns null if it could not be
+ */
+const int32_t *splice_pipe();
+void close_splice_pipe();
+bool pwrite_all(const int32_t file_descriptor,
+               const uint8_t *buffer,
+               uint64_t size,
+               off_t offset);
+
+/**
+ * At most this many responses are sent by one system call of flush
+ */
+constexpr static size_t MAX_FLUSH_PARTS = 64;
+
+static thread_local int32_t pipe_descriptors[2] = {-1, -1};
+
 namespace easykey
 {
 template <>
@@ -58,6 +85,12 @@ Socket::Option<struct linger> const Socket::Option<struct linger>::LINGER(
     SOL_SOCKET,
     SO_LINGER);
 
+template <>
+Socket::Option<struct sock_fprog> const
+    Socket::Option<struct sock_fprog>::ATTACH_REUSE_PORT_PROGRAM(
+        SOL_SOCKET,
+        SO_ATTACH_REUSEPORT_CBPF);
+
 };  // namespace easykey
 
 Socket::Socket(const int32_t file_descriptor) : file_descriptor(file_descriptor)
@@ -96,44 +129,43 @@ ClientSocket *ServerSocket::accept_connection() const
     struct sockaddr_in client_address;
     socklen_t size = sizeof(struct sockaddr_in);
 
-    int32_t client_file_descriptor =
-        accept(file_descriptor, (struct sockaddr *)&client_address, &size);
+    /**
+     * A client that sends half a request can not block the server loop, the
+     * read returns what there is and the request is parsed again when the
+     * rest arrives. The socket is created non blocking, without another
+     * system call
+     * https://man7.org/linux/man-pages/man2/accept.2.html
+     */
+    int32_t client_file_descriptor;
+    do
+    {
+        client_file_descriptor = accept4(file_descriptor,
+                                         (struct sockaddr *)&client_address,
+                                         &size,
+                                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+    } while (client_file_descriptor < 0 &&
+             (errno == EINTR || errno == ECONNABORTED));
     if (client_file_descriptor < 0)
     {
-        throw "Could not accept a connection!";
-    }
-
-    /*
-        if (fcntl(client_file_descriptor, F_SETFL, SOCK_NONBLOCK) < 0)
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
         {
-            const auto error = "Could not set the socket file descriptor " +
-                               to_string(client_file_descriptor) +
-                               "as non blocking";
-            cerr << error << endl;
-            throw error;
+            perror("accept4: ");
         }
-    */
-    string host_ip = inet_ntoa(client_address.sin_addr);
-    uint16_t port = ntohs(client_address.sin_port);
-    return new ClientSocket(client_file_descriptor, host_ip, port);
+        return nullptr;
+    }
+    return new ClientSocket(client_file_descriptor, client_address);
 }
 
 ClientSocket::ClientSocket(const int32_t file_descriptor,
-                           const string host_ip,
-                           const uint16_t port)
+                           const struct sockaddr_in address)
     : Socket(file_descriptor),
       start(chrono::steady_clock::now()),
-      host_ip(host_ip),
-      port(port),
-      read_buffer([this]() -> vector<uint8_t> {
-          // 1MiB  buffer
-          uint8_t buffer[1024 * 1024 * 1];
-          const int64_t buffer_size = sizeof(buffer) / sizeof(buffer[0]);
-
-          // Uses the read system call to read from kernel buffer to our buffer
+      address(address),
+      read_buffer([this](uint8_t *output, uint64_t size) -> uint64_t {
+          // Uses the read system call to read from kernel buffer straight to
+          // the read buffer
           // man 2 read
-          const auto bytes_read =
-              ::read(this->file_descriptor, buffer, buffer_size);
+          const auto bytes_read = ::read(this->file_descriptor, output, size);
 
           // An error occurred
           if (bytes_read < 0)
@@ -147,18 +179,14 @@ ClientSocket::ClientSocket(const int32_t file_descriptor,
                    Socket::MINIMUM_BYTES_TO_CONSIDER_BUFFER_AS_READABLE is in
                    use
                   */
-                  cout
-                      << "No data available in the buffer for file descriptor: "
-                      << this->file_descriptor << endl;
-                  return {};
+                  return 0;
               }
               cerr << "Unexpected error occurred while trying to read from "
                       "file descriptor: "
                    << this->file_descriptor << endl;
-              return {};
+              return 0;
           }
-          vector<uint8_t> bytes(buffer, buffer + bytes_read);
-          return bytes;
+          return bytes_read;
       })
 {
     // The last seen variable to check for idle connections once in a while
@@ -166,31 +194,476 @@ ClientSocket::ClientSocket(const int32_t file_descriptor,
 
     // Starts the iterations with zero
     iterations = 0;
+
+    reading_paused = false;
+    closing = false;
+    peer_closed = false;
+    output_size = 0;
+    first_slot = 0;
+    reserved_responses = 0;
+    batching = false;
+    shut_down = false;
+    failed = false;
+}
+
+ClientSocket::~ClientSocket()
+{
+    drop_output();
+}
+
+string ClientSocket::host_ip() const
+{
+    char text[INET_ADDRSTRLEN];
+    if (inet_ntop(AF_INET, &address.sin_addr, text, sizeof(text)) == nullptr)
+    {
+        return "";
+    }
+    return text;
+}
+
+uint16_t ClientSocket::port() const
+{
+    return ntohs(address.sin_port);
 }
+
 void ClientSocket::write(const uint8_t *buffer,
                          const uint32_t size,
-                         bool more_coming) const
+                         bool more_coming)
 {
     /**
      * With the MSG_MORE, we tell the kernel that we have more data to send to
      * this socket https://man7.org/linux/man-pages/man2/send.2.html
      */
     int32_t flags = more_coming ? MSG_MORE : 0;
-    if (::send(file_descriptor, buffer, size, flags) == -1)
+    uint32_t sent = 0;
+    while (!failed && !batching && output.empty() && sent < size)
     {
-        cerr << "Could not send data to the filedescriptor: " << file_descriptor
-             << endl;
+        const auto result =
+            ::send(file_descriptor, buffer + sent, size - sent, flags);
+        if (result < 0)
+        {
+            if (errno == EAGAIN)
+            {
+                break;
+            }
+            fail("Could not send data to the filedescriptor: ");
+            return;
+        }
+        sent += result;
     }
+    queue(buffer + sent, size - sent);
 }
 
 void ClientSocket::write(const int32_t file_descriptor,
                          off_t offset,
-                         const int64_t size) const
+                         const int64_t size)
+{
+    uint64_t left = size;
+    while (!failed && !batching && output.empty() && left > 0)
+    {
+        const auto result =
+            ::sendfile(this->file_descriptor, file_descriptor, &offset, left);
+        if (result < 0 && errno == EAGAIN)
+        {
+            break;
+        }
+
+        // Zero is the end of the file, the range is shorter than its header
+        if (result <= 0)
+        {
+            fail("Could not use sendfile system call to the filedescriptor: ");
+            return;
+        }
+        left -= result;
+    }
+    queue(file_descriptor, offset, left);
+}
+
+void ClientSocket::write(const struct iovec *parts, const uint32_t count)
+{
+    // The parts that were not sent yet, the first one can be half sent
+    vector<struct iovec> left(parts, parts + count);
+    auto next = left.begin();
+    while (!failed && !batching && output.empty() && next != left.end())
+    {
+        // https://man7.org/linux/man-pages/man2/writev.2.html
+        const auto result = ::writev(file_descriptor, &*next, left.end() - next);
+        if (result < 0)
+        {
+            if (errno == EAGAIN)
+            {
+                break;
+            }
+            fail("Could not use writev system call to the filedescriptor: ");
+            return;
+        }
+        auto written = static_cast<size_t>(result);
+        while (next != left.end() && written >= next->iov_len)
+        {
+            written -= next->iov_len;
+            next++;
+        }
+        if (next != left.end())
+        {
+            next->iov_base = static_cast<uint8_t *>(next->iov_base) + written;
+            next->iov_len -= written;
+        }
+    }
+    for (; next != left.end(); next++)
+    {
+        queue(static_cast<const uint8_t *>(next->iov_base), next->iov_len);
+    }
+}
+
+bool ClientSocket::flush()
+{
+    // A reserved response is sent as far as it was filled, see fill_part
+    while (!output.empty() &&
+           (!output.front().reserved || output.front().size > 0))
+    {
+        auto &next = output.front();
+        if (next.size == 0)
+        {
+            output.pop_front();
+            first_slot++;
+            continue;
+        }
+        ssize_t result;
+        if (next.file_descriptor >= 0)
+        {
+            result = ::sendfile(
+                file_descriptor, next.file_descriptor, &next.offset, next.size);
+        }
+        else
+        {
+            /**
+             * The responses that are ready go with just one system call, up
+             * to a file range or to one that is not ready yet(its filled
+             * part is the last one sent)
+             * https://man7.org/linux/man-pages/man2/sendmsg.2.html
+             */
+            struct iovec parts[MAX_FLUSH_PARTS];
+            struct msghdr message = {};
+            message.msg_iov = parts;
+            auto part = output.begin();
+            bool stopped = false;
+            while (!stopped && part != output.end() &&
+                   (!part->reserved || part->size > 0) &&
+                   part->file_descriptor < 0 &&
+                   message.msg_iovlen < MAX_FLUSH_PARTS)
+            {
+                parts[message.msg_iovlen++] = {
+                    part->bytes.data() + part->offset, part->size};
+                stopped = part->reserved;
+                part++;
+            }
+
+            // The bytes before a file range go in the same packets as it
+            const bool file_next = !stopped && part != output.end() &&
+                                   !part->reserved &&
+                                   part->file_descriptor >= 0;
+            result =
+                ::sendmsg(file_descriptor, &message, file_next ? MSG_MORE : 0);
+        }
+        if (result < 0 && errno == EAGAIN)
+        {
+            // The client did not read enough yet, the next event continues
+            return true;
+        }
+        if (result <= 0)
+        {
+            fail("Could not send the pending output to the filedescriptor: ");
+            return false;
+        }
+        sent(result);
+    }
+    return !failed;
+}
+
+void ClientSocket::sent(uint64_t size)
+{
+    while (size > 0)
+    {
+        auto &next = output.front();
+        const auto taken = min(size, next.size);
+
+        // sendfile already moved the offset of a file range
+        if (next.file_descriptor < 0)
+        {
+            next.offset += taken;
+        }
+        next.size -= taken;
+        output_size -= taken;
+        size -= taken;
+        if (next.size > 0)
+        {
+            return;
+        }
+
+        // The rest of a reserved response was not filled yet
+        if (next.reserved)
+        {
+            next.bytes.clear();
+            next.offset = 0;
+            return;
+        }
+        if (next.owned)
+        {
+            close(next.file_descriptor);
+        }
+        output.pop_front();
+        first_slot++;
+    }
+}
+
+void ClientSocket::begin_batch()
+{
+    batching = true;
+}
+
+void ClientSocket::end_batch()
+{
+    batching = false;
+    if (!flush())
+    {
+        return;
+    }
+
+    // What is left is sent in the next iterations, after the compaction
+    for (auto &next : output)
+    {
+        if (next.file_descriptor < 0 || next.owned)
+        {
+            continue;
+        }
+        next.file_descriptor =
+            fcntl(next.file_descriptor, F_DUPFD_CLOEXEC, 0);
+        next.owned = next.file_descriptor >= 0;
+        if (!next.owned)
+        {
+            perror("fcntl F_DUPFD_CLOEXEC: ");
+            fail("Could not keep the output of the filedescriptor: ");
+            return;
+        }
+    }
+}
+
+uint64_t ClientSocket::pending_output() const
+{
+    return output_size;
+}
+
+uint64_t ClientSocket::reserve()
+{
+    // Its response is never sent, see fill
+    if (failed)
+    {
+        return first_slot;
+    }
+    output.push_back({{}, -1, 0, 0, false, true});
+    reserved_responses++;
+    return first_slot + output.size() - 1;
+}
+
+void ClientSocket::fill(const uint64_t slot, vector<uint8_t> response)
+{
+    if (failed || slot < first_slot || slot - first_slot >= output.size())
+    {
+        return;
+    }
+    auto &next = output[slot - first_slot];
+    add(next, move(response));
+    next.reserved = false;
+    reserved_responses--;
+}
+
+void ClientSocket::fill_part(const uint64_t slot, vector<uint8_t> part)
+{
+    if (failed || slot < first_slot || slot - first_slot >= output.size())
+    {
+        return;
+    }
+    add(output[slot - first_slot], move(part));
+}
+
+void ClientSocket::add(Output &reserved, vector<uint8_t> bytes)
+{
+    output_size += bytes.size();
+    if (reserved.size == 0)
+    {
+        reserved.size = bytes.size();
+        reserved.bytes = move(bytes);
+        reserved.offset = 0;
+        return;
+    }
+    reserved.bytes.insert(reserved.bytes.end(), bytes.begin(), bytes.end());
+    reserved.size += bytes.size();
+}
+
+uint64_t ClientSocket::pending_responses() const
+{
+    return reserved_responses;
+}
+
+void ClientSocket::queue(const uint8_t *buffer, const uint64_t size)
+{
+    if (size == 0 || failed)
+    {
+        return;
+    }
+
+    // The small responses of a slow client go together
+    if (output.empty() || output.back().file_descriptor >= 0 ||
+        output.back().reserved)
+    {
+        output.push_back({{}, -1, 0, 0, false, false});
+    }
+    auto &last = output.back();
+    last.bytes.insert(last.bytes.end(), buffer, buffer + size);
+    last.size += size;
+    output_size += size;
+}
+
+void ClientSocket::queue(const int32_t file_descriptor,
+                         const off_t offset,
+                         const uint64_t size)
 {
-    if (::sendfile(this->file_descriptor, file_descriptor, &offset, size) == -1)
+    if (size == 0 || failed)
     {
-        cerr << "Could not use sendfile system call!" << endl;
+        return;
     }
+    if (batching)
+    {
+        output.push_back({{}, file_descriptor, offset, size, false, false});
+        output_size += size;
+        return;
+    }
+    const auto copy = fcntl(file_descriptor, F_DUPFD_CLOEXEC, 0);
+    if (copy < 0)
+    {
+        perror("fcntl F_DUPFD_CLOEXEC: ");
+        fail("Could not keep the output of the filedescriptor: ");
+        return;
+    }
+    output.push_back({{}, copy, offset, size, true, false});
+    output_size += size;
+}
+
+void ClientSocket::drop_output()
+{
+    for (const auto &next : output)
+    {
+        if (next.owned)
+        {
+            close(next.file_descriptor);
+        }
+    }
+    first_slot += output.size();
+    output.clear();
+    output_size = 0;
+    reserved_responses = 0;
+}
+
+void ClientSocket::fail(const char *reason)
+{
+    cerr << reason << file_descriptor << endl;
+    drop_output();
+    failed = true;
+    closing = true;
+    ::shutdown(file_descriptor, SHUT_RDWR);
+}
+
+bool ClientSocket::drain()
+{
+    if (!shut_down)
+    {
+        // The client reads the end of the responses, and no reset
+        ::shutdown(file_descriptor, SHUT_WR);
+        shut_down = true;
+    }
+    uint8_t discarded[4096];
+    while (true)
+    {
+        const auto bytes_read =
+            ::read(file_descriptor, discarded, sizeof(discarded));
+        if (bytes_read == 0)
+        {
+            return true;
+        }
+        if (bytes_read < 0)
+        {
+            return errno != EAGAIN && errno != EWOULDBLOCK;
+        }
+    }
+}
+
+bool ClientSocket::receive(const int32_t file_descriptor,
+                           off_t& offset,
+                           uint64_t& size)
+{
+    // The bytes already read are written as they are
+    const auto buffered = min(size, (uint64_t)read_buffer.size());
+    if (!pwrite_all(file_descriptor, read_buffer.data(), buffered, offset))
+    {
+        return false;
+    }
+    read_buffer.consume(buffered);
+    offset += buffered;
+    size -= buffered;
+
+    /**
+     * The rest goes from the socket to a pipe, and from the pipe to the file.
+     * The kernel only moves references to the pages, the bytes are never
+     * copied to the user space
+     * https://man7.org/linux/man-pages/man2/splice.2.html
+     */
+    const auto pipe = splice_pipe();
+    if (size > 0 && pipe == nullptr)
+    {
+        return false;
+    }
+    while (size > 0)
+    {
+        const auto moved = splice(this->file_descriptor,
+                                  nullptr,
+                                  pipe[1],
+                                  nullptr,
+                                  min(size, SPLICE_PIPE_SIZE),
+                                  SPLICE_F_MOVE);
+
+        // The rest of the value did not arrive yet
+        if (moved < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return true;
+        }
+        if (moved <= 0)
+        {
+            if (moved < 0)
+            {
+                perror("splice: ");
+            }
+            cerr << "The value could not be read from the file descriptor: "
+                 << this->file_descriptor << endl;
+            return false;
+        }
+        auto in_pipe = moved;
+        while (in_pipe > 0)
+        {
+            const auto written = splice(
+                pipe[0], nullptr, file_descriptor, &offset, in_pipe, 0);
+            if (written <= 0)
+            {
+                perror("splice: ");
+
+                // What is left in the pipe would go to the next value
+                close_splice_pipe();
+                return false;
+            }
+            in_pipe -= written;
+        }
+        size -= moved;
+    }
+    return true;
 }
 
 ServerSocket ServerSocket::from(uint16_t port)
@@ -211,3 +684,55 @@ ServerSocket ServerSocket::from(uint16_t port)
 
     return ServerSocket(file_descriptor, address);
 }
+
+const int32_t *splice_pipe()
+{
+    if (pipe_descriptors[0] >= 0)
+    {
+        return pipe_descriptors;
+    }
+    if (pipe2(pipe_descriptors, O_CLOEXEC) < 0)
+    {
+        perror("pipe2: ");
+        pipe_descriptors[0] = pipe_descriptors[1] = -1;
+        return nullptr;
+    }
+
+    // The default pipe holds 64 KiB, a bigger one needs fewer system calls
+    if (fcntl(pipe_descriptors[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE) < 0)
+    {
+        perror("fcntl F_SETPIPE_SZ: ");
+    }
+    return pipe_descriptors;
+}
+
+void close_splice_pipe()
+{
+    if (pipe_descriptors[0] < 0)
+    {
+        return;
+    }
+    close(pipe_descriptors[0]);
+    close(pipe_descriptors[1]);
+    pipe_descriptors[0] = pipe_descriptors[1] = -1;
+}
+
+bool pwrite_all(const int32_t file_descriptor,
+               const uint8_t *buffer,
+               uint64_t size,
+               off_t offset)
+{
+    while (size > 0)
+    {
+        const auto written = ::pwrite(file_descriptor, buffer, size, offset);
+        if (written < 0)
+        {
+            perror("pwrite: ");
+            return false;
+        }
+        buffer += written;
+        offset += written;
+        size -= written;
+    }
+    return true;
+}
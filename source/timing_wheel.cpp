@@ -0,0 +1,246 @@
+#include "timing_wheel.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+using namespace easykey;
+using namespace std;
+
+/**
+ * How many milliseconds a slot of the first level is
+ */
+constexpr static uint64_t RESOLUTION = 10;
+
+/**
+ * 256 slots per level, 4 levels cover about 497 days
+ */
+constexpr static uint8_t SLOT_BITS = 8;
+constexpr static uint64_t LEVEL_SLOTS = 1ull << SLOT_BITS;
+constexpr static uint64_t SLOT_MASK = LEVEL_SLOTS - 1;
+constexpr static uint8_t LEVELS = 4;
+
+/**
+ * The lists after the slots, see TimingWheel::lists
+ */
+constexpr static uint32_t OVERFLOW_LIST = LEVELS * LEVEL_SLOTS;
+constexpr static uint32_t DUE_LIST = OVERFLOW_LIST + 1;
+
+/**
+ * The list of a timer that is in none, an expired one
+ */
+constexpr static uint32_t UNLINKED = UINT32_MAX;
+
+TimingWheel::TimingWheel(const uint64_t now)
+    : current(now / RESOLUTION), count(0), due(0)
+{
+    timers.resize(1);
+    lists.resize(DUE_LIST + 1, 0);
+}
+
+uint32_t TimingWheel::schedule(const uint64_t hash, const uint64_t expiry)
+{
+    uint32_t number;
+    if (unused.empty())
+    {
+        number = timers.size();
+        timers.emplace_back();
+    }
+    else
+    {
+        number = unused.back();
+        unused.pop_back();
+    }
+    timers[number].hash = hash;
+    timers[number].expiry = expiry;
+    count++;
+    place(number);
+    return number;
+}
+
+void TimingWheel::cancel(const uint32_t number)
+{
+    if (timers[number].list != UNLINKED)
+    {
+        unlink(number);
+        count--;
+    }
+    unused.push_back(number);
+}
+
+const Timer& TimingWheel::timer(const uint32_t number) const
+{
+    return timers[number];
+}
+
+bool TimingWheel::advance(const uint64_t now,
+                          const uint32_t limit,
+                          vector<uint32_t>& expired)
+{
+    const auto target = now / RESOLUTION;
+
+    // Without timers in the wheel, there is nothing to move on the way
+    if (count == due)
+    {
+        current = max(current, target);
+    }
+    while (current < target)
+    {
+        current = next_slot(target);
+        if ((current & ((1ull << (SLOT_BITS * LEVELS)) - 1)) == 0)
+        {
+            auto number = lists[OVERFLOW_LIST];
+            lists[OVERFLOW_LIST] = 0;
+            while (number != 0)
+            {
+                const auto next = timers[number].next;
+                place(number);
+                number = next;
+            }
+        }
+
+        // The higher levels first, their timers can fall in a lower slot
+        // that cascades now too
+        for (uint8_t level = LEVELS - 1; level > 0; level--)
+        {
+            if ((current & ((1ull << (SLOT_BITS * level)) - 1)) == 0)
+            {
+                cascade(level, (current >> (SLOT_BITS * level)) & SLOT_MASK);
+            }
+        }
+        cascade(0, current & SLOT_MASK);
+    }
+
+    while (due > 0 && expired.size() < limit)
+    {
+        const auto number = lists[DUE_LIST];
+        unlink(number);
+        count--;
+        expired.push_back(number);
+    }
+    return due > 0;
+}
+
+uint64_t TimingWheel::next_expiry(const uint64_t now) const
+{
+    if (due > 0)
+    {
+        return 0;
+    }
+    if (count == 0)
+    {
+        return UINT64_MAX;
+    }
+
+    // The next timer of the first level, or the next cascade
+    const auto at = next_slot(UINT64_MAX / RESOLUTION) * RESOLUTION;
+    return at > now ? at - now : 0;
+}
+
+uint64_t TimingWheel::next_slot(const uint64_t target) const
+{
+    /**
+     * The timers of a level are in the slots after the current one, in the
+     * same turn of the level above, so they all come before the ones of the
+     * level above. A slot of the level above is reached when it cascades
+     */
+    for (uint8_t level = 0; level < LEVELS; level++)
+    {
+        const auto shift = SLOT_BITS * level;
+        const auto turn = current >> (shift + SLOT_BITS) << SLOT_BITS;
+        for (auto slot = ((current >> shift) & SLOT_MASK) + 1;
+             slot < LEVEL_SLOTS;
+             slot++)
+        {
+            if (lists[level * LEVEL_SLOTS + slot] != 0)
+            {
+                return min(target, (turn | slot) << shift);
+            }
+        }
+    }
+
+    // Only the overflow is left, it is placed again when the wheel turns
+    if (lists[OVERFLOW_LIST] != 0)
+    {
+        const auto turn = SLOT_BITS * LEVELS;
+        return min(target, ((current >> turn) + 1) << turn);
+    }
+    return target;
+}
+
+uint64_t TimingWheel::size() const
+{
+    return count;
+}
+
+void TimingWheel::place(const uint32_t number)
+{
+    // Rounded up, a timer never expires before its expiry
+    const auto slot = (timers[number].expiry + RESOLUTION - 1) / RESOLUTION;
+    if (slot <= current)
+    {
+        link(number, DUE_LIST);
+        return;
+    }
+
+    // The highest slot bits that differ from the current time
+    const auto level = (63 - __builtin_clzll(slot ^ current)) / SLOT_BITS;
+    if (level >= LEVELS)
+    {
+        link(number, OVERFLOW_LIST);
+        return;
+    }
+    link(number,
+         level * LEVEL_SLOTS + ((slot >> (SLOT_BITS * level)) & SLOT_MASK));
+}
+
+void TimingWheel::cascade(const uint8_t level, const uint64_t slot)
+{
+    auto number = lists[level * LEVEL_SLOTS + slot];
+    lists[level * LEVEL_SLOTS + slot] = 0;
+    while (number != 0)
+    {
+        const auto next = timers[number].next;
+        place(number);
+        number = next;
+    }
+}
+
+void TimingWheel::link(const uint32_t number, const uint32_t list)
+{
+    auto& timer = timers[number];
+    timer.list = list;
+    timer.previous = 0;
+    timer.next = lists[list];
+    if (timer.next != 0)
+    {
+        timers[timer.next].previous = number;
+    }
+    lists[list] = number;
+    if (list == DUE_LIST)
+    {
+        due++;
+    }
+}
+
+void TimingWheel::unlink(const uint32_t number)
+{
+    auto& timer = timers[number];
+    if (timer.previous != 0)
+    {
+        timers[timer.previous].next = timer.next;
+    }
+    else
+    {
+        lists[timer.list] = timer.next;
+    }
+    if (timer.next != 0)
+    {
+        timers[timer.next].previous = timer.previous;
+    }
+    if (timer.list == DUE_LIST)
+    {
+        due--;
+    }
+    timer.list = UNLINKED;
+}
@@ -0,0 +1,166 @@
+#include "key_table.hpp"
+#include "storage.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <thread>
+
+using namespace easykey;
+using namespace std;
+using namespace testing;
+
+void check_values(Database& database, const uint32_t round)
+{
+    string value;
+    for (uint32_t key = 0; key < 10; key++)
+    {
+        CHECK(get(database, "key" + to_string(key), value));
+        CHECK(value == string(100, 'a' + round % 26) + to_string(key));
+    }
+}
+
+/**
+ * Overwritten keys fill small segments with dead records, the compaction
+ * rewrites them with only the live ones, and every key keeps its last value
+ */
+void test_compaction()
+{
+    const auto directory = temporary_directory();
+    DatabaseOptions options;
+    options.data_directories = {directory};
+    options.segment_size = 4096;
+    options.compaction_rate = 1024 * 1024;
+    const uint32_t rounds = 50;
+    {
+        Database database(options);
+        for (uint32_t round = 0; round < rounds; round++)
+        {
+            for (uint32_t key = 0; key < 10; key++)
+            {
+                put(database,
+                    "key" + to_string(key),
+                    string(100, 'a' + round % 26) + to_string(key));
+            }
+        }
+        const auto written = segments_size(directory);
+        maintain(database);
+        CHECK(segments_size(directory) < written / 2);
+        check_values(database, rounds - 1);
+    }
+
+    // The segments and their hint files are read back after a restart
+    CHECK(files_ending_with(directory, ".compact").empty());
+    CHECK(files_ending_with(directory, ".hint").size() ==
+          files_ending_with(directory, ".db").size());
+    {
+        Database database(options);
+        check_values(database, rounds - 1);
+    }
+    remove_directory(directory);
+}
+
+/**
+ * The hint file(or the key table, with the disk index) of a sealed segment
+ * is written a part at every tick, under the compaction rate, and only put
+ * in place once it is complete
+ */
+void test_index_over_ticks(const bool disk_index)
+{
+    const auto suffix = disk_index ? ".keys" : ".hint";
+    const auto directory = temporary_directory();
+    DatabaseOptions options;
+    options.data_directories = {directory};
+    options.partitions = 1;
+    options.segment_size = 1024 * 1024;
+    options.compaction_rate = 4 * 1024 * 1024;
+    options.disk_index = disk_index;
+    {
+        Database database(options);
+        for (uint32_t key = 0; key < 1200; key++)
+        {
+            put(database, "key" + to_string(key), string(1000, 'a' + key % 26));
+        }
+        database.maintenance();
+        CHECK(files_ending_with(directory, suffix).empty());
+        maintain(database);
+        CHECK(files_ending_with(directory, suffix).size() == 1);
+        CHECK(files_ending_with(directory, ".tmp").empty());
+        string value;
+        CHECK(get(database, "key0", value) && value == string(1000, 'a'));
+
+        // The keys of the key table left the memory index
+        ostringstream report;
+        database.report(report);
+        const auto text = report.str();
+        const auto keys =
+            stoul(text.substr(text.find('\n', text.find("Indexed keys")) + 1));
+        CHECK(disk_index ? keys < 1200 : keys == 1200);
+    }
+    {
+        Database database(options);
+        string value;
+        for (uint32_t key = 0; key < 1200; key++)
+        {
+            CHECK(get(database, "key" + to_string(key), value));
+            CHECK(value == string(1000, 'a' + key % 26));
+        }
+    }
+    remove_directory(directory);
+}
+
+/**
+ * With the disk index, a key overwritten while its segment is compacted
+ * leaves its dead bytes in the key table of the compacted segment, so they
+ * are known even if the server does not stop cleanly
+ */
+void test_dead_bytes_while_compacting()
+{
+    const auto directory = temporary_directory();
+    DatabaseOptions options;
+    options.data_directories = {directory};
+    options.partitions = 1;
+    options.segment_size = 4096;
+    options.compaction_rate = 1024 * 1024;
+    options.disk_index = true;
+    {
+        Database database(options);
+        for (uint32_t key = 0; key < 10; key++)
+        {
+            put(database, "key" + to_string(key), string(200, 'a'));
+        }
+        for (uint32_t round = 0; round < 3; round++)
+        {
+            for (uint32_t key = 5; key < 10; key++)
+            {
+                put(database, "key" + to_string(key), string(200, 'b'));
+            }
+        }
+
+        // The first record, key0, is copied in the tick the compaction starts
+        while (files_ending_with(directory, ".compact").empty())
+        {
+            CHECK(database.maintenance());
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        put(database, "key0", "again");
+        maintain(database);
+        CHECK(files_ending_with(directory, ".compact").empty());
+        const auto table = KeyTable::open(directory + "/easykey-0-0.keys");
+        CHECK(table && table->dead_bytes() > 0);
+        string value;
+        CHECK(get(database, "key0", value) && value == "again");
+    }
+    remove_directory(directory);
+}
+
+int main()
+{
+    test_compaction();
+    test_index_over_ticks(false);
+    test_index_over_ticks(true);
+    test_dead_bytes_while_compacting();
+    cout << "compaction ok" << endl;
+    return 0;
+}
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "easykey.hpp"
+#include "shards.hpp"
+#include "socket.hpp"
+#include "testing.hpp"
+
+namespace testing
+{
+/**
+ * The messages of a response, the first one is the status
+ */
+using Response = std::vector<std::string>;
+
+/**
+ * [protocol][message count]([4-byte size][message])...
+ */
+inline std::vector<std::uint8_t> frame(const std::vector<std::string>& messages,
+                                       const std::uint8_t protocol = 0x01)
+{
+    std::vector<std::uint8_t> bytes = {protocol,
+                                       (std::uint8_t)messages.size()};
+    for (const auto& message : messages)
+    {
+        const std::uint32_t size = message.size();
+        for (std::uint8_t shift = 0; shift < 32; shift += 8)
+        {
+            bytes.push_back((size >> shift) & 0xff);
+        }
+        bytes.insert(bytes.end(), message.begin(), message.end());
+    }
+    return bytes;
+}
+
+/**
+ * A client of the handler of a shard, through a socket pair. The test plays
+ * the server loop of the shard, see run_shard in main.cpp
+ */
+class Connection
+{
+  public:
+    Connection(easykey::Handler& handler,
+               easykey::Shards& shards,
+               const std::uint16_t shard)
+        : handler(handler), shards(shards), shard(shard)
+    {
+        std::int32_t pair[2];
+        CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pair) == 0);
+        peer = pair[1];
+        struct sockaddr_in address = {};
+        client.reset(new easykey::ClientSocket(pair[0], address));
+    }
+
+    ~Connection()
+    {
+        handler.disconnected(*client);
+        close(peer);
+    }
+
+    easykey::ClientSocket& socket()
+    {
+        return *client;
+    }
+
+    /**
+     * Sends the requests at once, like a pipelining client
+     */
+    void send(const std::vector<std::vector<std::string>>& frames)
+    {
+        std::vector<std::uint8_t> bytes;
+        for (const auto& messages : frames)
+        {
+            const auto part = frame(messages);
+            bytes.insert(bytes.end(), part.begin(), part.end());
+        }
+        send(bytes);
+    }
+
+    void send(const std::vector<std::uint8_t>& bytes)
+    {
+        CHECK(write(peer, bytes.data(), bytes.size()) == (ssize_t)bytes.size());
+    }
+
+    /**
+     * Runs the loop until count responses arrived, for up to 2 seconds
+     */
+    std::vector<Response> receive(const std::size_t count)
+    {
+        std::vector<Response> responses;
+        const auto deadline =
+            std::chrono::steady_clock::now() + std::chrono::seconds(2);
+        while (std::chrono::steady_clock::now() < deadline)
+        {
+            step();
+            Response response;
+            while (responses.size() < count && next(response))
+            {
+                responses.push_back(response);
+            }
+            if (responses.size() == count)
+            {
+                return responses;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return responses;
+    }
+
+    /**
+     * True once the handler shut down its side, with nothing unread
+     */
+    bool shut_down()
+    {
+        step();
+        std::uint8_t byte;
+        return received.empty() && read(peer, &byte, 1) == 0;
+    }
+
+  private:
+    easykey::Handler& handler;
+    easykey::Shards& shards;
+    const std::uint16_t shard;
+    std::int32_t peer;
+    std::unique_ptr<easykey::ClientSocket> client;
+    std::vector<std::uint8_t> received;
+
+    void step()
+    {
+        if (!client->closing)
+        {
+            client->begin_batch();
+            while (!client->closing && handler.parse_request(*client))
+            {
+            }
+            client->end_batch();
+        }
+        if (handler.completion_descriptor() >= 0)
+        {
+            handler.complete();
+        }
+        shards.receive(shard, handler);
+        handler.tick();
+        client->flush();
+        if (client->closing && client->pending_output() == 0 &&
+            client->pending_responses() == 0)
+        {
+            client->drain();
+        }
+
+        std::uint8_t buffer[4096];
+        ssize_t bytes_read;
+        while ((bytes_read = read(peer, buffer, sizeof(buffer))) > 0)
+        {
+            received.insert(received.end(), buffer, buffer + bytes_read);
+        }
+    }
+
+    /**
+     * Parses the next whole response that arrived
+     */
+    bool next(Response& response)
+    {
+        std::size_t position = 0;
+        if (received.size() < 2)
+        {
+            return false;
+        }
+        const auto count = received[1];
+        position += 2;
+        response.clear();
+        for (std::uint8_t message = 0; message < count; message++)
+        {
+            if (received.size() - position < 4)
+            {
+                return false;
+            }
+            std::uint32_t size = 0;
+            for (std::uint8_t byte = 0; byte < 4; byte++)
+            {
+                size |= (std::uint32_t)received[position + byte] << (8 * byte);
+            }
+            position += 4;
+            if (received.size() - position < size)
+            {
+                return false;
+            }
+            response.emplace_back(received.begin() + position,
+                                  received.begin() + position + size);
+            position += size;
+        }
+        received.erase(received.begin(), received.begin() + position);
+        return true;
+    }
+};
+}  // namespace testing
@@ -0,0 +1,111 @@
+#include "crc32c.hpp"
+#include "testing.hpp"
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace easykey;
+using namespace std;
+
+uint32_t checksum_of(const vector<uint8_t>& input)
+{
+    return crc32c(input.data(), input.size());
+}
+
+/**
+ * One bit at a time, the definition the fast paths must agree with
+ */
+uint32_t bitwise(const vector<uint8_t>& input)
+{
+    uint32_t checksum = ~0u;
+    for (const auto byte : input)
+    {
+        checksum ^= byte;
+        for (uint8_t bit = 0; bit < 8; bit++)
+        {
+            checksum = (checksum >> 1) ^ (0x82F63B78u & (0u - (checksum & 1)));
+        }
+    }
+    return ~checksum;
+}
+
+/**
+ * The check value of the catalogue, and the vectors of RFC 3720
+ */
+void test_known_vectors()
+{
+    const string check = "123456789";
+    CHECK(checksum_of(vector<uint8_t>(check.begin(), check.end())) ==
+          0xE3069283);
+    CHECK(checksum_of({}) == 0);
+
+    vector<uint8_t> input(32, 0x00);
+    CHECK(checksum_of(input) == 0x8A9136AA);
+    input.assign(32, 0xFF);
+    CHECK(checksum_of(input) == 0x62A8AB43);
+    for (uint8_t byte = 0; byte < 32; byte++)
+    {
+        input[byte] = byte;
+    }
+    CHECK(checksum_of(input) == 0x46DD794E);
+    for (uint8_t byte = 0; byte < 32; byte++)
+    {
+        input[byte] = 31 - byte;
+    }
+    CHECK(checksum_of(input) == 0x113FDB5C);
+}
+
+/**
+ * Every size around the 8-byte steps, at every alignment, against the
+ * bitwise definition, and continued from any split
+ */
+void test_against_bitwise()
+{
+    mt19937_64 random(14);
+    vector<uint8_t> buffer(1100);
+    for (auto& byte : buffer)
+    {
+        byte = random();
+    }
+    for (uint64_t size = 0; size < 1030; size += size < 40 ? 1 : 37)
+    {
+        for (uint64_t start = 0; start < 8; start++)
+        {
+            const vector<uint8_t> input(buffer.begin() + start,
+                                        buffer.begin() + start + size);
+            const auto expected = bitwise(input);
+            CHECK(crc32c(buffer.data() + start, size) == expected);
+
+            const auto split = size == 0 ? 0 : random() % size;
+            CHECK(crc32c(buffer.data() + start + split,
+                         size - split,
+                         crc32c(buffer.data() + start, split)) == expected);
+        }
+    }
+}
+
+/**
+ * Every single bit flip changes the checksum
+ */
+void test_bit_flips()
+{
+    vector<uint8_t> input(100, 'r');
+    const auto original = checksum_of(input);
+    for (uint64_t bit = 0; bit < input.size() * 8; bit++)
+    {
+        input[bit / 8] ^= 1 << (bit % 8);
+        CHECK(checksum_of(input) != original);
+        input[bit / 8] ^= 1 << (bit % 8);
+    }
+}
+
+int main()
+{
+    test_known_vectors();
+    test_against_bitwise();
+    test_bit_flips();
+    cout << "crc32c ok" << endl;
+    return 0;
+}
@@ -0,0 +1,170 @@
+#include "storage.hpp"
+
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <thread>
+
+using namespace easykey;
+using namespace std;
+using namespace testing;
+
+/**
+ * How many keys are in the index, from the report
+ */
+uint64_t indexed_keys(const Database& database)
+{
+    stringstream report;
+    database.report(report);
+    string line;
+    while (getline(report, line))
+    {
+        if (line.rfind("Indexed keys", 0) == 0)
+        {
+            getline(report, line);
+            return stoull(line);
+        }
+    }
+    CHECK(false);
+    return 0;
+}
+
+void sleep_for(const uint32_t milliseconds)
+{
+    this_thread::sleep_for(chrono::milliseconds(milliseconds));
+}
+
+/**
+ * A key is readable until its ttl passes, and an expired key is removed by
+ * the maintenance even if no one reads it
+ */
+void test_expiry(const DatabaseOptions& options)
+{
+    Database database(options);
+    string value;
+    put(database, "short", "value", chrono::milliseconds(200));
+    put(database, "forever", "value");
+    put(database, "long", "value", chrono::hours(1));
+    CHECK(get(database, "short", value) && value == "value");
+    sleep_for(250);
+    CHECK(!get(database, "short", value));
+    CHECK(get(database, "forever", value));
+    CHECK(get(database, "long", value));
+
+    put(database, "unread", "value", chrono::milliseconds(100));
+    CHECK(indexed_keys(database) == 3);
+    sleep_for(150);
+    maintain(database);
+    CHECK(indexed_keys(database) == 2);
+
+    // A rewrite replaces the expiry, with another one or with none
+    put(database, "rewritten", "first", chrono::milliseconds(100));
+    put(database, "rewritten", "second");
+    put(database, "extended", "first", chrono::milliseconds(100));
+    put(database, "extended", "second", chrono::hours(1));
+    put(database, "shortened", "first", chrono::hours(1));
+    put(database, "shortened", "second", chrono::milliseconds(100));
+    sleep_for(150);
+    maintain(database);
+    CHECK(get(database, "rewritten", value) && value == "second");
+    CHECK(get(database, "extended", value) && value == "second");
+    CHECK(indexed_keys(database) == 4);
+    CHECK(!get(database, "shortened", value));
+
+    // A deleted key does not expire again
+    put(database, "deleted", "value", chrono::milliseconds(100));
+    remove(database, "deleted");
+    put(database, "deleted", "again");
+    sleep_for(150);
+    maintain(database);
+    CHECK(get(database, "deleted", value) && value == "again");
+
+    // Expires after the restart, while the server is down
+    put(database, "restart", "value", chrono::milliseconds(300));
+}
+
+void check_restart(const DatabaseOptions& options)
+{
+    Database database(options);
+    string value;
+    CHECK(get(database, "forever", value));
+    CHECK(get(database, "long", value));
+    CHECK(get(database, "rewritten", value) && value == "second");
+    CHECK(get(database, "extended", value) && value == "second");
+    CHECK(get(database, "deleted", value) && value == "again");
+    CHECK(!get(database, "short", value));
+    CHECK(!get(database, "unread", value));
+    CHECK(!get(database, "shortened", value));
+    CHECK(!get(database, "restart", value));
+    CHECK(indexed_keys(database) == 5);
+}
+
+/**
+ * The expired records are compacted away, the segments with them shrink
+ */
+void test_compaction(DatabaseOptions options)
+{
+    const auto directory = temporary_directory();
+    options.data_directories = {directory};
+    {
+        Database database(options);
+        for (uint32_t key = 0; key < 40; key++)
+        {
+            put(database,
+                "key" + to_string(key),
+                string(200, 'e'),
+                chrono::milliseconds(key < 35 ? 100 : 0));
+        }
+        const auto written = segments_size(directory);
+        sleep_for(150);
+        maintain(database);
+        CHECK(segments_size(directory) < written / 2);
+        CHECK(indexed_keys(database) == 5);
+    }
+    for (const auto& hint : files_ending_with(directory, ".hint"))
+    {
+        unlink(hint.c_str());
+    }
+    Database database(options);
+    string value;
+    for (uint32_t key = 0; key < 40; key++)
+    {
+        CHECK(get(database, "key" + to_string(key), value) == (key >= 35));
+    }
+    remove_directory(directory);
+}
+
+void test_ttl(const IOBackend io)
+{
+    const auto directory = temporary_directory();
+    DatabaseOptions options;
+    options.data_directories = {directory};
+    options.partitions = 1;
+    options.segment_size = 4096;
+    options.compaction_rate = 1024 * 1024;
+    options.io = io;
+    test_expiry(options);
+    sleep_for(350);
+
+    // From the hint files, then from a full scan of the segments
+    check_restart(options);
+    for (const auto& hint : files_ending_with(directory, ".hint"))
+    {
+        unlink(hint.c_str());
+    }
+    check_restart(options);
+    remove_directory(directory);
+
+    test_compaction(options);
+}
+
+int main()
+{
+    test_ttl(IOBackend::BLOCKING);
+    test_ttl(IOBackend::URING);
+    cout << "expiry ok" << endl;
+    return 0;
+}
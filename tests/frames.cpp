@@ -0,0 +1,165 @@
+#include "connection.hpp"
+#include "easykey.hpp"
+#include "shards.hpp"
+#include "testing.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace easykey;
+using namespace std;
+using testing::Connection;
+using testing::frame;
+
+constexpr static char OK = 0x01;
+constexpr static char CLIENT_ERROR = 0x02;
+
+vector<uint8_t> join(const vector<vector<uint8_t>>& frames)
+{
+    vector<uint8_t> bytes;
+    for (const auto& part : frames)
+    {
+        bytes.insert(bytes.end(), part.begin(), part.end());
+    }
+    return bytes;
+}
+
+/**
+ * A frame is answered only once it arrived whole, even when it stops in the
+ * middle of a message size
+ */
+void test_partial_frame(Handler& handler, Shards& shards)
+{
+    Connection connection(handler, shards, 0);
+    const auto write = frame({"partial", "value"});
+    connection.send(vector<uint8_t>(write.begin(), write.begin() + 4));
+    CHECK(connection.receive(1).empty());
+    connection.send(vector<uint8_t>(write.begin() + 4, write.begin() + 9));
+    CHECK(connection.receive(1).empty());
+    connection.send(vector<uint8_t>(write.begin() + 9, write.end()));
+    const auto responses = connection.receive(1);
+    CHECK(responses.size() == 1 && responses[0][0][0] == OK);
+}
+
+/**
+ * A request with a bad message is answered with an error, and the request
+ * after it is still parsed from where it starts
+ */
+void test_bad_messages(Handler& handler, Shards& shards)
+{
+    Connection connection(handler, shards, 0);
+    connection.send(join({
+        frame({"key", "value", "ttl"}),
+        frame({"a", "b", "c", "d"}),
+        frame({string(1, '\x7f')}),
+        frame({"key", "value"}),
+        frame({"key"}),
+    }));
+    const auto responses = connection.receive(5);
+    CHECK(responses.size() == 5);
+    CHECK(responses[0][0][0] == CLIENT_ERROR);
+    CHECK(responses[1][0][0] == CLIENT_ERROR);
+    CHECK(responses[2][0][0] == CLIENT_ERROR);
+    CHECK(responses[3][0][0] == OK);
+    CHECK(responses[4][0][0] == OK && responses[4][1] == "value");
+    CHECK(!connection.socket().closing);
+}
+
+/**
+ * Without a known protocol the frame size is unknown, nothing after it is
+ * parsed and the connection is closed
+ */
+void test_unknown_protocol(Handler& handler, Shards& shards)
+{
+    Connection connection(handler, shards, 0);
+    connection.send(join({frame({"key"}, 0x02), frame({"key"})}));
+    const auto responses = connection.receive(2);
+    CHECK(responses.size() == 1 && responses[0][0][0] == CLIENT_ERROR);
+    CHECK(connection.socket().closing);
+    CHECK(connection.shut_down());
+}
+
+/**
+ * A frame bigger than the request limit is answered with an error, and the
+ * connection is closed without reading the rest
+ */
+void test_frame_too_big(Handler& handler,
+                        Shards& shards,
+                        const uint64_t limit)
+{
+    Connection connection(handler, shards, 0);
+    connection.send(join({frame({"big", string(limit * 2, 'x')}),
+                          frame({"key"})}));
+    const auto responses = connection.receive(2);
+    CHECK(responses.size() == 1 && responses[0][0][0] == CLIENT_ERROR);
+    CHECK(connection.socket().closing);
+}
+
+/**
+ * A spliced value is moved as it arrives, the other clients are served
+ * meanwhile. The one of a client that goes away is never indexed, and the
+ * recovery skips its record
+ */
+void test_partial_value(DatabaseOptions options)
+{
+    const auto value = string(4096, 'v');
+    {
+        Shards shards(1);
+        Handler handler(options, shards);
+        Connection connection(handler, shards, 0);
+        const auto write = frame({"spliced", value});
+        connection.send(vector<uint8_t>(write.begin(), write.begin() + 1000));
+        CHECK(connection.receive(1).empty());
+        connection.send(vector<uint8_t>(write.begin() + 1000, write.end()));
+        auto responses = connection.receive(1);
+        CHECK(responses.size() == 1 && responses[0][0][0] == OK);
+
+        {
+            Connection leaving(handler, shards, 0);
+            const auto lost = frame({"lost", value});
+            leaving.send(vector<uint8_t>(lost.begin(), lost.begin() + 1000));
+            CHECK(leaving.receive(1).empty());
+            connection.send({{"after", "value"}});
+            responses = connection.receive(1);
+            CHECK(responses.size() == 1 && responses[0][0][0] == OK);
+        }
+        connection.send({{"lost"}, {"spliced"}});
+        responses = connection.receive(2);
+        CHECK(responses.size() == 2);
+        CHECK(responses[0][0][0] == CLIENT_ERROR);
+        CHECK(responses[1][0][0] == OK && responses[1][1] == value);
+    }
+
+    Shards shards(1);
+    Handler handler(options, shards);
+    Connection connection(handler, shards, 0);
+    connection.send({{"lost"}, {"after"}, {"spliced"}});
+    const auto responses = connection.receive(3);
+    CHECK(responses.size() == 3);
+    CHECK(responses[0][0][0] == CLIENT_ERROR);
+    CHECK(responses[1][0][0] == OK && responses[1][1] == "value");
+    CHECK(responses[2][0][0] == OK && responses[2][1] == value);
+}
+
+int main()
+{
+    const auto directory = testing::temporary_directory();
+    DatabaseOptions options;
+    options.data_directories = {directory};
+    options.partitions = 1;
+    options.max_request_size = 1024;
+    {
+        Shards shards(1);
+        Handler handler(options, shards);
+        test_partial_frame(handler, shards);
+        test_bad_messages(handler, shards);
+        test_unknown_protocol(handler, shards);
+        test_frame_too_big(handler, shards, options.max_request_size);
+    }
+    options.splice_threshold = 1024;
+    test_partial_value(options);
+    testing::remove_directory(directory);
+    cout << "frames ok" << endl;
+    return 0;
+}
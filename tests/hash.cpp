@@ -0,0 +1,47 @@
+#include "hash.hpp"
+#include "testing.hpp"
+
+#include <cstdint>
+#include <string>
+
+using namespace easykey;
+using namespace std;
+
+uint64_t hash_of(const string& input, const uint64_t seed = 0)
+{
+    return easykey::hash(
+        reinterpret_cast<const uint8_t*>(input.data()), input.size(), seed);
+}
+
+/**
+ * The vectors of the reference implementation, short inputs and inputs of
+ * more than one 32-byte stripe
+ */
+void test_known_vectors()
+{
+    CHECK(hash_of("") == 0xEF46DB3751D8E999ULL);
+    CHECK(hash_of("a") == 0xD24EC4F1A98C6E5BULL);
+    CHECK(hash_of("abc") == 0x44BC2CF5AD770999ULL);
+    CHECK(hash_of("xxhash") == 0x32DD38952C4BC720ULL);
+    CHECK(hash_of("xxhash", 20141025) == 0xB559B98D844E0635ULL);
+    CHECK(hash_of("Nobody inspects the spammish repetition") ==
+          0xFBCEA83C8A378BF1ULL);
+}
+
+/**
+ * The key overload is the same hash, and keys that only differ in their
+ * last byte do not collide
+ */
+void test_keys()
+{
+    CHECK(easykey::hash(string("abc")) == hash_of("abc"));
+    CHECK(easykey::hash(string("key1")) != easykey::hash(string("key2")));
+}
+
+int main()
+{
+    test_known_vectors();
+    test_keys();
+    cout << "hash ok" << endl;
+    return 0;
+}
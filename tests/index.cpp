@@ -0,0 +1,338 @@
+#include "index.hpp"
+#include "testing.hpp"
+
+#include <cstdint>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace easykey;
+using namespace std;
+
+/**
+ * How few keys a B+tree node has before it is merged, see index.cpp
+ */
+constexpr static uint64_t TREE_NODE_MIN_KEYS = 16;
+
+/**
+ * Keys of many sizes, most with a common prefix, so they share hash tags
+ * only by chance
+ */
+string random_key(mt19937_64& random)
+{
+    const auto size = random() % 24;
+    string key = "key";
+    for (uint64_t index = 0; index < size; index++)
+    {
+        key.push_back('a' + random() % 26);
+    }
+    return key;
+}
+
+/**
+ * Inserts, overwrites, erases and finds random keys, and compares every
+ * answer with std::map, across several doublings of the table
+ */
+void test_against_map(const bool ordered)
+{
+    mt19937_64 random(42);
+    Index index(ordered);
+    map<string, IndexEntry> expected;
+    for (uint32_t operation = 0; operation < 100000; operation++)
+    {
+        const auto key = random_key(random);
+        if (random() % 4 == 0)
+        {
+            const auto entry = index.find(key);
+            const auto found = expected.find(key);
+            CHECK((entry == nullptr) == (found == expected.end()));
+            if (entry != nullptr)
+            {
+                CHECK(entry->offset == found->second.offset);
+                CHECK(entry->file == found->second.file);
+                CHECK(entry->size == found->second.size);
+            }
+            continue;
+        }
+        if (random() % 5 == 0)
+        {
+            CHECK(index.erase(key) == (expected.erase(key) == 1));
+            continue;
+        }
+        bool inserted;
+        auto& entry = index.insert(key, inserted);
+        CHECK(inserted == (expected.count(key) == 0));
+        entry.offset = operation;
+        entry.file = operation % 7;
+        entry.size = operation * 3;
+        expected[key] = entry;
+    }
+
+    CHECK(index.size() == expected.size());
+    for (const auto& pair : expected)
+    {
+        const auto entry = index.find(pair.first);
+        CHECK(entry != nullptr);
+        CHECK(entry->offset == pair.second.offset);
+        CHECK(entry->file == pair.second.file);
+        CHECK(entry->size == pair.second.size);
+    }
+    CHECK(index.find("not a key") == nullptr);
+}
+
+/**
+ * A key bigger than an arena chunk gets a chunk of its own, and the keys
+ * after it still go to a normal chunk
+ */
+void test_big_keys()
+{
+    Index index(true);
+    const string big(3 * 1024 * 1024, 'b');
+    bool inserted;
+    index.insert("small", inserted).offset = 1;
+    index.insert(big, inserted).offset = 2;
+    index.insert("", inserted).offset = 3;
+    index.insert("after", inserted).offset = 4;
+    CHECK(index.find("small")->offset == 1);
+    CHECK(index.find(big)->offset == 2);
+    CHECK(index.find("")->offset == 3);
+    CHECK(index.find("after")->offset == 4);
+    CHECK(index.find(big.substr(1)) == nullptr);
+    CHECK(index.size() == 4);
+}
+
+/**
+ * The keys of the index from the from key until the to key, in order
+ */
+vector<string> scanned(Index& index,
+                       const string& from,
+                       const string& to,
+                       const uint64_t limit = UINT64_MAX)
+{
+    vector<string> keys;
+    CHECK(index.scan(from, to, [&keys, limit](const string& key,
+                                              const IndexEntry&) {
+        keys.push_back(key);
+        return keys.size() < limit;
+    }));
+    return keys;
+}
+
+/**
+ * Random ranges of the index against the same ranges of std::map
+ */
+void check_ranges(mt19937_64& random,
+                  Index& index,
+                  const map<string, uint64_t>& expected)
+{
+    for (uint32_t round = 0; round < 50; round++)
+    {
+        auto from = random_key(random);
+        auto to = random_key(random);
+        if (to < from)
+        {
+            swap(from, to);
+        }
+        if (round % 10 == 0)
+        {
+            to.clear();
+        }
+        vector<string> keys;
+        for (auto found = expected.lower_bound(from);
+             found != expected.end() && (to.empty() || found->first < to);
+             found++)
+        {
+            keys.push_back(found->first);
+        }
+        CHECK(scanned(index, from, to) == keys);
+    }
+}
+
+/**
+ * Random ranges of the B+tree against std::map, with enough keys for a
+ * few levels of nodes, before and after most of them are erased
+ */
+void test_scan_against_map()
+{
+    mt19937_64 random(7);
+    Index index(true);
+    map<string, uint64_t> expected;
+    for (uint32_t operation = 0; operation < 20000; operation++)
+    {
+        const auto key = random_key(random);
+        bool inserted;
+        index.insert(key, inserted).offset = operation;
+        expected[key] = operation;
+    }
+
+    check_ranges(random, index, expected);
+
+    // Everything, and a scan stopped by its callback
+    vector<string> keys;
+    for (const auto& pair : expected)
+    {
+        keys.push_back(pair.first);
+    }
+    CHECK(scanned(index, "", "") == keys);
+    CHECK(scanned(index, "", "", 10) ==
+          vector<string>(keys.begin(), keys.begin() + 10));
+
+    // The entries are the ones of the table
+    CHECK(index.scan("", "", [&index](const string& key,
+                                      const IndexEntry& entry) {
+        CHECK(index.find(key)->offset == entry.offset);
+        return true;
+    }));
+
+    for (auto pair = expected.begin(); pair != expected.end();)
+    {
+        if (random() % 4 != 0)
+        {
+            CHECK(index.erase(pair->first));
+            pair = expected.erase(pair);
+        }
+        else
+        {
+            pair++;
+        }
+    }
+    CHECK(index.size() == expected.size());
+    check_ranges(random, index, expected);
+}
+
+/**
+ * When most of the arena is erased keys it is repacked: the memory goes
+ * down, and the keys left, and the tree pointing at them, are still found
+ */
+void test_repack(const bool ordered)
+{
+    Index index(ordered);
+    map<string, uint64_t> expected;
+    for (uint32_t key = 0; key < 60000; key++)
+    {
+        const auto name = "key" + to_string(key) + string(80, 'r');
+        bool inserted;
+        index.insert(name, inserted).offset = key;
+        expected[name] = key;
+    }
+    const auto before = index.memory();
+    for (auto pair = expected.begin(); pair != expected.end();)
+    {
+        if (pair->second % 4 != 0)
+        {
+            CHECK(index.erase(pair->first));
+            pair = expected.erase(pair);
+        }
+        else
+        {
+            pair++;
+        }
+    }
+    CHECK(index.memory() < before * 3 / 4);
+    CHECK(index.size() == expected.size());
+    for (const auto& pair : expected)
+    {
+        CHECK(index.find(pair.first)->offset == pair.second);
+    }
+    if (ordered)
+    {
+        vector<string> keys;
+        for (const auto& pair : expected)
+        {
+            keys.push_back(pair.first);
+        }
+        CHECK(scanned(index, "", "") == keys);
+        mt19937_64 random(9);
+        check_ranges(random, index, expected);
+    }
+}
+
+/**
+ * The B+tree nodes of the erased keys are merged and freed, so a tree that
+ * lost most of its keys takes about the memory of its keys left, and it is
+ * still found and scanned in order. The tree is all the difference between
+ * an ordered and an unordered index with the same keys, while the arena is
+ * one chunk that is never repacked
+ */
+void test_tree_shrinks()
+{
+    Index ordered(true);
+    Index unordered(false);
+    const auto node = ordered.memory() - unordered.memory();
+    map<string, uint64_t> expected;
+    mt19937_64 random(3);
+    for (uint32_t key = 0; key < 20000; key++)
+    {
+        const auto name = "k" + to_string(random() % 1000000);
+        bool inserted;
+        ordered.insert(name, inserted).offset = key;
+        unordered.insert(name, inserted).offset = key;
+        expected[name] = key;
+    }
+    CHECK(ordered.memory() - unordered.memory() > 100 * node);
+
+    // From both ends and from the middle, so every side is merged
+    for (auto pair = expected.begin(); pair != expected.end();)
+    {
+        if (random() % 100 != 0)
+        {
+            CHECK(ordered.erase(pair->first));
+            CHECK(unordered.erase(pair->first));
+            pair = expected.erase(pair);
+        }
+        else
+        {
+            pair++;
+        }
+    }
+    CHECK(ordered.memory() - unordered.memory() <
+          (expected.size() / TREE_NODE_MIN_KEYS + 4) * node);
+    vector<string> keys;
+    for (const auto& pair : expected)
+    {
+        keys.push_back(pair.first);
+        CHECK(ordered.find(pair.first)->offset == pair.second);
+    }
+    CHECK(scanned(ordered, "", "") == keys);
+    check_ranges(random, ordered, expected);
+
+    // Down to an empty root, that takes keys again
+    for (const auto& key : keys)
+    {
+        CHECK(ordered.erase(key));
+        CHECK(unordered.erase(key));
+    }
+    CHECK(ordered.memory() - unordered.memory() == node);
+    CHECK(scanned(ordered, "", "").empty());
+    bool inserted;
+    ordered.insert("again", inserted);
+    CHECK(scanned(ordered, "", "") == vector<string>{"again"});
+}
+
+/**
+ * An unordered index can not be scanned
+ */
+void test_unordered_scan()
+{
+    Index index(false);
+    bool inserted;
+    index.insert("key", inserted);
+    CHECK(!index.scan("", "", [](const string&, const IndexEntry&) {
+        return true;
+    }));
+}
+
+int main()
+{
+    test_against_map(false);
+    test_against_map(true);
+    test_big_keys();
+    test_scan_against_map();
+    test_repack(false);
+    test_repack(true);
+    test_tree_shrinks();
+    test_unordered_scan();
+    cout << "index ok" << endl;
+    return 0;
+}
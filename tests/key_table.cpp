@@ -0,0 +1,121 @@
+#include "key_table.hpp"
+#include "testing.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace easykey;
+using namespace std;
+using namespace testing;
+
+bool find(const KeyTable& table, const string& key, TableEntry& entry)
+{
+    return table.find(key, KeyTable::filter_hash(key), entry);
+}
+
+/**
+ * Random entries, some keys many times, tombstones, expiries and keys
+ * bigger than a page, against std::map. Every key written is found, so the
+ * filter has no false negatives, and the keys that were not written are not
+ */
+void test_against_map(const string& directory)
+{
+    mt19937_64 random(15);
+    vector<TableEntry> entries;
+    map<string, TableEntry> expected;
+    for (uint32_t index = 0; index < 50000; index++)
+    {
+        TableEntry entry;
+        entry.key = "key" + to_string(random() % 30000);
+        if (index % 5000 == 0)
+        {
+            entry.key += string(6000, 'b');
+        }
+        entry.offset = random() >> 1;
+        entry.size = index % 10 == 0 ? 0 : random() % 100000 + 4;
+        entry.expiry = index % 3 == 0 ? random() >> 20 : 0;
+        entries.push_back(entry);
+        expected[entry.key] = entry;
+    }
+
+    const auto filename = directory + "/table.keys";
+    CHECK(KeyTable::write(filename, entries, 123456, 789));
+    const auto table = KeyTable::open(filename);
+    CHECK(table != nullptr);
+    CHECK(table->size() == expected.size());
+    CHECK(table->covered() == 123456);
+    CHECK(table->dead_bytes() == 789);
+
+    TableEntry found;
+    for (const auto& pair : expected)
+    {
+        CHECK(find(*table, pair.first, found));
+        CHECK(found.key == pair.first);
+        CHECK(found.offset == pair.second.offset);
+        CHECK(found.size == pair.second.size);
+        CHECK(found.expiry == pair.second.expiry);
+    }
+    for (uint32_t key = 30000; key < 40000; key++)
+    {
+        CHECK(!find(*table, "key" + to_string(key), found));
+    }
+    CHECK(!find(*table, "", found));
+    CHECK(!find(*table, "zzz", found));
+}
+
+/**
+ * The dead bytes are saved in the file, and a table that is not complete or
+ * was changed is not opened
+ */
+void test_file(const string& directory)
+{
+    const auto filename = directory + "/small.keys";
+    vector<TableEntry> entries{{"a", 4, 10, 0}, {"b", 20, 0, 0}};
+    CHECK(KeyTable::write(filename, entries, 40, 0));
+    {
+        const auto table = KeyTable::open(filename);
+        CHECK(table != nullptr);
+        table->save_dead_bytes(14);
+    }
+    {
+        const auto table = KeyTable::open(filename);
+        CHECK(table->dead_bytes() == 14);
+        TableEntry found;
+        CHECK(find(*table, "b", found) && found.size == 0);
+    }
+
+    // A changed byte of the header or of the filter
+    for (const off_t offset : {20, 60})
+    {
+        const auto fd = ::open(filename.c_str(), O_RDWR);
+        uint8_t byte;
+        CHECK(pread(fd, &byte, 1, offset) == 1);
+        byte ^= 0x10;
+        CHECK(pwrite(fd, &byte, 1, offset) == 1);
+        CHECK(KeyTable::open(filename) == nullptr);
+        byte ^= 0x10;
+        CHECK(pwrite(fd, &byte, 1, offset) == 1);
+        close(fd);
+        CHECK(KeyTable::open(filename) != nullptr);
+    }
+
+    CHECK(truncate(filename.c_str(), 30) == 0);
+    CHECK(KeyTable::open(filename) == nullptr);
+    CHECK(KeyTable::open(directory + "/missing.keys") == nullptr);
+}
+
+int main()
+{
+    const auto directory = temporary_directory();
+    test_against_map(directory);
+    test_file(directory);
+    remove_directory(directory);
+    cout << "key table ok" << endl;
+    return 0;
+}
@@ -0,0 +1,162 @@
+#include "lz4.hpp"
+#include "testing.hpp"
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace easykey;
+using namespace std;
+
+vector<uint8_t> bytes_of(const string& input)
+{
+    return vector<uint8_t>(input.begin(), input.end());
+}
+
+/**
+ * Compresses and decompresses the input, after some bytes already in the
+ * output vectors, that must be kept
+ */
+vector<uint8_t> round_trip(const vector<uint8_t>& input)
+{
+    vector<uint8_t> compressed{7, 7};
+    lz4_compress(input.data(), input.size(), compressed);
+    compressed.erase(compressed.begin(), compressed.begin() + 2);
+
+    vector<uint8_t> output{9};
+    CHECK(lz4_decompress(
+        compressed.data(), compressed.size(), input.size(), output));
+    CHECK(output.size() == input.size() + 1 && output[0] == 9);
+    CHECK(vector<uint8_t>(output.begin() + 1, output.end()) == input);
+    return compressed;
+}
+
+/**
+ * Inputs shorter than a match, repeated ones, ones that do not compress,
+ * JSON, and matches across the whole 64 KiB window and beyond it
+ */
+void test_round_trip()
+{
+    mt19937_64 random(3);
+    round_trip({});
+    round_trip(bytes_of("a"));
+    round_trip(bytes_of("abcabcabcab"));
+    CHECK(round_trip(vector<uint8_t>(100000, 'x')).size() < 1000);
+
+    vector<uint8_t> noise(200000);
+    for (auto& byte : noise)
+    {
+        byte = random();
+    }
+    CHECK(round_trip(noise).size() <= noise.size() + noise.size() / 255 + 16);
+
+    string json;
+    for (uint32_t item = 0; json.size() < 50000; item++)
+    {
+        json += "{\"id\":" + to_string(item) + ",\"name\":\"user" +
+                to_string(item % 97) + "\",\"active\":" +
+                (item % 3 == 0 ? "true" : "false") + ",\"tags\":[\"a\",\"b\"]},";
+    }
+    CHECK(round_trip(bytes_of(json)).size() < json.size() / 3);
+
+    // A block repeated at the edge of the window, and after it
+    for (const auto distance : {65535u, 65536u, 70000u})
+    {
+        vector<uint8_t> input(noise.begin(), noise.begin() + 1000);
+        input.resize(distance, 'z');
+        input.insert(input.end(), noise.begin(), noise.begin() + 1000);
+        round_trip(input);
+    }
+
+    // Literal and match lengths around the extra length bytes
+    for (const auto length : {14u, 15u, 16u, 269u, 270u, 271u, 600u})
+    {
+        vector<uint8_t> input(noise.begin(), noise.begin() + length);
+        input.insert(input.end(), length, 'm');
+        input.insert(input.end(), noise.begin(), noise.begin() + length);
+        round_trip(input);
+    }
+}
+
+/**
+ * A block written by hand, as the reference implementation reads it: three
+ * literals, an overlapping match of 10 bytes 3 bytes back, and the last 5
+ * literals
+ */
+void test_known_block()
+{
+    const vector<uint8_t> block{
+        0x36, 'a', 'b', 'c', 0x03, 0x00, 0x50, 'b', 'c', 'a', 'b', 'c'};
+    vector<uint8_t> output;
+    CHECK(lz4_decompress(block.data(), block.size(), 18, output));
+    CHECK(output == bytes_of("abcabcabcabcabcabc"));
+}
+
+/**
+ * The input is from the disk, so every corrupt block is rejected without
+ * touching the output: truncated ones, wrong sizes, offsets before the
+ * start, and random bytes
+ */
+void test_corrupt()
+{
+    const vector<uint8_t> before{1, 2, 3};
+    vector<uint8_t> output = before;
+    string text;
+    for (uint32_t line = 0; line < 200; line++)
+    {
+        text += "line " + to_string(line % 13) + " of the text\n";
+    }
+    const auto input = bytes_of(text);
+    vector<uint8_t> compressed;
+    lz4_compress(input.data(), input.size(), compressed);
+
+    for (uint64_t size = 0; size < compressed.size(); size++)
+    {
+        CHECK(!lz4_decompress(compressed.data(), size, input.size(), output));
+        CHECK(output == before);
+    }
+    CHECK(!lz4_decompress(
+        compressed.data(), compressed.size(), input.size() - 1, output));
+    CHECK(!lz4_decompress(
+        compressed.data(), compressed.size(), input.size() + 1, output));
+    CHECK(output == before);
+
+    const vector<uint8_t> zero_offset{0x10, 'a', 0x00, 0x00, 0x50, 'a',
+                                      'a',  'a', 'a',  'a'};
+    CHECK(!lz4_decompress(zero_offset.data(), zero_offset.size(), 10, output));
+    const vector<uint8_t> far_offset{0x10, 'a', 0x02, 0x00, 0x50, 'a',
+                                     'a',  'a', 'a',  'a'};
+    CHECK(!lz4_decompress(far_offset.data(), far_offset.size(), 10, output));
+    CHECK(output == before);
+
+    // Never reads or writes out of bounds, and a failure appends nothing
+    mt19937_64 random(5);
+    for (uint32_t round = 0; round < 10000; round++)
+    {
+        auto changed = compressed;
+        changed[random() % changed.size()] = random();
+        if (round % 2 == 0)
+        {
+            changed[random() % changed.size()] = random();
+        }
+        output = before;
+        if (lz4_decompress(changed.data(), changed.size(), input.size(), output))
+        {
+            CHECK(output.size() == before.size() + input.size());
+        }
+        else
+        {
+            CHECK(output == before);
+        }
+    }
+}
+
+int main()
+{
+    test_round_trip();
+    test_known_block();
+    test_corrupt();
+    cout << "lz4 ok" << endl;
+    return 0;
+}
@@ -0,0 +1,170 @@
+#include "socket.hpp"
+#include "testing.hpp"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace easykey;
+using namespace std;
+
+/**
+ * A client socket and the peer the test reads from, both non-blocking
+ */
+struct Pair
+{
+    Pair()
+    {
+        int32_t pair[2];
+        CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pair) == 0);
+        peer = pair[1];
+        struct sockaddr_in address = {};
+        client.reset(new ClientSocket(pair[0], address));
+    }
+
+    ~Pair()
+    {
+        close(peer);
+    }
+
+    /**
+     * Reads what arrived, returns true if the client shut down its side
+     */
+    bool read_all(string& received)
+    {
+        char buffer[65536];
+        while (true)
+        {
+            const auto bytes_read = read(peer, buffer, sizeof(buffer));
+            if (bytes_read == 0)
+            {
+                return true;
+            }
+            if (bytes_read < 0)
+            {
+                return false;
+            }
+            received.append(buffer, bytes_read);
+        }
+    }
+
+    int32_t peer;
+    unique_ptr<ClientSocket> client;
+};
+
+/**
+ * A file with the content, its descriptor is returned
+ */
+int32_t file_with(const string& directory, const string& content)
+{
+    const auto name = directory + "/values";
+    const auto fd = open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    CHECK(fd >= 0);
+    CHECK(write(fd, content.data(), content.size()) == (ssize_t)content.size());
+    return fd;
+}
+
+/**
+ * What the socket buffer does not take waits in the output, and the writes
+ * after it go after it, so a slow client gets every response in order
+ */
+void test_queued_output(const string& directory)
+{
+    Pair pair;
+    const string value(1024 * 1024, 'v');
+    const auto fd = file_with(directory, value);
+    string expected;
+    for (uint32_t round = 0; round < 4; round++)
+    {
+        const auto header = "header" + to_string(round);
+        pair.client->write(
+            (const uint8_t*)header.data(), header.size(), true);
+        pair.client->write(fd, 0, value.size());
+        expected += header + value;
+    }
+    CHECK(pair.client->pending_output() > 0);
+    close(fd);
+
+    // The ranges of the file were copied, it can be closed meanwhile
+    string received;
+    while (pair.client->pending_output() > 0)
+    {
+        CHECK(!pair.read_all(received));
+        CHECK(pair.client->flush());
+    }
+    CHECK(!pair.read_all(received));
+    CHECK(received == expected);
+    CHECK(!pair.client->closing);
+}
+
+/**
+ * A range longer than the file can not be sent whole after its header, the
+ * connection is closed instead of leaving the client waiting for it
+ */
+void test_short_file(const string& directory)
+{
+    Pair pair;
+    const auto fd = file_with(directory, "short");
+    const string header = "size";
+    pair.client->write((const uint8_t*)header.data(), header.size(), true);
+    pair.client->write(fd, 0, 100);
+    CHECK(pair.client->closing);
+
+    // Nothing is sent after it
+    const string next = "next";
+    pair.client->write((const uint8_t*)next.data(), next.size(), false);
+    CHECK(pair.client->pending_output() == 0);
+    string received;
+    CHECK(pair.read_all(received));
+    CHECK(received == header + "short");
+    close(fd);
+}
+
+/**
+ * The same, for a range that was waiting in the output behind a response
+ * the client did not read yet
+ */
+void test_short_file_queued(const string& directory)
+{
+    Pair pair;
+    const auto fd = file_with(directory, "short");
+    const string first(4 * 1024 * 1024, 'f');
+    pair.client->write((const uint8_t*)first.data(), first.size(), true);
+    CHECK(pair.client->pending_output() > 0);
+    const string header = "size";
+    pair.client->write((const uint8_t*)header.data(), header.size(), true);
+    pair.client->write(fd, 0, 100);
+    CHECK(!pair.client->closing);
+    close(fd);
+
+    string received;
+    while (!pair.client->closing)
+    {
+        CHECK(!pair.read_all(received));
+        pair.client->flush();
+    }
+    CHECK(pair.client->pending_output() == 0);
+
+    // A response that completes later is dropped
+    const string late = "late";
+    pair.client->write((const uint8_t*)late.data(), late.size(), false);
+    CHECK(!pair.client->flush());
+    CHECK(pair.client->pending_output() == 0);
+    CHECK(pair.read_all(received));
+    CHECK(received == first + header + "short");
+}
+
+int main()
+{
+    const auto directory = testing::temporary_directory();
+    test_queued_output(directory);
+    test_short_file(directory);
+    test_short_file_queued(directory);
+    testing::remove_directory(directory);
+    cout << "output ok" << endl;
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include "connection.hpp"
+#include "easykey.hpp"
+#include "shards.hpp"
+#include "testing.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace easykey;
+using namespace std;
+using testing::Connection;
+using testing::frame;
+
+constexpr static char OK = 0x01;
+constexpr static char CLIENT_ERROR = 0x02;
+
+/**
+ * What a pipelined request is answered with: a status, and the value of a
+ * read
+ */
+struct Expected
+{
+    char status;
+    string value;
+};
+
+/**
+ * Many requests in one send: the reads see the writes before them and not
+ * the ones after, and the responses come in the order of the requests, even
+ * when a write is answered after the reads that follow it
+ */
+void test_pipelining(const DatabaseOptions& options)
+{
+    Shards shards(1);
+    Handler handler(options, shards);
+    Connection connection(handler, shards, 0);
+    vector<uint8_t> requests;
+    vector<Expected> expected;
+    const auto add = [&](const vector<string>& messages,
+                         const char status,
+                         const string& value) {
+        const auto bytes = frame(messages);
+        requests.insert(requests.end(), bytes.begin(), bytes.end());
+        expected.push_back(Expected{status, value});
+    };
+    for (uint32_t round = 0; round < 200; round++)
+    {
+        const auto key = "key" + to_string(round % 20);
+        const auto value = "value" + to_string(round);
+        add({key, value}, OK, "");
+        add({key}, OK, value);
+        if (round % 7 == 0)
+        {
+            add({string(1, (char)Command::DELETE), key}, OK, "");
+            add({key}, CLIENT_ERROR, "");
+            add({key, value}, OK, "");
+        }
+    }
+    connection.send(requests);
+    const auto responses = connection.receive(expected.size());
+    CHECK(responses.size() == expected.size());
+    for (size_t index = 0; index < expected.size(); index++)
+    {
+        CHECK(responses[index][0][0] == expected[index].status);
+        if (!expected[index].value.empty())
+        {
+            CHECK(responses[index].size() == 2 &&
+                  responses[index][1] == expected[index].value);
+        }
+    }
+}
+
+int main()
+{
+    const auto directory = testing::temporary_directory();
+    DatabaseOptions options;
+    options.data_directories = {directory};
+    options.partitions = 1;
+    for (const auto io : {IOBackend::BLOCKING, IOBackend::URING})
+    {
+        for (const auto durability : {Durability::NONE, Durability::GROUP})
+        {
+            options.io = io;
+            options.durability = durability;
+            test_pipelining(options);
+        }
+    }
+    testing::remove_directory(directory);
+    cout << "pipelining ok" << endl;
+    return 0;
+}
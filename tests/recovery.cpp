@@ -0,0 +1,133 @@
+#include "storage.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace easykey;
+using namespace std;
+using namespace testing;
+
+/**
+ * The keys written by write_keys, after a restart
+ */
+void check_keys(const DatabaseOptions& options)
+{
+    Database database(options);
+    string value;
+    CHECK(get(database, "first", value) && value == "overwritten");
+    CHECK(!get(database, "second", value));
+    CHECK(get(database, "empty", value) && value.empty());
+    CHECK(!get(database, "missing", value));
+}
+
+void write_keys(const DatabaseOptions& options)
+{
+    Database database(options);
+    put(database, "first", "first value");
+    put(database, "second", "second value");
+    put(database, "first", "overwritten");
+    remove(database, "second");
+    put(database, "empty", "");
+}
+
+void test_recovery(const IOBackend io)
+{
+    const auto directory = temporary_directory();
+    DatabaseOptions options;
+    options.data_directories = {directory};
+    options.io = io;
+    write_keys(options);
+
+    // From the hint files, then from a full scan of the segments
+    check_keys(options);
+    for (const auto& hint : files_ending_with(directory, ".hint"))
+    {
+        unlink(hint.c_str());
+    }
+    check_keys(options);
+
+    // A record torn by a crash is cut from the end of the segment
+    string torn_file;
+    for (const auto& file : files_ending_with(directory, ".db"))
+    {
+        struct stat file_stat;
+        CHECK(stat(file.c_str(), &file_stat) == 0);
+        if (file_stat.st_size > 0)
+        {
+            torn_file = file;
+        }
+    }
+    CHECK(!torn_file.empty());
+    const auto fd = open(torn_file.c_str(), O_WRONLY | O_APPEND);
+    CHECK(fd >= 0);
+    const uint8_t torn[] = {0x05, 0x00, 0x00, 0x00, 't', 'o'};
+    CHECK(write(fd, torn, sizeof(torn)) == (ssize_t)sizeof(torn));
+    close(fd);
+    check_keys(options);
+    {
+        Database database(options);
+        put(database, "new", "after the torn record");
+    }
+    {
+        Database database(options);
+        string value;
+        CHECK(get(database, "new", value) && value == "after the torn record");
+    }
+    remove_directory(directory);
+}
+
+/**
+ * The partitions are striped over the directories, and the server refuses
+ * to start with them in another order
+ */
+void test_directories()
+{
+    const vector<string> directories{temporary_directory(),
+                                     temporary_directory()};
+    DatabaseOptions options;
+    options.data_directories = directories;
+    options.partitions = 4;
+    write_keys(options);
+    check_keys(options);
+    for (uint16_t number = 0; number < directories.size(); number++)
+    {
+        CHECK(!files_ending_with(directories[number], "easykey-layout")
+                   .empty());
+        for (const auto& file : files_ending_with(directories[number], ".db"))
+        {
+            const auto partition =
+                stoi(file.substr(file.rfind("easykey-") + 8));
+            CHECK(partition % directories.size() == number);
+        }
+    }
+
+    options.data_directories = {directories[1], directories[0]};
+    bool refused = false;
+    try
+    {
+        Database database(options);
+    }
+    catch (const string&)
+    {
+        refused = true;
+    }
+    CHECK(refused);
+    for (const auto& directory : directories)
+    {
+        remove_directory(directory);
+    }
+}
+
+int main()
+{
+    test_recovery(IOBackend::BLOCKING);
+    test_recovery(IOBackend::URING);
+    test_directories();
+    cout << "recovery ok" << endl;
+    return 0;
+}
@@ -0,0 +1,198 @@
+#include "connection.hpp"
+#include "easykey.hpp"
+#include "shards.hpp"
+#include "testing.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace easykey;
+using namespace std;
+using namespace testing;
+
+constexpr static char OK = 0x01;
+constexpr static char CLIENT_ERROR = 0x02;
+
+string key_of(const uint32_t key)
+{
+    return "key" + string(key < 10 ? "0" : "") + to_string(key);
+}
+
+/**
+ * Every request goes to the first shard, the others get the keys of their
+ * partitions through the queues and answer through them, in order
+ */
+void use_shards(Connection& connection)
+{
+    vector<vector<string>> frames;
+    for (uint32_t key = 0; key < 60; key++)
+    {
+        frames.push_back({key_of(key), "value" + key_of(key)});
+        frames.push_back({key_of(key)});
+    }
+    connection.send(frames);
+    auto responses = connection.receive(frames.size());
+    CHECK(responses.size() == frames.size());
+    for (uint32_t key = 0; key < 60; key++)
+    {
+        CHECK(responses[2 * key][0][0] == OK);
+        CHECK(responses[2 * key + 1][0][0] == OK &&
+              responses[2 * key + 1][1] == "value" + key_of(key));
+    }
+
+    frames.clear();
+    for (uint32_t key = 0; key < 20; key++)
+    {
+        frames.push_back({string(1, '\x02'), key_of(key)});
+        frames.push_back({key_of(key)});
+    }
+    connection.send(frames);
+    responses = connection.receive(frames.size());
+    CHECK(responses.size() == frames.size());
+    for (uint32_t key = 0; key < 20; key++)
+    {
+        CHECK(responses[2 * key][0][0] == OK);
+        CHECK(responses[2 * key + 1][0][0] == CLIENT_ERROR);
+    }
+
+    // Every shard finds a page of its keys, and the first one merges them
+    vector<string> scanned;
+    string cursor;
+    do
+    {
+        connection.send({{string(1, '\x01'),
+                          string(1, '\x00'),
+                          cursor,
+                          "",
+                          string("\x07\x00\x00\x00", 4)}});
+        responses = connection.receive(1);
+        CHECK(responses.size() == 1 && responses[0][0][0] == OK);
+        CHECK(responses[0].size() <= 2 + 7);
+        cursor = responses[0][1];
+        scanned.insert(scanned.end(), responses[0].begin() + 2,
+                       responses[0].end());
+    } while (!cursor.empty());
+    CHECK(scanned.size() == 40);
+    for (uint32_t key = 20; key < 60; key++)
+    {
+        CHECK(scanned[key - 20] == key_of(key));
+    }
+
+    // Without a limit, the pages of every key follow each other
+    for (uint32_t key = 0; key < 40; key++)
+    {
+        connection.send(
+            {{"big" + key_of(key), string(64 * 1024, 'a' + key % 26)}});
+        responses = connection.receive(1);
+        CHECK(responses.size() == 1 && responses[0][0][0] == OK);
+    }
+    connection.send({{string(1, '\x01'),
+                      string(1, '\x03'),
+                      "",
+                      "big",
+                      string(4, '\x00')}});
+    scanned.clear();
+    uint32_t pages = 0;
+    do
+    {
+        responses = connection.receive(1);
+        CHECK(responses.size() == 1 && responses[0][0][0] == OK);
+        cursor = responses[0][1];
+        for (size_t message = 2; message < responses[0].size(); message += 2)
+        {
+            const auto key = scanned.size();
+            CHECK(responses[0][message] == "big" + key_of(key));
+            CHECK(responses[0][message + 1] ==
+                  string(64 * 1024, 'a' + key % 26));
+            scanned.push_back(responses[0][message]);
+        }
+        pages++;
+    } while (!cursor.empty());
+    CHECK(scanned.size() == 40 && pages > 1);
+}
+
+void test_shards(const IOBackend io, const Durability durability)
+{
+    const auto directory = temporary_directory();
+    DatabaseOptions options;
+    options.data_directories = {directory};
+    options.partitions = 6;
+    options.shards = 3;
+    options.io = io;
+    options.durability = durability;
+    options.ordered_index = true;
+    {
+        Shards shards(options.shards);
+        vector<unique_ptr<Handler>> handlers;
+        for (uint16_t shard = 0; shard < options.shards; shard++)
+        {
+            options.shard = shard;
+            handlers.emplace_back(new Handler(options, shards));
+        }
+
+        // The first shard runs in the test thread, with the connection
+        atomic<bool> stopping(false);
+        vector<thread> threads;
+        for (uint16_t shard = 1; shard < options.shards; shard++)
+        {
+            threads.emplace_back([&shards, &stopping, &handlers, shard]() {
+                auto& handler = *handlers[shard];
+                while (!stopping)
+                {
+                    if (handler.completion_descriptor() >= 0)
+                    {
+                        handler.complete();
+                    }
+                    shards.receive(shard, handler);
+                    handler.tick();
+                    this_thread::sleep_for(chrono::milliseconds(1));
+                }
+            });
+        }
+        {
+            Connection connection(*handlers[0], shards, 0);
+            use_shards(connection);
+        }
+        stopping = true;
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    // A key is always in the same partition, so one shard finds them all
+    options.shards = 1;
+    options.shard = 0;
+    {
+        Shards shards(1);
+        Handler handler(options, shards);
+        Connection connection(handler, shards, 0);
+        vector<vector<string>> frames;
+        for (uint32_t key = 0; key < 60; key++)
+        {
+            frames.push_back({key_of(key)});
+        }
+        connection.send(frames);
+        const auto responses = connection.receive(frames.size());
+        CHECK(responses.size() == frames.size());
+        for (uint32_t key = 0; key < 60; key++)
+        {
+            CHECK(key < 20 ? responses[key][0][0] == CLIENT_ERROR
+                           : responses[key][1] == "value" + key_of(key));
+        }
+    }
+    remove_directory(directory);
+}
+
+int main()
+{
+    test_shards(IOBackend::BLOCKING, Durability::NONE);
+    test_shards(IOBackend::URING, Durability::GROUP);
+    cout << "shards ok" << endl;
+    return 0;
+}
@@ -0,0 +1,238 @@
+#include "storage.hpp"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace easykey;
+using namespace std;
+using namespace testing;
+
+/**
+ * Takes the snapshot and waits until its manifest is written
+ */
+void snapshot(Database& database, const string& name)
+{
+    const auto start = chrono::steady_clock::now();
+    bool taken = false;
+    CHECK(database.create_snapshot(name));
+    database.snapshot(name,
+                      [&](const bool linked,
+                          const vector<string>& manifests,
+                          const uint64_t bytes) {
+                          taken = linked && database.finish_snapshot(
+                                                name, manifests, bytes, start);
+                      });
+    database.wait();
+    CHECK(taken);
+}
+
+/**
+ * Every file of the manifest is in the snapshot, with its size, and every
+ * file of the snapshot is in the manifest
+ */
+void check_manifest(const string& snapshot, const uint16_t partitions)
+{
+    ifstream manifest(snapshot + "/manifest");
+    CHECK(manifest.good());
+    string line;
+    CHECK(getline(manifest, line) &&
+          line == "xxh64 " + to_string(partitions) + " crc32c");
+    uint32_t files = 0;
+    while (getline(manifest, line))
+    {
+        istringstream fields(line);
+        string name;
+        int64_t size;
+        CHECK(fields >> name >> size);
+        struct stat file_stat;
+        CHECK(stat((snapshot + "/" + name).c_str(), &file_stat) == 0);
+        CHECK(file_stat.st_size == size);
+        files++;
+    }
+    CHECK(files + 1 == files_ending_with(snapshot, "").size());
+}
+
+/**
+ * A copy of the snapshot, like a restore, in a new directory
+ */
+string restore(const string& snapshot)
+{
+    const auto directory = temporary_directory();
+    for (const auto& file : files_ending_with(snapshot, ""))
+    {
+        const auto name = file.substr(file.rfind('/') + 1);
+        if (name == "manifest")
+        {
+            continue;
+        }
+        ifstream input(file, ios::binary);
+        ofstream output(directory + "/" + name, ios::binary);
+        output << input.rdbuf();
+    }
+    return directory;
+}
+
+void check_values(const DatabaseOptions& options, const string& prefix)
+{
+    Database database(options);
+    string value;
+    for (uint32_t key = 0; key < 40; key++)
+    {
+        const auto name = "key" + to_string(key);
+        CHECK(get(database, name, value) && value == prefix + name);
+    }
+    CHECK(!get(database, "later", value));
+}
+
+/**
+ * The snapshot has the values of when it was taken: the overwrites, deletes
+ * and compactions after it do not reach its files, and the server keeps
+ * its own
+ */
+void test_snapshot(const IOBackend io, const bool disk_index)
+{
+    const auto directory = temporary_directory();
+    DatabaseOptions options;
+    options.data_directories = {directory};
+    options.partitions = 2;
+    options.segment_size = 4096;
+    options.compaction_rate = 1024 * 1024;
+    options.io = io;
+    options.disk_index = disk_index;
+    const auto taken = directory + "/easykey-snapshot-first";
+    {
+        Database database(options);
+        for (uint32_t key = 0; key < 40; key++)
+        {
+            const auto name = "key" + to_string(key);
+            put(database, name, string(300, 'f'));
+            put(database, name, "first" + name);
+        }
+        maintain(database);
+        snapshot(database, "first");
+
+        // The name is taken, and must be a new directory
+        CHECK(!database.create_snapshot("first"));
+
+        for (uint32_t round = 0; round < 10; round++)
+        {
+            for (uint32_t key = 0; key < 40; key++)
+            {
+                const auto name = "key" + to_string(key);
+                put(database, name, string(300, 's'));
+                put(database, name, "second" + name);
+            }
+        }
+        put(database, "later", "later");
+        remove(database, "later");
+        maintain(database);
+    }
+    check_manifest(taken, options.partitions);
+
+    // A restore of the snapshot
+    const auto restored = restore(taken);
+    auto restored_options = options;
+    restored_options.data_directories = {restored};
+    check_values(restored_options, "first");
+    remove_directory(restored);
+
+    // The server kept its own values, next to the snapshot
+    check_values(options, "second");
+    remove_directory(taken);
+    remove_directory(directory);
+}
+
+/**
+ * Writes the value of the upload, from the offset of the value
+ */
+void receive(const Upload& upload, const string& value, const uint64_t from)
+{
+    CHECK(pwrite(upload.storage.file->fd,
+                 value.data() + from,
+                 value.size() - from,
+                 upload.storage.offset + 4 + from) ==
+          (ssize_t)(value.size() - from));
+}
+
+/**
+ * A snapshot taken while a value is arriving waits for it: its record is
+ * finished through the same file, so it is only linked after. The uploads
+ * started after the snapshot go to a new segment
+ */
+void test_upload(const IOBackend io)
+{
+    const auto directory = temporary_directory();
+    DatabaseOptions options;
+    options.data_directories = {directory};
+    options.partitions = 1;
+    options.io = io;
+    const auto taken = directory + "/easykey-snapshot-upload";
+    const string value(1000, 'u');
+    {
+        Database database(options);
+        put(database, "before", "before");
+        Upload upload;
+        CHECK(database.begin_upload("uploaded", value.size(), upload));
+        receive(upload, value.substr(0, 500), 0);
+
+        const auto start = chrono::steady_clock::now();
+        bool finished = false;
+        CHECK(database.create_snapshot("upload"));
+        database.snapshot("upload",
+                          [&](const bool linked,
+                              const vector<string>& manifests,
+                              const uint64_t bytes) {
+                              finished = linked &&
+                                      database.finish_snapshot(
+                                          "upload", manifests, bytes, start);
+                          });
+        database.wait();
+        database.maintenance();
+        CHECK(!finished);
+
+        Upload later;
+        CHECK(database.begin_upload("later", value.size(), later));
+        receive(later, value, 0);
+        database.finish_upload(later, true, [](bool) {});
+        receive(upload, value, 500);
+        database.finish_upload(upload, true, [](bool) {});
+        put(database, "before", "after");
+        database.wait();
+        database.maintenance();
+        database.wait();
+        CHECK(finished);
+    }
+    check_manifest(taken, options.partitions);
+
+    const auto restored = restore(taken);
+    auto restored_options = options;
+    restored_options.data_directories = {restored};
+    {
+        Database database(restored_options);
+        string stored;
+        CHECK(get(database, "before", stored) && stored == "before");
+        CHECK(get(database, "uploaded", stored) && stored == value);
+        CHECK(!get(database, "later", stored));
+    }
+    remove_directory(restored);
+    remove_directory(taken);
+    remove_directory(directory);
+}
+
+int main()
+{
+    test_snapshot(IOBackend::BLOCKING, false);
+    test_snapshot(IOBackend::URING, false);
+    test_snapshot(IOBackend::BLOCKING, true);
+    test_upload(IOBackend::BLOCKING);
+    test_upload(IOBackend::URING);
+    cout << "snapshot ok" << endl;
+    return 0;
+}
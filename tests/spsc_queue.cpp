@@ -0,0 +1,104 @@
+#include "spsc_queue.hpp"
+#include "testing.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+using namespace easykey;
+using namespace std;
+
+/**
+ * The capacity is rounded up to a power of two, a full queue refuses the
+ * item without moving it, and the items come out in order
+ */
+void test_bounds()
+{
+    unique_ptr<SPSCQueue<unique_ptr<uint32_t>>> queue(
+        new SPSCQueue<unique_ptr<uint32_t>>(5));
+    CHECK((uintptr_t)queue.get() % 64 == 0);
+
+    unique_ptr<uint32_t> item;
+    CHECK(!queue->pop(item));
+    for (uint32_t number = 0; number < 8; number++)
+    {
+        item.reset(new uint32_t(number));
+        CHECK(queue->push(item));
+        CHECK(item == nullptr);
+    }
+    item.reset(new uint32_t(8));
+    CHECK(!queue->push(item));
+    CHECK(item != nullptr && *item == 8);
+
+    // The indexes wrap around the slots many times
+    for (uint32_t number = 0; number < 1000; number++)
+    {
+        CHECK(queue->pop(item) && *item == number);
+        item.reset(new uint32_t(number + 8));
+        CHECK(queue->push(item));
+    }
+    for (uint32_t number = 1000; number < 1008; number++)
+    {
+        CHECK(queue->pop(item) && *item == number);
+    }
+    CHECK(!queue->pop(item));
+}
+
+/**
+ * A popped slot does not keep the item alive
+ */
+void test_release()
+{
+    SPSCQueue<shared_ptr<uint32_t>> queue(4);
+    auto shared = make_shared<uint32_t>(1);
+    auto copy = shared;
+    CHECK(queue.push(copy));
+    CHECK(shared.use_count() == 2);
+    shared_ptr<uint32_t> popped;
+    CHECK(queue.pop(popped));
+    popped.reset();
+    CHECK(shared.use_count() == 1);
+}
+
+/**
+ * A producer and a consumer thread, through a small queue so both wait for
+ * each other often: every item arrives once, in order
+ */
+void test_threads()
+{
+    constexpr uint64_t ITEMS = 2000000;
+    unique_ptr<SPSCQueue<uint64_t>> queue(new SPSCQueue<uint64_t>(64));
+    thread producer([&queue]() {
+        for (uint64_t number = 0; number < ITEMS; number++)
+        {
+            auto item = number;
+            while (!queue->push(item))
+            {
+                this_thread::yield();
+            }
+        }
+    });
+    uint64_t expected = 0;
+    uint64_t item;
+    while (expected < ITEMS)
+    {
+        if (!queue->pop(item))
+        {
+            this_thread::yield();
+            continue;
+        }
+        CHECK(item == expected);
+        expected++;
+    }
+    producer.join();
+    CHECK(!queue->pop(item));
+}
+
+int main()
+{
+    test_bounds();
+    test_release();
+    test_threads();
+    cout << "spsc queue ok" << endl;
+    return 0;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "database.hpp"
+#include "testing.hpp"
+
+namespace testing
+{
+/**
+ * Writes the value and waits until it is written
+ */
+inline void put(easykey::Database& database,
+                const std::string& key,
+                const std::string& value,
+                const std::chrono::milliseconds ttl =
+                    std::chrono::milliseconds(0))
+{
+    bool written = false;
+    database.write(key,
+                   std::vector<std::uint8_t>(value.begin(), value.end()),
+                   ttl,
+                   [&written](const bool success) { written = success; });
+    database.wait();
+    CHECK(written);
+}
+
+/**
+ * Deletes the key and waits until its tombstone is written
+ */
+inline void remove(easykey::Database& database, const std::string& key)
+{
+    bool removed = false;
+    CHECK(database.remove(
+        key, [&removed](const bool success) { removed = success; }));
+    database.wait();
+    CHECK(removed);
+}
+
+/**
+ * Reads the value of the key, returns false if it does not exist
+ */
+inline bool get(easykey::Database& database,
+                const std::string& key,
+                std::string& value)
+{
+    const auto storage = database.read(key);
+    if (storage.file == nullptr)
+    {
+        return false;
+    }
+
+    // The value size comes first
+    CHECK(storage.size >= 4);
+    value.assign(storage.size - 4, '\0');
+    CHECK(pread(storage.file->fd, &value[0], value.size(),
+                storage.offset + 4) == (ssize_t)value.size());
+    return true;
+}
+
+/**
+ * Runs the maintenance until it has nothing left to do, for up to 5
+ * seconds
+ */
+inline void maintain(easykey::Database& database)
+{
+    const auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (database.maintenance())
+    {
+        database.wait();
+        CHECK(std::chrono::steady_clock::now() < deadline);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+/**
+ * The bytes of the segments of the directory
+ */
+inline std::uint64_t segments_size(const std::string& directory)
+{
+    std::uint64_t size = 0;
+    for (const auto& file : files_ending_with(directory, ".db"))
+    {
+        struct stat file_stat;
+        CHECK(stat(file.c_str(), &file_stat) == 0);
+        size += file_stat.st_size;
+    }
+    return size;
+}
+}  // namespace testing
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+/**
+ * Stops the test at the first check that fails, telling where it is
+ */
+#define CHECK(condition)                                                   \
+    do                                                                     \
+    {                                                                      \
+        if (!(condition))                                                  \
+        {                                                                  \
+            std::cerr << __FILE__ << ":" << __LINE__                       \
+                      << ": check failed: " << #condition << std::endl;    \
+            std::exit(1);                                                  \
+        }                                                                  \
+    } while (false)
+
+namespace testing
+{
+/**
+ * A new empty directory for the data files of a test
+ */
+inline std::string temporary_directory()
+{
+    char path[] = "/tmp/easykeytest-XXXXXX";
+    if (mkdtemp(path) == nullptr)
+    {
+        perror("mkdtemp: ");
+        std::exit(1);
+    }
+    return path;
+}
+
+/**
+ * The names of the files of the directory that end with the suffix
+ */
+inline std::vector<std::string> files_ending_with(const std::string& directory,
+                                                  const std::string& suffix)
+{
+    std::vector<std::string> found;
+    const auto opened = opendir(directory.c_str());
+    if (opened == nullptr)
+    {
+        return found;
+    }
+    while (const auto entry = readdir(opened))
+    {
+        const std::string name = entry->d_name;
+        if (name.size() >= suffix.size() &&
+            name.compare(name.size() - suffix.size(), suffix.size(), suffix) ==
+                0 &&
+            name != "." && name != "..")
+        {
+            found.push_back(directory + "/" + name);
+        }
+    }
+    closedir(opened);
+    return found;
+}
+
+/**
+ * Removes the directory, it only has files
+ */
+inline void remove_directory(const std::string& directory)
+{
+    for (const auto& file : files_ending_with(directory, ""))
+    {
+        unlink(file.c_str());
+    }
+    rmdir(directory.c_str());
+}
+}  // namespace testing
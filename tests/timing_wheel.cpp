@@ -0,0 +1,198 @@
+#include "testing.hpp"
+#include "timing_wheel.hpp"
+
+#include <cstdint>
+#include <map>
+#include <random>
+#include <vector>
+
+using namespace easykey;
+using namespace std;
+
+/**
+ * The wheel resolution, a timer expires at the first slot after its expiry
+ */
+constexpr static uint64_t RESOLUTION = 10;
+
+/**
+ * When a timer with the expiry must be returned
+ */
+uint64_t due_at(const uint64_t expiry)
+{
+    return (expiry + RESOLUTION - 1) / RESOLUTION * RESOLUTION;
+}
+
+/**
+ * Random timers from a few milliseconds to two days, in every level below
+ * the overflow, some cancelled and some rescheduled. At every step the
+ * timers returned are exactly the ones due, none early and none late, and
+ * the wheel never asks to be woken up after the next one is due
+ */
+void test_against_expiries()
+{
+    mt19937_64 random(12);
+    uint64_t now = 1700000000000;
+    TimingWheel wheel(now);
+
+    // The pending timers by due time, and the number of every one
+    multimap<uint64_t, uint32_t> pending;
+    const auto schedule = [&](const uint64_t expiry) {
+        const auto number = wheel.schedule(random(), expiry);
+        CHECK(number != 0);
+        CHECK(wheel.timer(number).expiry == expiry);
+        pending.emplace(due_at(expiry), number);
+    };
+    const uint64_t ranges[] = {
+        2000, 10 * 60 * 1000, 48 * 60 * 60 * 1000ull};
+    for (uint32_t timer = 0; timer < 3000; timer++)
+    {
+        schedule(now + random() % ranges[timer % 3]);
+    }
+
+    const auto end = now + 50 * 60 * 60 * 1000ull;
+    while (!pending.empty())
+    {
+        const auto next = wheel.next_expiry(now);
+        CHECK(now + next <= pending.begin()->first);
+
+        // Steps of every size, some of them to exactly the next wake up
+        switch (random() % 3)
+        {
+        case 0:
+            now += 1 + random() % 30;
+            break;
+        case 1:
+            now += random() % (20 * 60 * 1000);
+            break;
+        default:
+            now += next;
+        }
+
+        vector<uint32_t> expired;
+        CHECK(!wheel.advance(now, UINT32_MAX, expired));
+        for (const auto number : expired)
+        {
+            const auto expiry = wheel.timer(number).expiry;
+            CHECK(expiry <= now);
+            bool found = false;
+            for (auto timer = pending.find(due_at(expiry));
+                 timer != pending.end() && timer->first == due_at(expiry);
+                 timer++)
+            {
+                if (timer->second == number)
+                {
+                    pending.erase(timer);
+                    found = true;
+                    break;
+                }
+            }
+            CHECK(found);
+            wheel.cancel(number);
+        }
+        CHECK(pending.empty() || pending.begin()->first > now);
+        CHECK(wheel.size() == pending.size());
+
+        // Some are cancelled before they expire, and some more are added,
+        // reusing the numbers of the cancelled ones
+        if (now < end && random() % 4 == 0 && !pending.empty())
+        {
+            auto timer = pending.begin();
+            advance(timer, random() % pending.size());
+            wheel.cancel(timer->second);
+            pending.erase(timer);
+            schedule(now + random() % ranges[random() % 3]);
+        }
+    }
+    CHECK(pending.empty());
+    CHECK(wheel.next_expiry(now) == UINT64_MAX);
+}
+
+/**
+ * An expiry in the past is due at the next advance, and an advance fills
+ * expired up to limit timers, keeping the others for the next one
+ */
+void test_limit()
+{
+    const uint64_t now = 1000000;
+    TimingWheel wheel(now);
+    for (uint32_t timer = 0; timer < 10; timer++)
+    {
+        wheel.schedule(timer, now - 5000);
+    }
+    CHECK(wheel.next_expiry(now) == 0);
+
+    vector<uint32_t> expired;
+    CHECK(wheel.advance(now, 4, expired));
+    CHECK(expired.size() == 4);
+    CHECK(wheel.advance(now, 8, expired));
+    CHECK(expired.size() == 8);
+    CHECK(!wheel.advance(now, 20, expired));
+    CHECK(expired.size() == 10);
+    CHECK(wheel.size() == 0);
+}
+
+/**
+ * A cancelled timer never expires, and a rescheduled key gets the expiry of
+ * its new timer
+ */
+void test_cancel()
+{
+    const uint64_t now = 1000000;
+    TimingWheel wheel(now);
+    const auto first = wheel.schedule(1, now + 100);
+    const auto second = wheel.schedule(2, now + 100);
+    CHECK(first != second);
+    wheel.cancel(first);
+    CHECK(wheel.size() == 1);
+
+    const auto third = wheel.schedule(3, now + 300);
+    CHECK(wheel.timer(third).hash == 3);
+    CHECK(wheel.timer(second).hash == 2);
+
+    vector<uint32_t> expired;
+    CHECK(!wheel.advance(now + 200, UINT32_MAX, expired));
+    CHECK(expired == vector<uint32_t>{second});
+    wheel.cancel(second);
+    expired.clear();
+    CHECK(!wheel.advance(now + 299, UINT32_MAX, expired));
+    CHECK(expired.empty());
+    CHECK(!wheel.advance(now + 300, UINT32_MAX, expired));
+    CHECK(expired == vector<uint32_t>{third});
+}
+
+/**
+ * A clock that jumps years ahead moves the wheel at once, through the
+ * overflow too, and a far timer does not wake the wheel up before it is
+ * near
+ */
+void test_large_jump()
+{
+    const uint64_t now = 1700000000000;
+    TimingWheel wheel(now);
+    const auto hour = wheel.schedule(1, now + 60 * 60 * 1000);
+    const auto month = wheel.schedule(2, now + 30 * 24 * 60 * 60 * 1000ull);
+    const auto far = wheel.schedule(3, now + (1ull << 41));
+
+    vector<uint32_t> expired;
+    CHECK(!wheel.advance(now + 2 * 60 * 60 * 1000, UINT32_MAX, expired));
+    CHECK(expired == vector<uint32_t>{hour});
+    wheel.cancel(hour);
+    CHECK(wheel.next_expiry(now) > 60 * 60 * 1000);
+
+    expired.clear();
+    CHECK(!wheel.advance(now + (1ull << 41) + 10, UINT32_MAX, expired));
+    CHECK(expired.size() == 2);
+    CHECK((expired[0] == month && expired[1] == far) ||
+          (expired[0] == far && expired[1] == month));
+    CHECK(wheel.size() == 0);
+}
+
+int main()
+{
+    test_against_expiries();
+    test_limit();
+    test_cancel();
+    test_large_jump();
+    cout << "timing wheel ok" << endl;
+    return 0;
+}
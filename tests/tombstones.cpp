@@ -0,0 +1,121 @@
+#include "storage.hpp"
+
+#include <unistd.h>
+
+#include <cstdint>
+#include <string>
+
+using namespace easykey;
+using namespace std;
+using namespace testing;
+
+/**
+ * The keys after write_keys, the deleted ones must not come back from the
+ * older segments that still have their records
+ */
+void check_keys(Database& database)
+{
+    string value;
+    for (uint32_t key = 0; key < 20; key++)
+    {
+        const auto name = "key" + to_string(key);
+        if (key < 10)
+        {
+            CHECK(!get(database, name, value));
+            CHECK(!database.remove(name, [](const bool) {}));
+        }
+        else
+        {
+            CHECK(get(database, name, value) && value == "last" + name);
+        }
+    }
+    CHECK(get(database, "key0again", value) && value == "again");
+}
+
+/**
+ * Half of the keys are deleted, and the other half overwritten until the
+ * segments of their first records are compacted
+ */
+void write_keys(const DatabaseOptions& options)
+{
+    const auto& directory = options.data_directories[0];
+    Database database(options);
+    for (uint32_t key = 0; key < 20; key++)
+    {
+        put(database, "key" + to_string(key), string(200, 'f'));
+    }
+
+    // With the disk index, the keys of the first segment move to its key
+    // table, and are deleted from there
+    maintain(database);
+    CHECK(files_ending_with(directory, ".keys").empty() != options.disk_index);
+    for (uint32_t key = 0; key < 10; key++)
+    {
+        remove(database, "key" + to_string(key));
+    }
+    for (uint32_t round = 0; round < 20; round++)
+    {
+        for (uint32_t key = 10; key < 20; key++)
+        {
+            put(database, "key" + to_string(key), string(200, 'o'));
+        }
+    }
+    for (uint32_t key = 10; key < 20; key++)
+    {
+        put(database, "key" + to_string(key), "lastkey" + to_string(key));
+    }
+    put(database, "key0again", "again");
+    const auto written = segments_size(directory);
+    maintain(database);
+    CHECK(segments_size(directory) < written / 2);
+    check_keys(database);
+}
+
+void test_tombstones(const IOBackend io, const bool disk_index)
+{
+    const auto directory = temporary_directory();
+    DatabaseOptions options;
+    options.data_directories = {directory};
+    options.partitions = 1;
+    options.segment_size = 4096;
+    options.compaction_rate = 1024 * 1024;
+    options.io = io;
+    options.disk_index = disk_index;
+    write_keys(options);
+
+    // From the hint files or the key tables, then from a full scan of the
+    // segments
+    {
+        Database database(options);
+        check_keys(database);
+    }
+    for (const auto& suffix : {".hint", ".keys"})
+    {
+        for (const auto& file : files_ending_with(directory, suffix))
+        {
+            unlink(file.c_str());
+        }
+    }
+    {
+        Database database(options);
+        check_keys(database);
+
+        // A deleted key can be written again
+        put(database, "key0", "back");
+    }
+    {
+        Database database(options);
+        string value;
+        CHECK(get(database, "key0", value) && value == "back");
+    }
+    remove_directory(directory);
+}
+
+int main()
+{
+    test_tombstones(IOBackend::BLOCKING, false);
+    test_tombstones(IOBackend::URING, false);
+    test_tombstones(IOBackend::BLOCKING, true);
+    cout << "tombstones ok" << endl;
+    return 0;
+}